@@ -23,7 +23,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <leveldb/c.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sqlite3.h>
 #include <stdarg.h>
@@ -49,12 +51,62 @@ leveldb_readoptions_t *ropt;
 leveldb_writeoptions_t *wopt;
 char *errptr;	  
 
+char *cfgfile=NULL;
+char *dbd=NULL;
+char *alfile=NULL;
+int listenport=8080;
+int numthreads=10;
+int ratelimit=0;
+int ratelimitburst=0;
+long writebuffer=8388608;
+int compression=leveldb_no_compression;
+long cachesize=0;
+int bloombits=0;
+long blocksize=4096;
+int maxopenfiles=1000;
+int verifychecksums=1;
+char *adminacl=NULL;  // clients allowed to POST /meta/reload
+int reload=0;
+char pending[SHORT_STRING_MAX];
+pthread_mutex_t cfglock=PTHREAD_MUTEX_INITIALIZER;
+struct tokenbucket ratebucket=TOKENBUCKET_INITIALIZER;
+struct mg_context *ctx=NULL;
+
+static int compressionparse(const char *name) {
+	return !strcmp(name, "none") ? leveldb_no_compression : !strcmp(name, "snappy") ? leveldb_snappy_compression : -1;
+}
+
+static const char *compressionname(int c) {
+	return c==leveldb_no_compression ? "none" : "snappy";
+}
+
+// keys of the config file, those with restart set are only read at startup
+struct cfgkey cfgkeys[]={
+	{"threads", CFG_INT, &numthreads, 1, 1024},
+	{"loglevel", CFG_INT, &vlevel, INT_MIN, INT_MAX},
+	{"ratelimit", CFG_INT, &ratelimit, 0, INT_MAX},
+	{"ratelimit_burst", CFG_INT, &ratelimitburst, 0, INT_MAX},
+	{"port", CFG_INT, &listenport, 0, 65535, 1},
+	{"database", CFG_STRING, &dbd, 0, 0, 1},
+	{"access_log", CFG_STRING, &alfile, 0, 0, 1},
+	{"write_buffer_size", CFG_LONG, &writebuffer, 1, LONG_MAX, 1},
+	{"compression", CFG_NAMED, &compression, 0, 0, 1, &compressionparse, &compressionname},
+	{"cache_size", CFG_LONG, &cachesize, 0, LONG_MAX, 1},
+	{"bloom_bits_per_key", CFG_INT, &bloombits, 0, 64, 1},
+	{"block_size", CFG_LONG, &blocksize, 1, LONG_MAX, 1},
+	{"max_open_files", CFG_INT, &maxopenfiles, 20, INT_MAX, 1},
+	{"verify_checksums", CFG_YESNO, &verifychecksums},
+	{"admin_acl", CFG_STRING, &adminacl},
+	{NULL}
+};
+
 void usage(char *err, int ec) {
   if(err!=NULL) {
     fprintf(stderr,_("Error: %s\n\n"),err);
   }
   
   fprintf(stderr,_("Usage (cosd v%i.%i.%i):\n"),cosd_VERSION_MAJOR,cosd_VERSION_MINOR,cosd_VERSION_REV);
+  fprintf(stderr,_(" -f /path/to/config     -- Config file of key = value lines, reread on SIGHUP or a POST to /meta/reload, flags override it\n"));
   fprintf(stderr,_(" -d database dir        -- Specifies database connection to use, module:/path/to/file\n"));
   fprintf(stderr,_(" -p port spec           -- Port nuber to listen on, passed directly to mongoose HTTP library\n"));
   fprintf(stderr,_(" -n N                   -- Number of HTTP serving threads (default: 10)\n"));
@@ -73,7 +125,47 @@ void handlesig(int sig) {
 			LOG_DEBUG(vlevel, _("Finishing...\n"));
 			done=1; 
 		}
+	} else if(sig==SIGHUP) {
+		reload=1;
+	}
+}
+
+// (re)reads the config file. Threads, log level, rate limit and read
+// checksums change right away, the rest is only read at startup and a changed value is listed in
+// pending until the next restart.
+static int loadconfig(int running) {
+	int threads, checksums, bad;
+
+	pthread_mutex_lock(&cfglock);
+	threads=numthreads;
+	checksums=verifychecksums;
+	if((bad=cfgread(cfgfile, cfgkeys))!=0) {
+		if(bad<0) {
+			LOG_ERROR(vlevel, _("Unable to read config file %s: %s\n"), cfgfile, strerror(errno));
+		} else {
+			LOG_ERROR(vlevel, _("%i bad entries in config file %s, keeping current settings\n"), bad, cfgfile);
+		}
+		pthread_mutex_unlock(&cfglock);
+		return -1;
+	}
+
+	cfgapply(cfgkeys, running, pending, SHORT_STRING_MAX);
+	tokenbucket_set(&ratebucket, ratelimit, ratelimitburst);
+	if(running) {
+		if(numthreads!=threads && !mg_set_num_threads(ctx, numthreads)) {
+			LOG_ERROR(vlevel, _("Unable to change HTTP serving threads to %i\n"), numthreads);
+		}
+		if(verifychecksums!=checksums) {
+			leveldb_readoptions_set_verify_checksums(ropt, verifychecksums);
+		}
+		if(*pending) {
+			LOG_WARN(vlevel, _("Config file changes need a restart to take effect: %s\n"), pending);
+		}
 	}
+	LOG_INFO(vlevel, _("Loaded config file %s: threads %i, loglevel %i, ratelimit %i/%i\n"),
+					 cfgfile, numthreads, vlevel, ratelimit, ratelimitburst);
+	pthread_mutex_unlock(&cfglock);
+	return 0;
 }
 
 static void *mghandle(enum mg_event event, struct mg_connection *conn) {
@@ -95,6 +187,92 @@ static void *mghandle(enum mg_event event, struct mg_connection *conn) {
 		"\r\n"
 		"OK\r\n",
 		4);
+    } else if(strncmp(req, "/meta/config\0", 13) == 0) {
+      char *cinfo=calloc(URL_STRING_MAX, sizeof(char));
+      pthread_mutex_lock(&cfglock);
+      cfgjson(cfgkeys, cfgfile, pending, cinfo, URL_STRING_MAX);
+      pthread_mutex_unlock(&cfglock);
+      mg_printf(conn,
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %zu\r\n"
+		"\r\n"
+		"%s\r\n",
+		strlen(cinfo)+2, cinfo);
+      free(cinfo);
+    } else if(strncmp(req, "/meta/reload\0", 13) == 0) {
+      int allowed;
+
+      // it changes the server: POST only, from clients admin_acl allows, without
+      // one loopback and unix socket clients
+      pthread_mutex_lock(&cfglock);
+      allowed=mg_check_acl(conn, adminacl);
+      pthread_mutex_unlock(&cfglock);
+      if(strcmp(request_info->request_method, "POST")) {
+	mg_printf(conn,
+		  "HTTP/1.1 405 Method Not Allowed\r\n"
+		  "Content-Type: text/plain\r\n"
+		  "Allow: POST\r\n"
+		  "Content-Length: %d\r\n"
+		  "\r\n"
+		  "BADMETHOD\r\n",
+		  11);
+      } else if(allowed!=1) {
+	mg_printf(conn,
+		  "HTTP/1.1 403 Forbidden\r\n"
+		  "Content-Type: text/plain\r\n"
+		  "Content-Length: %d\r\n"
+		  "\r\n"
+		  "FORBIDDEN\r\n",
+		  11);
+      } else if(cfgfile==NULL) {
+	mg_printf(conn,
+		  "HTTP/1.1 500 ERROR\r\n"
+		  "Content-Type: text/plain\r\n"
+		  "Content-Length: %d\r\n"
+		  "\r\n"
+		  "NOCONFIG\r\n",
+		  10);
+      } else if(loadconfig(1)==0) {
+	mg_printf(conn,
+		  "HTTP/1.1 200 OK\r\n"
+		  "Content-Type: text/plain\r\n"
+		  "Content-Length: %d\r\n"
+		  "\r\n"
+		  "OK\r\n",
+		  4);
+      } else {
+	mg_printf(conn,
+		  "HTTP/1.1 500 ERROR\r\n"
+		  "Content-Type: text/plain\r\n"
+		  "Content-Length: %d\r\n"
+		  "\r\n"
+		  "ERROR\r\n",
+		  7);
+      }
+    } else if(strncmp(req, "/meta/", 6) == 0) {
+      char *minfo=calloc(URL_STRING_MAX, sizeof(char));
+      snprintf(minfo, URL_STRING_MAX, "{\"storage\": {\"cache_size\": %li, \"bloom_bits_per_key\": %i, \"compression\": \"%s\", \"block_size\": %li, "
+	       "\"write_buffer_size\": %li, \"max_open_files\": %i, \"verify_checksums\": \"%s\"}}",
+	       cachesize, bloombits, compressionname(compression), blocksize,
+	       writebuffer, maxopenfiles, verifychecksums ? "yes" : "no");
+      mg_printf(conn,
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: %zu\r\n"
+		"\r\n"
+		"%s\r\n",
+		strlen(minfo)+2, minfo);
+      free(minfo);
+    } else if(!tokenbucket_take(&ratebucket)) {
+      mg_printf(conn,
+		"HTTP/1.1 429 Too Many Requests\r\n"
+		"Content-Type: text/plain\r\n"
+		"Retry-After: 1\r\n"
+		"Content-Length: %d\r\n"
+		"\r\n"
+		"RATELIMITED\r\n",
+		13);
     } else if(strncmp(req, "/set/", 5) == 0) { 
       int n=strlen(req);
       while(n) {
@@ -174,43 +352,66 @@ static void *mghandle(enum mg_event event, struct mg_connection *conn) {
 }
 
 int main(int argc, char **argv) {
+  const char *optstring="d:p:n:a:t:f:vh";
   int goopt;
-  int listenport=8080;
-  int numthreads=10;
   int tf;
   
-  char *dbd=NULL;
   char *lpstr=NULL;
   char *ntstr=NULL;
-  char *alfile=NULL;
 
   leveldb_options_t *dbopt;
+  leveldb_cache_t *cache=NULL;
+  leveldb_filterpolicy_t *bloom=NULL;
 
-  struct mg_context *ctx= NULL; 
   char **mgoptions;
   
   signal(SIGINT,handlesig);
   signal(SIGTERM,handlesig);
+  signal(SIGHUP,handlesig);
   
+  // the config file sets the baseline, flags on the command line override it
+  opterr=0;
+  while ((goopt=getopt (argc, argv, optstring)) != -1) {
+    if(goopt=='f') {
+      cfgfile=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(cfgfile,(char*)optarg,strlen((char*)optarg));
+    }
+  }
+  optind=1;
+  opterr=1;
+  if(cfgfile!=NULL && loadconfig(0)!=0) {
+    LOG_FATAL(vlevel, _("Unable to load config file: %s\n"),cfgfile);
+    exit(EXIT_FAILURE);
+  }
+
   // command line parsing
-  while ((goopt=getopt (argc, argv, "d:p:n:a:t:vh")) != -1) {
+  while ((goopt=getopt (argc, argv, optstring)) != -1) {
     switch (goopt) {
+    case 'f': // config file, already loaded above
+      break;
     case 'd': // database 
+      free(dbd);
       dbd=calloc(strlen((char*)optarg)+1,sizeof(char));
       strncpy(dbd,(char*)optarg,strlen((char*)optarg));
+      cfgflag(cfgkeys, "database");
       break;
     case 'a': // access log, passed to mongoose
+      free(alfile);
       alfile=calloc(strlen((char*)optarg)+1,sizeof(char));
       strncpy(alfile,(char*)optarg,strlen((char*)optarg));
+      cfgflag(cfgkeys, "access_log");
       break;
     case 'p': // port
       listenport=atoi(optarg);
+      cfgflag(cfgkeys, "port");
       break;
     case 'n': // number of threads
       numthreads=atoi(optarg);
+      cfgflag(cfgkeys, "threads");
       break;
     case 'v': // verbose
       vlevel++;
+      cfgflag(cfgkeys, "loglevel");
       break;
     case 'h': // help
       usage(NULL,EXIT_SUCCESS);
@@ -252,14 +453,27 @@ int main(int argc, char **argv) {
   LOG_TRACE(vlevel, _("Setting up leveldb store in %s\n"),dbd);
   dbopt=leveldb_options_create();
   leveldb_options_set_create_if_missing(dbopt, 1);
-  leveldb_options_set_write_buffer_size(dbopt, 8388608);
-  leveldb_options_set_compression(dbopt,leveldb_no_compression);
+  leveldb_options_set_write_buffer_size(dbopt, writebuffer);
+  leveldb_options_set_compression(dbopt,compression);
+  leveldb_options_set_block_size(dbopt, blocksize);
+  leveldb_options_set_max_open_files(dbopt, maxopenfiles);
+  if(cachesize>0) {
+    cache=leveldb_cache_create_lru(cachesize);
+    leveldb_options_set_cache(dbopt, cache);
+  }
+  if(bloombits>0) {
+    bloom=leveldb_filterpolicy_create_bloom(bloombits);
+    leveldb_options_set_filter_policy(dbopt, bloom);
+  }
+  LOG_INFO(vlevel, _("Storage profile: block cache %li, bloom bits %i, %s, block size %li, write buffer %li, max open files %i, read checksums %s\n"),
+	   cachesize, bloombits, compression==leveldb_no_compression ? "uncompressed" : "snappy", blocksize, writebuffer, maxopenfiles,
+	   verifychecksums ? "on" : "off");
   dbh=leveldb_open(dbopt,dbd,&errptr);
 
   LOG_TRACE(vlevel, _("Setting leveldb read options\n"));
   ropt = leveldb_readoptions_create();
-  leveldb_readoptions_set_verify_checksums(ropt, 1);
-  leveldb_readoptions_set_fill_cache(ropt, 0);
+  leveldb_readoptions_set_verify_checksums(ropt, verifychecksums);
+  leveldb_readoptions_set_fill_cache(ropt, cache!=NULL);
 
   LOG_TRACE(vlevel, _("Setting leveldb write options\n"));
   wopt = leveldb_writeoptions_create();
@@ -269,8 +483,8 @@ int main(int argc, char **argv) {
   lpstr=calloc(7,sizeof(char));
   snprintf(lpstr,6,"%i",listenport);
   
-  ntstr=calloc(4,sizeof(char));
-  snprintf(ntstr,3,"%i",numthreads);
+  ntstr=calloc(8,sizeof(char));
+  snprintf(ntstr,8,"%i",numthreads);
   
   if(alfile!=NULL) {
     mgoptions = calloc(9,sizeof(char*));
@@ -295,6 +509,14 @@ int main(int argc, char **argv) {
   ctx = mg_start(&mghandle, NULL, (const char**)mgoptions);
   if(ctx!=NULL) {
     while(!done) {
+      if(reload) {
+        reload=0;
+        if(cfgfile==NULL) {
+          LOG_WARN(vlevel, _("SIGHUP received but no config file given, nothing to reload\n"));
+        } else {
+          loadconfig(1);
+        }
+      }
       // cleaner thread here?
       sleep(1);
     }
@@ -313,9 +535,18 @@ int main(int argc, char **argv) {
   leveldb_readoptions_destroy(ropt);
   leveldb_writeoptions_destroy(wopt);
   leveldb_close(dbh);
+  if(cache!=NULL) {
+    leveldb_cache_destroy(cache);
+  }
+  if(bloom!=NULL) {
+    leveldb_filterpolicy_destroy(bloom);
+  }
 
   LOG_TRACE(vlevel, _("Cleaning up\n"));
   free(dbd);
+  free(alfile);
+  free(cfgfile);
+  free(adminacl);
   free(lpstr);
   free(ntstr);
   free(mgoptions);
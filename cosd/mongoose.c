@@ -482,6 +482,7 @@ struct mg_context {
   struct socket *listening_sockets;
 
   volatile int num_threads;  // Number of threads
+  volatile int target_threads;  // Number of threads wanted, see mg_set_num_threads()
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
@@ -4263,11 +4264,11 @@ static void log_access(const struct mg_connection *conn) {
 
 // Verify given socket address against the ACL.
 // Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
-static int check_acl(struct mg_context *ctx, uint32_t remote_ip) {
+static int check_acl_list(struct mg_context *ctx, const char *list,
+                          uint32_t remote_ip) {
   int allowed, flag;
   uint32_t net, mask;
   struct vec vec;
-  const char *list = ctx->config[ACCESS_CONTROL_LIST];
 
   // If any ACL is set, deny by default
   allowed = list == NULL ? '+' : '-';
@@ -4288,6 +4289,24 @@ static int check_acl(struct mg_context *ctx, uint32_t remote_ip) {
   return allowed == '+';
 }
 
+static int check_acl(struct mg_context *ctx, uint32_t remote_ip) {
+  return check_acl_list(ctx, ctx->config[ACCESS_CONTROL_LIST], remote_ip);
+}
+
+int mg_check_acl(struct mg_connection *conn, const char *list) {
+  uint32_t remote_ip;
+
+  // Unix socket peers were checked against their credentials on accept
+  if (conn->client.rsa.sa.sa_family == AF_UNIX) {
+    return 1;
+  }
+  remote_ip = ntohl(* (uint32_t *) &conn->client.rsa.sin.sin_addr);
+  if (list == NULL) {
+    return (remote_ip >> 24) == 127;
+  }
+  return check_acl_list(conn->ctx, list, remote_ip);
+}
+
 static void add_to_set(SOCKET fd, fd_set *set, int *max_fd) {
   FD_SET(fd, set);
   if (fd > (SOCKET) *max_fd) {
@@ -4684,10 +4703,19 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   DEBUG_TRACE(("going idle"));
 
   // If the queue is empty, wait. We're idle at this point.
-  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
+  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0 &&
+         ctx->num_threads <= ctx->target_threads) {
     pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
   }
 
+  // Thread count was lowered, retire this worker
+  if (ctx->num_threads > ctx->target_threads && ctx->stop_flag == 0) {
+    ctx->num_threads--;
+    DEBUG_TRACE(("retiring, %d threads left", ctx->num_threads));
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return -1;
+  }
+
   // If we're stopping, sq_head may be equal to sq_tail.
   if (ctx->sq_head > ctx->sq_tail) {
     // Copy socket from the queue and increment tail
@@ -4710,6 +4738,7 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
 
 static void worker_thread(struct mg_context *ctx) {
   struct mg_connection *conn;
+  int got = 0;
 
   conn = (struct mg_connection *) calloc(1, sizeof(*conn) + MAX_REQUEST_SIZE);
   if (conn == NULL) {
@@ -4720,7 +4749,7 @@ static void worker_thread(struct mg_context *ctx) {
 
     // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
     // sq_empty condvar to wake up the master waiting in produce_socket()
-    while (consume_socket(ctx, &conn->client)) {
+    while ((got = consume_socket(ctx, &conn->client)) > 0) {
       conn->birth_time = time(NULL);
       conn->ctx = ctx;
 
@@ -4745,12 +4774,15 @@ static void worker_thread(struct mg_context *ctx) {
     free(conn);
   }
 
-  // Signal master that we're done with connection and exiting
-  (void) pthread_mutex_lock(&ctx->mutex);
-  ctx->num_threads--;
-  (void) pthread_cond_signal(&ctx->cond);
-  assert(ctx->num_threads >= 0);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+  // Signal master that we're done with connection and exiting. A retired
+  // worker was already taken off the count by consume_socket().
+  if (got == 0) {
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    (void) pthread_cond_signal(&ctx->cond);
+    assert(ctx->num_threads >= 0);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+  }
 
   DEBUG_TRACE(("exiting"));
 }
@@ -4918,6 +4950,30 @@ void mg_stop(struct mg_context *ctx) {
 #endif // _WIN32
 }
 
+int mg_set_num_threads(struct mg_context *ctx, int n) {
+  int ok;
+
+  if (n < 1) {
+    return 0;
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  ctx->target_threads = n;
+  while (ctx->num_threads < n && ctx->stop_flag == 0) {
+    if (mg_start_thread((mg_thread_func_t) worker_thread, ctx) != 0) {
+      cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
+      break;
+    }
+    ctx->num_threads++;
+  }
+  // Surplus workers notice on their next trip through consume_socket()
+  (void) pthread_cond_broadcast(&ctx->sq_full);
+  ok = ctx->num_threads >= n;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  return ok;
+}
+
 struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
                             const char **options) {
   struct mg_context *ctx;
@@ -4998,7 +5054,8 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
   mg_start_thread((mg_thread_func_t) master_thread, ctx);
 
   // Start worker threads
-  for (i = 0; i < atoi(ctx->config[NUM_THREADS]); i++) {
+  ctx->target_threads = atoi(ctx->config[NUM_THREADS]);
+  for (i = 0; i < ctx->target_threads; i++) {
     if (mg_start_thread((mg_thread_func_t) worker_thread, ctx) != 0) {
       cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
     } else {
@@ -18,14 +18,17 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "util.h"
@@ -151,3 +154,242 @@ void jsondequote(char **jstr) {
 		n++;
 	}
 }
+
+// reads a config file of "key = value" lines, blank lines and lines starting
+// with # are skipped. set() is called with arg for every entry and returns
+// non-zero to reject it. Returns the number of rejected or malformed lines, -1 if the
+// file can not be read.
+int readconfig(const char *file, int (*set)(void *arg, char *key, char *val), void *arg) {
+	char line[URL_STRING_MAX];
+	char *key, *val, *e;
+	int bad=0, lineno=0;
+	FILE *fp;
+
+	if((fp=fopen(file, "r"))==NULL) {
+		return -1;
+	}
+	while(fgets(line, URL_STRING_MAX, fp)!=NULL) {
+		lineno++;
+		key=line+strspn(line, " \t");
+		if(*key=='#' || *key=='\0' || *key=='\r' || *key=='\n') {
+			continue;
+		}
+		if((val=strchr(key, '='))==NULL) {
+			LOG_ERROR(vlevel, _("%s:%i: expected key = value\n"), file, lineno);
+			bad++;
+			continue;
+		}
+		for(e=val; e>key && isspace((unsigned char)e[-1]); e--);
+		*e='\0';
+		val++;
+		val+=strspn(val, " \t");
+		for(e=val+strlen(val); e>val && isspace((unsigned char)e[-1]); e--);
+		*e='\0';
+		if(set(arg, key, val)!=0) {
+			LOG_ERROR(vlevel, _("%s:%i: invalid setting %s = %s\n"), file, lineno, key, val);
+			bad++;
+		}
+	}
+	fclose(fp);
+	return bad;
+}
+
+static int cfgset(void *arg, char *key, char *val) {
+	struct cfgkey *k=cfgfind(arg, key);
+	char *e;
+	long n;
+
+	if(k==NULL) {
+		return 1;
+	}
+	switch(k->type) {
+	case CFG_INT:
+	case CFG_LONG:
+		errno=0;
+		n=strtol(val, &e, 10);
+		if(*val=='\0' || *e!='\0' || errno!=0) {
+			return 1;
+		}
+		break;
+	case CFG_YESNO:
+		if(strcmp(val, "yes") && strcmp(val, "no")) {
+			return 1;
+		}
+		n=!strcmp(val, "yes");
+		break;
+	case CFG_NAMED:
+		if((n=k->parse(val))<0) {
+			return 1;
+		}
+		break;
+	default:
+		if(!k->flag) {
+			snprintf(k->sstaged, SHORT_STRING_MAX, "%s", val);
+		}
+		return 0;
+	}
+	if(!k->flag) {
+		k->staged=n;
+	}
+	return 0;
+}
+
+struct cfgkey *cfgfind(struct cfgkey *keys, const char *key) {
+	for(; keys->key!=NULL; keys++) {
+		if(!strcmp(keys->key, key)) {
+			return keys;
+		}
+	}
+	return NULL;
+}
+
+// marks key as set on the command line, reloads keep the flag's value
+void cfgflag(struct cfgkey *keys, const char *key) {
+	cfgfind(keys, key)->flag=1;
+}
+
+// stages the values of file, keys missing from it or set by a flag keep
+// their current value. Returns the number of bad lines and out of bounds
+// values, -1 if the file can not be read. Nothing is stored, see
+// cfgapply().
+int cfgread(const char *file, struct cfgkey *keys) {
+	struct cfgkey *k;
+	int bad;
+
+	for(k=keys; k->key!=NULL; k++) {
+		if(k->type==CFG_STRING) {
+			snprintf(k->sstaged, SHORT_STRING_MAX, "%s", *(char **)k->var ? *(char **)k->var : "");
+		} else {
+			k->staged=k->type==CFG_LONG ? *(long *)k->var : *(int *)k->var;
+		}
+	}
+	if((bad=readconfig(file, &cfgset, keys))<0) {
+		return -1;
+	}
+	for(k=keys; k->key!=NULL; k++) {
+		if((k->type==CFG_INT || k->type==CFG_LONG) && (k->staged<k->min || k->staged>k->max)) {
+			LOG_ERROR(vlevel, _("%s: %s = %li out of bounds, %li to %li\n"), file, k->key, k->staged, k->min, k->max);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+static int cfgchanged(const struct cfgkey *k) {
+	if(k->type==CFG_STRING) {
+		return strcmp(k->sstaged, *(char **)k->var ? *(char **)k->var : "")!=0;
+	}
+	return k->staged!=(k->type==CFG_LONG ? *(long *)k->var : *(int *)k->var);
+}
+
+// stores the staged values, at startup all of them. Once running keys with
+// restart set keep their value and a changed one is listed in pending.
+// Numbers are stored atomically, handlers read them without a lock.
+void cfgapply(struct cfgkey *keys, int running, char *pending, size_t len) {
+	struct cfgkey *k;
+	size_t n;
+
+	pending[0]='\0';
+	for(k=keys; k->key!=NULL; k++) {
+		if(running && k->restart) {
+			if(cfgchanged(k)) {
+				n=strlen(pending);
+				snprintf(pending+n, len-n, "%s\"%s\"", n ? ", " : "", k->key);
+			}
+		} else if(k->type==CFG_STRING) {
+			free(*(char **)k->var);
+			*(char **)k->var=*k->sstaged ? strdup(k->sstaged) : NULL;
+		} else if(k->type==CFG_LONG) {
+			__atomic_store_n((long *)k->var, k->staged, __ATOMIC_RELAXED);
+		} else {
+			__atomic_store_n((int *)k->var, (int)k->staged, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// sets the rate in tokens per second and the burst of the bucket, a rate of
+// 0 turns the limit off
+void tokenbucket_set(struct tokenbucket *tb, int rate, int burst) {
+	pthread_mutex_lock(&tb->lock);
+	__atomic_store_n(&tb->rate, rate, __ATOMIC_RELAXED);
+	tb->burst=burst;
+	pthread_mutex_unlock(&tb->lock);
+}
+
+// vsnprintf() at off into buf, returns the new off even once buf is full
+static size_t cfgput(char *buf, size_t off, size_t len, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n=vsnprintf(off<len ? buf+off : NULL, off<len ? len-off : 0, fmt, ap);
+	va_end(ap);
+	return off+(n>0 ? n : 0);
+}
+
+static size_t cfgquote(char *buf, size_t off, size_t len, const char *s) {
+	off=cfgput(buf, off, len, "\"");
+	for(s=s ? s : ""; *s; s++) {
+		if(*s=='"' || *s=='\\') {
+			off=cfgput(buf, off, len, "\\%c", *s);
+		} else if((unsigned char)*s<0x20) {
+			off=cfgput(buf, off, len, "\\u%04x", (unsigned char)*s);
+		} else {
+			off=cfgput(buf, off, len, "%c", *s);
+		}
+	}
+	return cfgput(buf, off, len, "\"");
+}
+
+// writes the settings in effect as a JSON object into buf, with the config
+// file name and the keys in pending as restart_required. Returns the length
+// of the whole object, buf holds it if that is below len.
+size_t cfgjson(const struct cfgkey *keys, const char *file, const char *pending, char *buf, size_t len) {
+	size_t off=cfgput(buf, 0, len, "{\"config_file\": ");
+
+	off=cfgquote(buf, off, len, file);
+	for(; keys->key!=NULL; keys++) {
+		off=cfgput(buf, off, len, ", \"%s\": ", keys->key);
+		if(keys->type==CFG_INT) {
+			off=cfgput(buf, off, len, "%i", *(int *)keys->var);
+		} else if(keys->type==CFG_LONG) {
+			off=cfgput(buf, off, len, "%li", *(long *)keys->var);
+		} else if(keys->type==CFG_YESNO) {
+			off=cfgquote(buf, off, len, *(int *)keys->var ? "yes" : "no");
+		} else if(keys->type==CFG_NAMED) {
+			off=cfgquote(buf, off, len, keys->name(*(int *)keys->var));
+		} else {
+			off=cfgquote(buf, off, len, *(char **)keys->var);
+		}
+	}
+	return cfgput(buf, off, len, ", \"restart_required\": [%s]}", pending);
+}
+
+// takes a token from the bucket, which refills at rate tokens per second and
+// holds up to burst of them (one second worth if burst is 0). Returns 1 if
+// a token was available or there is no limit.
+int tokenbucket_take(struct tokenbucket *tb) {
+	struct timeval tv;
+	double now, cap;
+	int ret=1;
+
+	if(__atomic_load_n(&tb->rate, __ATOMIC_RELAXED)==0) {
+		return 1;
+	}
+	gettimeofday(&tv, NULL);
+	now=tv.tv_sec+tv.tv_usec/1000000.0;
+	pthread_mutex_lock(&tb->lock);
+	if(tb->rate>0) {
+		cap=tb->burst>0 ? tb->burst : tb->rate;
+		tb->tokens=tb->last==0 ? cap : tb->tokens+(now-tb->last)*tb->rate;
+		if(tb->tokens>cap) {
+			tb->tokens=cap;
+		}
+		tb->last=now;
+		if((ret=tb->tokens>=1)) {
+			tb->tokens-=1;
+		}
+	}
+	pthread_mutex_unlock(&tb->lock);
+	return ret;
+}
@@ -0,0 +1,149 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "bhash.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define BHASH_SSE42
+#endif
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32ctable[256];
+static int hwcrc=0;
+static pthread_once_t initonce=PTHREAD_ONCE_INIT;
+
+static void bhash_init(void) {
+	uint32_t c;
+	int i, j;
+
+	for(i=0; i<256; i++) {
+		c=i;
+		for(j=0; j<8; j++) {
+			c=c & 1 ? (c>>1)^CRC32C_POLY : c>>1;
+		}
+		crc32ctable[i]=c;
+	}
+#ifdef BHASH_SSE42
+	__builtin_cpu_init();
+	hwcrc=__builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32ctab(const char *key, size_t len) {
+	const unsigned char *p=(const unsigned char *)key;
+	uint32_t c=0xffffffff;
+
+	while(len--) {
+		c=crc32ctable[(c^*p++) & 0xff]^(c>>8);
+	}
+	return ~c;
+}
+
+#ifdef BHASH_SSE42
+__attribute__((target("sse4.2")))
+static uint64_t crc32cstep(uint64_t c, const char *p, size_t len) {
+	uint64_t w;
+
+	for(; len>=8; p+=8, len-=8) {
+		memcpy(&w, p, 8);
+		c=_mm_crc32_u64(c, w);
+	}
+	for(; len>0; p++, len--) {
+		c=_mm_crc32_u8(c, *p);
+	}
+	return c;
+}
+
+// BHASH_LANES keys at once over their common length, then each on its own
+__attribute__((target("sse4.2")))
+static void crc32clanes(const char *const *keys, const size_t *lens, uint32_t *out) {
+	const char *k0=keys[0], *k1=keys[1], *k2=keys[2], *k3=keys[3];
+	uint64_t c0=0xffffffff, c1=0xffffffff, c2=0xffffffff, c3=0xffffffff, w0, w1, w2, w3;
+	size_t common=lens[0], i;
+	int l;
+
+	for(l=1; l<BHASH_LANES; l++) {
+		if(lens[l]<common) {
+			common=lens[l];
+		}
+	}
+	for(i=0; i+8<=common; i+=8) {
+		memcpy(&w0, k0+i, 8);
+		memcpy(&w1, k1+i, 8);
+		memcpy(&w2, k2+i, 8);
+		memcpy(&w3, k3+i, 8);
+		c0=_mm_crc32_u64(c0, w0);
+		c1=_mm_crc32_u64(c1, w1);
+		c2=_mm_crc32_u64(c2, w2);
+		c3=_mm_crc32_u64(c3, w3);
+	}
+	out[0]=~(uint32_t)crc32cstep(c0, k0+i, lens[0]-i);
+	out[1]=~(uint32_t)crc32cstep(c1, k1+i, lens[1]-i);
+	out[2]=~(uint32_t)crc32cstep(c2, k2+i, lens[2]-i);
+	out[3]=~(uint32_t)crc32cstep(c3, k3+i, lens[3]-i);
+}
+#endif
+
+uint32_t bhash(int kind, const char *key, size_t len) {
+	if(kind==BHASH_CRC32) {
+		return crc32(0, (const unsigned char *)key, len);
+	}
+	pthread_once(&initonce, &bhash_init);
+#ifdef BHASH_SSE42
+	if(hwcrc) {
+		return ~(uint32_t)crc32cstep(0xffffffff, key, len);
+	}
+#endif
+	return crc32ctab(key, len);
+}
+
+void bhash_many(int kind, const char *const *keys, const size_t *lens, int n, uint32_t *out) {
+	int i=0;
+
+	pthread_once(&initonce, &bhash_init);
+#ifdef BHASH_SSE42
+	if(kind==BHASH_CRC32C && hwcrc) {
+		for(; i+BHASH_LANES<=n; i+=BHASH_LANES) {
+			crc32clanes(keys+i, lens+i, out+i);
+		}
+	}
+#endif
+	for(; i<n; i++) {
+		out[i]=bhash(kind, keys[i], lens[i]);
+	}
+}
+
+const char *bhash_impl(int kind) {
+	if(kind==BHASH_CRC32) {
+		return "zlib";
+	}
+	pthread_once(&initonce, &bhash_init);
+	return hwcrc ? "sse4.2" : "table";
+}
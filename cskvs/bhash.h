@@ -0,0 +1,48 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+
+#ifndef __BHASH_H__
+#define __BHASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hashes that map keys to buckets. BHASH_CRC32 is zlib's crc32(), the
+// assignment cskvs has always had. BHASH_CRC32C is the Castagnoli CRC, taken
+// with the SSE4.2 crc32 instruction where the CPU has it and from a table
+// elsewhere, both give the same values.
+//
+// bhash_many() hashes a batch of keys in one pass. With the instruction it
+// runs BHASH_LANES keys side by side, each crc32 takes three cycles but a new
+// one can start every cycle, so the independent chains hide that latency.
+
+#define BHASH_CRC32 0
+#define BHASH_CRC32C 1
+
+#define BHASH_LANES 4
+
+uint32_t bhash(int kind, const char *key, size_t len);
+void bhash_many(int kind, const char *const *keys, const size_t *lens, int n, uint32_t *out);
+// what computes kind on this machine: zlib, sse4.2 or table
+const char *bhash_impl(int kind);
+
+#endif // __BHASH_H__
@@ -0,0 +1,187 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binstream.h"
+
+enum { B_KLEN, B_KEY, B_VLEN, B_VAL };
+
+struct binstream {
+	int state;
+	int withvals;
+	unsigned char hdr[4]; // length prefix being read
+	size_t hdrlen;
+	size_t need;          // bytes still missing from the key or value
+	char *key;
+	size_t klen;
+	char *val;
+	size_t vlen;
+	size_t keysize;
+	size_t valsize;
+	size_t maxstr;
+	size_t offset;
+	jsonstream_cb cb;
+	void *arg;
+};
+
+struct binstream *binstream_new(size_t maxstr, int withvals, jsonstream_cb cb, void *arg) {
+	struct binstream *bs=calloc(1, sizeof(struct binstream));
+
+	if(bs!=NULL) {
+		bs->withvals=withvals;
+		bs->maxstr=maxstr;
+		bs->cb=cb;
+		bs->arg=arg;
+	}
+	return bs;
+}
+
+void binstream_free(struct binstream *bs) {
+	if(bs!=NULL) {
+		free(bs->key);
+		free(bs->val);
+		free(bs);
+	}
+}
+
+// bytes consumed so far, points near the problem after an error
+size_t binstream_offset(const struct binstream *bs) {
+	return bs->offset;
+}
+
+static uint32_t be32(const unsigned char *p) {
+	return (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3];
+}
+
+static int reserve(char **buf, size_t *size, size_t n) {
+	char *nb;
+
+	if(n<=*size) {
+		return 0;
+	}
+	if((nb=realloc(*buf, n))==NULL) {
+		return -1;
+	}
+	*buf=nb;
+	*size=n;
+	return 0;
+}
+
+// a whole record sitting in buf, returns its length or 0 if it is split
+static size_t wholerecord(struct binstream *bs, const char *buf, size_t len) {
+	const unsigned char *p=(const unsigned char *)buf;
+	size_t klen, vlen=0, rlen;
+
+	if(len<4 || (klen=be32(p))>bs->maxstr || len-4<klen) {
+		return 0;
+	}
+	rlen=4+klen;
+	if(bs->withvals) {
+		if(len-rlen<4 || (vlen=be32(p+rlen))>bs->maxstr || len-rlen-4<vlen) {
+			return 0;
+		}
+		rlen+=4+vlen;
+	}
+	return rlen;
+}
+
+int binstream_feed(struct binstream *bs, const char *buf, size_t len) {
+	size_t n, rlen;
+
+	while(len>0) {
+		if(bs->state==B_KLEN && bs->hdrlen==0 && (rlen=wholerecord(bs, buf, len))>0) {
+			size_t klen=be32((const unsigned char *)buf);
+
+			if(bs->cb(bs->arg, buf+4, klen, bs->withvals ? buf+8+klen : "", bs->withvals ? rlen-8-klen : 0, bs->withvals)) {
+				bs->offset+=rlen;
+				return JSONSTREAM_STOPPED;
+			}
+			buf+=rlen;
+			len-=rlen;
+			bs->offset+=rlen;
+			continue;
+		}
+
+		// the slow way, the record is split over several pieces
+		if(bs->state==B_KLEN || bs->state==B_VLEN) {
+			n=4-bs->hdrlen < len ? 4-bs->hdrlen : len;
+			memcpy(bs->hdr+bs->hdrlen, buf, n);
+			bs->hdrlen+=n;
+			buf+=n;
+			len-=n;
+			bs->offset+=n;
+			if(bs->hdrlen<4) {
+				break;
+			}
+			bs->hdrlen=0;
+			if((bs->need=be32(bs->hdr))>bs->maxstr) {
+				return JSONSTREAM_TOOLONG;
+			}
+			if(bs->state==B_KLEN) {
+				if(reserve(&bs->key, &bs->keysize, bs->need)!=0) {
+					return JSONSTREAM_TOOLONG;
+				}
+				bs->klen=0;
+				bs->state=B_KEY;
+			} else {
+				if(reserve(&bs->val, &bs->valsize, bs->need)!=0) {
+					return JSONSTREAM_TOOLONG;
+				}
+				bs->vlen=0;
+				bs->state=B_VAL;
+			}
+		} else {
+			n=bs->need < len ? bs->need : len;
+			if(bs->state==B_KEY) {
+				memcpy(bs->key+bs->klen, buf, n);
+				bs->klen+=n;
+			} else {
+				memcpy(bs->val+bs->vlen, buf, n);
+				bs->vlen+=n;
+			}
+			bs->need-=n;
+			buf+=n;
+			len-=n;
+			bs->offset+=n;
+		}
+
+		if((bs->state==B_KEY || bs->state==B_VAL) && bs->need==0) {
+			if(bs->state==B_KEY && bs->withvals) {
+				bs->state=B_VLEN;
+				continue;
+			}
+			bs->state=B_KLEN;
+			if(bs->cb(bs->arg, bs->klen ? bs->key : "", bs->klen,
+								bs->withvals && bs->vlen ? bs->val : "", bs->withvals ? bs->vlen : 0, bs->withvals)) {
+				return JSONSTREAM_STOPPED;
+			}
+		}
+	}
+	return JSONSTREAM_OK;
+}
+
+// call at the end of the body, JSONSTREAM_ERROR if it stops inside a record
+int binstream_finish(struct binstream *bs) {
+	return bs->state==B_KLEN && bs->hdrlen==0 ? JSONSTREAM_OK : JSONSTREAM_ERROR;
+}
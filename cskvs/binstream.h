@@ -0,0 +1,49 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef __BINSTREAM_H__
+#define __BINSTREAM_H__
+
+#include <stddef.h>
+
+#include "jsonstream.h"
+
+// Binary alternative to the JSON batch bodies, Content-Type BINSTREAM_TYPE.
+// A body is a plain sequence of records, lengths are 32 bit big endian:
+//
+//   mset request, mget answer:  klen key vlen value  klen key vlen value ...
+//   mget request:               klen key  klen key ...
+//
+// Keys and values are raw bytes. The parser takes the same callback and
+// returns the same status codes as jsonstream. A record that arrives whole
+// in one piece is passed without copying.
+
+#define BINSTREAM_TYPE "application/x-cskvs-batch"
+
+struct binstream;
+
+struct binstream *binstream_new(size_t maxstr, int withvals, jsonstream_cb cb, void *arg);
+int binstream_feed(struct binstream *bs, const char *buf, size_t len);
+int binstream_finish(struct binstream *bs);
+size_t binstream_offset(const struct binstream *bs);
+void binstream_free(struct binstream *bs);
+
+#endif // __BINSTREAM_H__
@@ -25,5 +25,28 @@
 #define BUCKETS 256 
 #endif // BUCKETS
 
+// most deletes in one ttl sweeper write, and keys it reads per iterator
+#ifndef SWEEP_BATCH
+#define SWEEP_BATCH 256
+#endif // SWEEP_BATCH
+#ifndef SWEEP_SCAN
+#define SWEEP_SCAN 16384
+#endif // SWEEP_SCAN
+
+// keys hashed together when routing /mset/, /mget/ and /mincr/ batches
+#ifndef HASH_BATCH
+#define HASH_BATCH 256
+#endif // HASH_BATCH
+
+// versions reserved in the VERSIONS file with each sync of it
+#ifndef VERSION_BLOCK
+#define VERSION_BLOCK 65536
+#endif // VERSION_BLOCK
+
+// longest memcached command line, a get with all its keys included
+#ifndef MC_LINE_MAX
+#define MC_LINE_MAX 65536
+#endif // MC_LINE_MAX
+
 #endif // __CONFIG_H__
 
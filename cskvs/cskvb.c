@@ -55,6 +55,10 @@ typedef struct {
 GThreadPool *senderpool;
 struct bucket *bucketlist;
 
+char *acceptorcpus=NULL;
+char *workercpus=NULL;
+char *storagecpus=NULL;
+
 void usage(char *err, int ec) {
   if(err!=NULL) {
     fprintf(stderr,_("Error: %s\n"),err);
@@ -67,6 +71,9 @@ void usage(char *err, int ec) {
   fprintf(stderr,_(" -t N                   -- Number of HTTP threads\n"));
   fprintf(stderr,_(" -T N                   -- Number of storage threads\n"));
   fprintf(stderr,_(" -s storage map         -- Storage mapping\n"));
+  fprintf(stderr,_(" -W cpulist             -- Pin the acceptor thread to these CPUs, e.g. 0-3,8\n"));
+  fprintf(stderr,_(" -w cpulist             -- Pin the HTTP threads to these CPUs\n"));
+  fprintf(stderr,_(" -c cpulist             -- Pin the storage threads to these CPUs\n"));
   fprintf(stderr,_(" -v                     -- Increases verbose level, can be specified multiple times\n"));
   fprintf(stderr,_(" -h                     -- This help listing\n"));
 	
@@ -85,6 +92,15 @@ void handlesig(int sig) {
 }
 
 static void storagesender(void *data, void *user_data) {
+	static __thread int pinned=0;
+
+	// pool threads are created on demand by glib, pin each one on its first job
+	if(!pinned && storagecpus!=NULL) {
+		if(!mg_pin_thread(storagecpus)) {
+			LOG_ERROR(vlevel,_("Unable to pin storage thread to cpus %s\n"),storagecpus);
+		}
+		pinned=1;
+	}
 	LOG_TRACE(vlevel,_("Pool worker starting...\n"));
 }
 
@@ -151,7 +167,7 @@ int main(int argc, char **argv) {
   signal(SIGTERM,handlesig);
   
   // command line parsing
-  while ((goopt=getopt (argc, argv, "p:a:t:s:vh")) != -1) {
+  while ((goopt=getopt (argc, argv, "p:a:t:s:w:W:c:vh")) != -1) {
     switch (goopt) {
     case 'a': // access log, passed to mongoose
       alfile=calloc(strlen((char*)optarg)+1,sizeof(char));
@@ -170,6 +186,18 @@ int main(int argc, char **argv) {
       bucketmapstr=calloc(strlen((char*)optarg)+1,sizeof(char));
       strncpy(bucketmapstr,(char*)optarg,strlen((char*)optarg));
       break;
+    case 'w': // HTTP thread cpus, passed to mongoose
+      workercpus=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(workercpus,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'W': // acceptor cpus, passed to mongoose
+      acceptorcpus=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(acceptorcpus,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'c': // storage thread cpus
+      storagecpus=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(storagecpus,(char*)optarg,strlen((char*)optarg));
+      break;
     case 'v': // verbose
       vlevel++;
       break;
@@ -209,6 +237,11 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+	ts=numatopology();
+	LOG_INFO(vlevel, _("NUMA topology: %s, acceptor cpus: %s, HTTP cpus: %s, storage cpus: %s\n"), ts,
+					 acceptorcpus ? acceptorcpus : "any", workercpus ? workercpus : "any", storagecpus ? storagecpus : "any");
+	free(ts);
+
 	// 
 	if(bucketmapstr!=NULL) {
 		bucketlist=calloc(BUCKETS,sizeof(bucket));
@@ -272,24 +305,27 @@ int main(int argc, char **argv) {
   ntstr=calloc(5,sizeof(char));
   snprintf(ntstr,4,"%i",numhttpthreads);
   
+  mgoptions = calloc(13,sizeof(char*));
+  tf=0;
+  mgoptions[tf++]="listening_ports";
+  mgoptions[tf++]=lpstr;
+  mgoptions[tf++]="document_root";
+  mgoptions[tf++]="/dev/null";
+  mgoptions[tf++]="num_threads";
+  mgoptions[tf++]=ntstr;
   if(alfile!=NULL) {
-    mgoptions = calloc(9,sizeof(char*));
-  } else {
-    mgoptions = calloc(7,sizeof(char*));
+    mgoptions[tf++]="access_log_file";
+    mgoptions[tf++]=alfile;
   }
-  mgoptions[0]="listening_ports";
-  mgoptions[1]=lpstr;
-  mgoptions[2]="document_root";
-  mgoptions[3]="/dev/null";
-  mgoptions[4]="num_threads";
-  mgoptions[5]=ntstr;
-  if(alfile!=NULL) {
-    mgoptions[6]="access_log_file";
-    mgoptions[7]=alfile;
-    mgoptions[8]=NULL;
-  } else {
-    mgoptions[6]=NULL;
+  if(acceptorcpus!=NULL) {
+    mgoptions[tf++]="acceptor_cpus";
+    mgoptions[tf++]=acceptorcpus;
+  }
+  if(workercpus!=NULL) {
+    mgoptions[tf++]="worker_cpus";
+    mgoptions[tf++]=workercpus;
   }
+  mgoptions[tf]=NULL;
 
 	LOG_INFO(vlevel, _("Creating sender pool\n"));
 	senderpool=g_thread_pool_new(storagesender,NULL,numstoragethreads,1,NULL);
@@ -317,6 +353,9 @@ int main(int argc, char **argv) {
   free(ntstr);
   free(mgoptions);
   free(bucketmapstr);
+  free(acceptorcpus);
+  free(workercpus);
+  free(storagecpus);
   
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,780 @@
+// Copyright (c) 2012 Dave DeMaagd
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <leveldb/c.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "bhash.h"
+#include "util.h"
+#include "mongoose.h"
+#include "binstream.h"
+
+#define BENCH_CHUNK 65536
+
+int vlevel=0;
+
+char *sslcert=NULL;
+int numhandshakes=500;
+long bulkbytes=67108864;
+char *target=NULL;
+char *batchsizes=NULL;
+int rounds=20;
+int valuelen=100;
+char *benchdir=NULL;
+int numkeys=200000;
+
+void usage(char *err, int ec) {
+  if(err!=NULL) {
+    fprintf(stderr,_("Error: %s\n"),err);
+    fprintf(stderr,"\n");
+  }
+
+  fprintf(stderr,_("Usage (v%i.%i.%i):\n"),cskvs_VERSION_MAJOR,cskvs_VERSION_MINOR,cskvs_VERSION_REV);
+  fprintf(stderr,_(" -m mode                -- Benchmark to run: tls, batch, storage, hash\n"));
+  fprintf(stderr,_(" -C /path/to/cert.pem   -- TLS certificate and key (tls)\n"));
+  fprintf(stderr,_(" -n N                   -- Handshakes per run (tls, default: 500)\n"));
+  fprintf(stderr,_(" -s N                   -- Bytes per bulk transfer (tls, default: 67108864)\n"));
+  fprintf(stderr,_(" -a host:port           -- Running cskvs to test (batch, default: 127.0.0.1:8080)\n"));
+  fprintf(stderr,_(" -k N[,N...]            -- Keys per batch (batch, default: 1000,10000)\n"));
+  fprintf(stderr,_(" -r N                   -- Requests per batch size and encoding (batch), passes over the keys (hash, default: 20)\n"));
+  fprintf(stderr,_(" -l N                   -- Value length (batch, storage), key length (hash, default: 100)\n"));
+  fprintf(stderr,_(" -d /path/to/dir        -- Scratch directory for the databases (storage, default: a new dir under /tmp)\n"));
+  fprintf(stderr,_(" -c N                   -- Keys loaded per profile (storage), keys hashed per pass (hash, default: 200000)\n"));
+  fprintf(stderr,_(" -v                     -- Increases verbose level, can be specified multiple times\n"));
+  fprintf(stderr,_(" -h                     -- This help listing\n"));
+
+  exit(ec);
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+// tls mode: serves /ping (tiny) and /bulk (bulkbytes) from an in-process
+// mongoose, so only the TLS layer is measured
+static void *tlshandle(enum mg_event event, struct mg_connection *conn) {
+  const struct mg_request_info *request_info = mg_get_request_info(conn);
+  static char chunk[BENCH_CHUNK];
+  long left;
+
+  if (event != MG_NEW_REQUEST) {
+    return NULL;
+  }
+  if(!strcmp(request_info->uri,"/bulk")) {
+    mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %li\r\nConnection: close\r\n\r\n", bulkbytes);
+    for(left=bulkbytes; left>0; left-=BENCH_CHUNK) {
+      if(mg_write(conn, chunk, left>BENCH_CHUNK ? BENCH_CHUNK : left)<=0) {
+        break;
+      }
+    }
+  } else {
+    mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 4\r\nConnection: close\r\n\r\npong");
+  }
+  return "";
+}
+
+static struct mg_context *tlsserver(const char *ktls, int *port) {
+  const char *options[]={
+    "listening_ports", "127.0.0.1:0s",
+    "document_root", "/dev/null",
+    "num_threads", "4",
+    "ssl_certificate", sslcert,
+    "ssl_ktls", ktls,
+    NULL
+  };
+  struct mg_context *ctx;
+  struct sockaddr_in sin;
+  socklen_t len=sizeof(sin);
+  int fd, ssl, raw;
+
+  if((ctx=mg_start(&tlshandle, NULL, options))==NULL) {
+    return NULL;
+  }
+  mg_get_listening_sockets(ctx, &fd, &ssl, &raw, 1);
+  getsockname(fd, (struct sockaddr*)&sin, &len);
+  *port=ntohs(sin.sin_port);
+  return ctx;
+}
+
+static SSL *tlsconnect(SSL_CTX *cctx, int port, SSL_SESSION *sess) {
+  struct sockaddr_in sin;
+  SSL *ssl;
+  int fd;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family=AF_INET;
+  sin.sin_port=htons(port);
+  sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if((fd=socket(AF_INET, SOCK_STREAM, 0))==-1 || connect(fd, (struct sockaddr*)&sin, sizeof(sin))!=0) {
+    LOG_ERROR(vlevel, _("Unable to connect to port %i: %s\n"), port, strerror(errno));
+    if(fd!=-1) {
+      close(fd);
+    }
+    return NULL;
+  }
+  ssl=SSL_new(cctx);
+  SSL_set_fd(ssl, fd);
+  if(sess!=NULL) {
+    SSL_set_session(ssl, sess);
+  }
+  if(SSL_connect(ssl)!=1) {
+    LOG_ERROR(vlevel, _("TLS handshake failed: %s\n"), ERR_error_string(ERR_get_error(), NULL));
+    SSL_free(ssl);
+    close(fd);
+    return NULL;
+  }
+  return ssl;
+}
+
+// sends a GET and reads the response to EOF, returns the bytes received
+static long tlsget(SSL *ssl, const char *uri) {
+  char buf[BENCH_CHUNK];
+  long total=0;
+  int n;
+
+  n=snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", uri);
+  if(SSL_write(ssl, buf, n)!=n) {
+    return -1;
+  }
+  while((n=SSL_read(ssl, buf, sizeof(buf)))>0) {
+    total+=n;
+  }
+  return total;
+}
+
+static void tlsclose(SSL *ssl) {
+  int fd=SSL_get_fd(ssl);
+  // without close_notify OpenSSL marks the session as not resumable
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  close(fd);
+}
+
+// resume: 0 full handshakes, 1 session tickets, 2 server side session cache
+static void tlshandshakes(int port, int resume, const char *label) {
+  SSL_CTX *cctx=SSL_CTX_new(TLS_client_method());
+  SSL_SESSION *sess=NULL;
+  SSL *ssl;
+  double start;
+  int i, reused=0;
+
+  if(resume==2) {
+    SSL_CTX_set_options(cctx, SSL_OP_NO_TICKET);
+  }
+  start=now();
+  for(i=0; i<numhandshakes; i++) {
+    if((ssl=tlsconnect(cctx, port, sess))==NULL) {
+      break;
+    }
+    reused+=SSL_session_reused(ssl);
+    tlsget(ssl, "/ping");
+    if(resume) {
+      // TLS 1.3 tickets arrive after the handshake, so grab it last
+      SSL_SESSION_free(sess);
+      sess=SSL_get1_session(ssl);
+    }
+    tlsclose(ssl);
+  }
+  LOG_ALWAYS(vlevel, _("%-34s %8.1f handshakes/s (%i of %i resumed)\n"), label, i/(now()-start), reused, i);
+  SSL_SESSION_free(sess);
+  SSL_CTX_free(cctx);
+}
+
+static void tlsbulk(int port, const char *label) {
+  SSL_CTX *cctx=SSL_CTX_new(TLS_client_method());
+  SSL *ssl;
+  double start, secs;
+  long got;
+
+  start=now();
+  if((ssl=tlsconnect(cctx, port, NULL))!=NULL) {
+    got=tlsget(ssl, "/bulk");
+    secs=now()-start;
+    LOG_ALWAYS(vlevel, _("%-34s %8.1f MB/s (%li bytes in %.2fs)\n"), label, got/secs/1048576.0, got, secs);
+    tlsclose(ssl);
+  }
+  SSL_CTX_free(cctx);
+}
+
+// kTLS needs the kernel tls module, check with a throwaway connection
+static int tlsktlsprobe(int port) {
+  SSL_CTX *cctx=SSL_CTX_new(TLS_client_method());
+  SSL *ssl;
+  int ret=0;
+
+#if defined(SSL_OP_ENABLE_KTLS)
+  SSL_CTX_set_options(cctx, SSL_OP_ENABLE_KTLS);
+  if((ssl=tlsconnect(cctx, port, NULL))!=NULL) {
+    ret=BIO_get_ktls_send(SSL_get_wbio(ssl))>0;
+    tlsget(ssl, "/ping");
+    tlsclose(ssl);
+  }
+#else
+  (void)ssl;
+  (void)port;
+#endif
+  SSL_CTX_free(cctx);
+  return ret;
+}
+
+static int tlsbench(void) {
+  struct mg_context *plain, *ktls;
+  int plainport, ktlsport;
+
+  if(sslcert==NULL) {
+    usage("tls mode needs a certificate (-C)\n",EXIT_FAILURE);
+  }
+  if((plain=tlsserver("no", &plainport))==NULL || (ktls=tlsserver("yes", &ktlsport))==NULL) {
+    LOG_FATAL(vlevel, _("Unable to start TLS servers, check the certificate\n"));
+    return EXIT_FAILURE;
+  }
+  LOG_ALWAYS(vlevel, _("Kernel TLS %s\n"), tlsktlsprobe(ktlsport) ? "available" : "not available, kTLS rows use the OpenSSL write path");
+
+  tlshandshakes(plainport, 0, "full handshake");
+  tlshandshakes(plainport, 1, "resumed, session ticket");
+  tlshandshakes(plainport, 2, "resumed, server session cache");
+  tlsbulk(plainport, "bulk, userspace TLS");
+  tlsbulk(ktlsport, "bulk, kernel TLS");
+  tlshandshakes(ktlsport, 0, "full handshake, kernel TLS");
+  tlshandshakes(ktlsport, 1, "resumed, kernel TLS");
+
+  mg_stop(plain);
+  mg_stop(ktls);
+  return EXIT_SUCCESS;
+}
+
+// batch mode: /mset/ and /mget/ against a running cskvs, JSON bodies
+// against binstream bodies carrying the same keys and values
+struct body {
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+static void bodyadd(struct body *b, const void *p, size_t n) {
+  if(b->len+n>b->size) {
+    b->size=(b->len+n)*2;
+    b->buf=realloc(b->buf, b->size);
+  }
+  memcpy(b->buf+b->len, p, n);
+  b->len+=n;
+}
+
+static void bodylen(struct body *b, size_t n) {
+  unsigned char p[4]={ n>>24, n>>16, n>>8, n };
+  bodyadd(b, p, 4);
+}
+
+static int batchconnect(const char *host, const char *port) {
+  struct addrinfo hints, *res;
+  int fd=-1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype=SOCK_STREAM;
+  if(getaddrinfo(host, port, &hints, &res)!=0) {
+    return -1;
+  }
+  if((fd=socket(res->ai_family, SOCK_STREAM, 0))!=-1 && connect(fd, res->ai_addr, res->ai_addrlen)!=0) {
+    close(fd);
+    fd=-1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+// one POST, the response is read to EOF. Returns its size or -1 on anything
+// but a 200.
+static long batchpost(const char *host, const char *port, const char *uri, const char *type, struct body *b) {
+  char buf[BENCH_CHUNK];
+  long total=0;
+  int fd, n, ok=0;
+
+  if((fd=batchconnect(host, port))==-1) {
+    LOG_ERROR(vlevel, _("Unable to connect to %s:%s: %s\n"), host, port, strerror(errno));
+    return -1;
+  }
+  n=snprintf(buf, sizeof(buf), "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", uri, host, type, b->len);
+  if(write(fd, buf, n)!=n || write(fd, b->buf, b->len)!=(ssize_t)b->len) {
+    close(fd);
+    return -1;
+  }
+  while((n=read(fd, buf, sizeof(buf)))>0) {
+    if(total==0) {
+      ok=n>12 && !strncmp(buf+8, " 200", 4);
+    }
+    total+=n;
+  }
+  close(fd);
+  return ok ? total : -1;
+}
+
+static void batchrun(const char *host, const char *port, const char *uri, const char *type, struct body *b, int keys, const char *label) {
+  double start, secs;
+  long got=0;
+  int i;
+
+  start=now();
+  for(i=0; i<rounds; i++) {
+    if((got=batchpost(host, port, uri, type, b))<0) {
+      LOG_ERROR(vlevel, _("%s failed\n"), label);
+      return;
+    }
+  }
+  secs=now()-start;
+  LOG_ALWAYS(vlevel, _("%-24s %7i keys %10.0f keys/s %8.2f ms/batch  request %zu, response %li bytes\n"),
+             label, keys, (double)keys*rounds/secs, secs*1000/rounds, b->len, got);
+}
+
+static void batchsize(const char *host, const char *port, int keys) {
+  struct body jset={0}, jget={0}, bset={0}, bget={0};
+  char *val=malloc(valuelen+1);
+  char key[32];
+  int i, j, klen;
+
+  for(i=0; i<keys; i++) {
+    klen=snprintf(key, sizeof(key), "bench:%08i", i);
+    for(j=0; j<valuelen; j++) {
+      val[j]='a'+(i+j)%26;
+    }
+    bodyadd(&jset, i ? ", " : "[ ", 2);
+    bodyadd(&jset, "{ \"key\": \"", 10);
+    bodyadd(&jset, key, klen);
+    bodyadd(&jset, "\", \"value\": \"", 13);
+    bodyadd(&jset, val, valuelen);
+    bodyadd(&jset, "\" }", 3);
+    bodyadd(&jget, i ? ", " : "[ ", 2);
+    bodyadd(&jget, "{ \"key\": \"", 10);
+    bodyadd(&jget, key, klen);
+    bodyadd(&jget, "\" }", 3);
+
+    bodylen(&bset, klen);
+    bodyadd(&bset, key, klen);
+    bodylen(&bset, valuelen);
+    bodyadd(&bset, val, valuelen);
+    bodylen(&bget, klen);
+    bodyadd(&bget, key, klen);
+  }
+  bodyadd(&jset, " ]", 2);
+  bodyadd(&jget, " ]", 2);
+
+  batchrun(host, port, "/mset/", "application/json", &jset, keys, "mset, JSON");
+  batchrun(host, port, "/mset/", BINSTREAM_TYPE, &bset, keys, "mset, binstream");
+  batchrun(host, port, "/mget/", "application/json", &jget, keys, "mget, JSON");
+  batchrun(host, port, "/mget/", BINSTREAM_TYPE, &bget, keys, "mget, binstream");
+
+  free(jset.buf);
+  free(jget.buf);
+  free(bset.buf);
+  free(bget.buf);
+  free(val);
+}
+
+static int batchbench(void) {
+  char *host=strdup(target!=NULL ? target : "127.0.0.1:8080");
+  char *sizes=strdup(batchsizes!=NULL ? batchsizes : "1000,10000");
+  char *port=strrchr(host, ':');
+  char *tok, *save=NULL;
+
+  if(port==NULL) {
+    usage("Target must be host:port\n",EXIT_FAILURE);
+  }
+  *port++='\0';
+  for(tok=strtok_r(sizes, ",", &save); tok!=NULL; tok=strtok_r(NULL, ",", &save)) {
+    if(atoi(tok)>0) {
+      batchsize(host, port, atoi(tok));
+    }
+  }
+  free(host);
+  free(sizes);
+  return EXIT_SUCCESS;
+}
+
+// storage mode: the leveldb knobs cskvs and cosd expose as their storage
+// profile, one at a time against the defaults and then all together. Each
+// profile loads numkeys keys in random order, reopens the database so reads
+// come from tables rather than the memtable, then does the same number of
+// random reads of present and of absent keys.
+struct profile {
+  const char *label;
+  long cachesize;
+  int bloombits;
+  int compression;
+  long blocksize;
+  long writebuffer;
+  int maxopenfiles;
+  int verifychecksums;
+};
+
+static const struct profile profiles[]={
+  { "defaults", 0, 0, leveldb_no_compression, 4096, 8388608, 1000, 1 },
+  { "cache_size 64MB", 67108864, 0, leveldb_no_compression, 4096, 8388608, 1000, 1 },
+  { "bloom_bits_per_key 10", 0, 10, leveldb_no_compression, 4096, 8388608, 1000, 1 },
+  { "compression snappy", 0, 0, leveldb_snappy_compression, 4096, 8388608, 1000, 1 },
+  { "block_size 16KB", 0, 0, leveldb_no_compression, 16384, 8388608, 1000, 1 },
+  { "write_buffer_size 64MB", 0, 0, leveldb_no_compression, 4096, 67108864, 1000, 1 },
+  { "max_open_files 64", 0, 0, leveldb_no_compression, 4096, 8388608, 64, 1 },
+  { "verify_checksums no", 0, 0, leveldb_no_compression, 4096, 8388608, 1000, 0 },
+  { "all of the above", 67108864, 10, leveldb_snappy_compression, 16384, 67108864, 1000, 0 },
+  { NULL }
+};
+
+static long dirsize(const char *path) {
+  char file[SHORT_STRING_MAX];
+  struct dirent *de;
+  struct stat st;
+  long total=0;
+  DIR *d;
+
+  if((d=opendir(path))==NULL) {
+    return -1;
+  }
+  while((de=readdir(d))!=NULL) {
+    snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+    if(stat(file, &st)==0 && S_ISREG(st.st_mode)) {
+      total+=st.st_size;
+    }
+  }
+  closedir(d);
+  return total;
+}
+
+static leveldb_t *storageopen(const struct profile *p, const char *path, leveldb_options_t **opt, leveldb_cache_t **cache, leveldb_filterpolicy_t **bloom) {
+  char *err=NULL;
+  leveldb_t *db;
+
+  *opt=leveldb_options_create();
+  *cache=NULL;
+  *bloom=NULL;
+  leveldb_options_set_create_if_missing(*opt, 1);
+  leveldb_options_set_write_buffer_size(*opt, p->writebuffer);
+  leveldb_options_set_compression(*opt, p->compression);
+  leveldb_options_set_block_size(*opt, p->blocksize);
+  leveldb_options_set_max_open_files(*opt, p->maxopenfiles);
+  if(p->cachesize>0) {
+    *cache=leveldb_cache_create_lru(p->cachesize);
+    leveldb_options_set_cache(*opt, *cache);
+  }
+  if(p->bloombits>0) {
+    *bloom=leveldb_filterpolicy_create_bloom(p->bloombits);
+    leveldb_options_set_filter_policy(*opt, *bloom);
+  }
+  if((db=leveldb_open(*opt, path, &err))==NULL) {
+    LOG_ERROR(vlevel, _("Unable to open %s: %s\n"), path, err);
+    free(err);
+  }
+  return db;
+}
+
+static void storageclose(leveldb_t *db, leveldb_options_t *opt, leveldb_cache_t *cache, leveldb_filterpolicy_t *bloom) {
+  leveldb_close(db);
+  leveldb_options_destroy(opt);
+  if(cache!=NULL) {
+    leveldb_cache_destroy(cache);
+  }
+  if(bloom!=NULL) {
+    leveldb_filterpolicy_destroy(bloom);
+  }
+}
+
+// Fisher-Yates with a fixed seed, every profile sees the same order
+static int *shuffled(int n, unsigned int seed) {
+  int *order=malloc(n*sizeof(int));
+  int i, j, t;
+
+  for(i=0; i<n; i++) {
+    order[i]=i;
+  }
+  for(i=n-1; i>0; i--) {
+    j=rand_r(&seed)%(i+1);
+    t=order[i];
+    order[i]=order[j];
+    order[j]=t;
+  }
+  return order;
+}
+
+static void storageprofile(const struct profile *p, const char *dir, int num) {
+  leveldb_options_t *opt;
+  leveldb_cache_t *cache;
+  leveldb_filterpolicy_t *bloom;
+  leveldb_writeoptions_t *wopt=leveldb_writeoptions_create();
+  leveldb_readoptions_t *ropt=leveldb_readoptions_create();
+  leveldb_writebatch_t *wb=leveldb_writebatch_create();
+  int *order=shuffled(num, 1), *reads=shuffled(num, 2);
+  char path[SHORT_STRING_MAX], key[32];
+  char *val=malloc(valuelen), *err=NULL, *got;
+  double start, load, hit, miss;
+  int i, j, klen, found=0;
+  leveldb_t *db;
+  size_t rlen;
+
+  snprintf(path, sizeof(path), "%s/profile", dir);
+  if((db=storageopen(p, path, &opt, &cache, &bloom))==NULL) {
+    goto out;
+  }
+  start=now();
+  for(i=0; i<num; i++) {
+    klen=snprintf(key, sizeof(key), "bench:%08i", order[i]);
+    // text-like values, so compression has something to work with
+    for(j=0; j<valuelen; j++) {
+      val[j]="the quick brown fox jumps over the lazy dog "[(order[i]+j)%44];
+    }
+    leveldb_writebatch_put(wb, key, klen, val, valuelen);
+    if(i%1000==999 || i==num-1) {
+      leveldb_write(db, wopt, wb, &err);
+      leveldb_writebatch_clear(wb);
+    }
+  }
+  load=now()-start;
+  storageclose(db, opt, cache, bloom);
+  if(err!=NULL || (db=storageopen(p, path, &opt, &cache, &bloom))==NULL) {
+    LOG_ERROR(vlevel, _("%s: load failed: %s\n"), p->label, err ? err : "reopen");
+    goto out;
+  }
+
+  leveldb_readoptions_set_verify_checksums(ropt, p->verifychecksums);
+  leveldb_readoptions_set_fill_cache(ropt, cache!=NULL);
+  start=now();
+  for(i=0; i<num; i++) {
+    klen=snprintf(key, sizeof(key), "bench:%08i", reads[i]);
+    if((got=leveldb_get(db, ropt, key, klen, &rlen, &err))!=NULL) {
+      found++;
+      free(got);
+    }
+  }
+  hit=now()-start;
+  start=now();
+  for(i=0; i<num; i++) {
+    // sorts between the loaded keys, so every table range covers it
+    klen=snprintf(key, sizeof(key), "bench:%08i-", reads[i]);
+    if((got=leveldb_get(db, ropt, key, klen, &rlen, &err))!=NULL) {
+      free(got);
+    }
+  }
+  miss=now()-start;
+  storageclose(db, opt, cache, bloom);
+
+  LOG_ALWAYS(vlevel, _("%-24s load %9.0f keys/s  get %9.0f keys/s  miss %9.0f keys/s  %6.1f MB on disk%s\n"),
+             p->label, num/load, num/hit, num/miss, dirsize(path)/1048576.0, found==num ? "" : "  (keys missing!)");
+
+out:
+  free(err);
+  opt=leveldb_options_create();
+  leveldb_destroy_db(opt, path, &err);
+  leveldb_options_destroy(opt);
+  free(err);
+  leveldb_writebatch_destroy(wb);
+  leveldb_readoptions_destroy(ropt);
+  leveldb_writeoptions_destroy(wopt);
+  free(order);
+  free(reads);
+  free(val);
+}
+
+static int storagebench(void) {
+  char tmpl[]="/tmp/cskvbench.XXXXXX";
+  const char *dir=benchdir;
+  int i;
+
+  if(dir==NULL && (dir=mkdtemp(tmpl))==NULL) {
+    LOG_FATAL(vlevel, _("Unable to create a scratch directory: %s\n"), strerror(errno));
+    return EXIT_FAILURE;
+  }
+  LOG_ALWAYS(vlevel, _("%i keys of %i bytes per profile in %s\n"), numkeys, valuelen, dir);
+  for(i=0; profiles[i].label!=NULL; i++) {
+    storageprofile(&profiles[i], dir, numkeys);
+  }
+  if(benchdir==NULL) {
+    rmdir(dir);
+  }
+  return EXIT_SUCCESS;
+}
+
+// hash mode: bucket hashing as /set/ and /mset/ route keys. The path cskvs
+// always had, zlib crc32() one key at a time, against CRC32C one at a time
+// and in HASH_BATCH batches through bhash_many().
+static void hashrun(const char *label, int kind, int batch, char **keys, size_t *lens, int num) {
+  uint32_t out[HASH_BATCH], sink=0;
+  double start;
+  int r, i, j, n;
+
+  start=now();
+  for(r=0; r<rounds; r++) {
+    for(i=0; i<num; i+=n) {
+      n=num-i<HASH_BATCH ? num-i : HASH_BATCH;
+      if(batch) {
+        bhash_many(kind, (const char *const *)keys+i, lens+i, n, out);
+      } else {
+        for(j=0; j<n; j++) {
+          out[j]=bhash(kind, keys[i+j], lens[i+j]);
+        }
+      }
+      for(j=0; j<n; j++) {
+        sink+=out[j];
+      }
+    }
+  }
+  start=now()-start;
+  LOG_ALWAYS(vlevel, _("%-28s %-7s %8.1f ns/key  %8.0f MB/s  (%08X)\n"), label, bhash_impl(kind),
+             start*1e9/((double)num*rounds), (double)num*rounds*lens[0]/start/1048576.0, sink);
+}
+
+static int hashbench(void) {
+  char **keys=calloc(numkeys, sizeof(char *));
+  size_t *lens=calloc(numkeys, sizeof(size_t));
+  size_t klen=valuelen<14 ? 14 : valuelen, j;
+  int i;
+
+  if(keys==NULL || lens==NULL) {
+    LOG_FATAL(vlevel, _("Unable to allocate %i keys\n"), numkeys);
+    return EXIT_FAILURE;
+  }
+  for(i=0; i<numkeys; i++) {
+    if((keys[i]=malloc(klen+1))==NULL) {
+      LOG_FATAL(vlevel, _("Unable to allocate %i keys\n"), numkeys);
+      return EXIT_FAILURE;
+    }
+    snprintf(keys[i], klen+1, "bench:%08i", i);
+    for(j=14; j<klen; j++) {
+      keys[i][j]='a'+(i+j)%26;
+    }
+    keys[i][klen]='\0';
+    lens[i]=klen;
+  }
+  LOG_ALWAYS(vlevel, _("%i keys of %zu bytes, %i passes\n"), numkeys, klen, rounds);
+  hashrun("crc32, one at a time", BHASH_CRC32, 0, keys, lens, numkeys);
+  hashrun("crc32, batched", BHASH_CRC32, 1, keys, lens, numkeys);
+  hashrun("crc32c, one at a time", BHASH_CRC32C, 0, keys, lens, numkeys);
+  hashrun("crc32c, batched", BHASH_CRC32C, 1, keys, lens, numkeys);
+
+  for(i=0; i<numkeys; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+  free(lens);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  int goopt;
+  char *mode=NULL;
+  int ret;
+
+  signal(SIGPIPE,SIG_IGN);
+
+  // command line parsing
+  while ((goopt=getopt (argc, argv, "m:C:n:s:a:k:r:l:d:c:vh")) != -1) {
+    switch (goopt) {
+    case 'm': // benchmark mode
+      mode=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(mode,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'C': // tls certificate
+      sslcert=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(sslcert,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'n': // handshakes per run
+      numhandshakes=atoi(optarg);
+      break;
+    case 's': // bulk transfer size
+      bulkbytes=strtol(optarg,NULL,10);
+      break;
+    case 'a': // batch target
+      target=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(target,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'k': // batch sizes
+      batchsizes=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(batchsizes,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'r': // requests per batch size
+      rounds=atoi(optarg);
+      break;
+    case 'l': // value length
+      valuelen=atoi(optarg);
+      break;
+    case 'd': // storage scratch dir
+      benchdir=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(benchdir,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'c': // storage keys
+      numkeys=atoi(optarg);
+      break;
+    case 'v': // verbose
+      vlevel++;
+      break;
+    case 'h': // help
+      usage(NULL,EXIT_SUCCESS);
+      break;
+    default: // fallthrough
+      usage(NULL,EXIT_FAILURE);
+    }
+  }
+
+  // validation
+  if(mode==NULL) {
+    usage("Must give a benchmark mode\n",EXIT_FAILURE);
+  }
+  if(numhandshakes<1 || bulkbytes<1) {
+    usage("Handshake count and bulk size must be positive\n",EXIT_FAILURE);
+  }
+  if(rounds<1 || valuelen<1 || numkeys<1) {
+    usage("Request count, value length and key count must be positive\n",EXIT_FAILURE);
+  }
+
+  if(!strcmp(mode,"tls")) {
+    ret=tlsbench();
+  } else if(!strcmp(mode,"batch")) {
+    ret=batchbench();
+  } else if(!strcmp(mode,"storage")) {
+    ret=storagebench();
+  } else if(!strcmp(mode,"hash")) {
+    ret=hashbench();
+  } else {
+    usage("Unknown benchmark mode\n",EXIT_FAILURE);
+    ret=EXIT_FAILURE;
+  }
+
+  free(mode);
+  free(sslcert);
+  free(target);
+  free(batchsizes);
+  free(benchdir);
+  return ret;
+}
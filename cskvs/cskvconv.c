@@ -0,0 +1,238 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+// cskvconv: rewrites a cskvs database into another key layout. Runs offline,
+// the source is only read, the destination must not exist yet.
+
+#include <errno.h>
+#include <leveldb/c.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "util.h"
+
+// flush the destination batch after this many bytes
+#define CONV_BATCH_BYTES 4194304
+
+int vlevel=0;
+
+void usage(char *err, int ec) {
+  if(err!=NULL) {
+    fprintf(stderr,_("Error: %s\n"),err);
+    fprintf(stderr,"\n");
+  }
+
+  fprintf(stderr,_("Usage (v%i.%i.%i):\n"),cskvs_VERSION_MAJOR,cskvs_VERSION_MINOR,cskvs_VERSION_REV);
+  fprintf(stderr,_(" -i database dir        -- Source database, left untouched\n"));
+  fprintf(stderr,_(" -o database dir        -- Destination database, must not exist yet\n"));
+  fprintf(stderr,_(" -L layout              -- Layout of the destination, raw|bucket[,ttl][,version][,crc32c], expired entries are dropped, values entering version start at 1\n"));
+  fprintf(stderr,_(" -v                     -- Increases verbose level, can be specified multiple times\n"));
+  fprintf(stderr,_(" -h                     -- This help listing\n"));
+
+  exit(ec);
+}
+
+int main(int argc, char **argv) {
+  int goopt;
+  char *srcdir=NULL;
+  char *dstdir=NULL;
+  int srclayout, dstlayout=-1;
+  leveldb_t *src, *dst;
+  leveldb_options_t *sopt, *dopt;
+  leveldb_readoptions_t *ropt;
+  leveldb_writeoptions_t *wopt;
+  leveldb_writebatch_t *wb;
+  leveldb_iterator_t *it;
+  char *errptr=NULL;
+  size_t pending=0;
+  long long count=0, dropped=0;
+  char *vbuf=NULL;
+  size_t vbufsize=0;
+  time_t now=time(NULL);
+  uint32_t expires;
+  unsigned long long version, maxversion=0;
+
+  while ((goopt=getopt (argc, argv, "i:o:L:vh")) != -1) {
+    switch (goopt) {
+    case 'i': // source
+      srcdir=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(srcdir,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'o': // destination
+      dstdir=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(dstdir,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'L': // destination layout
+      if((dstlayout=layoutparse(optarg))<0) {
+        usage("-L takes raw or bucket, then optionally ,ttl ,version and ,crc32c\n",EXIT_FAILURE);
+      }
+      break;
+    case 'v': // verbosity
+      vlevel++;
+      break;
+    case 'h': // help
+      usage(NULL, EXIT_SUCCESS);
+      break;
+    default:
+      usage("Unknown option\n",EXIT_FAILURE);
+    }
+  }
+  if(srcdir==NULL || dstdir==NULL || dstlayout<0) {
+    usage("-i, -o and -L are required\n",EXIT_FAILURE);
+  }
+  if((srclayout=layoutread(srcdir))<0) {
+    LOG_FATAL(vlevel, _("%s holds no database or an unknown layout\n"), srcdir);
+    exit(EXIT_FAILURE);
+  }
+  if(srclayout==dstlayout) {
+    LOG_FATAL(vlevel, _("%s already uses the %s layout\n"), srcdir, layoutname(srclayout));
+    exit(EXIT_FAILURE);
+  }
+
+  sopt=leveldb_options_create();
+  src=leveldb_open(sopt, srcdir, &errptr);
+  if(errptr!=NULL) {
+    LOG_FATAL(vlevel, _("leveldb_open(%s): %s\n"), srcdir, errptr);
+    exit(EXIT_FAILURE);
+  }
+  dopt=leveldb_options_create();
+  leveldb_options_set_create_if_missing(dopt, 1);
+  leveldb_options_set_error_if_exists(dopt, 1);
+  dst=leveldb_open(dopt, dstdir, &errptr);
+  if(errptr!=NULL) {
+    LOG_FATAL(vlevel, _("leveldb_open(%s): %s\n"), dstdir, errptr);
+    exit(EXIT_FAILURE);
+  }
+
+  LOG_INFO(vlevel, _("Converting %s (%s) to %s (%s)\n"), srcdir, layoutname(srclayout), dstdir, layoutname(dstlayout));
+  ropt=leveldb_readoptions_create();
+  leveldb_readoptions_set_fill_cache(ropt, 0);
+  wopt=leveldb_writeoptions_create();
+  wb=leveldb_writebatch_create();
+  it=leveldb_create_iterator(src, ropt);
+  for(leveldb_iter_seek_to_first(it); leveldb_iter_valid(it) && errptr==NULL; leveldb_iter_next(it)) {
+    const char *k, *v;
+    size_t klen, vlen, sklen;
+    char *sk;
+
+    k=leveldb_iter_key(it, &klen);
+    v=leveldb_iter_value(it, &vlen);
+    // back to the user key and value, then into the destination layout
+    expires=0;
+    version=0;
+    if((srclayout & LAYOUT_HEADER) &&
+       (!valuedecode(v, vlen, &expires, &version, &v, &vlen) || (expires!=0 && (time_t)expires<=now))) {
+      dropped++;
+      continue;
+    }
+    if(dstlayout & LAYOUT_HEADER) {
+      size_t n;
+
+      if(!(dstlayout & LAYOUT_TTL)) {
+        expires=0;
+      }
+      if(!(dstlayout & LAYOUT_VERSION)) {
+        version=0;
+      } else if(version==0) {
+        version=1;
+      }
+      if(version>maxversion) {
+        maxversion=version;
+      }
+      if(vlen+VALUE_HEADER_MAX>vbufsize) {
+        vbufsize=vlen+VALUE_HEADER_MAX;
+        if((vbuf=realloc(vbuf, vbufsize))==NULL) {
+          LOG_FATAL(vlevel, _("Unable to allocate a value\n"));
+          exit(EXIT_FAILURE);
+        }
+      }
+      n=valueencode(vbuf, expires, version);
+      memcpy(vbuf+n, v, vlen);
+      v=vbuf;
+      vlen+=n;
+    }
+    if(srclayout & LAYOUT_BUCKET) {
+      if(klen<BUCKET_PREFIX_LEN) {
+        LOG_ERROR(vlevel, _("Skipping key without a bucket prefix\n"));
+        continue;
+      }
+      k+=BUCKET_PREFIX_LEN;
+      klen-=BUCKET_PREFIX_LEN;
+    }
+    if((sk=storedkey(dstlayout, k, klen, &sklen))==NULL) {
+      LOG_FATAL(vlevel, _("Unable to allocate a key\n"));
+      exit(EXIT_FAILURE);
+    }
+    leveldb_writebatch_put(wb, sk, sklen, v, vlen);
+    free(sk);
+    pending+=sklen+vlen;
+    count++;
+    if(pending>=CONV_BATCH_BYTES) {
+      leveldb_write(dst, wopt, wb, &errptr);
+      leveldb_writebatch_clear(wb);
+      pending=0;
+      LOG_DEBUG(vlevel, _("%lli keys converted\n"), count);
+    }
+  }
+  if(errptr==NULL) {
+    leveldb_iter_get_error(it, &errptr);
+  }
+  if(errptr==NULL && pending>0) {
+    leveldb_write(dst, wopt, wb, &errptr);
+  }
+  leveldb_iter_destroy(it);
+  leveldb_writebatch_destroy(wb);
+  leveldb_writeoptions_destroy(wopt);
+  leveldb_readoptions_destroy(ropt);
+  leveldb_close(src);
+  leveldb_close(dst);
+  leveldb_options_destroy(sopt);
+  leveldb_options_destroy(dopt);
+
+  if(errptr!=NULL) {
+    LOG_FATAL(vlevel, _("Conversion failed after %lli keys: %s\n"), count, errptr);
+    exit(EXIT_FAILURE);
+  }
+  if(layoutwrite(dstdir, dstlayout)!=0) {
+    LOG_FATAL(vlevel, _("Unable to record the layout of %s: %s\n"), dstdir, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  // cskvs goes on from here, versions are never reused. Those of keys the
+  // source deleted or let expire may still be held as ETags, so the source's
+  // ceiling counts too, not just the versions still live in it.
+  if((srclayout & LAYOUT_VERSION) && versionsread(srcdir)>maxversion+1) {
+    maxversion=versionsread(srcdir)-1;
+  }
+  if((dstlayout & LAYOUT_VERSION) && versionswrite(dstdir, maxversion+1)!=0) {
+    LOG_FATAL(vlevel, _("Unable to record the versions of %s: %s\n"), dstdir, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  LOG_INFO(vlevel, _("Converted %lli keys, dropped %lli expired\n"), count, dropped);
+
+  free(vbuf);
+  free(srcdir);
+  free(dstdir);
+  return EXIT_SUCCESS;
+}
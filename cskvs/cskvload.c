@@ -0,0 +1,760 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+
+// cskvload: builds a cskvs database offline from key/value records, far
+// faster than seeding a shard with /mset/ through a running server. Records
+// outside the bucket range are dropped, the rest are sorted in runs by
+// parallel threads, spilled to temporary files and merged, so the database
+// is written once, in key order, in large batches. Of several records with
+// the same key the last one read wins.
+//
+// Input is TSV, key TAB value per line, or the binary records of
+// BINSTREAM_TYPE /mset/ bodies: klen key vlen value, 32 bit big endian.
+
+#include <errno.h>
+#include <leveldb/c.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binstream.h"
+#include "config.h"
+#include "util.h"
+
+// a record in a run: klen and vlen, 32 bit big endian, the key's bucket in
+// BUCKET_PREFIX_LEN bytes, then key and value. Bucket and key together are
+// the stored key of LAYOUT_BUCKET databases.
+#define LOAD_RECORD_HDR (8+BUCKET_PREFIX_LEN)
+// memtable of the destination while loading, fewer and larger level-0 files
+#define LOAD_WRITE_BUFFER 67108864
+// sorted runs of a level merged into one of the next while loading, bounds
+// the temporary files open at a time
+#define LOAD_MERGE_FANIN 32
+// sort threads without -j, each holds a run of -R bytes besides the one read
+#define LOAD_THREADS_MAX 4
+
+int vlevel=0;
+int layout=LAYOUT_RAW;
+int bucketlow=0;
+int buckethigh=BUCKETS;
+int sortthreads=0;
+long runbytes=268435456;
+long batchbytes=16777216;
+long maxrecord=1048576;
+char *tmpdir=NULL;
+
+// records read into memory, sorted by a thread of their own and spilled to
+// a temporary file unless it is the only run. Merged runs are of a higher
+// level and have no records in memory.
+struct run {
+	char *buf;
+	size_t len;
+	size_t size;
+	long long nrecs;
+	const char **recs;  // kept records in stored key order
+	long long nkept;
+	long long dropped;  // outside the bucket range
+	long long dups;     // superseded by a later record in the run
+	int spill;
+	int level;
+	FILE *f;
+	pthread_t thread;
+	int busy;           // thread not joined yet
+};
+
+struct loader {
+	struct run **runs;
+	int nruns;
+	int sorted;         // runs sorted, merged ones included
+	struct run *cur;
+	long long records;
+	long long malformed;
+	long long bytes;
+};
+
+void usage(char *err, int ec) {
+  if(err!=NULL) {
+    fprintf(stderr,_("Error: %s\n"),err);
+    fprintf(stderr,"\n");
+  }
+
+  fprintf(stderr,_("Usage (v%i.%i.%i): cskvload [options] [input ...]\n"),cskvs_VERSION_MAJOR,cskvs_VERSION_MINOR,cskvs_VERSION_REV);
+  fprintf(stderr,_(" input                  -- Files to load in order, later records of a key win, none or - reads stdin\n"));
+  fprintf(stderr,_(" -o database dir        -- Destination database, must not exist yet\n"));
+  fprintf(stderr,_(" -L layout              -- Layout of the destination, raw|bucket[,ttl][,version][,crc32c], see cskvs (default: raw)\n"));
+  fprintf(stderr,_(" -F tsv|bin             -- Input format, key TAB value lines or the binary records of /mset/ bodies (default: tsv)\n"));
+  fprintf(stderr,_(" -b N                   -- Lowest bucket of the shard, inclusive (default: 0)\n"));
+  fprintf(stderr,_(" -B N                   -- Highest bucket of the shard, exclusive (default: %i)\n"), BUCKETS);
+  fprintf(stderr,_(" -j N                   -- Threads sorting runs (default: one per CPU, at most %i)\n"), LOAD_THREADS_MAX);
+  fprintf(stderr,_(" -R N                   -- Bytes of records per sorted run, one per thread is in memory at a time (default: 268435456)\n"));
+  fprintf(stderr,_(" -W N                   -- Bytes per leveldb write batch (default: 16777216)\n"));
+  fprintf(stderr,_(" -M N                   -- Longest key or value accepted, in bytes (default: 1048576)\n"));
+  fprintf(stderr,_(" -T dir                 -- Directory for the sorted runs (default: /tmp)\n"));
+  fprintf(stderr,_(" -v                     -- Increases verbose level, can be specified multiple times\n"));
+  fprintf(stderr,_(" -h                     -- This help listing\n"));
+
+  exit(ec);
+}
+
+static void be32put(char *p, uint32_t n) {
+	p[0]=n>>24;
+	p[1]=n>>16;
+	p[2]=n>>8;
+	p[3]=n;
+}
+
+static uint32_t be32get(const char *p) {
+	const unsigned char *u=(const unsigned char *)p;
+
+	return (uint32_t)u[0]<<24 | (uint32_t)u[1]<<16 | (uint32_t)u[2]<<8 | u[3];
+}
+
+// the stored key of a run record
+static const char *reckey(const char *rec, size_t *sklen) {
+	size_t pfx=layout & LAYOUT_BUCKET ? BUCKET_PREFIX_LEN : 0;
+
+	*sklen=be32get(rec)+pfx;
+	return rec+LOAD_RECORD_HDR-pfx;
+}
+
+// leveldb's bytewise order
+static int keycmp(const char *a, size_t alen, const char *b, size_t blen) {
+	int c=memcmp(a, b, alen<blen ? alen : blen);
+
+	return c ? c : (alen>blen)-(alen<blen);
+}
+
+// records of a key stay in the order they were read
+static int reccmp(const void *a, const void *b) {
+	const char *ra=*(const char *const *)a, *rb=*(const char *const *)b, *ka, *kb;
+	size_t alen, blen;
+	int c;
+
+	ka=reckey(ra, &alen);
+	kb=reckey(rb, &blen);
+	if((c=keycmp(ka, alen, kb, blen))!=0) {
+		return c;
+	}
+	return (ra>rb)-(ra<rb);
+}
+
+// Sorts a run: buckets are hashed HASH_BATCH keys at a time, records outside
+// the range dropped, the rest sorted and of equal keys only the last kept.
+static void *sortrun(void *arg) {
+	struct run *r=arg;
+	const char *keys[HASH_BATCH], *p, *end=r->buf+r->len;
+	const char *batch[HASH_BATCH];
+	size_t lens[HASH_BATCH], sklen, nklen;
+	uint32_t hashes[HASH_BATCH];
+	long long i, j;
+	int n, k, bucket;
+
+	if((r->recs=malloc((r->nrecs ? r->nrecs : 1)*sizeof(char *)))==NULL) {
+		LOG_FATAL(vlevel, _("Unable to allocate a run of %lli records\n"), r->nrecs);
+		exit(EXIT_FAILURE);
+	}
+	for(p=r->buf; p<end; ) {
+		for(n=0; n<HASH_BATCH && p<end; n++) {
+			batch[n]=p;
+			keys[n]=p+LOAD_RECORD_HDR;
+			lens[n]=be32get(p);
+			p+=LOAD_RECORD_HDR+lens[n]+be32get(p+4);
+		}
+		bhash_many(LAYOUT_HASH(layout), keys, lens, n, hashes);
+		for(k=0; k<n; k++) {
+			bucket=hashes[k] % BUCKETS;
+			if(bucket<bucketlow || bucket>=buckethigh) {
+				r->dropped++;
+				continue;
+			}
+			((char *)batch[k])[8]=(bucket>>8) & 0xff;
+			((char *)batch[k])[9]=bucket & 0xff;
+			r->recs[r->nkept++]=batch[k];
+		}
+	}
+	qsort(r->recs, r->nkept, sizeof(char *), &reccmp);
+	for(i=0, j=0; i<r->nkept; i++) {
+		const char *k1=reckey(r->recs[i], &sklen), *k2;
+
+		if(i+1<r->nkept && (k2=reckey(r->recs[i+1], &nklen))!=NULL && keycmp(k1, sklen, k2, nklen)==0) {
+			r->dups++;
+			continue;
+		}
+		r->recs[j++]=r->recs[i];
+	}
+	r->nkept=j;
+	if(!r->spill) {
+		return NULL;
+	}
+
+	if(r->f==NULL) {
+		LOG_FATAL(vlevel, _("No temporary file for a sorted run\n"));
+		exit(EXIT_FAILURE);
+	}
+	// spilled as sklen, vlen, stored key, value
+	for(i=0; i<r->nkept; i++) {
+		const char *sk=reckey(r->recs[i], &sklen);
+		uint32_t vlen=be32get(r->recs[i]+4);
+		char hdr[8];
+
+		be32put(hdr, sklen);
+		be32put(hdr+4, vlen);
+		if(fwrite(hdr, 8, 1, r->f)!=1 || fwrite(sk, sklen+vlen, 1, r->f)!=1) {
+			LOG_FATAL(vlevel, _("Unable to write a sorted run: %s\n"), strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(fflush(r->f)!=0 || fseek(r->f, 0, SEEK_SET)!=0) {
+		LOG_FATAL(vlevel, _("Unable to write a sorted run: %s\n"), strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	free(r->recs);
+	free(r->buf);
+	r->recs=NULL;
+	r->buf=NULL;
+	LOG_DEBUG(vlevel, _("Spilled a run of %lli records\n"), r->nkept);
+	return NULL;
+}
+
+// an unlinked temporary file in tmpdir, gone once it is closed
+static FILE *spillfile(void) {
+	char *path=malloc(strlen(tmpdir)+20);
+	FILE *f=NULL;
+	int fd;
+
+	if(path!=NULL) {
+		sprintf(path, "%s/cskvload.XXXXXX", tmpdir);
+		if((fd=mkstemp(path))!=-1) {
+			unlink(path);
+			f=fdopen(fd, "w+");
+		}
+	}
+	free(path);
+	return f;
+}
+
+static void joinrun(struct run *r) {
+	if(r->busy) {
+		pthread_join(r->thread, NULL);
+		r->busy=0;
+	}
+}
+
+static void compactruns(struct loader *l, int done);
+
+// hands the current run to a sort thread, once fewer than sortthreads are
+// busy. last says no more input follows, a lone run then stays in memory.
+static void submitrun(struct loader *l, int last) {
+	struct run *r=l->cur, **runs;
+	int done;
+
+	l->cur=NULL;
+	if(r==NULL || (r->nrecs==0 && l->nruns>0)) {
+		if(r!=NULL) {
+			free(r->buf);
+			free(r);
+		}
+		return;
+	}
+	if((runs=realloc(l->runs, (l->nruns+1)*sizeof(struct run *)))==NULL) {
+		LOG_FATAL(vlevel, _("Unable to allocate a run\n"));
+		exit(EXIT_FAILURE);
+	}
+	l->runs=runs;
+	r->spill=!last || l->nruns>0;
+	if(r->spill && (r->f=spillfile())==NULL) {
+		LOG_FATAL(vlevel, _("Unable to create a temporary file in %s: %s\n"), tmpdir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(l->nruns>=sortthreads) {
+		joinrun(l->runs[l->nruns-sortthreads]);
+	}
+	for(done=0; done<l->nruns && !l->runs[done]->busy; done++);
+	compactruns(l, done);
+	l->runs[l->nruns++]=r;
+	l->sorted++;
+	if(pthread_create(&r->thread, NULL, &sortrun, r)!=0) {
+		LOG_FATAL(vlevel, _("Unable to start a sort thread\n"));
+		exit(EXIT_FAILURE);
+	}
+	r->busy=1;
+}
+
+// jsonstream_cb, appends a record to the current run
+static int addrecord(void *arg, const char *key, size_t klen, const char *val, size_t vlen, int hasval) {
+	struct loader *l=arg;
+	size_t need=LOAD_RECORD_HDR+klen+vlen;
+	char *p;
+
+	if(klen==0 || klen>(size_t)maxrecord || vlen>(size_t)maxrecord) {
+		l->malformed++;
+		return 0;
+	}
+	if(l->cur!=NULL && l->cur->len+need>l->cur->size) {
+		submitrun(l, 0);
+	}
+	if(l->cur==NULL) {
+		if((l->cur=calloc(1, sizeof(struct run)))==NULL || (l->cur->buf=malloc(runbytes))==NULL) {
+			LOG_FATAL(vlevel, _("Unable to allocate a run of %li bytes\n"), runbytes);
+			exit(EXIT_FAILURE);
+		}
+		l->cur->size=runbytes;
+	}
+	p=l->cur->buf+l->cur->len;
+	be32put(p, klen);
+	be32put(p+4, vlen);
+	memcpy(p+LOAD_RECORD_HDR, key, klen);
+	memcpy(p+LOAD_RECORD_HDR+klen, val, vlen);
+	l->cur->len+=need;
+	l->cur->nrecs++;
+	l->records++;
+	l->bytes+=klen+vlen;
+	return 0;
+}
+
+static int readtsv(struct loader *l, FILE *in) {
+	char *line=NULL, *tab;
+	size_t size=0;
+	ssize_t n;
+
+	while((n=getline(&line, &size, in))>0) {
+		if(line[n-1]=='\n') {
+			n--;
+		}
+		if(n>0 && line[n-1]=='\r') {
+			n--;
+		}
+		if((tab=memchr(line, '\t', n))==NULL) {
+			l->malformed++;
+			continue;
+		}
+		addrecord(l, line, tab-line, tab+1, line+n-tab-1, 1);
+	}
+	free(line);
+	return ferror(in) ? -1 : 0;
+}
+
+static int readbin(struct loader *l, FILE *in) {
+	struct binstream *bs=binstream_new(maxrecord, 1, &addrecord, l);
+	char buf[65536];
+	size_t n;
+	int ret=0;
+
+	if(bs==NULL) {
+		return -1;
+	}
+	while(ret==JSONSTREAM_OK && (n=fread(buf, 1, sizeof(buf), in))>0) {
+		ret=binstream_feed(bs, buf, n);
+	}
+	if(ret==JSONSTREAM_OK) {
+		ret=binstream_finish(bs);
+	}
+	if(ret!=JSONSTREAM_OK) {
+		LOG_ERROR(vlevel, _("Malformed record at byte %zu\n"), binstream_offset(bs));
+	}
+	binstream_free(bs);
+	return ret!=JSONSTREAM_OK || ferror(in) ? -1 : 0;
+}
+
+// where the merge takes the next record of a run from
+struct source {
+	struct run *run;
+	long long pos;
+	char *buf;          // record read from a spilled run
+	size_t size;
+	const char *key;
+	size_t klen;
+	const char *val;
+	size_t vlen;
+	int idx;            // later runs hold later records
+};
+
+static int sourcenext(struct source *s) {
+	struct run *r=s->run;
+	char hdr[8];
+
+	if(!r->spill) {
+		if(s->pos==r->nkept) {
+			return 0;
+		}
+		s->key=reckey(r->recs[s->pos], &s->klen);
+		s->vlen=be32get(r->recs[s->pos]+4);
+		s->val=s->key+s->klen;
+		s->pos++;
+		return 1;
+	}
+	if(fread(hdr, 8, 1, r->f)!=1) {
+		return 0;
+	}
+	s->klen=be32get(hdr);
+	s->vlen=be32get(hdr+4);
+	if(s->klen+s->vlen>s->size) {
+		s->size=s->klen+s->vlen;
+		if((s->buf=realloc(s->buf, s->size))==NULL) {
+			LOG_FATAL(vlevel, _("Unable to allocate a record\n"));
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(fread(s->buf, s->klen+s->vlen, 1, r->f)!=1) {
+		LOG_FATAL(vlevel, _("Unable to read a sorted run: %s\n"), strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	s->key=s->buf;
+	s->val=s->buf+s->klen;
+	return 1;
+}
+
+static int sourcecmp(const struct source *a, const struct source *b) {
+	int c=keycmp(a->key, a->klen, b->key, b->klen);
+
+	return c ? c : a->idx-b->idx;
+}
+
+static void siftdown(struct source **heap, int n, int i) {
+	struct source *s=heap[i];
+	int c;
+
+	while((c=2*i+1)<n) {
+		if(c+1<n && sourcecmp(heap[c+1], heap[c])<0) {
+			c++;
+		}
+		if(sourcecmp(s, heap[c])<=0) {
+			break;
+		}
+		heap[i]=heap[c];
+		i=c;
+	}
+	heap[i]=s;
+}
+
+// Merges sorted runs, oldest first, into db or with db NULL into the spill
+// file out, of equal keys the one from the latest run is kept. Returns the
+// keys kept, -1 on a leveldb error in *err.
+static long long mergeruns(struct run **runs, int nruns, leveldb_t *db, FILE *out, long long *dups, long long *wbytes, char **err) {
+	struct source *srcs=calloc(nruns ? nruns : 1, sizeof(struct source));
+	struct source **heap=calloc(nruns ? nruns : 1, sizeof(struct source *));
+	leveldb_writeoptions_t *wopt=leveldb_writeoptions_create();
+	leveldb_writebatch_t *wb=leveldb_writebatch_create();
+	char hdr[VALUE_HEADER_MAX], *vbuf=NULL;
+	size_t hlen=0, vbufsize=0, pending=0;
+	long long count=0;
+	struct source *s;
+	int i, n=0;
+
+	if(srcs==NULL || heap==NULL) {
+		LOG_FATAL(vlevel, _("Unable to allocate %i merge sources\n"), nruns);
+		exit(EXIT_FAILURE);
+	}
+	// every value gets the same header, cskvconv starts versions at 1 too
+	if(db!=NULL && (layout & LAYOUT_HEADER)) {
+		hlen=valueencode(hdr, 0, layout & LAYOUT_VERSION ? 1 : 0);
+	}
+	for(i=0; i<nruns; i++) {
+		srcs[i].run=runs[i];
+		srcs[i].idx=i;
+		if(sourcenext(&srcs[i])) {
+			heap[n++]=&srcs[i];
+		}
+	}
+	for(i=n/2-1; i>=0; i--) {
+		siftdown(heap, n, i);
+	}
+	while(n>0 && *err==NULL) {
+		s=heap[0];
+		// a later run has the same key, this record is superseded
+		if((n>1 && keycmp(s->key, s->klen, heap[1]->key, heap[1]->klen)==0) ||
+			 (n>2 && keycmp(s->key, s->klen, heap[2]->key, heap[2]->klen)==0)) {
+			(*dups)++;
+		} else if(db==NULL) {
+			char rhdr[8];
+
+			be32put(rhdr, s->klen);
+			be32put(rhdr+4, s->vlen);
+			if(fwrite(rhdr, 8, 1, out)!=1 || fwrite(s->key, s->klen, 1, out)!=1 ||
+				 (s->vlen>0 && fwrite(s->val, s->vlen, 1, out)!=1)) {
+				LOG_FATAL(vlevel, _("Unable to write a merged run: %s\n"), strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			count++;
+		} else {
+			const char *v=s->val;
+			size_t vlen=s->vlen;
+
+			if(hlen>0) {
+				if(hlen+vlen>vbufsize) {
+					vbufsize=hlen+vlen;
+					if((vbuf=realloc(vbuf, vbufsize))==NULL) {
+						LOG_FATAL(vlevel, _("Unable to allocate a value\n"));
+						exit(EXIT_FAILURE);
+					}
+				}
+				memcpy(vbuf, hdr, hlen);
+				memcpy(vbuf+hlen, s->val, s->vlen);
+				v=vbuf;
+				vlen+=hlen;
+			}
+			leveldb_writebatch_put(wb, s->key, s->klen, v, vlen);
+			pending+=s->klen+vlen;
+			*wbytes+=s->klen+vlen;
+			count++;
+			if(pending>=(size_t)batchbytes) {
+				leveldb_write(db, wopt, wb, err);
+				leveldb_writebatch_clear(wb);
+				pending=0;
+				LOG_DEBUG(vlevel, _("%lli keys written\n"), count);
+			}
+		}
+		if(!sourcenext(s)) {
+			heap[0]=heap[--n];
+		}
+		if(n>0) {
+			siftdown(heap, n, 0);
+		}
+	}
+	if(*err==NULL && pending>0) {
+		leveldb_write(db, wopt, wb, err);
+	}
+	for(i=0; i<nruns; i++) {
+		free(srcs[i].buf);
+	}
+	leveldb_writebatch_destroy(wb);
+	leveldb_writeoptions_destroy(wopt);
+	free(vbuf);
+	free(heap);
+	free(srcs);
+	return *err==NULL ? count : -1;
+}
+
+// Merges the last LOAD_MERGE_FANIN of the first done runs, those sorted
+// already, into one run of the next level while they are of the same level,
+// so about LOAD_MERGE_FANIN temporary files per level are open rather than
+// one per run.
+static void compactruns(struct loader *l, int done) {
+	struct run *m, *r;
+	long long wbytes=0;
+	char *err=NULL;
+	int first, i;
+
+	while(done>=LOAD_MERGE_FANIN &&
+				l->runs[done-LOAD_MERGE_FANIN]->level==l->runs[done-1]->level) {
+		first=done-LOAD_MERGE_FANIN;
+		if((m=calloc(1, sizeof(struct run)))==NULL) {
+			LOG_FATAL(vlevel, _("Unable to allocate a run\n"));
+			exit(EXIT_FAILURE);
+		}
+		m->spill=1;
+		m->level=l->runs[first]->level+1;
+		if((m->f=spillfile())==NULL) {
+			LOG_FATAL(vlevel, _("Unable to create a temporary file in %s: %s\n"), tmpdir, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		m->nkept=mergeruns(l->runs+first, LOAD_MERGE_FANIN, NULL, m->f, &m->dups, &wbytes, &err);
+		if(fflush(m->f)!=0 || fseek(m->f, 0, SEEK_SET)!=0) {
+			LOG_FATAL(vlevel, _("Unable to write a merged run: %s\n"), strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		for(i=first; i<done; i++) {
+			r=l->runs[i];
+			m->dropped+=r->dropped;
+			m->dups+=r->dups;
+			fclose(r->f);
+			free(r->recs);
+			free(r->buf);
+			free(r);
+		}
+		l->runs[first]=m;
+		memmove(l->runs+first+1, l->runs+done, (l->nruns-done)*sizeof(struct run *));
+		l->nruns-=LOAD_MERGE_FANIN-1;
+		done=first+1;
+		LOG_DEBUG(vlevel, _("Merged %i runs into one of level %i, %lli records\n"), LOAD_MERGE_FANIN, m->level, m->nkept);
+	}
+}
+
+int main(int argc, char **argv) {
+  int goopt;
+  char *dstdir=NULL;
+  char *format=NULL;
+  char *errptr=NULL;
+  struct loader l;
+  leveldb_t *db;
+  leveldb_options_t *opt;
+  long long written, dropped=0, dups=0, wbytes=0;
+  double start, sorted, done;
+  FILE *in;
+  int i, bin, bad=0;
+
+  while ((goopt=getopt (argc, argv, "o:L:F:b:B:j:R:W:M:T:vh")) != -1) {
+    switch (goopt) {
+    case 'o': // destination
+      dstdir=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(dstdir,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'L': // destination layout
+      if((layout=layoutparse(optarg))<0) {
+        usage("-L takes raw or bucket, then optionally ,ttl ,version and ,crc32c\n",EXIT_FAILURE);
+      }
+      break;
+    case 'F': // input format
+      format=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(format,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'b': // low bucket
+      bucketlow=atoi(optarg);
+      break;
+    case 'B': // high bucket
+      buckethigh=atoi(optarg);
+      break;
+    case 'j': // sort threads
+      sortthreads=atoi(optarg);
+      break;
+    case 'R': // run size
+      runbytes=atol(optarg);
+      break;
+    case 'W': // write batch size
+      batchbytes=atol(optarg);
+      break;
+    case 'M': // longest key or value
+      maxrecord=atol(optarg);
+      break;
+    case 'T': // temporary files
+      tmpdir=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(tmpdir,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'v': // verbosity
+      vlevel++;
+      break;
+    case 'h': // help
+      usage(NULL, EXIT_SUCCESS);
+      break;
+    default:
+      usage("Unknown option\n",EXIT_FAILURE);
+    }
+  }
+  if(dstdir==NULL) {
+    usage("-o is required\n",EXIT_FAILURE);
+  }
+  if(format!=NULL && strcmp(format, "tsv") && strcmp(format, "bin")) {
+    usage("-F takes tsv or bin\n",EXIT_FAILURE);
+  }
+  bin=format!=NULL && !strcmp(format, "bin");
+  if(bucketlow<0 || buckethigh>BUCKETS || bucketlow>=buckethigh) {
+    LOG_FATAL(vlevel, _("Given bucket range out of bounds: %i-%i\n"), bucketlow, buckethigh);
+    exit(EXIT_FAILURE);
+  }
+  if(maxrecord<1 || maxrecord>INT32_MAX/4 || runbytes<2*maxrecord+LOAD_RECORD_HDR || batchbytes<1) {
+    LOG_FATAL(vlevel, _("Given sizes out of bounds, runs must hold at least one record of the longest key and value\n"));
+    exit(EXIT_FAILURE);
+  }
+  if(sortthreads<=0) {
+    if((sortthreads=sysconf(_SC_NPROCESSORS_ONLN))<=0) {
+      sortthreads=1;
+    } else if(sortthreads>LOAD_THREADS_MAX) {
+      sortthreads=LOAD_THREADS_MAX;
+    }
+  }
+  if(tmpdir==NULL) {
+    tmpdir=strdup("/tmp");
+  }
+
+  opt=leveldb_options_create();
+  leveldb_options_set_create_if_missing(opt, 1);
+  leveldb_options_set_error_if_exists(opt, 1);
+  leveldb_options_set_write_buffer_size(opt, LOAD_WRITE_BUFFER);
+  leveldb_options_set_compression(opt, leveldb_no_compression);
+  db=leveldb_open(opt, dstdir, &errptr);
+  if(errptr!=NULL) {
+    LOG_FATAL(vlevel, _("leveldb_open(%s): %s\n"), dstdir, errptr);
+    exit(EXIT_FAILURE);
+  }
+
+  LOG_INFO(vlevel, _("Loading %s (%s), buckets %i-%i, %i sort threads, %li byte runs\n"),
+           dstdir, layoutname(layout), bucketlow, buckethigh, sortthreads, runbytes);
+  memset(&l, 0, sizeof(l));
+  start=walltime();
+  for(i=optind; i<argc || (i==optind && argc==optind); i++) {
+    const char *name=i<argc ? argv[i] : "-";
+
+    if(!strcmp(name, "-")) {
+      in=stdin;
+    } else if((in=fopen(name, "r"))==NULL) {
+      LOG_FATAL(vlevel, _("Unable to open %s: %s\n"), name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if((bin ? readbin(&l, in) : readtsv(&l, in))!=0) {
+      LOG_ERROR(vlevel, _("Unable to read all of %s\n"), name);
+      bad=1;
+    }
+    if(in!=stdin) {
+      fclose(in);
+    }
+  }
+  submitrun(&l, 1);
+  for(i=0; i<l.nruns; i++) {
+    joinrun(l.runs[i]);
+  }
+  for(i=0; i<l.nruns; i++) {
+    dropped+=l.runs[i]->dropped;
+    dups+=l.runs[i]->dups;
+  }
+  sorted=walltime();
+  LOG_ALWAYS(vlevel, _("Read %lli records (%.1f MB) in %.2fs, %lli malformed, %lli outside buckets %i-%i, sorted in %i runs\n"),
+             l.records, l.bytes/1048576.0, sorted-start, l.malformed, dropped, bucketlow, buckethigh, l.sorted);
+
+  written=mergeruns(l.runs, l.nruns, db, NULL, &dups, &wbytes, &errptr);
+  leveldb_close(db);
+  leveldb_options_destroy(opt);
+  done=walltime();
+  for(i=0; i<l.nruns; i++) {
+    if(l.runs[i]->f!=NULL) {
+      fclose(l.runs[i]->f);
+    }
+    free(l.runs[i]->recs);
+    free(l.runs[i]->buf);
+    free(l.runs[i]);
+  }
+  free(l.runs);
+
+  if(errptr!=NULL) {
+    LOG_FATAL(vlevel, _("Load failed: %s\n"), errptr);
+    exit(EXIT_FAILURE);
+  }
+  if(layoutwrite(dstdir, layout)!=0) {
+    LOG_FATAL(vlevel, _("Unable to record the layout of %s: %s\n"), dstdir, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if((layout & LAYOUT_VERSION) && versionswrite(dstdir, 2)!=0) {
+    LOG_FATAL(vlevel, _("Unable to record the versions of %s: %s\n"), dstdir, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  LOG_ALWAYS(vlevel, _("Wrote %lli keys (%.1f MB) in %.2fs, %lli duplicates dropped\n"),
+             written, wbytes/1048576.0, done-sorted, dups);
+  LOG_ALWAYS(vlevel, _("Loaded %s in %.2fs: %.0f records/s, %.1f MB/s\n"),
+             dstdir, done-start, l.records/(done-start), l.bytes/1048576.0/(done-start));
+
+  free(dstdir);
+  free(format);
+  free(tmpdir);
+  return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -22,15 +22,19 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <json/json.h> 
 #include <leveldb/c.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sqlite3.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -38,9 +42,14 @@
 #include <sys/types.h>
 #include <ctype.h>
 #include <unistd.h>
-#include <zlib.h>
 
 #include "config.h"
+#include "binstream.h"
+#include "jsonstream.h"
+#include "gcommit.h"
+#include "hotkeys.h"
+#include "keylock.h"
+#include "vcache.h"
 #include "util.h"
 #include "mongoose.h"
 
@@ -55,6 +64,134 @@ char *errptr;
 int bucketlow=0;
 int buckethigh=BUCKETS;
 
+char *portspec=NULL;
+char *mcportspec=NULL;
+char *unixacl=NULL;
+char *adminacl=NULL;  // clients allowed to POST /meta/reload
+char *handoff=NULL;
+char *sslcert=NULL;
+char *ticketkey=NULL;
+char *ktls=NULL;
+char *acceptorcpus=NULL;
+char *workercpus=NULL;
+char *topology=NULL;
+
+char *cfgfile=NULL;
+char *dbd=NULL;
+char *alfile=NULL;
+int numthreads=10;
+int ratelimit=0;
+int ratelimitburst=0;
+long maxvalue=1048576;
+long writebuffer=8388608;
+long cachesize=0;
+int bloombits=0;
+long blocksize=4096;
+int maxopenfiles=1000;
+int verifychecksums=1;
+long vcachesize=0;
+long scanbudget=4194304;
+int layout=LAYOUT_RAW;
+int durable=0;
+long gcommitbytes=1048576;
+long gcommitwindow=0;
+long ttlsweeprate=1000;
+long ttlsweepinterval=60;
+struct vcache *vcache=NULL;
+struct gcommit *gcommit=NULL;
+struct keylock *keylocks=NULL;
+struct hotkeys *hotkeys=NULL;
+long hotkeyrate=100;
+long counterflush=0;
+long mcmaxconns=1024;
+int flushstop=0;
+int sweepstop=0;
+// next version to hand out and the end of the block reserved on disk
+unsigned long long nextversion=1;
+unsigned long long versionceil=0;
+pthread_mutex_t versionlock=PTHREAD_MUTEX_INITIALIZER;
+int compression=leveldb_no_compression;
+int reload=0;
+char pending[SHORT_STRING_MAX];
+pthread_mutex_t cfglock=PTHREAD_MUTEX_INITIALIZER;
+struct tokenbucket ratebucket=TOKENBUCKET_INITIALIZER;
+struct mg_context *ctx=NULL;
+
+// deadline accounting for /meta/stats, bumped with __sync builtins
+unsigned long dlrequests=0;    // requests that carried X-Request-Deadline
+unsigned long dlexpired=0;     // already expired when a worker got to them
+unsigned long dlaborted=0;     // batches cut short between keys
+unsigned long dlkeysskipped=0; // keys those batches never looked at
+unsigned long dllate=0;        // finished, but after the deadline
+unsigned long dlwastedus=0;    // time spent on aborted and late requests
+
+// ttl accounting for /meta/stats
+unsigned long ttlhidden=0;     // expired values reads did not return
+unsigned long ttlswept=0;      // expired entries the sweeper deleted
+unsigned long ttlpasses=0;     // sweeper passes over the whole database
+
+// counter accounting for /meta/stats
+unsigned long incrops=0;       // increments applied
+unsigned long cflushes=0;      // writes of accumulated counters
+unsigned long cflushed=0;      // counters those writes carried
+
+// memcached listener accounting for /meta/stats
+unsigned long mcconns=0;       // connections accepted
+unsigned long mcopen=0;        // of them still open
+unsigned long mccmds=0;        // commands handled
+unsigned long mchits=0;        // keys get and gets found
+unsigned long mcmisses=0;      // and did not
+unsigned long mcerrors=0;      // ERROR, CLIENT_ERROR and SERVER_ERROR answers
+unsigned long mcrefused=0;     // connections turned away, memcached_connections open
+
+static int compressionparse(const char *name) {
+	return !strcmp(name, "none") ? leveldb_no_compression : !strcmp(name, "snappy") ? leveldb_snappy_compression : -1;
+}
+
+static const char *compressionname(int c) {
+	return c==leveldb_no_compression ? "none" : "snappy";
+}
+
+// keys of the config file, those with restart set are only read at startup
+struct cfgkey cfgkeys[]={
+	{"threads", CFG_INT, &numthreads, 1, 1024},
+	{"loglevel", CFG_INT, &vlevel, INT_MIN, INT_MAX},
+	{"ratelimit", CFG_INT, &ratelimit, 0, INT_MAX},
+	{"ratelimit_burst", CFG_INT, &ratelimitburst, 0, INT_MAX},
+	{"bucketlow", CFG_INT, &bucketlow, 0, BUCKETS-1},
+	{"buckethigh", CFG_INT, &buckethigh, 1, BUCKETS},
+	{"max_value_size", CFG_LONG, &maxvalue, 0, INT_MAX},
+	{"port", CFG_STRING, &portspec, 0, 0, 1},
+	{"memcached_port", CFG_STRING, &mcportspec, 0, 0, 1},
+	{"memcached_connections", CFG_LONG, &mcmaxconns, 1, LONG_MAX},
+	{"database", CFG_STRING, &dbd, 0, 0, 1},
+	{"access_log", CFG_STRING, &alfile, 0, 0, 1},
+	{"write_buffer_size", CFG_LONG, &writebuffer, 1, LONG_MAX, 1},
+	{"cache_size", CFG_LONG, &cachesize, 0, LONG_MAX, 1},
+	{"bloom_bits_per_key", CFG_INT, &bloombits, 0, 64, 1},
+	{"block_size", CFG_LONG, &blocksize, 1, LONG_MAX, 1},
+	{"max_open_files", CFG_INT, &maxopenfiles, 20, INT_MAX, 1},
+	{"verify_checksums", CFG_YESNO, &verifychecksums},
+	{"value_cache_size", CFG_LONG, &vcachesize, 0, LONG_MAX},
+	{"scan_budget", CFG_LONG, &scanbudget, 1, LONG_MAX},
+	{"layout", CFG_NAMED, &layout, 0, 0, 1, &layoutparse, &layoutname},
+	{"compression", CFG_NAMED, &compression, 0, 0, 1, &compressionparse, &compressionname},
+	{"durable_writes", CFG_YESNO, &durable, 0, 0, 1},
+	{"group_commit_bytes", CFG_LONG, &gcommitbytes, 1, LONG_MAX},
+	{"group_commit_window", CFG_LONG, &gcommitwindow, 0, 1000000},
+	{"ttl_sweep_rate", CFG_LONG, &ttlsweeprate, 0, LONG_MAX},
+	{"ttl_sweep_interval", CFG_LONG, &ttlsweepinterval, 1, LONG_MAX},
+	{"counter_flush_interval", CFG_LONG, &counterflush, 0, 60000},
+	{"hotkey_sample_rate", CFG_LONG, &hotkeyrate, 0, LONG_MAX},
+	{"admin_acl", CFG_STRING, &adminacl},
+	{NULL}
+};
+
+// the bucket range handlers check keys against. bucketlow and buckethigh
+// change under cfglock, shardset() then publishes both in one word so a
+// check never pairs the low end of one range with the high end of another.
+unsigned long long shard=BUCKETS;
+
 void usage(char *err, int ec) {
   if(err!=NULL) {
     fprintf(stderr,_("Error: %s\n"),err);
@@ -62,11 +199,26 @@ void usage(char *err, int ec) {
   }
   
   fprintf(stderr,_("Usage (v%i.%i.%i):\n"),cskvs_VERSION_MAJOR,cskvs_VERSION_MINOR,cskvs_VERSION_REV);
+  fprintf(stderr,_(" -f /path/to/config     -- Config file of key = value lines, reread on SIGHUP or a POST to /meta/reload, flags override it\n"));
   fprintf(stderr,_(" -d database dir        -- Specifies database connection to use, module:/path/to/file\n"));
-  fprintf(stderr,_(" -p port spec           -- Port nuber to listen on, passed directly to mongoose HTTP library\n"));
+  fprintf(stderr,_(" -p port spec           -- Port nuber to listen on, passed directly to mongoose HTTP library, e.g. 8080,unix:/run/cskvs.sock\n"));
+  fprintf(stderr,_(" -c port spec           -- Ports speaking the memcached text protocol instead of HTTP, same syntax as -p, e.g. 11211 (default: none)\n"));
+  fprintf(stderr,_(" -U acl                 -- Peer credential ACL for unix: listeners, e.g. +uid:1000,+gid:33 (default: allow all)\n"));
+  fprintf(stderr,_(" -C /path/to/cert.pem   -- TLS certificate and key, enables ports marked with s in the port spec, e.g. 8443s\n"));
+  fprintf(stderr,_(" -T /path/to/ticketkey  -- 80 byte TLS session ticket key, share it between instances so sessions resume across them\n"));
+  fprintf(stderr,_(" -K yes|no              -- Use kernel TLS offload when available (default: yes)\n"));
+  fprintf(stderr,_(" -H /path/to/socket     -- Handoff socket, a new instance started with the same path takes over the listening ports of the running one\n"));
+  fprintf(stderr,_(" -D N                   -- Seconds to let in-flight requests finish after a handoff (default: 30)\n"));
   fprintf(stderr,_(" -n N                   -- Number of HTTP serving threads (default: 10)\n"));
+  fprintf(stderr,_(" -M N                   -- Largest value accepted by PUT /kv/, in bytes (default: 1048576)\n"));
+  fprintf(stderr,_(" -V N                   -- Bytes of hot values cached in front of leveldb for /get/ and /mget/ (default: 0, off)\n"));
+  fprintf(stderr,_(" -S yes|no              -- Durable writes, acknowledged once synced to disk by a group commit thread (default: no)\n"));
+  fprintf(stderr,_(" -G N                   -- Microseconds a durable write group waits for more writers before it is synced (default: 0)\n"));
+  fprintf(stderr,_(" -L layout              -- On-disk layout, raw|bucket[,ttl][,version][,crc32c], bucket keeps each bucket contiguous, ttl allows ttl= on writes, version keeps a version per value for conditional writes, crc32c assigns buckets by CRC32C instead of zlib crc32, must match the database (default: raw)\n"));
   fprintf(stderr,_(" -a /path/to/accessfile -- Access log file, must be writable (if it exists) or in a writable dir (if it does not exist, it will be created)\n"));
   fprintf(stderr,_(" -m mapping spec        -- Hash mapping specification\n"));
+  fprintf(stderr,_(" -W cpulist             -- Pin the acceptor thread to these CPUs, e.g. 0-3,8\n"));
+  fprintf(stderr,_(" -w cpulist             -- Pin the HTTP serving threads to these CPUs, e.g. 0-7,16-23\n"));
   fprintf(stderr,_(" -v                     -- Increases verbose level, can be specified multiple times\n"));
   fprintf(stderr,_(" -h                     -- This help listing\n"));
 	
@@ -81,38 +233,2432 @@ void handlesig(int sig) {
 			LOG_DEBUG(vlevel, _("Finishing...\n"));
 			done=1; 
 		}
+	} else if(sig==SIGHUP) {
+		reload=1;
 	}
 }
 
-static void *mghandle(enum mg_event event, struct mg_connection *conn) {
-  const struct mg_request_info *request_info = mg_get_request_info(conn);
-  if (event == MG_NEW_REQUEST) {
-    char *req=calloc(URL_STRING_MAX+1,sizeof(char));
-    struct in_addr saddr;
-    
-    strncpy(req,request_info->uri, URL_STRING_MAX);
-    saddr.s_addr = ntohl(request_info->remote_ip);
-    
-    LOG_DEBUG(vlevel, _("Connection from: %s, request: %s\n"), inet_ntoa(saddr), req);
-    if(strncmp(req, "/status\0", 8) == 0) { // status
-      // XXX how to get more status 
-      mg_printf(conn,
-								"HTTP/1.1 200 OK\r\n"
+static void shardset(void) {
+	__atomic_store_n(&shard, (unsigned long long)bucketlow<<32 | (unsigned)buckethigh, __ATOMIC_RELAXED);
+}
+
+static void shardrange(int *low, int *high) {
+	unsigned long long s=__atomic_load_n(&shard, __ATOMIC_RELAXED);
+
+	*low=s>>32;
+	*high=s & 0xffffffff;
+}
+
+static int inshard(int bucket) {
+	int low, high;
+
+	shardrange(&low, &high);
+	return bucket>=low && bucket<high;
+}
+
+// (re)reads the config file. Threads, log level, rate limit, bucket range,
+// value size limit, value cache size, scan budget, group commit, ttl sweep,
+// counter flush, hot key sampling, read checksums and the memcached
+// connection limit change right away, the rest is only read at startup and
+// a changed value is listed in pending until the next restart.
+static int loadconfig(int running) {
+	int threads, checksums, bad;
+	long vcsize, gcbytes, gcwindow;
+
+	pthread_mutex_lock(&cfglock);
+	threads=numthreads;
+	checksums=verifychecksums;
+	vcsize=vcachesize;
+	gcbytes=gcommitbytes;
+	gcwindow=gcommitwindow;
+	if((bad=cfgread(cfgfile, cfgkeys))!=0) {
+		if(bad<0) {
+			LOG_ERROR(vlevel, _("Unable to read config file %s: %s\n"), cfgfile, strerror(errno));
+		} else {
+			LOG_ERROR(vlevel, _("%i bad entries in config file %s, keeping current settings\n"), bad, cfgfile);
+		}
+		pthread_mutex_unlock(&cfglock);
+		return -1;
+	}
+	if(cfgfind(cfgkeys, "bucketlow")->staged>=cfgfind(cfgkeys, "buckethigh")->staged) {
+		LOG_ERROR(vlevel, _("bucketlow is not below buckethigh in config file %s, keeping current settings\n"), cfgfile);
+		pthread_mutex_unlock(&cfglock);
+		return -1;
+	}
+	// after a handoff we listen on inherited descriptors, not the spec
+	if(running && !strncmp(portspec, "fd:", 3)) {
+		snprintf(cfgfind(cfgkeys, "port")->sstaged, SHORT_STRING_MAX, "%s", portspec);
+	}
+	if(running && mcportspec!=NULL && !strncmp(mcportspec, "fd:", 3)) {
+		snprintf(cfgfind(cfgkeys, "memcached_port")->sstaged, SHORT_STRING_MAX, "%s", mcportspec);
+	}
+
+	cfgapply(cfgkeys, running, pending, SHORT_STRING_MAX);
+	tokenbucket_set(&ratebucket, ratelimit, ratelimitburst);
+	shardset();
+	if(running) {
+		if(numthreads!=threads && !mg_set_num_threads(ctx, numthreads)) {
+			LOG_ERROR(vlevel, _("Unable to change HTTP serving threads to %i\n"), numthreads);
+		}
+		if(vcachesize!=vcsize) {
+			vcache_resize(vcache, vcachesize);
+		}
+		if(gcommit!=NULL && (gcommitbytes!=gcbytes || gcommitwindow!=gcwindow)) {
+			gcommit_tune(gcommit, gcommitbytes, gcommitwindow);
+		}
+		if(verifychecksums!=checksums) {
+			leveldb_readoptions_set_verify_checksums(ropt, verifychecksums);
+		}
+		if(*pending) {
+			LOG_WARN(vlevel, _("Config file changes need a restart to take effect: %s\n"), pending);
+		}
+	}
+	LOG_INFO(vlevel, _("Loaded config file %s: threads %i, loglevel %i, ratelimit %i/%i, buckets %i-%i\n"),
+					 cfgfile, numthreads, vlevel, ratelimit, ratelimitburst, bucketlow, buckethigh);
+	pthread_mutex_unlock(&cfglock);
+	return 0;
+}
+
+// bytes in front of the user key in stored keys
+static size_t keyprefix(void) {
+	return layout & LAYOUT_BUCKET ? BUCKET_PREFIX_LEN : 0;
+}
+
+// leveldb_write() of a batch, its keys are dropped from the value cache
+// around the write. The batch holds stored keys, the cache user keys.
+static void vcbeginput(void *arg, const char *k, size_t klen, const char *v, size_t vlen) {
+	vcache_begin(arg, k+keyprefix(), klen-keyprefix());
+}
+
+static void vcbegindel(void *arg, const char *k, size_t klen) {
+	vcache_begin(arg, k+keyprefix(), klen-keyprefix());
+}
+
+static void vcendput(void *arg, const char *k, size_t klen, const char *v, size_t vlen) {
+	vcache_end(arg, k+keyprefix(), klen-keyprefix());
+}
+
+static void vcenddel(void *arg, const char *k, size_t klen) {
+	vcache_end(arg, k+keyprefix(), klen-keyprefix());
+}
+
+// Writes a batch with its keys dropped from the value cache meanwhile. With
+// durable writes the batch goes through the group commit thread and this
+// returns once it is synced.
+static void commitbatch(leveldb_writebatch_t *wb, char **err) {
+	leveldb_writebatch_iterate(wb, vcache, &vcbeginput, &vcbegindel);
+	if(gcommit!=NULL) {
+		gcommit_write(gcommit, wb, err);
+	} else {
+		leveldb_write(dbh, wopt, wb, err);
+	}
+	leveldb_writebatch_iterate(wb, vcache, &vcendput, &vcenddel);
+}
+
+// Versions only grow and are never handed out twice, not even across a
+// crash: the end of each block is synced to VERSIONS_FILE before the first
+// version in it is used. 0 if that failed.
+static unsigned long long newversion(void) {
+	unsigned long long v=0;
+
+	pthread_mutex_lock(&versionlock);
+	if(nextversion<versionceil) {
+		v=nextversion++;
+	} else if(versionswrite(dbd, nextversion+VERSION_BLOCK)==0) {
+		versionceil=nextversion+VERSION_BLOCK;
+		v=nextversion++;
+	} else {
+		LOG_ERROR(vlevel, _("Unable to reserve versions in %s: %s\n"), dbd, strerror(errno));
+	}
+	pthread_mutex_unlock(&versionlock);
+	return v;
+}
+
+// a ttl that stores a value already expired, for memcached exptimes that
+// have passed. -1 stays the malformed one, see requestttl().
+#define TTL_EXPIRED -2
+
+// the value as stored, behind a header on LAYOUT_HEADER databases. On
+// LAYOUT_VERSION ones it gets a new version, returned in *version if that is
+// not NULL. Returns val itself or a copy in *buf the caller frees, NULL if
+// that copy or the version failed.
+static const char *storedvalue(const char *val, size_t vlen, long ttl, size_t *slen, char **buf, unsigned long long *version) {
+	unsigned long long v=0;
+	size_t n;
+
+	*buf=NULL;
+	*slen=vlen;
+	if(version!=NULL) {
+		*version=0;
+	}
+	if(!(layout & LAYOUT_HEADER)) {
+		return val;
+	}
+	if((layout & LAYOUT_VERSION) && (v=newversion())==0) {
+		return NULL;
+	}
+	if((*buf=malloc(vlen+VALUE_HEADER_MAX))==NULL) {
+		return NULL;
+	}
+	n=valueencode(*buf, ttl>0 ? (uint32_t)(time(NULL)+ttl) : ttl==TTL_EXPIRED ? (uint32_t)time(NULL) : 0, v);
+	memcpy(*buf+n, val, vlen);
+	*slen=n+vlen;
+	if(version!=NULL) {
+		*version=v;
+	}
+	return *buf;
+}
+
+// points body at what a reader gets of a stored value, 0 once it expired
+static int livevalue(const char *val, size_t vlen, const char **body, size_t *blen) {
+	if(!(layout & LAYOUT_HEADER)) {
+		*body=val;
+		*blen=vlen;
+		return 1;
+	}
+	if(valuebody(val, vlen, time(NULL), body, blen)) {
+		return 1;
+	}
+	__sync_fetch_and_add(&ttlhidden, 1);
+	return 0;
+}
+
+// condition of a write on LAYOUT_VERSION databases, from If-Match and
+// If-None-Match or the version member of an /mset/ element
+#define PRE_NONE 0
+#define PRE_VERSION 1 // the stored value has version
+#define PRE_EXISTS 2  // there is a live value, If-Match: *
+#define PRE_ABSENT 3  // there is none, If-None-Match: *
+struct precond {
+	int type;
+	unsigned long long version;
+};
+
+// "N", N or * into pre, -1 if it is none of them. With absent * means the
+// key must not exist, and so does version 0 from an /mset/ element.
+static int precondparse(const char *s, size_t len, int absent, struct precond *pre) {
+	char num[32], *e;
+
+	if(len==1 && *s=='*') {
+		pre->type=absent ? PRE_ABSENT : PRE_EXISTS;
+		return 0;
+	}
+	if(len>=2 && s[0]=='"' && s[len-1]=='"') {
+		s++;
+		len-=2;
+	}
+	if(absent || len==0 || len>=sizeof(num) || !isdigit((unsigned char)*s)) {
+		return -1;
+	}
+	memcpy(num, s, len);
+	num[len]='\0';
+	errno=0;
+	pre->version=strtoull(num, &e, 10);
+	if(*e!='\0' || errno) {
+		return -1;
+	}
+	pre->type=pre->version ? PRE_VERSION : PRE_ABSENT;
+	return 0;
+}
+
+// Whether pre holds for the current value of key, whose stripe the caller
+// holds so the answer stays true until it unlocks. *cur is the version of
+// that value, 0 if there is none or it has none yet, like a counter /incr/
+// has not written.
+static int precondholds(const char *key, size_t klen, int stripe, const struct precond *pre, unsigned long long *cur, char **err) {
+	const char *body;
+	char *v, *sk;
+	size_t vlen, blen, sklen;
+	uint32_t expires;
+	long long cval;
+	int exists;
+
+	*cur=0;
+	if(pre->type==PRE_NONE) {
+		return 1;
+	}
+	if(keylock_pending(keylocks, stripe, key, klen, &cval)) {
+		exists=1;
+	} else {
+		if((sk=storedkey(layout, key, klen, &sklen))==NULL) {
+			*err=strdup("out of memory");
+			return 0;
+		}
+		v=leveldb_get(dbh, ropt, sk, sklen, &vlen, err);
+		exists=v!=NULL && valuedecode(v, vlen, &expires, cur, &body, &blen) && (expires==0 || (time_t)expires>time(NULL));
+		if(!exists) {
+			*cur=0;
+		}
+		free(v);
+		free(sk);
+	}
+	if(pre->type==PRE_EXISTS) {
+		return exists;
+	}
+	if(pre->type==PRE_ABSENT) {
+		return !exists;
+	}
+	return *cur!=0 && *cur==pre->version;
+}
+
+// Writes the value unless pre does not hold, then it returns 0 with the
+// current version in *version. Otherwise *version is the version written,
+// 0 without LAYOUT_VERSION.
+static int putvalue(const char *key, size_t klen, const char *val, size_t vlen, long ttl, const struct precond *pre, unsigned long long *version, char **err) {
+	size_t sklen, svlen;
+	char *sk=storedkey(layout, key, klen, &sklen), *buf=NULL;
+	const char *sv=NULL;
+	int stripe=keylock_stripe(keylocks, key, klen);
+
+	*version=0;
+	// ordered against /incr/ of the key, a pending counter is replaced. The
+	// version is taken under the lock so a key's versions grow with its writes.
+	keylock_lock(keylocks, stripe);
+	if(sk!=NULL && !precondholds(key, klen, stripe, pre, version, err)) {
+		keylock_unlock(keylocks, stripe);
+		free(sk);
+		return 0;
+	}
+	keylock_droppending(keylocks, stripe, key, klen);
+	if(sk==NULL || (sv=storedvalue(val, vlen, ttl, &svlen, &buf, version))==NULL) {
+		*err=strdup("out of memory");
+	} else if(gcommit!=NULL) {
+		leveldb_writebatch_t *wb=leveldb_writebatch_create();
+
+		leveldb_writebatch_put(wb, sk, sklen, sv, svlen);
+		commitbatch(wb, err);
+		leveldb_writebatch_destroy(wb);
+	} else {
+		vcache_begin(vcache, key, klen);
+		leveldb_put(dbh, wopt, sk, sklen, sv, svlen, err);
+		vcache_end(vcache, key, klen);
+	}
+	keylock_unlock(keylocks, stripe);
+	free(sk);
+	free(buf);
+	return 1;
+}
+
+// ETag header line for a version, empty for none
+static const char *etagheader(char *buf, size_t len, unsigned long long version) {
+	if(version==0) {
+		return "";
+	}
+	snprintf(buf, len, "ETag: \"%llu\"\r\n", version);
+	return buf;
+}
+
+// feeds one in hotkey_sample_rate accesses to /meta/hotkeys, the bucket is
+// only worked out for those if the caller passes -1
+static void hotsample(const char *key, size_t klen, int bucket, int write) {
+	if(hotkeys_sampled(hotkeyrate)) {
+		hotkeys_add(hotkeys, key, klen, bucket>=0 ? bucket : keybucket(layout, key, klen), write);
+	}
+}
+
+// Looks up key, in the value cache first. Returns 1 with body pointing into
+// *val, which the caller frees, and on LAYOUT_VERSION databases the version
+// of a stored value in *version. 0 for a miss, or a leveldb error in *err.
+static int lookupvalue(const char *key, size_t klen, char **val, const char **body, size_t *blen, unsigned long long *version, char **err) {
+  unsigned long gens[VCACHE_SHARDS];
+  size_t rlen=0;
+  uint32_t expires;
+  long long cval;
+
+  *val=NULL;
+  *body=NULL;
+  *version=0;
+  // a counter accumulated in memory is newer than anything stored
+  if(keylock_npending(keylocks)>0) {
+    int stripe=keylock_stripe(keylocks, key, klen);
+
+    keylock_lock(keylocks, stripe);
+    if(keylock_pending(keylocks, stripe, key, klen, &cval) && (*val=malloc(32))!=NULL) {
+      *blen=snprintf(*val, 32, "%lli", cval);
+      *body=*val;
+    }
+    keylock_unlock(keylocks, stripe);
+    if(*body!=NULL) {
+      return 1;
+    }
+  }
+
+  if(!vcache_get(vcache, NULL, key, klen, val, &rlen)) {
+    size_t sklen;
+    char *sk=storedkey(layout, key, klen, &sklen);
+
+    vcache_view(vcache, gens);
+    if((*val=leveldb_get(dbh, ropt, sk, sklen, &rlen, err))!=NULL) {
+      vcache_fill(vcache, gens, key, klen, *val, rlen);
+    }
+    free(sk);
+  }
+  if(*val!=NULL && !livevalue(*val, rlen, body, blen)) {
+    free(*val);
+    *val=NULL;
+  }
+  if(*val==NULL) {
+    return 0;
+  }
+  if(layout & LAYOUT_VERSION) {
+    valuedecode(*val, rlen, &expires, version, body, blen);
+  }
+  return 1;
+}
+
+// Deletes key and a counter of it pending in memory. 1 if there was a live
+// value to delete.
+static int delvalue(const char *key, size_t klen, char **err) {
+  leveldb_writebatch_t *wb;
+  const char *body;
+  size_t sklen, vlen, blen;
+  char *sk=storedkey(layout, key, klen, &sklen), *v=NULL;
+  int stripe=keylock_stripe(keylocks, key, klen), found, stored=0;
+  long long cval;
+
+  if(sk==NULL) {
+    *err=strdup("out of memory");
+    return 0;
+  }
+  keylock_lock(keylocks, stripe);
+  found=keylock_pending(keylocks, stripe, key, klen, &cval);
+  keylock_droppending(keylocks, stripe, key, klen);
+  if((v=leveldb_get(dbh, ropt, sk, sklen, &vlen, err))!=NULL) {
+    stored=1;
+    found=found || livevalue(v, vlen, &body, &blen);
+    free(v);
+  }
+  // an expired value is deleted too, it is only a miss to the caller
+  if(stored && *err==NULL) {
+    wb=leveldb_writebatch_create();
+    leveldb_writebatch_delete(wb, sk, sklen);
+    commitbatch(wb, err);
+    leveldb_writebatch_destroy(wb);
+  }
+  keylock_unlock(keylocks, stripe);
+  free(sk);
+  return found && *err==NULL;
+}
+
+// looks up key and writes the value either raw as application/octet-stream
+// or as text/plain with the trailing CRLF /get/ has always had. Misses are a
+// 404. On LAYOUT_VERSION databases the version of a stored value goes out as
+// its ETag.
+static void sendvalue(struct mg_connection *conn, const char *key, int raw) {
+  unsigned long long version=0;
+  size_t blen=0;
+  char *err=NULL;
+  char *val=NULL;
+  char etag[48];
+  const char *body=NULL;
+
+  hotsample(key, strlen(key), -1, 0);
+  lookupvalue(key, strlen(key), &val, &body, &blen, &version, &err);
+
+  if(err!=NULL) {
+    LOG_ERROR(vlevel,_("leveldb_get(): %s\n"),err);
+    mg_printf(conn,
+              "HTTP/1.1 500 ERROR\r\n"
+              "Content-Type: text/plain\r\n"
+              "Content-Length: %zu\r\n"
+              "\r\n"
+              "ERROR: %s\r\n",
+              9+strlen(err), err);
+    free(err);
+  } else if(val==NULL) {
+    LOG_DEBUG(vlevel, _("Nothing found for %s\n"),key);
+    mg_printf(conn,
+              "HTTP/1.1 404 Not Found\r\n"
+              "Content-Type: text/plain\r\n"
+              "Content-Length: 10\r\n"
+              "\r\n"
+              "NOTFOUND\r\n");
+  } else {
+    LOG_DEBUG(vlevel, _("Found %zu bytes for %s\n"),blen,key);
+    mg_printf(conn,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: %s\r\n"
+              "%s"
+              "Content-Length: %zu\r\n"
+              "\r\n",
+              raw ? "application/octet-stream" : "text/plain", etagheader(etag, sizeof(etag), version), raw ? blen : blen+2);
+    mg_write(conn, body, blen);
+    if(!raw) {
+      mg_write(conn, "\r\n", 2);
+    }
+  }
+  free(val);
+}
+
+// mget keys looked up and answered at a time, which bounds what a batch
+// holds to this many keys and values however many it asks for
+#define MGET_CHUNK 1024
+
+struct mgetkey {
+	const char *key;  // into keybuf once the chunk is complete
+	size_t koff;
+	size_t klen;
+	size_t voff;      // into valbuf
+	size_t vlen;
+	int found;
+};
+
+// one increment of /incr/ or /mincr/
+struct incrop {
+	const char *key;  // into keybuf once parsing is done
+	size_t koff;
+	size_t klen;
+	long long by;
+	long long value;  // the counter after the increment
+	int stripe;
+	int mustexist;    // NOTFOUND instead of starting a missing counter at 0
+	const char *status; // why it was not applied, NULL if it was
+};
+
+// an /mset/ element waiting for its key to be hashed, offsets into stage
+struct msetent {
+	size_t koff;
+	size_t klen;
+	size_t voff;
+	size_t vlen;
+	size_t veroff;
+	size_t verlen;
+	int hasver;
+};
+
+// an /mset/ element this node writes
+struct msetput {
+	size_t koff;      // into keybuf
+	size_t klen;
+	size_t voff;      // into valbuf
+	size_t vlen;
+	int bucket;
+	int stripe;
+	int hascond;      // it had a version member, pre is what it asks for
+	struct precond pre;
+	unsigned long long cur; // the version found when it did not hold
+	int failed;
+};
+
+// state shared between a batch handler and its parser callback
+struct batch {
+	struct jsonstream *js;     // one of js or bs parses the request
+	struct binstream *bs;
+	leveldb_writebatch_t *wb;  // mset, filled by msetflush()
+	struct mg_connection *conn;
+	struct jsonwriter out;     // mget answer
+	int binary;                // mget answer as binstream records
+	struct mgetkey *keys;      // mget keys of the chunk in request order
+	int nkeys;
+	int keyssize;
+	struct jsonwriter keybuf;  // mget and mset key bytes
+	struct jsonwriter valbuf;  // mget values found, mset values
+	const leveldb_snapshot_t *snap; // mget, every chunk reads from it
+	unsigned long gens[VCACHE_SHARDS]; // the value cache as of snap
+	size_t pending;            // mset bytes queued, up to write_buffer_size
+	long ttl;                  // mset ttl in seconds, 0 never expires
+	char *stripes;             // mset, stripes of the keys queued
+	struct msetput *puts;      // mset elements queued, in request order
+	int nputs;
+	int putssize;
+	int failed;                // conditions that did not hold
+	struct msetent *ents;      // mset elements not routed yet, HASH_BATCH of them
+	int nents;
+	struct jsonwriter stage;   // their keys, values and versions
+	const char *status;        // why mset stopped short of the end, if not err
+	struct incrop *ops;        // mincr increments in request order
+	int nops;
+	int opssize;
+	int count;                 // elements seen
+	int hits;                  // mget keys found
+	int skipped;               // elements seen after the deadline passed
+	double deadline;
+	char *err;                 // leveldb error, stops the batch
+};
+
+// Writes what mset queued, the whole request in one batch. The stripes of
+// its keys are held meanwhile, taken in ascending order like incrapply() so
+// two batches cannot deadlock. That orders the batch against /incr/ and
+// conditional writes of the same keys: it is written only if all its
+// conditions hold, and replaces the counters of its keys still pending in
+// memory, which would otherwise be read and flushed over it. The values get
+// their versions here too, so a key's versions grow with its writes.
+static void msetflush(struct batch *b) {
+	const char *sv;
+	size_t sklen, svlen;
+	char *sk, *buf;
+	int i;
+
+	for(i=0; i<KEYLOCK_STRIPES; i++) {
+		if(b->stripes[i]) {
+			keylock_lock(keylocks, i);
+		}
+	}
+	for(i=0; i<b->nputs && b->err==NULL; i++) {
+		struct msetput *p=&b->puts[i];
+
+		if(p->hascond && !precondholds(b->keybuf.buf+p->koff, p->klen, p->stripe, &p->pre, &p->cur, &b->err)) {
+			p->failed=1;
+			b->failed++;
+		}
+	}
+	for(i=0; i<b->nputs && b->err==NULL && b->failed==0; i++) {
+		struct msetput *p=&b->puts[i];
+
+		sk=storedkeyin(layout, p->bucket, b->keybuf.buf+p->koff, p->klen, &sklen);
+		sv=storedvalue(b->valbuf.buf+p->voff, p->vlen, b->ttl, &svlen, &buf, NULL);
+		if(sk==NULL || sv==NULL) {
+			b->err=strdup("out of memory");
+		} else {
+			leveldb_writebatch_put(b->wb, sk, sklen, sv, svlen);
+		}
+		free(sk);
+		free(buf);
+	}
+	if(b->err==NULL && b->failed==0) {
+		commitbatch(b->wb, &b->err);
+	}
+	if(b->err==NULL && b->failed==0 && keylock_npending(keylocks)>0) {
+		for(i=0; i<b->nputs; i++) {
+			keylock_droppending(keylocks, b->puts[i].stripe, b->keybuf.buf+b->puts[i].koff, b->puts[i].klen);
+		}
+	}
+	for(i=KEYLOCK_STRIPES-1; i>=0; i--) {
+		if(b->stripes[i]) {
+			keylock_unlock(keylocks, i);
+		}
+	}
+	leveldb_writebatch_clear(b->wb);
+	b->pending=0;
+}
+
+// Takes note of an element mset writes, with its version member if it has
+// one, see precondparse(). NULL if the element is rejected and b->status
+// says why.
+static struct msetput *msetput(struct batch *b, const char *key, size_t klen, const char *val, size_t vlen, int bucket, int stripe, int hasver, const char *ver, size_t verlen) {
+	struct msetput *p;
+
+	if(hasver && !(layout & LAYOUT_VERSION)) {
+		b->status="NOVERSIONS";
+		return NULL;
+	}
+	if(b->nputs==b->putssize) {
+		int size=b->putssize ? b->putssize*2 : 64;
+
+		if((p=realloc(b->puts, size*sizeof(struct msetput)))==NULL) {
+			b->status="NOMEM";
+			return NULL;
+		}
+		b->puts=p;
+		b->putssize=size;
+	}
+	p=&b->puts[b->nputs];
+	memset(p, 0, sizeof(struct msetput));
+	if(hasver && precondparse(ver, verlen, 0, &p->pre)) {
+		b->status="BADVERSION";
+		return NULL;
+	}
+	p->hascond=hasver;
+	p->koff=b->keybuf.len;
+	p->klen=klen;
+	p->voff=b->valbuf.len;
+	p->vlen=vlen;
+	p->bucket=bucket;
+	p->stripe=stripe;
+	if(jsonwriter_raw(&b->keybuf, key, klen) || jsonwriter_raw(&b->valbuf, val, vlen)) {
+		b->status="NOMEM";
+		return NULL;
+	}
+	b->nputs++;
+	return p;
+}
+
+// Routes the staged elements of an mset: their keys are hashed together,
+// those in buckets this node serves are queued for msetflush(). Non-zero
+// stops the batch.
+static int msetroute(struct batch *b) {
+	const char *keys[HASH_BATCH];
+	size_t lens[HASH_BATCH];
+	uint32_t hashes[HASH_BATCH];
+	int i, n=b->nents, bucket, stripe, ret=0;
+
+	if(n<=0) {
+		return 0;
+	}
+	for(i=0; i<n; i++) {
+		keys[i]=b->stage.buf+b->ents[i].koff;
+		lens[i]=b->ents[i].klen;
+	}
+	bhash_many(LAYOUT_HASH(layout), keys, lens, n, hashes);
+	for(i=0; i<n && ret==0; i++) {
+		struct msetent *e=&b->ents[i];
+		const char *key=keys[i];
+		size_t klen=e->klen, vlen=e->vlen;
+
+		bucket=hashes[i] % BUCKETS;
+		if(!inshard(bucket)) {
+			LOG_TRACE(vlevel,_("Deny element: key %.*s crc %08X bucket %i\n"), (int)klen, key, hashes[i], bucket);
+			continue;
+		}
+		LOG_TRACE(vlevel,_("Allow element: key %.*s crc %08X bucket %i\n"), (int)klen, key, hashes[i], bucket);
+		hotsample(key, klen, bucket, 1);
+		if(b->stripes==NULL) {
+			b->status="NOMEM";
+			ret=1;
+			break;
+		}
+		stripe=keylock_stripe(keylocks, key, klen);
+		b->stripes[stripe]=1;
+		if(msetput(b, key, klen, b->stage.buf+e->voff, vlen, bucket, stripe, e->hasver, b->stage.buf+e->veroff, e->verlen)==NULL) {
+			ret=1;
+			break;
+		}
+		b->pending+=klen+vlen+sizeof(struct msetput);
+		// the batch is only written once it is complete, so that it is all or
+		// nothing. That bounds it to one memtable.
+		if(b->pending>(size_t)writebuffer) {
+			b->status="TOOLARGE";
+			ret=1;
+		}
+	}
+	b->nents=0;
+	b->stage.len=0;
+	return ret;
+}
+
+// mset elements are copied aside and routed HASH_BATCH at a time, see
+// msetroute()
+static int msetelem(void *arg, const char *key, size_t klen, const char *val, size_t vlen, int hasval) {
+	struct batch *b=arg;
+	struct msetent *e;
+	const char *ver=NULL;
+	size_t verlen=0;
+
+	b->count++;
+	if(b->skipped || (b->deadline>0 && walltime()>=b->deadline)) {
+		b->skipped++;
+		return 0;
+	}
+	if(!hasval) {
+		LOG_ERROR(vlevel,_("mset element %i has no value\n"), b->count);
+		return 1;
+	}
+	if(b->ents==NULL) {
+		b->status="NOMEM";
+		return 1;
+	}
+	e=&b->ents[b->nents++];
+	e->hasver=b->js!=NULL && jsonstream_version(b->js, &ver, &verlen);
+	e->koff=b->stage.len;
+	e->klen=klen;
+	e->voff=e->koff+klen;
+	e->vlen=vlen;
+	e->veroff=e->voff+vlen;
+	e->verlen=e->hasver ? verlen : 0;
+	if(jsonwriter_raw(&b->stage, key, klen) || jsonwriter_raw(&b->stage, val, vlen) ||
+		 jsonwriter_raw(&b->stage, ver, e->verlen)) {
+		b->status="NOMEM";
+		return 1;
+	}
+	return b->nents==HASH_BATCH ? msetroute(b) : 0;
+}
+
+// counters are stored as decimal text so /get/ shows them as they are
+static int counterparse(const char *v, size_t vlen, long long *n) {
+	char num[32], *e;
+
+	if(vlen==0 || vlen>=sizeof(num)) {
+		return -1;
+	}
+	memcpy(num, v, vlen);
+	num[vlen]='\0';
+	errno=0;
+	*n=strtoll(num, &e, 10);
+	return *e!='\0' || errno ? -1 : 0;
+}
+
+// keylock_flush() callback, queues a counter's value in the write batch arg
+static void counterput(void *arg, const char *key, size_t klen, long long val, long ttl) {
+	char num[32], *sk, *buf;
+	const char *sv;
+	size_t sklen, svlen;
+
+	snprintf(num, sizeof(num), "%lli", val);
+	sk=storedkey(layout, key, klen, &sklen);
+	sv=storedvalue(num, strlen(num), ttl, &svlen, &buf, NULL);
+	if(sk!=NULL && sv!=NULL) {
+		leveldb_writebatch_put(arg, sk, sklen, sv, svlen);
+	}
+	free(sk);
+	free(buf);
+}
+
+// Applies the increments with their stripes held, so concurrent increments
+// and /set/s of a key never lose an update. The new values are kept as
+// pending counters, duplicate keys in ops see each other through them. They
+// are written right away in one batch, or with counter_flush_interval left
+// to counterflusher(). Missing counters start at 0 unless the op says they
+// must exist, values that are not integers are left alone.
+static void incrapply(struct incrop *ops, int n, long ttl, char **err) {
+	char locked[KEYLOCK_STRIPES];
+	leveldb_writebatch_t *wb;
+	long long cur;
+	size_t vlen, blen, sklen;
+	const char *body;
+	char *v, *sk, *werr=NULL;
+	int i;
+
+	memset(locked, 0, sizeof(locked));
+	for(i=0; i<n; i++) {
+		ops[i].stripe=keylock_stripe(keylocks, ops[i].key, ops[i].klen);
+		locked[ops[i].stripe]=1;
+	}
+	for(i=0; i<KEYLOCK_STRIPES; i++) {
+		if(locked[i]) {
+			keylock_lock(keylocks, i);
+		}
+	}
+	for(i=0; i<n && *err==NULL; i++) {
+		struct incrop *op=&ops[i];
+
+		if(op->status!=NULL) {
+			continue;
+		}
+		if(!keylock_pending(keylocks, op->stripe, op->key, op->klen, &cur)) {
+			cur=0;
+			sk=storedkey(layout, op->key, op->klen, &sklen);
+			v=sk!=NULL ? leveldb_get(dbh, ropt, sk, sklen, &vlen, err) : NULL;
+			if(v!=NULL && livevalue(v, vlen, &body, &blen)) {
+				if(counterparse(body, blen, &cur)) {
+					op->status="NOTANUMBER";
+				}
+			} else if(op->mustexist && *err==NULL) {
+				op->status="NOTFOUND";
+			}
+			free(v);
+			free(sk);
+			if(op->status!=NULL || *err!=NULL) {
+				continue;
+			}
+		}
+		if(__builtin_add_overflow(cur, op->by, &op->value)) {
+			op->status="OVERFLOW";
+		} else if(keylock_setpending(keylocks, op->stripe, op->key, op->klen, op->value, ttl)) {
+			op->status="NOMEM";
+		} else {
+			__sync_fetch_and_add(&incrops, 1);
+		}
+	}
+	if(counterflush==0) {
+		wb=leveldb_writebatch_create();
+		for(i=0; i<KEYLOCK_STRIPES; i++) {
+			if(locked[i]) {
+				keylock_flush(keylocks, i, &counterput, wb);
+			}
+		}
+		commitbatch(wb, &werr);
+		leveldb_writebatch_destroy(wb);
+		if(*err==NULL) {
+			*err=werr;
+		} else {
+			free(werr);
+		}
+	}
+	for(i=KEYLOCK_STRIPES-1; i>=0; i--) {
+		if(locked[i]) {
+			keylock_unlock(keylocks, i);
+		}
+	}
+}
+
+// Writes the counters accumulated in memory every counter_flush_interval
+// milliseconds, all of them in one batch. The stripes stay locked until the
+// write is done, so readers never miss a value in between.
+static void *counterflusher(void *arg) {
+	leveldb_writebatch_t *wb=leveldb_writebatch_create();
+	char *err=NULL;
+	size_t n;
+	long left;
+	int i, stop=0;
+
+	while(!stop) {
+		for(left=counterflush>0 ? counterflush : 100; !flushstop && left>0; left-=100) {
+			usleep((left<100 ? left : 100)*1000);
+		}
+		// one more round after the stop, nothing accumulated is lost
+		stop=flushstop;
+		if(keylock_npending(keylocks)==0) {
+			continue;
+		}
+		for(i=0; i<KEYLOCK_STRIPES; i++) {
+			keylock_lock(keylocks, i);
+		}
+		for(i=0, n=0; i<KEYLOCK_STRIPES; i++) {
+			n+=keylock_flush(keylocks, i, &counterput, wb);
+		}
+		commitbatch(wb, &err);
+		for(i=KEYLOCK_STRIPES-1; i>=0; i--) {
+			keylock_unlock(keylocks, i);
+		}
+		leveldb_writebatch_clear(wb);
+		if(err!=NULL) {
+			LOG_ERROR(vlevel,_("Unable to write %zu counters: %s\n"), n, err);
+			free(err);
+			err=NULL;
+		} else {
+			__sync_fetch_and_add(&cflushes, 1);
+			__sync_fetch_and_add(&cflushed, n);
+		}
+	}
+	leveldb_writebatch_destroy(wb);
+	return NULL;
+}
+
+// /mincr/ elements, the value is the increment, 1 without one
+static int mincrelem(void *arg, const char *key, size_t klen, const char *val, size_t vlen, int hasval) {
+	struct batch *b=arg;
+	struct incrop *op;
+
+	b->count++;
+	if(b->skipped || (b->deadline>0 && walltime()>=b->deadline)) {
+		b->skipped++;
+		return 0;
+	}
+	if(b->nops==b->opssize) {
+		b->opssize=b->opssize ? b->opssize*2 : 256;
+		if((op=realloc(b->ops, b->opssize*sizeof(struct incrop)))==NULL) {
+			return 1;
+		}
+		b->ops=op;
+	}
+	op=&b->ops[b->nops++];
+	memset(op, 0, sizeof(struct incrop));
+	op->koff=b->keybuf.len;
+	op->klen=klen;
+	op->by=1;
+	if(hasval && counterparse(val, vlen, &op->by)) {
+		op->status="BADBY";
+	} else if(klen==0) {
+		op->status="MALFORMED";
+	}
+	return jsonwriter_raw(&b->keybuf, key, klen);
+}
+
+// marks the increments of keys this node does not serve, their keys hashed
+// HASH_BATCH at a time
+static void mincrroute(struct batch *b) {
+	const char *keys[HASH_BATCH];
+	size_t lens[HASH_BATCH];
+	uint32_t hashes[HASH_BATCH];
+	int i, j, n, bkt;
+
+	for(i=0; i<b->nops; i+=n) {
+		n=b->nops-i<HASH_BATCH ? b->nops-i : HASH_BATCH;
+		for(j=0; j<n; j++) {
+			keys[j]=b->ops[i+j].key;
+			lens[j]=b->ops[i+j].klen;
+		}
+		bhash_many(LAYOUT_HASH(layout), keys, lens, n, hashes);
+		for(j=0; j<n; j++) {
+			bkt=hashes[j] % BUCKETS;
+			if(b->ops[i+j].status==NULL && !inshard(bkt)) {
+				b->ops[i+j].status="OUTOFRANGE";
+			}
+		}
+	}
+}
+
+// binstream length prefix
+static int putlen(struct jsonwriter *w, size_t n) {
+	unsigned char p[4]={ n>>24, n>>16, n>>8, n };
+	return jsonwriter_raw(w, (char *)p, 4);
+}
+
+// hashes the collected keys HASH_BATCH at a time and puts their buckets in
+// front of them
+static void mgetroute(struct batch *b) {
+	const char *keys[HASH_BATCH];
+	size_t lens[HASH_BATCH];
+	uint32_t hashes[HASH_BATCH];
+	int i, j, n, bkt;
+
+	for(i=0; i<b->nkeys; i+=n) {
+		n=b->nkeys-i<HASH_BATCH ? b->nkeys-i : HASH_BATCH;
+		for(j=0; j<n; j++) {
+			keys[j]=b->keys[i+j].key+BUCKET_PREFIX_LEN;
+			lens[j]=b->keys[i+j].klen-BUCKET_PREFIX_LEN;
+		}
+		bhash_many(LAYOUT_HASH(layout), keys, lens, n, hashes);
+		for(j=0; j<n; j++) {
+			char *p=b->keybuf.buf+b->keys[i+j].koff;
+
+			bkt=hashes[j] % BUCKETS;
+			p[0]=(bkt>>8) & 0xff;
+			p[1]=bkt & 0xff;
+		}
+	}
+}
+
+// leveldb's default bytewise order
+static int keycmp(const char *a, size_t alen, const char *b, size_t blen) {
+	int r=memcmp(a, b, alen<blen ? alen : blen);
+	return r ? r : (alen>blen)-(alen<blen);
+}
+
+static int mgetkeycmp(const void *a, const void *b) {
+	const struct mgetkey *x=*(struct mgetkey * const *)a, *y=*(struct mgetkey * const *)b;
+	return keycmp(x->key, x->klen, y->key, y->klen);
+}
+
+// Serves the collected keys of a chunk. All chunks read from the snapshot the
+// first one takes, so the batch never sees half of a concurrent mset. The
+// keys are sorted and deduplicated and walked with a single iterator that
+// only seeks when the next key is not the one it already sits on, which
+// turns clustered keys into a sequential scan. Cached values are only used
+// if no write touched their shard since the snapshot.
+static void mgetlookup(struct batch *b) {
+	struct mgetkey **order, *prev=NULL;
+	leveldb_readoptions_t *sopt;
+	leveldb_iterator_t *it;
+	const char *ik, *iv, *body;
+	size_t iklen, ivlen, blen;
+	char *err=NULL, *cached;
+	int i, seeked=0;
+
+	if(b->nkeys==0) {
+		return;
+	}
+	if((order=malloc(b->nkeys*sizeof(struct mgetkey *)))==NULL) {
+		b->status="NOMEM";
+		return;
+	}
+	for(i=0; i<b->nkeys; i++) {
+		b->keys[i].key=b->keybuf.buf+b->keys[i].koff;
+		order[i]=&b->keys[i];
+	}
+	if(layout & LAYOUT_BUCKET) {
+		mgetroute(b);
+	}
+	qsort(order, b->nkeys, sizeof(struct mgetkey *), &mgetkeycmp);
+
+	if(b->snap==NULL) {
+		vcache_view(vcache, b->gens);
+		b->snap=leveldb_create_snapshot(dbh);
+	}
+	sopt=leveldb_readoptions_create();
+	leveldb_readoptions_set_verify_checksums(sopt, verifychecksums);
+	leveldb_readoptions_set_fill_cache(sopt, cachesize>0);
+	leveldb_readoptions_set_snapshot(sopt, b->snap);
+	it=leveldb_create_iterator(dbh, sopt);
+
+	for(i=0; i<b->nkeys; i++) {
+		struct mgetkey *m=order[i];
+
+		if(prev!=NULL && !keycmp(prev->key, prev->klen, m->key, m->klen)) {
+			m->found=prev->found;
+			m->voff=prev->voff;
+			m->vlen=prev->vlen;
+			continue;
+		}
+		prev=m;
+		if(b->deadline>0 && walltime()>=b->deadline) {
+			b->skipped=b->nkeys-i;
+			break;
+		}
+		if(vcache_get(vcache, b->gens, m->key+keyprefix(), m->klen-keyprefix(), &cached, &ivlen)) {
+			if(livevalue(cached, ivlen, &body, &blen)) {
+				m->voff=b->valbuf.len;
+				m->vlen=blen;
+				if(jsonwriter_raw(&b->valbuf, body, blen)) {
+					free(cached);
+					b->status="NOMEM";
+					break;
+				}
+				m->found=1;
+			}
+			free(cached);
+			continue;
+		}
+		// the iterator sits on the first key after the previous one looked
+		// up, anything in between does not exist
+		if(seeked && !leveldb_iter_valid(it)) {
+			continue;
+		}
+		if(!seeked || (ik=leveldb_iter_key(it, &iklen), keycmp(ik, iklen, m->key, m->klen)<0)) {
+			leveldb_iter_seek(it, m->key, m->klen);
+			seeked=1;
+			if(!leveldb_iter_valid(it)) {
+				continue;
+			}
+		}
+		ik=leveldb_iter_key(it, &iklen);
+		if(!keycmp(ik, iklen, m->key, m->klen)) {
+			iv=leveldb_iter_value(it, &ivlen);
+			if(livevalue(iv, ivlen, &body, &blen)) {
+				vcache_fill(vcache, b->gens, m->key+keyprefix(), m->klen-keyprefix(), iv, ivlen);
+				m->voff=b->valbuf.len;
+				m->vlen=blen;
+				if(jsonwriter_raw(&b->valbuf, body, blen)) {
+					b->status="NOMEM";
+					break;
+				}
+				m->found=1;
+			}
+			leveldb_iter_next(it);
+		}
+	}
+	// a key the iterator failed to reach is not a miss
+	leveldb_iter_get_error(it, &err);
+	if(err!=NULL) {
+		LOG_ERROR(vlevel,_("mget iterator: %s\n"), err);
+		b->err=err;
+	}
+	leveldb_iter_destroy(it);
+	leveldb_readoptions_destroy(sopt);
+	free(order);
+}
+
+// writes the hits in request order, duplicates included
+static int mgetemit(struct batch *b) {
+	int i, ret=0;
+
+	for(i=0; i<b->nkeys && !ret; i++) {
+		struct mgetkey *m=&b->keys[i];
+		const char *key=b->keybuf.buf+m->koff+keyprefix();
+		size_t klen=m->klen-keyprefix();
+		const char *val=b->valbuf.buf+m->voff;
+
+		if(!m->found) {
+			continue;
+		}
+		LOG_TRACE(vlevel, _("Found %zu bytes for '%.*s' (index %i)\n"), m->vlen, (int)klen, key, i);
+		if(b->binary) {
+			b->hits++;
+			ret=putlen(&b->out, klen) || jsonwriter_raw(&b->out, key, klen) ||
+				putlen(&b->out, m->vlen) || jsonwriter_raw(&b->out, val, m->vlen);
+		} else {
+			ret=jsonwriter_raw(&b->out, b->hits++ ? ", { \"key\": " : "[ { \"key\": ", 11) ||
+				jsonwriter_string(&b->out, key, klen) ||
+				jsonwriter_raw(&b->out, ", \"value\": ", 11) ||
+				jsonwriter_string(&b->out, val, m->vlen) ||
+				jsonwriter_raw(&b->out, " }", 2);
+		}
+	}
+	return ret;
+}
+
+// Answers the keys collected so far and forgets them, so neither they nor
+// their values pile up over a large batch. Non-zero stops the batch, with
+// b->status set if it ran out of memory.
+static int mgetchunk(struct batch *b) {
+	int ret;
+
+	mgetlookup(b);
+	ret=b->status!=NULL || b->err!=NULL || b->skipped;
+	if(!ret && mgetemit(b)) {
+		b->status="NOMEM";
+		ret=1;
+	}
+	b->nkeys=0;
+	b->keybuf.len=0;
+	b->valbuf.len=0;
+	return ret;
+}
+
+// mget keys are collected and looked up in key order MGET_CHUNK at a time,
+// see mgetlookup()
+static int mgetelem(void *arg, const char *key, size_t klen, const char *val, size_t vlen, int hasval) {
+	struct batch *b=arg;
+	struct mgetkey *m;
+
+	b->count++;
+	if(b->skipped || (b->deadline>0 && walltime()>=b->deadline)) {
+		b->skipped++;
+		return 0;
+	}
+	hotsample(key, klen, -1, 0);
+	if(b->nkeys==b->keyssize) {
+		b->keyssize=b->keyssize ? b->keyssize*2 : 256;
+		if((m=realloc(b->keys, b->keyssize*sizeof(struct mgetkey)))==NULL) {
+			b->status="NOMEM";
+			return 1;
+		}
+		b->keys=m;
+	}
+	m=&b->keys[b->nkeys++];
+	memset(m, 0, sizeof(struct mgetkey));
+	m->koff=b->keybuf.len;
+	m->klen=klen+keyprefix();
+	// keys are kept as stored so they sort in iterator order, the bucket
+	// prefix is filled in by mgetroute()
+	if(layout & LAYOUT_BUCKET) {
+		char bp[BUCKET_PREFIX_LEN]={ 0, 0 };
+
+		if(jsonwriter_raw(&b->keybuf, bp, BUCKET_PREFIX_LEN)) {
+			b->status="NOMEM";
+			return 1;
+		}
+	}
+	if(jsonwriter_raw(&b->keybuf, key, klen)) {
+		b->status="NOMEM";
+		return 1;
+	}
+	return b->nkeys==MGET_CHUNK ? mgetchunk(b) : 0;
+}
+
+// flush callback for the mget writer, the headers go out with the first chunk
+static int sendchunk(void *arg, const char *buf, size_t len) {
+	struct batch *b=arg;
+
+	if(b->out.flushed==0) {
+		mg_printf(b->conn,
+							"HTTP/1.1 200 OK\r\n"
+							"Content-Type: %s\r\n"
+							"Transfer-Encoding: chunked\r\n"
+							"\r\n",
+							b->binary ? BINSTREAM_TYPE : "application/json");
+	}
+	mg_printf(b->conn, "%zx\r\n", len);
+	mg_write(b->conn, buf, len);
+	mg_write(b->conn, "\r\n", 2);
+	return 0;
+}
+
+// Content-Type picks the request parser, a binstream body is read as records
+// with values for mset and bare keys for mget
+static void batchparser(struct mg_connection *conn, struct batch *b, int withvals, jsonstream_cb cb) {
+	const char *type=mg_get_header(conn, "Content-Type");
+
+	if(type!=NULL && strstr(type, BINSTREAM_TYPE)!=NULL) {
+		b->bs=binstream_new(maxvalue, withvals, cb, b);
+	} else {
+		b->js=jsonstream_new(maxvalue, cb, b);
+	}
+}
+
+static size_t batchoffset(const struct batch *b) {
+	return b->bs!=NULL ? binstream_offset(b->bs) : jsonstream_offset(b->js);
+}
+
+// feeds the request body through the parser in POST_DATA_STRING_MAX pieces,
+// stops reading once the deadline passed. Returns the parser status.
+static int readbatch(struct mg_connection *conn, struct batch *b) {
+	char *buf=malloc(POST_DATA_STRING_MAX);
+	int n, status=JSONSTREAM_OK;
+
+	while(status==JSONSTREAM_OK && !b->skipped && (n=mg_read(conn, buf, POST_DATA_STRING_MAX))>0) {
+		status=b->bs!=NULL ? binstream_feed(b->bs, buf, n) : jsonstream_feed(b->js, buf, n);
+	}
+	if(status==JSONSTREAM_OK && !b->skipped) {
+		status=b->bs!=NULL ? binstream_finish(b->bs) : jsonstream_finish(b->js);
+	}
+	free(buf);
+	return status;
+}
+
+static int hexdigit(int c) {
+	return c>='0' && c<='9' ? c-'0' : c>='a' && c<='f' ? c-'a'+10 : c>='A' && c<='F' ? c-'A'+10 : -1;
+}
+
+// group commit counters for /meta/stats, null without durable writes. The
+// histograms are power of two buckets, see GCOMMIT_HIST.
+static void groupcommitstats(char *buf, size_t len) {
+	struct gcommit_stats gs;
+	size_t off;
+	int i;
+
+	if(gcommit==NULL) {
+		snprintf(buf, len, "null");
+		return;
+	}
+	gcommit_stats(gcommit, &gs);
+	off=snprintf(buf, len, "{\"groups\": %lu, \"writes\": %lu, \"bytes\": %lu, \"sync_usec\": %lu, \"max_bytes\": %zu, \"window_usec\": %li, \"writers_hist\": [",
+							 gs.groups, gs.writes, gs.bytes, gs.syncus, gs.maxbytes, gs.window);
+	for(i=0; i<GCOMMIT_HIST && off<len; i++) {
+		off+=snprintf(buf+off, len-off, "%s%lu", i ? ", " : "", gs.writers[i]);
+	}
+	for(i=0; i<GCOMMIT_HIST && off<len; i++) {
+		off+=snprintf(buf+off, len-off, "%s%lu", i ? ", " : "], \"kbytes_hist\": [", gs.kbytes[i]);
+	}
+	if(off<len) {
+		snprintf(buf+off, len-off, "]}");
+	}
+}
+
+// GET /meta/buckets, leveldb's estimate of the bytes on disk for each bucket
+// this node serves. Only the bucket layout keeps a bucket in one key range.
+static void bucketsizes(struct mg_connection *conn) {
+	int low, high, n, i;
+	char **starts, **limits, num[64];
+	size_t *startlens, *limitlens;
+	uint64_t *sizes;
+	struct jsonwriter w;
+
+	shardrange(&low, &high);
+	n=high-low;
+	if(!(layout & LAYOUT_BUCKET)) {
+		mg_printf(conn,
+							"HTTP/1.1 409 Conflict\r\n"
+							"Content-Type: text/plain\r\n"
+							"Content-Length: 11\r\n"
+							"\r\n"
+							"RAWLAYOUT\r\n");
+		return;
+	}
+	n=n>0 ? n : 0;
+	starts=calloc(n+1, sizeof(char *));
+	limits=calloc(n+1, sizeof(char *));
+	startlens=calloc(n+1, sizeof(size_t));
+	limitlens=calloc(n+1, sizeof(size_t));
+	sizes=calloc(n+1, sizeof(uint64_t));
+	// bucket b is [b, b+1), the last possible bucket ends past every prefix
+	for(i=0; i<n; i++) {
+		int b=low+i;
+
+		starts[i]=malloc(BUCKET_PREFIX_LEN+1);
+		limits[i]=malloc(BUCKET_PREFIX_LEN+1);
+		starts[i][0]=(b>>8) & 0xff;
+		starts[i][1]=b & 0xff;
+		startlens[i]=BUCKET_PREFIX_LEN;
+		if(b+1>0xffff) {
+			memset(limits[i], 0xff, BUCKET_PREFIX_LEN+1);
+			limitlens[i]=BUCKET_PREFIX_LEN+1;
+		} else {
+			limits[i][0]=((b+1)>>8) & 0xff;
+			limits[i][1]=(b+1) & 0xff;
+			limitlens[i]=BUCKET_PREFIX_LEN;
+		}
+	}
+	leveldb_approximate_sizes(dbh, n, (const char * const *)starts, startlens, (const char * const *)limits, limitlens, sizes);
+
+	jsonwriter_init(&w, SHORT_STRING_MAX, NULL, NULL);
+	snprintf(num, sizeof(num), "{\"layout\": \"%s\", \"buckets\": [", layoutname(layout));
+	jsonwriter_raw(&w, num, strlen(num));
+	for(i=0; i<n; i++) {
+		snprintf(num, sizeof(num), "%s{\"bucket\": %i, \"bytes\": %llu}", i ? ", " : "", low+i, (unsigned long long)sizes[i]);
+		jsonwriter_raw(&w, num, strlen(num));
+		free(starts[i]);
+		free(limits[i]);
+	}
+	jsonwriter_raw(&w, "]}\r\n", 4);
+	mg_printf(conn,
+						"HTTP/1.1 200 OK\r\n"
+						"Content-Type: application/json\r\n"
+						"Content-Length: %zu\r\n"
+						"\r\n",
+						w.len);
+	mg_write(conn, w.buf, w.len);
+	jsonwriter_free(&w);
+	free(starts);
+	free(limits);
+	free(startlens);
+	free(limitlens);
+	free(sizes);
+}
+
+// GET /meta/hotkeys?n=N, the N (default 20) hottest keys and buckets in
+// estimated accesses, sampled counts times hotkey_sample_rate. Counts halve
+// every HOTKEYS_HALFLIFE seconds, see hotkeys.h.
+static void hotkeylist(struct mg_connection *conn, const struct mg_request_info *request_info) {
+	const char *qs=request_info->query_string;
+	struct hotkey keys[HOTKEYS_SLOTS];
+	struct hotbucket buckets[HOTKEYS_SLOTS];
+	struct jsonwriter w;
+	long rate=hotkeyrate>0 ? hotkeyrate : 1;
+	char num[160];
+	int n=20, nk, nb, i;
+
+	if(qs!=NULL && mg_get_var(qs, strlen(qs), "n", num, sizeof(num))>0) {
+		n=atoi(num);
+	}
+	n=n<1 ? 1 : n>HOTKEYS_SLOTS ? HOTKEYS_SLOTS : n;
+	nk=hotkeys_top(hotkeys, keys, n);
+	nb=hotkeys_topbuckets(hotkeys, buckets, n);
+
+	jsonwriter_init(&w, SHORT_STRING_MAX, NULL, NULL);
+	snprintf(num, sizeof(num), "{\"sample_rate\": %li, \"samples\": %lu, \"half_life\": %i, \"keys\": [",
+					 hotkeyrate, hotkeys_samples(hotkeys), HOTKEYS_HALFLIFE);
+	jsonwriter_raw(&w, num, strlen(num));
+	for(i=0; i<nk; i++) {
+		jsonwriter_raw(&w, i ? ", {\"key\": " : "{\"key\": ", i ? 10 : 8);
+		jsonwriter_string(&w, keys[i].key, keys[i].klen);
+		snprintf(num, sizeof(num), ", \"truncated\": %s, \"bucket\": %i, \"accesses\": %lu, \"reads\": %lu, \"writes\": %lu}",
+						 keys[i].truncated ? "true" : "false", keys[i].bucket, keys[i].count*rate, keys[i].reads*rate, keys[i].writes*rate);
+		jsonwriter_raw(&w, num, strlen(num));
+	}
+	jsonwriter_raw(&w, "], \"buckets\": [", 15);
+	for(i=0; i<nb; i++) {
+		snprintf(num, sizeof(num), "%s{\"bucket\": %i, \"reads\": %lu, \"writes\": %lu}",
+						 i ? ", " : "", buckets[i].bucket, buckets[i].reads*rate, buckets[i].writes*rate);
+		jsonwriter_raw(&w, num, strlen(num));
+	}
+	jsonwriter_raw(&w, "]}\r\n", 4);
+	mg_printf(conn,
+						"HTTP/1.1 200 OK\r\n"
+						"Content-Type: application/json\r\n"
+						"Content-Length: %zu\r\n"
+						"\r\n",
+						w.len);
+	mg_write(conn, w.buf, w.len);
+	jsonwriter_free(&w);
+}
+
+// GET /meta/config, the settings in effect and the config file changes that
+// wait for a restart
+static void configlist(struct mg_connection *conn) {
+	struct jsonwriter w;
+	struct cfgkey *k;
+	const char *s;
+	char num[64];
+
+	jsonwriter_init(&w, SHORT_STRING_MAX, NULL, NULL);
+	pthread_mutex_lock(&cfglock);
+	jsonwriter_raw(&w, "{\"config_file\": ", 16);
+	jsonwriter_string(&w, cfgfile ? cfgfile : "", cfgfile ? strlen(cfgfile) : 0);
+	for(k=cfgkeys; k->key!=NULL; k++) {
+		snprintf(num, sizeof(num), ", \"%s\": ", k->key);
+		jsonwriter_raw(&w, num, strlen(num));
+		if(k->type==CFG_INT || k->type==CFG_LONG) {
+			snprintf(num, sizeof(num), "%li", k->type==CFG_LONG ? *(long *)k->var : *(int *)k->var);
+			jsonwriter_raw(&w, num, strlen(num));
+			continue;
+		} else if(k->type==CFG_STRING) {
+			s=*(char **)k->var ? *(char **)k->var : "";
+		} else if(k->type==CFG_YESNO) {
+			s=*(int *)k->var ? "yes" : "no";
+		} else {
+			s=k->name(*(int *)k->var);
+		}
+		jsonwriter_string(&w, s, strlen(s));
+	}
+	jsonwriter_raw(&w, ", \"restart_required\": [", 23);
+	jsonwriter_raw(&w, pending, strlen(pending));
+	pthread_mutex_unlock(&cfglock);
+	jsonwriter_raw(&w, "]}\r\n", 4);
+	mg_printf(conn,
+						"HTTP/1.1 200 OK\r\n"
+						"Content-Type: application/json\r\n"
+						"Content-Length: %zu\r\n"
+						"\r\n",
+						w.len);
+	mg_write(conn, w.buf, w.len);
+	jsonwriter_free(&w);
+}
+
+// GET /scan?start=&end=&prefix=&bucket=&limit=&keys_only=&token=
+//
+// Walks [start, end) of one snapshot, optionally only keys under prefix or
+// in one bucket, and streams { "items": [ { "key": .., "value": .. }, .. ],
+// "next": .. }. With the bucket layout keys come bucket by bucket. A call
+// stops after limit items, at the deadline or once scan_budget bytes went to
+// the answer or to keys passed over, those of other buckets or expired.
+// "next" is then a token that continues after the last key looked at when
+// passed back with the same end and prefix, null when the range is
+// exhausted. Scans skip the block cache so a sequential pass doesn't push
+// out the hot blocks.
+static void scan(struct mg_connection *conn, const struct mg_request_info *request_info, double deadline) {
+	const char *qs=request_info->query_string ? request_info->query_string : "";
+	char *start=malloc(URL_STRING_MAX), *end=malloc(URL_STRING_MAX), *prefix=malloc(URL_STRING_MAX);
+	char *token=malloc(URL_STRING_MAX), num[32];
+	int slen, elen, plen, tlen, i, keysonly=0, more=0, count=0, examined=0;
+	int onebucket=-1, bkt, lastbkt;
+	size_t pfx=keyprefix();
+	const leveldb_snapshot_t *snap;
+	leveldb_readoptions_t *sopt;
+	leveldb_iterator_t *it;
+	struct jsonwriter last, seek;
+	const char *k, *uk, *v;
+	size_t klen, uklen, vlen, skipped=0;
+	char *nume;
+	char *err=NULL;
+	struct batch b;
+	long limit=0;
+
+	slen=mg_get_var(qs, strlen(qs), "start", start, URL_STRING_MAX);
+	elen=mg_get_var(qs, strlen(qs), "end", end, URL_STRING_MAX);
+	plen=mg_get_var(qs, strlen(qs), "prefix", prefix, URL_STRING_MAX);
+	tlen=mg_get_var(qs, strlen(qs), "token", token, URL_STRING_MAX);
+	if(mg_get_var(qs, strlen(qs), "limit", num, sizeof(num))>0) {
+		limit=strtol(num, NULL, 10);
+	}
+	if(mg_get_var(qs, strlen(qs), "keys_only", num, sizeof(num))>0) {
+		keysonly=strcmp(num, "0") && strcmp(num, "false") && strcmp(num, "no");
+	}
+	if(mg_get_var(qs, strlen(qs), "bucket", num, sizeof(num))>0) {
+		onebucket=strtol(num, &nume, 10);
+		if(*nume!='\0' || onebucket<0 || onebucket>=BUCKETS) {
+			onebucket=-2;
+		}
+	}
+	// the token is the last key handed out as stored, in hex
+	if(tlen>0) {
+		for(i=0; i<tlen/2 && tlen%2==0 && hexdigit(token[2*i])>=0 && hexdigit(token[2*i+1])>=0; i++) {
+			token[i]=hexdigit(token[2*i])<<4 | hexdigit(token[2*i+1]);
+		}
+		tlen=i==tlen/2 && tlen%2==0 && i>=(int)pfx ? i : -2;
+		// with the bucket layout it also names the bucket to go on in
+		if(tlen>0 && pfx>0) {
+			bkt=(unsigned char)token[0]<<8 | (unsigned char)token[1];
+			if(bkt>=BUCKETS || (onebucket>=0 && bkt!=onebucket)) {
+				tlen=-2;
+			}
+		}
+	}
+	if(tlen==-2 || onebucket==-2) {
+		mg_printf(conn,
+							"HTTP/1.1 400 Bad Request\r\n"
+							"Content-Type: text/plain\r\n"
+							"Content-Length: %d\r\n"
+							"\r\n"
+							"%s\r\n",
+							tlen==-2 ? 10 : 11, tlen==-2 ? "BADTOKEN" : "BADBUCKET");
+		free(start);
+		free(end);
+		free(prefix);
+		free(token);
+		return;
+	}
+	slen=slen<0 ? 0 : slen;
+	elen=elen<0 ? 0 : elen;
+	plen=plen<0 ? 0 : plen;
+	tlen=tlen<0 ? 0 : tlen;
+	// each bucket is walked from the later of start and prefix
+	if(plen>0 && keycmp(prefix, plen, start, slen)>0) {
+		memcpy(start, prefix, plen);
+		slen=plen;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.conn=conn;
+	jsonwriter_init(&b.out, POST_DATA_STRING_MAX, strcmp(request_info->http_version, "1.1") ? NULL : &sendchunk, &b);
+	jsonwriter_init(&last, SHORT_STRING_MAX, NULL, NULL);
+	jsonwriter_init(&seek, SHORT_STRING_MAX, NULL, NULL);
+	snap=leveldb_create_snapshot(dbh);
+	sopt=leveldb_readoptions_create();
+	leveldb_readoptions_set_verify_checksums(sopt, verifychecksums);
+	leveldb_readoptions_set_fill_cache(sopt, 0);
+	leveldb_readoptions_set_snapshot(sopt, snap);
+	it=leveldb_create_iterator(dbh, sopt);
+
+	// the raw layout is one pass over everything, bucket= then filters key by
+	// key. The bucket layout walks the buckets one after the other.
+	bkt=onebucket>=0 ? onebucket : 0;
+	lastbkt=pfx==0 ? bkt : onebucket>=0 ? onebucket : BUCKETS-1;
+	if(tlen>0 && pfx>0) {
+		bkt=(unsigned char)token[0]<<8 | (unsigned char)token[1];
+	}
+	jsonwriter_raw(&b.out, "{ \"items\": [ ", 13);
+	for(; bkt<=lastbkt && !more; bkt++) {
+		if(tlen>0) {
+			leveldb_iter_seek(it, token, tlen);
+			if(leveldb_iter_valid(it) && (k=leveldb_iter_key(it, &klen), !keycmp(k, klen, token, tlen))) {
+				leveldb_iter_next(it);
+			}
+			tlen=0;
+		} else {
+			seek.len=0;
+			if(pfx>0) {
+				unsigned char bp[BUCKET_PREFIX_LEN]={ bkt>>8, bkt };
+				jsonwriter_raw(&seek, (char *)bp, pfx);
+			}
+			jsonwriter_raw(&seek, start, slen);
+			leveldb_iter_seek(it, seek.buf, seek.len);
+		}
+		for(; leveldb_iter_valid(it); leveldb_iter_next(it)) {
+			k=leveldb_iter_key(it, &klen);
+			if(pfx>0 && (klen<pfx || ((unsigned char)k[0]<<8 | (unsigned char)k[1])!=bkt)) {
+				break;
+			}
+			uk=k+pfx;
+			uklen=klen-pfx;
+			if((elen>0 && keycmp(uk, uklen, end, elen)>=0) || (plen>0 && (uklen<(size_t)plen || memcmp(uk, prefix, plen)))) {
+				break;
+			}
+			// the first key is always looked at, so every call moves on
+			if(examined>0 && ((limit>0 && count>=limit) || b.out.flushed+b.out.len+skipped>=(size_t)scanbudget ||
+												(deadline>0 && walltime()>=deadline))) {
+				more=1;
+				break;
+			}
+			examined++;
+			last.len=0;
+			jsonwriter_raw(&last, k, klen);
+			if(pfx==0 && onebucket>=0 && keybucket(layout, uk, uklen)!=onebucket) {
+				skipped+=klen;
+				continue;
+			}
+			v=leveldb_iter_value(it, &vlen);
+			if(!livevalue(v, vlen, &v, &vlen)) {
+				skipped+=klen+vlen;
+				continue;
+			}
+			jsonwriter_raw(&b.out, count ? ", { \"key\": " : "{ \"key\": ", count ? 11 : 9);
+			count++;
+			jsonwriter_string(&b.out, uk, uklen);
+			if(!keysonly) {
+				jsonwriter_raw(&b.out, ", \"value\": ", 11);
+				jsonwriter_string(&b.out, v, vlen);
+			}
+			jsonwriter_raw(&b.out, " }", 2);
+		}
+	}
+	leveldb_iter_get_error(it, &err);
+	if(err!=NULL) {
+		LOG_ERROR(vlevel,_("scan iterator: %s\n"), err);
+		jsonwriter_raw(&b.out, " ], \"error\": ", 13);
+		jsonwriter_string(&b.out, err, strlen(err));
+		more=0;
+		free(err);
+	} else {
+		jsonwriter_raw(&b.out, " ]", 2);
+	}
+	jsonwriter_raw(&b.out, ", \"next\": ", 10);
+	if(more) {
+		jsonwriter_raw(&b.out, "\"", 1);
+		for(i=0; i<(int)last.len; i++) {
+			snprintf(num, sizeof(num), "%02x", (unsigned char)last.buf[i]);
+			jsonwriter_raw(&b.out, num, 2);
+		}
+		jsonwriter_raw(&b.out, "\" }\r\n", 5);
+	} else {
+		jsonwriter_raw(&b.out, "null }\r\n", 8);
+	}
+	LOG_DEBUG(vlevel, _("scan returned %i keys%s\n"), count, more ? ", more to come" : "");
+
+	if(b.out.flushed>0) {
+		jsonwriter_flush(&b.out);
+		mg_printf(conn, "0\r\n\r\n");
+	} else {
+		mg_printf(conn,
+							"HTTP/1.1 200 OK\r\n"
+							"Content-Type: application/json\r\n"
+							"Content-Length: %zu\r\n"
+							"\r\n",
+							b.out.len);
+		mg_write(conn, b.out.buf, b.out.len);
+	}
+
+	leveldb_iter_destroy(it);
+	leveldb_readoptions_destroy(sopt);
+	leveldb_release_snapshot(dbh, snap);
+	jsonwriter_free(&b.out);
+	jsonwriter_free(&last);
+	jsonwriter_free(&seek);
+	free(start);
+	free(end);
+	free(prefix);
+	free(token);
+}
+
+// sleeps in one second steps so shutdown doesn't wait on the sweeper
+static void sweepsleep(double secs) {
+	while(secs>0 && !sweepstop) {
+		usleep((secs<1 ? secs : 1)*1000000);
+		secs-=1;
+	}
+}
+
+// Deletes expired entries of LAYOUT_TTL databases in the background. Each
+// round looks at up to SWEEP_SCAN keys from a fresh iterator and deletes
+// the expired ones among them in one write of at most SWEEP_BATCH deletes,
+// paced to ttl_sweep_rate deletes a second, so tombstones trickle in rather
+// than all at once. A pass over the whole database starts every
+// ttl_sweep_interval seconds. The candidates are checked again under their
+// key stripes, which every write takes, so a key set again since the
+// iterator saw it is never deleted.
+static void *sweeper(void *arg) {
+	leveldb_readoptions_t *sopt=leveldb_readoptions_create();
+	leveldb_writebatch_t *wb=leveldb_writebatch_create();
+	struct jsonwriter keys, last;
+	size_t koff[SWEEP_BATCH+1], klen, vlen, blen, pfx=keyprefix();
+	const char *k, *v, *body;
+	char *val, *err=NULL, locked[KEYLOCK_STRIPES];
+	int n, i, scanned, more, deleted;
+	leveldb_iterator_t *it;
+	double started;
+	time_t now;
+
+	leveldb_readoptions_set_fill_cache(sopt, 0);
+	jsonwriter_init(&keys, SHORT_STRING_MAX, NULL, NULL);
+	jsonwriter_init(&last, SHORT_STRING_MAX, NULL, NULL);
+	while(!sweepstop) {
+		started=walltime();
+		last.len=0;
+		more=1;
+		while(more && !sweepstop) {
+			if(ttlsweeprate<=0) {
+				sweepsleep(1);
+				continue;
+			}
+			it=leveldb_create_iterator(dbh, sopt);
+			if(last.len>0) {
+				leveldb_iter_seek(it, last.buf, last.len);
+				if(leveldb_iter_valid(it) && (k=leveldb_iter_key(it, &klen), !keycmp(k, klen, last.buf, last.len))) {
+					leveldb_iter_next(it);
+				}
+			} else {
+				leveldb_iter_seek_to_first(it);
+			}
+			keys.len=0;
+			now=time(NULL);
+			for(n=0, scanned=0; leveldb_iter_valid(it) && n<SWEEP_BATCH && scanned<SWEEP_SCAN; leveldb_iter_next(it), scanned++) {
+				k=leveldb_iter_key(it, &klen);
+				v=leveldb_iter_value(it, &vlen);
+				if(!valuebody(v, vlen, now, &body, &blen)) {
+					koff[n++]=keys.len;
+					jsonwriter_raw(&keys, k, klen);
+				}
+				last.len=0;
+				jsonwriter_raw(&last, k, klen);
+			}
+			koff[n]=keys.len;
+			more=leveldb_iter_valid(it);
+			leveldb_iter_destroy(it);
+			if(n==0) {
+				continue;
+			}
+
+			// in ascending order like every other taker of several stripes
+			memset(locked, 0, sizeof(locked));
+			for(i=0; i<n; i++) {
+				locked[keylock_stripe(keylocks, keys.buf+koff[i]+pfx, koff[i+1]-koff[i]-pfx)]=1;
+			}
+			for(i=0; i<KEYLOCK_STRIPES; i++) {
+				if(locked[i]) {
+					keylock_lock(keylocks, i);
+				}
+			}
+			for(i=0, deleted=0; i<n; i++) {
+				klen=koff[i+1]-koff[i];
+				if((val=leveldb_get(dbh, ropt, keys.buf+koff[i], klen, &vlen, &err))!=NULL && !valuebody(val, vlen, now, &body, &blen)) {
+					leveldb_writebatch_delete(wb, keys.buf+koff[i], klen);
+					deleted++;
+				}
+				free(val);
+				free(err);
+				err=NULL;
+			}
+			if(deleted>0) {
+				commitbatch(wb, &err);
+			}
+			for(i=KEYLOCK_STRIPES-1; i>=0; i--) {
+				if(locked[i]) {
+					keylock_unlock(keylocks, i);
+				}
+			}
+			leveldb_writebatch_clear(wb);
+			if(err!=NULL) {
+				LOG_ERROR(vlevel,_("ttl sweep: %s\n"), err);
+				free(err);
+				err=NULL;
+			} else {
+				__sync_fetch_and_add(&ttlswept, deleted);
+				LOG_TRACE(vlevel, _("ttl sweep deleted %i expired entries\n"), deleted);
+			}
+			sweepsleep((double)deleted/ttlsweeprate);
+		}
+		if(!sweepstop) {
+			__sync_fetch_and_add(&ttlpasses, 1);
+			sweepsleep(ttlsweepinterval-(walltime()-started));
+		}
+	}
+	jsonwriter_free(&keys);
+	jsonwriter_free(&last);
+	leveldb_writebatch_destroy(wb);
+	leveldb_readoptions_destroy(sopt);
+	return NULL;
+}
+
+// ttl= of a write in seconds, 0 without one, -1 if it is malformed or the
+// database keeps no expiry (see LAYOUT_TTL)
+static long requestttl(const struct mg_request_info *request_info) {
+	const char *qs=request_info->query_string;
+	char num[32], *e;
+	long ttl;
+
+	if(qs==NULL || mg_get_var(qs, strlen(qs), "ttl", num, sizeof(num))<=0) {
+		return 0;
+	}
+	ttl=strtol(num, &e, 10);
+	if(*e!='\0' || ttl<0 || ttl>UINT32_MAX-time(NULL) || (ttl>0 && !(layout & LAYOUT_TTL))) {
+		return -1;
+	}
+	return ttl;
+}
+
+// If-Match or If-None-Match of a write into pre, -1 if it is malformed or
+// the database keeps no versions (see LAYOUT_VERSION)
+static int requestprecond(struct mg_connection *conn, struct precond *pre) {
+	const char *im=mg_get_header(conn, "If-Match");
+	const char *inm=mg_get_header(conn, "If-None-Match");
+
+	pre->type=PRE_NONE;
+	if(im==NULL && inm==NULL) {
+		return 0;
+	}
+	if(!(layout & LAYOUT_VERSION) || (im!=NULL && inm!=NULL)) {
+		return -1;
+	}
+	return im!=NULL ? precondparse(im, strlen(im), 0, pre) : precondparse(inm, strlen(inm), 1, pre);
+}
+
+// answer to /set/ and PUT /kv/, 412 with the current version if the
+// condition did not hold
+static void sendput(struct mg_connection *conn, int written, unsigned long long version) {
+	char etag[48];
+
+	if(written) {
+		mg_printf(conn,
+							"HTTP/1.1 200 OK\r\n"
+							"Content-Type: text/plain\r\n"
+							"%s"
+							"Content-Length: 4\r\n"
+							"\r\n"
+							"OK\r\n",
+							etagheader(etag, sizeof(etag), version));
+	} else {
+		mg_printf(conn,
+							"HTTP/1.1 412 Precondition Failed\r\n"
+							"Content-Type: text/plain\r\n"
+							"%s"
+							"Content-Length: 10\r\n"
+							"\r\n"
+							"MISMATCH\r\n",
+							etagheader(etag, sizeof(etag), version));
+	}
+}
+
+// memcached text protocol on the -c listeners: get, gets, set, cas, delete,
+// incr, version and quit. A connection only holds a worker thread while it
+// has commands to run, in between it is parked with mg_park() until the
+// client sends more, so idle client pools don't take workers from HTTP.
+// Connections beyond memcached_connections are turned away. Answers to a
+// pipelined run of commands are collected and go out together once no
+// complete command is left in the input.
+#define MC_KEY_MAX 250
+#define MC_RELATIVE_MAX 2592000 // larger exptimes are unix times
+#define MC_TOKENS 8
+
+struct mcconn {
+	struct mg_connection *conn;
+	char *in;           // received, from off on not handled yet
+	size_t off;
+	size_t len;
+	size_t size;
+	int noreply;        // the current command wants no answer
+	struct jsonwriter out;
+	struct in_addr addr;
+};
+
+static int mcsend(void *arg, const char *buf, size_t len) {
+	return mg_write(arg, buf, len)==(int)len ? 0 : -1;
+}
+
+// sends what is answered so far and reads more, with room for want bytes
+// from off on. <=0 once the peer is gone.
+static int mcfill(struct mcconn *mc, size_t want) {
+	size_t size=mc->size;
+	char *in;
+	int n;
+
+	if(mc->off>0) {
+		memmove(mc->in, mc->in+mc->off, mc->len-mc->off);
+		mc->len-=mc->off;
+		mc->off=0;
+	}
+	while(size<want) {
+		size*=2;
+	}
+	if(size>mc->size) {
+		if((in=realloc(mc->in, size))==NULL) {
+			return -1;
+		}
+		mc->in=in;
+		mc->size=size;
+	}
+	if(mc->out.len>0 && jsonwriter_flush(&mc->out)!=0) {
+		return -1;
+	}
+	if((n=mg_recv(mc->conn, mc->in+mc->len, mc->size-mc->len))>0) {
+		mc->len+=n;
+	}
+	return n;
+}
+
+static void mcreply(struct mcconn *mc, const char *s, size_t len) {
+	if(!mc->noreply) {
+		jsonwriter_raw(&mc->out, s, len);
+	}
+}
+
+static void mcerror(struct mcconn *mc, const char *s) {
+	__sync_fetch_and_add(&mcerrors, 1);
+	mcreply(mc, s, strlen(s));
+}
+
+// next space separated token of a command line, NULL at its end
+static char *mctoken(char **p, char *end, size_t *len) {
+	char *t;
+
+	while(*p<end && **p==' ') {
+		(*p)++;
+	}
+	if(*p==end) {
+		return NULL;
+	}
+	for(t=*p; *p<end && **p!=' '; (*p)++);
+	*len=*p-t;
+	return t;
+}
+
+static int mcnumber(const char *t, size_t len, unsigned long long *n) {
+	char num[24], *e;
+
+	if(len==0 || len>=sizeof(num) || !isdigit((unsigned char)*t)) {
+		return -1;
+	}
+	memcpy(num, t, len);
+	num[len]='\0';
+	errno=0;
+	*n=strtoull(num, &e, 10);
+	return *e!='\0' || errno ? -1 : 0;
+}
+
+// memcached keys are up to 250 bytes without whitespace or control characters
+static int mckey(const char *t, size_t len) {
+	size_t i;
+
+	if(len==0 || len>MC_KEY_MAX) {
+		return 0;
+	}
+	for(i=0; i<len; i++) {
+		if((unsigned char)t[i]<=' ' || t[i]==127) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// exptime as a ttl, 0 for none. A unix time that has passed stores the item
+// already expired like memcached does, TTL_EXPIRED. -1 if the database keeps
+// no expiry (see LAYOUT_TTL) or exptime is out of range.
+static long mcttl(unsigned long long exptime) {
+	long now=time(NULL);
+
+	if(exptime==0) {
+		return 0;
+	}
+	if(!(layout & LAYOUT_TTL)) {
+		return -1;
+	}
+	if(exptime>MC_RELATIVE_MAX) {
+		if(exptime<=(unsigned long long)now) {
+			return TTL_EXPIRED;
+		}
+		exptime-=now;
+	}
+	return exptime>UINT32_MAX-now ? -1 : (long)exptime;
+}
+
+// writes take the same bucket range check as /set/
+static int mcinrange(struct mcconn *mc, const char *key, size_t klen, int *bucket) {
+	*bucket=bhash(LAYOUT_HASH(layout), key, klen) % BUCKETS;
+	if(!inshard(*bucket)) {
+		LOG_TRACE(vlevel,_("Deny element: key %.*s bucket %i\n"), (int)klen, key, *bucket);
+		mcerror(mc, "SERVER_ERROR out of range\r\n");
+		return 0;
+	}
+	return 1;
+}
+
+static int mclimited(struct mcconn *mc) {
+	if(!tokenbucket_take(&ratebucket)) {
+		mcerror(mc, "SERVER_ERROR rate limited\r\n");
+		return 1;
+	}
+	return 0;
+}
+
+// get and gets, keys that are missing are left out of the answer
+static void mcget(struct mcconn *mc, char *p, char *end, int cas) {
+	unsigned long long version;
+	const char *body;
+	char *key, *val, *err=NULL, *q;
+	char hdr[MC_KEY_MAX+64];
+	size_t klen, blen;
+	int n;
+
+	for(q=p, n=0; (key=mctoken(&q, end, &klen))!=NULL; n++) {
+		if(!mckey(key, klen)) {
+			mcerror(mc, "CLIENT_ERROR bad command line format\r\n");
+			return;
+		}
+	}
+	if(n==0) {
+		mcerror(mc, "ERROR\r\n");
+		return;
+	}
+	if(mclimited(mc)) {
+		return;
+	}
+	while((key=mctoken(&p, end, &klen))!=NULL) {
+		hotsample(key, klen, -1, 0);
+		if(!lookupvalue(key, klen, &val, &body, &blen, &version, &err)) {
+			if(err!=NULL) {
+				LOG_ERROR(vlevel,_("leveldb_get(): %s\n"),err);
+				free(err);
+				mcerror(mc, "SERVER_ERROR read failed\r\n");
+				return;
+			}
+			__sync_fetch_and_add(&mcmisses, 1);
+			continue;
+		}
+		__sync_fetch_and_add(&mchits, 1);
+		n=cas ? snprintf(hdr, sizeof(hdr), "VALUE %.*s 0 %zu %llu\r\n", (int)klen, key, blen, version) :
+			snprintf(hdr, sizeof(hdr), "VALUE %.*s 0 %zu\r\n", (int)klen, key, blen);
+		jsonwriter_raw(&mc->out, hdr, n);
+		jsonwriter_raw(&mc->out, body, blen);
+		jsonwriter_raw(&mc->out, "\r\n", 2);
+		free(val);
+	}
+	jsonwriter_raw(&mc->out, "END\r\n", 5);
+}
+
+// set and cas, the data block follows the linelen bytes of the command
+// line. Only flags 0 are accepted, there is nowhere to keep others. -1 if
+// the connection has to go.
+static int mcstore(struct mcconn *mc, size_t linelen, char **tok, size_t *tlen, int ntok, int cas) {
+	unsigned long long flags, exptime, bytes, unique=0, version;
+	struct precond pre;
+	char key[MC_KEY_MAX+1], *data, *err=NULL;
+	size_t klen=tlen[1], need;
+	long ttl;
+	int bucket;
+
+	pre.type=PRE_NONE;
+	mc->noreply=ntok==6+cas && tlen[5+cas]==7 && !memcmp(tok[5+cas], "noreply", 7);
+	if(ntok<5+cas || ntok>6+cas || (ntok==6+cas && !mc->noreply) ||
+		 !mckey(tok[1], klen) || mcnumber(tok[2], tlen[2], &flags) || mcnumber(tok[3], tlen[3], &exptime) ||
+		 mcnumber(tok[4], tlen[4], &bytes) || (cas && mcnumber(tok[5], tlen[5], &unique))) {
+		mc->noreply=0;
+		mcerror(mc, "CLIENT_ERROR bad command line format\r\n");
+		return 0;
+	}
+	memcpy(key, tok[1], klen);
+	key[klen]='\0';
+	// the data is read, or skipped, even when the command is refused
+	if(bytes>(unsigned long long)maxvalue) {
+		mc->off+=linelen;
+		for(bytes+=2; bytes>0; bytes-=need) {
+			if(mc->len==mc->off && mcfill(mc, POST_DATA_STRING_MAX)<=0) {
+				return -1;
+			}
+			need=mc->len-mc->off<bytes ? mc->len-mc->off : bytes;
+			mc->off+=need;
+		}
+		mcerror(mc, "SERVER_ERROR object too large for cache\r\n");
+		return 0;
+	}
+	need=linelen+bytes+2;
+	while(mc->len-mc->off<need) {
+		if(mcfill(mc, need)<=0) {
+			return -1;
+		}
+	}
+	data=mc->in+mc->off+linelen;
+	mc->off+=need;
+	if(data[bytes]!='\r' || data[bytes+1]!='\n') {
+		mcerror(mc, "CLIENT_ERROR bad data chunk\r\n");
+		return -1;
+	}
+
+	if(flags!=0) {
+		mcerror(mc, "CLIENT_ERROR nonzero flags are not supported\r\n");
+	} else if((ttl=mcttl(exptime))==-1) {
+		mcerror(mc, "CLIENT_ERROR bad exptime\r\n");
+	} else if(cas && !(layout & LAYOUT_VERSION)) {
+		mcerror(mc, "SERVER_ERROR cas needs the version layout\r\n");
+	} else if(mcinrange(mc, key, klen, &bucket) && !mclimited(mc)) {
+		if(cas) {
+			pre.type=PRE_VERSION;
+			pre.version=unique;
+		}
+		LOG_TRACE(vlevel,_("Allow element: key %s length %llu bucket %i\n"), key, bytes, bucket);
+		hotsample(key, klen, bucket, 1);
+		if(putvalue(key, klen, data, bytes, ttl, &pre, &version, &err)) {
+			mcreply(mc, "STORED\r\n", 8);
+		} else if(err==NULL) {
+			// the version found, 0 if there was no value
+			mcreply(mc, version ? "EXISTS\r\n" : "NOT_FOUND\r\n", version ? 8 : 11);
+		}
+		if(err!=NULL) {
+			LOG_ERROR(vlevel,_("leveldb_put(): %s\n"),err);
+			free(err);
+			mcerror(mc, "SERVER_ERROR write failed\r\n");
+		}
+	}
+	return 0;
+}
+
+static void mcdelete(struct mcconn *mc, char **tok, size_t *tlen, int ntok) {
+	char *err=NULL;
+	int bucket;
+
+	// delete key 0 is still around from when there was a hold time
+	mc->noreply=ntok>2 && tlen[ntok-1]==7 && !memcmp(tok[ntok-1], "noreply", 7);
+	if(ntok<2 || ntok-mc->noreply>3 || !mckey(tok[1], tlen[1]) ||
+		 (ntok-mc->noreply==3 && (tlen[2]!=1 || *tok[2]!='0'))) {
+		mc->noreply=0;
+		mcerror(mc, "CLIENT_ERROR bad command line format\r\n");
+	} else if(mcinrange(mc, tok[1], tlen[1], &bucket) && !mclimited(mc)) {
+		if(delvalue(tok[1], tlen[1], &err)) {
+			mcreply(mc, "DELETED\r\n", 9);
+		} else if(err==NULL) {
+			mcreply(mc, "NOT_FOUND\r\n", 11);
+		} else {
+			LOG_ERROR(vlevel,_("delete of %.*s: %s\n"), (int)tlen[1], tok[1], err);
+			free(err);
+			mcerror(mc, "SERVER_ERROR write failed\r\n");
+		}
+	}
+}
+
+// incr on a missing key is NOT_FOUND like in memcached, counters are
+// signed 64 bit here and do not wrap
+static void mcincr(struct mcconn *mc, char **tok, size_t *tlen, int ntok) {
+	unsigned long long by;
+	struct incrop op;
+	char num[32], *err=NULL;
+	int bucket;
+
+	mc->noreply=ntok==4 && tlen[3]==7 && !memcmp(tok[3], "noreply", 7);
+	if(ntok<3 || ntok-mc->noreply!=3 || !mckey(tok[1], tlen[1])) {
+		mc->noreply=0;
+		mcerror(mc, "CLIENT_ERROR bad command line format\r\n");
+		return;
+	}
+	if(mcnumber(tok[2], tlen[2], &by) || by>LLONG_MAX) {
+		mcerror(mc, "CLIENT_ERROR invalid numeric delta argument\r\n");
+		return;
+	}
+	if(!mcinrange(mc, tok[1], tlen[1], &bucket) || mclimited(mc)) {
+		return;
+	}
+	memset(&op, 0, sizeof(op));
+	op.key=tok[1];
+	op.klen=tlen[1];
+	op.by=by;
+	op.mustexist=1;
+	incrapply(&op, 1, 0, &err);
+	if(err!=NULL) {
+		LOG_ERROR(vlevel,_("incr of %.*s: %s\n"), (int)op.klen, op.key, err);
+		free(err);
+		mcerror(mc, "SERVER_ERROR write failed\r\n");
+	} else if(op.status==NULL) {
+		mcreply(mc, num, snprintf(num, sizeof(num), "%lli\r\n", op.value));
+	} else if(!strcmp(op.status, "NOTFOUND")) {
+		mcreply(mc, "NOT_FOUND\r\n", 11);
+	} else if(!strcmp(op.status, "NOTANUMBER")) {
+		mcerror(mc, "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+	} else if(!strcmp(op.status, "OVERFLOW")) {
+		mcerror(mc, "CLIENT_ERROR increment would overflow\r\n");
+	} else {
+		mcerror(mc, "SERVER_ERROR out of memory\r\n");
+	}
+}
+
+// one command, the line of linelen bytes at off including its LF. -1 once
+// the connection has to go.
+static int mccommand(struct mcconn *mc, size_t linelen) {
+	char *p=mc->in+mc->off, *end=p+linelen-1, *tok[MC_TOKENS], *t;
+	size_t tlen[MC_TOKENS], len;
+	int ntok=0;
+
+	if(end>p && end[-1]=='\r') {
+		end--;
+	}
+	__sync_fetch_and_add(&mccmds, 1);
+	mc->noreply=0;
+	if((t=mctoken(&p, end, &len))==NULL) {
+		mc->off+=linelen;
+		mcerror(mc, "ERROR\r\n");
+		return 0;
+	}
+	if((len==3 && !memcmp(t, "get", 3)) || (len==4 && !memcmp(t, "gets", 4))) {
+		mcget(mc, p, end, len==4);
+		mc->off+=linelen;
+		return 0;
+	}
+	tok[ntok]=t;
+	tlen[ntok++]=len;
+	while(ntok<MC_TOKENS && (tok[ntok]=mctoken(&p, end, &tlen[ntok]))!=NULL) {
+		ntok++;
+	}
+	if(mctoken(&p, end, &len)!=NULL) {
+		mc->off+=linelen;
+		mcerror(mc, "CLIENT_ERROR bad command line format\r\n");
+		return 0;
+	}
+	if(tlen[0]==3 && !memcmp(tok[0], "set", 3)) {
+		return mcstore(mc, linelen, tok, tlen, ntok, 0);
+	}
+	if(tlen[0]==3 && !memcmp(tok[0], "cas", 3)) {
+		return mcstore(mc, linelen, tok, tlen, ntok, 1);
+	}
+	mc->off+=linelen;
+	if(tlen[0]==6 && !memcmp(tok[0], "delete", 6)) {
+		mcdelete(mc, tok, tlen, ntok);
+	} else if(tlen[0]==4 && !memcmp(tok[0], "incr", 4)) {
+		mcincr(mc, tok, tlen, ntok);
+	} else if(tlen[0]==7 && !memcmp(tok[0], "version", 7)) {
+		char ver[48];
+
+		mcreply(mc, ver, snprintf(ver, sizeof(ver), "VERSION %i.%i.%i\r\n", cskvs_VERSION_MAJOR, cskvs_VERSION_MINOR, cskvs_VERSION_REV));
+	} else if(tlen[0]==4 && !memcmp(tok[0], "quit", 4)) {
+		return -1;
+	} else {
+		mcerror(mc, "ERROR\r\n");
+	}
+	return 0;
+}
+
+// MG_RAW_CONNECTION, runs what a memcached client sent and parks the
+// connection again, until the client goes away
+static void mcserve(struct mg_connection *conn) {
+	const struct mg_request_info *request_info=mg_get_request_info(conn);
+	struct mcconn *mc=mg_get_parked(conn);
+	char *eol;
+	int fill=1;         // the socket is readable, one mcfill() won't block
+
+	if(mc==NULL) {
+		struct in_addr saddr;
+
+		saddr.s_addr=ntohl(request_info->remote_ip);
+		if(__sync_add_and_fetch(&mcopen, 1)>(unsigned long)__atomic_load_n(&mcmaxconns, __ATOMIC_RELAXED)) {
+			__sync_fetch_and_sub(&mcopen, 1);
+			__sync_fetch_and_add(&mcrefused, 1);
+			LOG_INFO(vlevel, _("memcached connection from %s refused, memcached_connections open\n"), inet_ntoa(saddr));
+			mg_write(conn, "ERROR Too many open connections\r\n", 33);
+			return;
+		}
+		if((mc=calloc(1, sizeof(*mc)))==NULL || (mc->in=malloc(POST_DATA_STRING_MAX))==NULL ||
+				jsonwriter_init(&mc->out, POST_DATA_STRING_MAX, &mcsend, conn)!=0) {
+			LOG_ERROR(vlevel,_("Unable to set up memcached connection\n"));
+			if(mc!=NULL) {
+				free(mc->in);
+				free(mc);
+			}
+			__sync_fetch_and_sub(&mcopen, 1);
+			return;
+		}
+		mc->size=POST_DATA_STRING_MAX;
+		mc->addr=saddr;
+		LOG_DEBUG(vlevel, _("memcached connection from: %s\n"), inet_ntoa(saddr));
+		__sync_fetch_and_add(&mcconns, 1);
+		// Pools open connections ahead of use, park it until it is
+		fill=0;
+	}
+	// A parked connection comes back on whichever worker is free
+	mc->conn=conn;
+	mc->out.arg=conn;
+	for(;;) {
+		if((eol=memchr(mc->in+mc->off, '\n', mc->len-mc->off))!=NULL) {
+			if(mccommand(mc, eol-(mc->in+mc->off)+1)<0) {
+				break;
+			}
+		} else if(mc->len-mc->off>=MC_LINE_MAX) {
+			mcerror(mc, "CLIENT_ERROR line too long\r\n");
+			break;
+		} else {
+			if(!fill) {
+				if(mc->out.len>0) {
+					jsonwriter_flush(&mc->out);
+				}
+				// Give the worker back until the client sends more. When
+				// the server is on its way out, serve it here until done.
+				if(mg_park(conn, mc)) {
+					return;
+				}
+			}
+			fill=0;
+			if(mcfill(mc, mc->len-mc->off+1)<=0) {
+				break;
+			}
+		}
+	}
+	if(mc->out.len>0) {
+		jsonwriter_flush(&mc->out);
+	}
+	__sync_fetch_and_sub(&mcopen, 1);
+	LOG_DEBUG(vlevel, _("memcached connection from %s closed\n"), inet_ntoa(mc->addr));
+	jsonwriter_free(&mc->out);
+	free(mc->in);
+	free(mc);
+}
+
+static void *mghandle(enum mg_event event, struct mg_connection *conn) {
+  const struct mg_request_info *request_info = mg_get_request_info(conn);
+  if (event == MG_NEW_REQUEST) {
+    char *req=calloc(URL_STRING_MAX+1,sizeof(char));
+    struct in_addr saddr;
+    double started=walltime();
+    double deadline=deadlineparse(mg_get_header(conn, DEADLINE_HEADER), request_info->arrival_time);
+    int dlstate=0; // 1 expired before starting, 2 batch aborted
+    long ttl=0;
+    struct precond pre;
+    unsigned long long version;
+    int written;
+    
+    strncpy(req,request_info->uri, URL_STRING_MAX);
+    saddr.s_addr = ntohl(request_info->remote_ip);
+    if(deadline>0) {
+      __sync_fetch_and_add(&dlrequests, 1);
+    }
+    
+    LOG_DEBUG(vlevel, _("Connection from: %s, request: %s\n"), inet_ntoa(saddr), req);
+    if(strncmp(req, "/status\0", 8) == 0) { // status
+      // XXX how to get more status 
+      mg_printf(conn,
+								"HTTP/1.1 200 OK\r\n"
+								"Content-Type: text/plain\r\n"
+								"Content-Length: 4\r\n"
+								"\r\n"
+								"OK\r\n");
+    } else if(strncmp(req, "/meta/config\0", 13) == 0) {
+			configlist(conn);
+    } else if(strncmp(req, "/meta/reload\0", 13) == 0) {
+			int allowed;
+
+			// it changes the server: POST only, from clients admin_acl allows, without
+			// one loopback and unix socket clients
+			pthread_mutex_lock(&cfglock);
+			allowed=mg_check_acl(conn, adminacl);
+			pthread_mutex_unlock(&cfglock);
+			if(strcmp(request_info->request_method, "POST")) {
+				mg_printf(conn,
+									"HTTP/1.1 405 Method Not Allowed\r\n"
+									"Content-Type: text/plain\r\n"
+									"Allow: POST\r\n"
+									"Content-Length: 11\r\n"
+									"\r\n"
+									"BADMETHOD\r\n");
+			} else if(allowed!=1) {
+				mg_printf(conn,
+									"HTTP/1.1 403 Forbidden\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: 11\r\n"
+									"\r\n"
+									"FORBIDDEN\r\n");
+			} else if(cfgfile==NULL) {
+				mg_printf(conn,
+									"HTTP/1.1 500 ERROR\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: 10\r\n"
+									"\r\n"
+									"NOCONFIG\r\n");
+			} else if(loadconfig(1)==0) {
+				mg_printf(conn,
+									"HTTP/1.1 200 OK\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: 4\r\n"
+									"\r\n"
+									"OK\r\n");
+			} else {
+				mg_printf(conn,
+									"HTTP/1.1 500 ERROR\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: 7\r\n"
+									"\r\n"
+									"ERROR\r\n");
+			}
+    } else if(strncmp(req, "/meta/stats\0", 12) == 0) {
+			char *sinfo=calloc(URL_STRING_MAX, sizeof(char));
+			char *gcinfo=calloc(SHORT_STRING_MAX*2, sizeof(char));
+			struct vcache_stats vs;
+
+			vcache_stats(vcache, &vs);
+			groupcommitstats(gcinfo, SHORT_STRING_MAX*2);
+			snprintf(sinfo, URL_STRING_MAX, "{\"deadline\": {\"requests\": %lu, \"expired_on_arrival\": %lu, \"batches_aborted\": %lu, "
+							 "\"keys_skipped\": %lu, \"finished_late\": %lu, \"wasted_usec\": %lu}, "
+							 "\"value_cache\": {\"hits\": %lu, \"misses\": %lu, \"inserts\": %lu, \"evictions\": %lu, \"invalidations\": %lu, "
+							 "\"entries\": %zu, \"bytes\": %zu, \"budget\": %zu}, \"group_commit\": %s, "
+							 "\"ttl\": {\"hidden\": %lu, \"swept\": %lu, \"passes\": %lu}, "
+							 "\"counters\": {\"increments\": %lu, \"pending\": %zu, \"flushes\": %lu, \"flushed\": %lu}, "
+							 "\"memcached\": {\"connections\": %lu, \"open\": %lu, \"refused\": %lu, \"commands\": %lu, \"hits\": %lu, \"misses\": %lu, \"errors\": %lu}}",
+							 dlrequests, dlexpired, dlaborted, dlkeysskipped, dllate, dlwastedus,
+							 vs.hits, vs.misses, vs.inserts, vs.evictions, vs.invalidations, vs.entries, vs.bytes, vs.budget, gcinfo,
+							 ttlhidden, ttlswept, ttlpasses, incrops, keylock_npending(keylocks), cflushes, cflushed,
+							 mcconns, mcopen, mcrefused, mccmds, mchits, mcmisses, mcerrors);
+			mg_printf(conn,
+								"HTTP/1.1 200 OK\r\n"
+								"Content-Type: application/json\r\n"
+								"Content-Length: %zu\r\n"
+								"\r\n"
+								"%s\r\n",
+								strlen(sinfo)+2, sinfo);
+			free(sinfo);
+			free(gcinfo);
+    } else if(strncmp(req, "/meta/buckets\0", 14) == 0) {
+			bucketsizes(conn);
+    } else if(strncmp(req, "/meta/hotkeys\0", 14) == 0) {
+			hotkeylist(conn, request_info);
+    } else if(strncmp(req, "/meta/", 6) == 0) { 
+			char *minfo=calloc(URL_STRING_MAX, sizeof(char));
+			int low, high;
+
+			shardrange(&low, &high);
+			snprintf(minfo, URL_STRING_MAX, "{\"shard\": [{\"bucketlow\": \"%i\"}, {\"buckethigh\": \"%i\"}, {\"buckets\": \"%i\"}], "
+							 "\"topology\": {\"nodes\": \"%s\", \"acceptor_cpus\": \"%s\", \"worker_cpus\": \"%s\"}, "
+							 "\"storage\": {\"cache_size\": %li, \"bloom_bits_per_key\": %i, \"compression\": \"%s\", \"block_size\": %li, "
+							 "\"write_buffer_size\": %li, \"max_open_files\": %i, \"verify_checksums\": \"%s\", \"layout\": \"%s\"}}",
+							 low, high, BUCKETS, topology, acceptorcpus ? acceptorcpus : "any", workercpus ? workercpus : "any",
+							 cachesize, bloombits, compressionname(compression), blocksize,
+							 writebuffer, maxopenfiles, verifychecksums ? "yes" : "no", layoutname(layout));
+			mg_printf(conn,
+								"HTTP/1.1 200 OK\r\n"
+								"Content-Type: application/json\r\n"
+								"Content-Length: %d\r\n"
+								"\r\n"
+								"%s\r\n",
+								strlen(minfo)+2, minfo);
+			free(minfo);
+    } else if(deadline>0 && started>=deadline) {
+			// the caller gave up already, don't spend anything on it
+			LOG_DEBUG(vlevel, _("Request %s expired %.3fs ago\n"), req, started-deadline);
+			__sync_fetch_and_add(&dlexpired, 1);
+			dlstate=1;
+			mg_printf(conn,
+								"HTTP/1.1 504 Gateway Timeout\r\n"
+								"Content-Type: text/plain\r\n"
+								"Content-Length: 9\r\n"
+								"\r\n"
+								"EXPIRED\r\n");
+    } else if(!tokenbucket_take(&ratebucket)) {
+			mg_printf(conn,
+								"HTTP/1.1 429 Too Many Requests\r\n"
+								"Content-Type: text/plain\r\n"
+								"Retry-After: 1\r\n"
+								"Content-Length: 13\r\n"
+								"\r\n"
+								"RATELIMITED\r\n");
+    } else if((strncmp(req, "/set/", 5) == 0 || strncmp(req, "/mset/\0", 7) == 0 ||
+							 strncmp(req, "/incr/", 6) == 0 || strncmp(req, "/mincr/\0", 8) == 0 ||
+							 (strncmp(req, "/kv/", 4) == 0 && strcmp(request_info->request_method, "GET"))) &&
+							(ttl=requestttl(request_info))<0) {
+			mg_printf(conn,
+								"HTTP/1.1 400 Bad Request\r\n"
 								"Content-Type: text/plain\r\n"
-								"Content-Length: 4\r\n"
+								"Content-Length: 8\r\n"
 								"\r\n"
-								"OK\r\n");
-    } else if(strncmp(req, "/meta/", 6) == 0) { 
-			char *minfo=calloc(SHORT_STRING_MAX, sizeof(char));
-			snprintf(minfo, SHORT_STRING_MAX, "{\"shard\": [{\"bucketlow\": \"%i\"}, {\"buckethigh\": \"%i\"}, {\"buckets\": \"%i\"}", bucketlow, buckethigh, BUCKETS);
+								"BADTTL\r\n");
+    } else if((strncmp(req, "/set/", 5) == 0 || (strncmp(req, "/kv/", 4) == 0 && strcmp(request_info->request_method, "GET"))) &&
+							requestprecond(conn, &pre)<0) {
 			mg_printf(conn,
-								"HTTP/1.1 200 OK\r\n"
-								"Content-Type: application/json\r\n"
-								"Content-Length: %d\r\n"
+								"HTTP/1.1 400 Bad Request\r\n"
+								"Content-Type: text/plain\r\n"
+								"Content-Length: 17\r\n"
 								"\r\n"
-								"%s\r\n",
-								strlen(minfo)+2, minfo);
-			free(minfo);
+								"BADPRECONDITION\r\n");
     } else if(strncmp(req, "/set/", 5) == 0) { 
       int n=strlen(req);
       while(n) {
@@ -128,13 +2674,14 @@ static void *mghandle(enum mg_event event, struct mg_connection *conn) {
 					memcpy(key,req+5,n-5);
 					memcpy(val,req+n+1,strlen(req)-n-1);
 
-					kcrc=crc32(kcrc, key, strlen(key));
+					kcrc=bhash(LAYOUT_HASH(layout), key, strlen(key));
 					kcrcm=kcrc % BUCKETS;
 
-					if(kcrcm < buckethigh && kcrcm >= bucketlow) {
+					if(inshard(kcrcm)) {
 						LOG_TRACE(vlevel,_("Allow element: key %s value %s crc %08llX bucket %i\n"), key, val, kcrc, kcrcm);
+						hotsample(req+5, n-5, kcrcm, 1);
 
-						leveldb_put(dbh, wopt, req+5, n-5, req+n+1, strlen(req)-n-1, &errptr);
+						written=putvalue(req+5, n-5, req+n+1, strlen(req)-n-1, ttl, &pre, &version, &errptr);
 						if(errptr!=NULL) {
 							LOG_ERROR(vlevel,_("leveldb_put(): %s\n"),errptr);
 							mg_printf(conn,
@@ -145,12 +2692,7 @@ static void *mghandle(enum mg_event event, struct mg_connection *conn) {
 												"ERROR: %s\r\n",
 												9+strlen(errptr), errptr);
 						} else {
-							mg_printf(conn,
-												"HTTP/1.1 200 OK\r\n"
-												"Content-Type: text/plain\r\n"
-												"Content-Length: 4\r\n"
-												"\r\n"
-												"OK\r\n");
+							sendput(conn, written, version);
 						}
 					} else {
 						LOG_TRACE(vlevel,_("Deny element: key %s value %s crc %08llX bucket %i\n"), key, val, kcrc, kcrcm);
@@ -177,195 +2719,466 @@ static void *mghandle(enum mg_event event, struct mg_connection *conn) {
 									"\r\n"
 									"MALFORMED\r\n");
       }
+    } else if(strncmp(req, "/scan\0", 6) == 0) {
+			scan(conn, request_info, deadline);
     } else if(strncmp(req, "/get/", 5) == 0) {
-      size_t rlen=-1;
-      char *tmp=leveldb_get(dbh, ropt, req+5, strlen(req)-5, &rlen, &errptr);
-      if(rlen) {
-				char *val=calloc(rlen+2,sizeof(char));
-				memcpy(val,tmp,rlen);
-				LOG_DEBUG(vlevel, _("Found: %s for %s\n"),val,req+5);
+			const char *accept=mg_get_header(conn, "Accept");
+			sendvalue(conn, req+5, accept!=NULL && strstr(accept, "application/octet-stream")!=NULL);
+    } else if(strncmp(req, "/kv/", 4) == 0 && !strcmp(request_info->request_method, "GET")) {
+			sendvalue(conn, req+4, 1);
+    } else if(strncmp(req, "/mset/\0", 7) == 0) {
+			struct batch b;
+			int status;
+
+			memset(&b, 0, sizeof(b));
+			b.deadline=deadline;
+			b.ttl=ttl;
+			b.wb=leveldb_writebatch_create();
+			b.stripes=calloc(KEYLOCK_STRIPES, 1);
+			b.ents=malloc(HASH_BATCH*sizeof(struct msetent));
+			batchparser(conn, &b, 1, &msetelem);
+			jsonwriter_init(&b.keybuf, SHORT_STRING_MAX, NULL, NULL);
+			jsonwriter_init(&b.valbuf, POST_DATA_STRING_MAX, NULL, NULL);
+			jsonwriter_init(&b.stage, POST_DATA_STRING_MAX, NULL, NULL);
+			status=readbatch(conn, &b);
+			if(status==JSONSTREAM_OK && !b.skipped && b.nents>0 && msetroute(&b)) {
+				status=JSONSTREAM_STOPPED;
+			}
+
+			if(b.skipped) {
+				// nothing was written, the batch is only written once complete
+				LOG_DEBUG(vlevel, _("mset expired after %i keys\n"), b.count-b.skipped);
+				__sync_fetch_and_add(&dlaborted, 1);
+				__sync_fetch_and_add(&dlkeysskipped, b.skipped);
+				dlstate=2;
 				mg_printf(conn,
-									"HTTP/1.1 200 OK\r\n"
+									"HTTP/1.1 504 Gateway Timeout\r\n"
 									"Content-Type: text/plain\r\n"
-									"Content-Length: %d\r\n"
+									"Content-Length: 9\r\n"
 									"\r\n"
-									"%s\r\n",
-									strlen(val)+2, val);
-				free(val);
-      } else {
-				LOG_DEBUG(vlevel, _("Nothing found for %s\n"),req+5);
+									"EXPIRED\r\n");
+			} else if(status==JSONSTREAM_TOOLONG || (b.status!=NULL && !strcmp(b.status, "TOOLARGE"))) {
 				mg_printf(conn,
-									"HTTP/1.1 200 OK\r\n"
+									"HTTP/1.1 413 Request Entity Too Large\r\n"
 									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
 									"Content-Length: 10\r\n"
 									"\r\n"
-									"NOTFOUND\r\n");
-      } 
-      free(tmp);
-    } else if(strncmp(req, "/mset/\0", 7) == 0) {
-			char *pd=calloc(POST_DATA_STRING_MAX+1,sizeof(char));			
-      int pdlen = mg_read(conn, pd, POST_DATA_STRING_MAX);
-			int msal=-1, n;
-			struct json_object *msjo=json_tokener_parse(pd);
-
-			if(msjo == NULL || pdlen < 2) {
-				LOG_ERROR(vlevel,_("Unable to parse request: %s\n"), pd);
+									"TOOLARGE\r\n");
+			} else if(b.status!=NULL) {
+				mg_printf(conn,
+									"HTTP/1.1 %s\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: %zu\r\n"
+									"\r\n"
+									"%s\r\n",
+									strcmp(b.status, "NOMEM") ? "400 Bad Request" : "500 ERROR", strlen(b.status)+2, b.status);
+			} else if(status!=JSONSTREAM_OK && b.err==NULL) {
+				LOG_ERROR(vlevel,_("Unable to parse request at byte %zu\n"), batchoffset(&b));
 				mg_printf(conn,
 									"HTTP/1.1 500 ERROR\r\n"
 									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
 									"Content-Length: 12\r\n"
 									"\r\n"
 									"PARSEERROR\r\n");
+			} else if(b.count==0) {
+				mg_printf(conn,
+									"HTTP/1.1 200 OK\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: 7\r\n"
+									"\r\n"
+									"EMPTY\r\n");
 			} else {
-				LOG_TRACE(vlevel,_("Post data(%i): %s\n"),pdlen,pd);
-
-				msal=json_object_array_length(msjo);
-				if(msal > 0) {
-					leveldb_writebatch_t *wb = leveldb_writebatch_create();
-					
-					n=0;
-					while(n<msal) {
-						struct json_object *tj;
-						struct json_object *av;
-						char *key=NULL;
-						char *val=NULL;	
-						char *t;
-						unsigned long kcrc=0;
-						int kcrcm=-1;
-
-						av=json_object_array_get_idx(msjo, n);
-						
-						tj=json_object_object_get(av, "key");
-						t=(char*)json_object_to_json_string(tj);
-						key=calloc(strlen(t),sizeof(char));
-						snprintf(key,strlen(t)-1,"%s",t+1);
-						
-						tj=json_object_object_get(av, "value");
-						t=(char*)json_object_to_json_string(tj);
-						val=calloc(strlen(t),sizeof(char));
-						snprintf(val,strlen(t)-1,"%s",t+1);
-	
-						jsondeslash(&key);
-						jsondeslash(&val);
-						kcrc=crc32(kcrc, key, strlen(key));
-						kcrcm=kcrc % BUCKETS;
-
-						if(kcrcm < buckethigh && kcrcm >= bucketlow) {
-							LOG_TRACE(vlevel,_("Allow element: key %s value %s crc %08llX bucket %i\n"), key, val, kcrc, kcrcm);
+				if(b.err==NULL && b.pending>0) {
+					msetflush(&b);
+				}
+				if(b.err!=NULL) {
+					LOG_ERROR(vlevel,_("leveldb_write(): %s\n"),b.err);
+					mg_printf(conn,
+										"HTTP/1.1 500 ERROR\r\n"
+										"Content-Type: text/plain\r\n"
+										"Content-Length: %zu\r\n"
+										"\r\n"
+										"ERROR: %s\r\n",
+										9+strlen(b.err), b.err);
+				} else if(b.failed>0) {
+					char num[32];
+					int i, n=0;
 
-							leveldb_writebatch_put(wb, key,strlen(key), val, strlen(val));
-						} else {
-							LOG_TRACE(vlevel,_("Deny element: key %s value %s crc %08llX bucket %i\n"), key, val, kcrc, kcrcm);
+					// nothing was written, the keys whose condition failed and
+					// the versions they have, 0 for none
+					jsonwriter_init(&b.out, POST_DATA_STRING_MAX, NULL, NULL);
+					for(i=0; i<b.nputs; i++) {
+						if(b.puts[i].failed) {
+							jsonwriter_raw(&b.out, n++ ? ", { \"key\": " : "[ { \"key\": ", 11);
+							jsonwriter_string(&b.out, b.keybuf.buf+b.puts[i].koff, b.puts[i].klen);
+							snprintf(num, sizeof(num), ", \"version\": \"%llu\" }", b.puts[i].cur);
+							jsonwriter_raw(&b.out, num, strlen(num));
 						}
-
-						free(key);
-						free(val);
-						n++;
 					}
-					leveldb_write(dbh, wopt, wb, &errptr);
-					leveldb_writebatch_destroy(wb);
-
+					jsonwriter_raw(&b.out, " ]\r\n", 4);
 					mg_printf(conn,
-										"HTTP/1.1 200 OK\r\n"
-										"Content-Type: text/plain\r\n"
-										"Content-Length: 4\r\n"
-										"\r\n"
-										"OK\r\n");
+										"HTTP/1.1 412 Precondition Failed\r\n"
+										"Content-Type: application/json\r\n"
+										"Content-Length: %zu\r\n"
+										"\r\n",
+										b.out.len);
+					mg_write(conn, b.out.buf, b.out.len);
+					jsonwriter_free(&b.out);
 				} else {
 					mg_printf(conn,
 										"HTTP/1.1 200 OK\r\n"
 										"Content-Type: text/plain\r\n"
-										"Content-Length: 7\r\n"
+										"Content-Length: 4\r\n"
 										"\r\n"
-										"EMPTY\r\n");
+										"OK\r\n");
 				}
 			}
-			json_object_put(msjo);
-			free(pd);
-    } else if(strncmp(req, "/mget/\0", 7) == 0) {
-			char *pd=calloc(POST_DATA_STRING_MAX+1,sizeof(char));
-			char *retstr;
-      int pdlen = mg_read(conn, pd, POST_DATA_STRING_MAX);
-			int mgal=-1, n;
-			struct json_object  *ret=json_object_new_array();
-			struct json_object *mgjo=json_tokener_parse(pd);
-
-			if(mgjo == NULL || pdlen < 2) {
-				LOG_ERROR(vlevel,_("Unable to parse request: %s\n"), pd);
+			jsonstream_free(b.js);
+			binstream_free(b.bs);
+			leveldb_writebatch_destroy(b.wb);
+			jsonwriter_free(&b.keybuf);
+			jsonwriter_free(&b.valbuf);
+			jsonwriter_free(&b.stage);
+			free(b.ents);
+			free(b.stripes);
+			free(b.puts);
+			free(b.err);
+    } else if(strncmp(req, "/incr/", 6) == 0) {
+			const char *qs=request_info->query_string;
+			struct incrop op;
+			char num[32];
+			char *err=NULL;
+			int bkt;
+
+			memset(&op, 0, sizeof(op));
+			op.key=req+6;
+			op.klen=strlen(op.key);
+			op.by=1;
+			if(qs!=NULL && mg_get_var(qs, strlen(qs), "by", num, sizeof(num))>=0 && counterparse(num, strlen(num), &op.by)) {
+				op.status="BADBY";
+			} else if(op.klen==0) {
+				op.status="MALFORMED";
+			} else if(!inshard(bkt=keybucket(layout, op.key, op.klen))) {
+				op.status="OUTOFRANGE";
+			} else {
+				incrapply(&op, 1, ttl, &err);
+			}
+			if(err!=NULL) {
+				LOG_ERROR(vlevel,_("incr of %s: %s\n"), op.key, err);
+				mg_printf(conn,
+									"HTTP/1.1 500 ERROR\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: %zu\r\n"
+									"\r\n"
+									"ERROR: %s\r\n",
+									9+strlen(err), err);
+				free(err);
+			} else if(op.status!=NULL) {
+				mg_printf(conn,
+									"HTTP/1.1 %s\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: %zu\r\n"
+									"\r\n"
+									"%s\r\n",
+									!strcmp(op.status, "NOTANUMBER") || !strcmp(op.status, "OVERFLOW") ? "409 Conflict" :
+									!strcmp(op.status, "OUTOFRANGE") || !strcmp(op.status, "NOMEM") ? "500 ERROR" : "400 Bad Request",
+									strlen(op.status)+2, op.status);
+			} else {
+				snprintf(num, sizeof(num), "%lli", op.value);
+				mg_printf(conn,
+									"HTTP/1.1 200 OK\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: %zu\r\n"
+									"\r\n"
+									"%s\r\n",
+									strlen(num)+2, num);
+			}
+    } else if(strncmp(req, "/mincr/\0", 8) == 0) {
+			struct batch b;
+			char num[64];
+			char *err=NULL;
+			int status, i;
+
+			memset(&b, 0, sizeof(b));
+			b.deadline=deadline;
+			batchparser(conn, &b, 1, &mincrelem);
+			jsonwriter_init(&b.keybuf, POST_DATA_STRING_MAX, NULL, NULL);
+			jsonwriter_init(&b.out, POST_DATA_STRING_MAX, NULL, NULL);
+			status=readbatch(conn, &b);
+			if(status==JSONSTREAM_OK && !b.skipped) {
+				for(i=0; i<b.nops; i++) {
+					b.ops[i].key=b.keybuf.buf+b.ops[i].koff;
+				}
+				mincrroute(&b);
+				incrapply(b.ops, b.nops, ttl, &err);
+			}
+
+			if(b.skipped) {
+				// nothing was applied
+				LOG_DEBUG(vlevel, _("mincr expired after %i keys\n"), b.count-b.skipped);
+				__sync_fetch_and_add(&dlaborted, 1);
+				__sync_fetch_and_add(&dlkeysskipped, b.skipped);
+				dlstate=2;
+				mg_printf(conn,
+									"HTTP/1.1 504 Gateway Timeout\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: 9\r\n"
+									"\r\n"
+									"EXPIRED\r\n");
+			} else if(status==JSONSTREAM_TOOLONG) {
+				mg_printf(conn,
+									"HTTP/1.1 413 Request Entity Too Large\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: 10\r\n"
+									"\r\n"
+									"TOOLARGE\r\n");
+			} else if(status!=JSONSTREAM_OK) {
+				LOG_ERROR(vlevel,_("Unable to parse request at byte %zu\n"), batchoffset(&b));
 				mg_printf(conn,
 									"HTTP/1.1 200 OK\r\n"
 									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
 									"Content-Length: 12\r\n"
 									"\r\n"
 									"PARSEERROR\r\n");
+			} else if(err!=NULL) {
+				LOG_ERROR(vlevel,_("mincr: %s\n"), err);
+				mg_printf(conn,
+									"HTTP/1.1 500 ERROR\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: %zu\r\n"
+									"\r\n"
+									"ERROR: %s\r\n",
+									9+strlen(err), err);
 			} else {
-				LOG_TRACE(vlevel,_("Post data(%i): %s\n"),pdlen,pd);
-
-				mgal=json_object_array_length(mgjo);
-				if(mgal > 0) {
-					n=0;
-					while(n<mgal) {
-						struct json_object *tj;
-						struct json_object *av;
-						char *key=NULL;
-						char *t;
-						size_t rlen=0;
-						
-						av=json_object_array_get_idx(mgjo, n);
-						
-						tj=json_object_object_get(av, "key");
-						t=(char*)json_object_to_json_string(tj);
-						key=calloc(strlen(t),sizeof(char));
-						snprintf(key,strlen(t)-1,"%s",t+1);
-						jsondeslash(&key);
-						
-						t=leveldb_get(dbh, ropt, key, strlen(key), &rlen, &errptr);					
-						
-						if(rlen && t) {
-							struct json_object *tjkv;
-							struct json_object *tjk;
-							struct json_object *tjv;
-							char *val=calloc(rlen+2,sizeof(char));
-							
-							memcpy(val,t,rlen);
-							LOG_TRACE(vlevel, _("Found: '%s' for '%s' (index %i len %i)\n"),val,key,n,rlen);
-							tjk=json_object_new_string(key);
-							tjv=json_object_new_string((const char*)val);
-							
-							tjkv=json_object_new_object();
-							json_object_object_add(tjkv, "key", tjk);
-							json_object_object_add(tjkv, "value", tjv);
-							
-							json_object_array_add(ret,tjkv);
-							
-							free(val);
-							free(t);
-						}
-						
-						free(key);
-						n++;
+				// the counters in request order, or why one was not touched
+				for(i=0; i<b.nops; i++) {
+					jsonwriter_raw(&b.out, i ? ", { \"key\": " : "[ { \"key\": ", 11);
+					jsonwriter_string(&b.out, b.ops[i].key, b.ops[i].klen);
+					if(b.ops[i].status!=NULL) {
+						snprintf(num, sizeof(num), ", \"error\": \"%s\" }", b.ops[i].status);
+					} else {
+						snprintf(num, sizeof(num), ", \"value\": %lli }", b.ops[i].value);
 					}
-					retstr=(char*)json_object_to_json_string(ret);
-					mg_printf(conn,
-										"HTTP/1.1 200 OK\r\n"
-										"Content-Type: application/json\r\n"
-										"Content-Length: %d\r\n"
-										"\r\n"
-										"%s\r\n",
-										strlen(retstr)+2, retstr);
-					
-					json_object_put(ret);
-					json_object_put(mgjo);
-				} else {
+					jsonwriter_raw(&b.out, num, strlen(num));
+				}
+				jsonwriter_raw(&b.out, b.nops ? " ]\r\n" : "[ ]\r\n", b.nops ? 4 : 5);
+				mg_printf(conn,
+									"HTTP/1.1 200 OK\r\n"
+									"Content-Type: application/json\r\n"
+									"Content-Length: %zu\r\n"
+									"\r\n",
+									b.out.len);
+				mg_write(conn, b.out.buf, b.out.len);
+			}
+			free(err);
+			jsonstream_free(b.js);
+			binstream_free(b.bs);
+			jsonwriter_free(&b.out);
+			jsonwriter_free(&b.keybuf);
+			free(b.ops);
+    } else if(strncmp(req, "/mget/\0", 7) == 0) {
+			const char *accept=mg_get_header(conn, "Accept");
+			struct batch b;
+			int status;
+
+			memset(&b, 0, sizeof(b));
+			b.deadline=deadline;
+			b.conn=conn;
+			batchparser(conn, &b, 0, &mgetelem);
+			// the answer is encoded like the request unless Accept names one of
+			// the two types, wildcards like curl's */* leave it to the request
+			if(accept!=NULL && strstr(accept, BINSTREAM_TYPE)!=NULL) {
+				b.binary=1;
+			} else if(accept!=NULL && strstr(accept, "application/json")!=NULL) {
+				b.binary=0;
+			} else {
+				b.binary=b.bs!=NULL;
+			}
+			// HTTP/1.0 has no chunked encoding, it gets the answer in one piece
+			jsonwriter_init(&b.out, POST_DATA_STRING_MAX, strcmp(request_info->http_version, "1.1") ? NULL : &sendchunk, &b);
+			jsonwriter_init(&b.keybuf, POST_DATA_STRING_MAX, NULL, NULL);
+			jsonwriter_init(&b.valbuf, POST_DATA_STRING_MAX, NULL, NULL);
+			status=readbatch(conn, &b);
+			if(status==JSONSTREAM_OK && !b.skipped && mgetchunk(&b)) {
+				status=JSONSTREAM_STOPPED;
+			}
+			if(status==JSONSTREAM_OK && !b.skipped && !b.binary &&
+				 jsonwriter_raw(&b.out, b.hits ? " ]\r\n" : "[ ]\r\n", b.hits ? 4 : 5)) {
+				b.status="NOMEM";
+				status=JSONSTREAM_STOPPED;
+			}
+
+			if(b.skipped) {
+				LOG_DEBUG(vlevel, _("mget expired after %i keys\n"), b.count-b.skipped);
+				__sync_fetch_and_add(&dlaborted, 1);
+				__sync_fetch_and_add(&dlkeysskipped, b.skipped);
+				dlstate=2;
+			} else if(status!=JSONSTREAM_OK && b.status==NULL && b.err==NULL) {
+				LOG_ERROR(vlevel,_("Unable to parse request at byte %zu\n"), batchoffset(&b));
+			} else if(b.status!=NULL) {
+				LOG_ERROR(vlevel,_("mget out of memory after %i keys\n"), b.count);
+			}
+
+			if(b.out.flushed>0 && (status!=JSONSTREAM_OK || b.skipped)) {
+				// the chunks answered so far are out already, leaving the
+				// answer unterminated tells the client it is incomplete
+				mg_must_close(conn);
+			} else if(b.out.flushed>0) {
+				jsonwriter_flush(&b.out);
+				mg_printf(conn, "0\r\n\r\n");
+			} else if(b.skipped) {
+				mg_printf(conn,
+									"HTTP/1.1 504 Gateway Timeout\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: 9\r\n"
+									"\r\n"
+									"EXPIRED\r\n");
+			} else if(status==JSONSTREAM_TOOLONG) {
+				mg_printf(conn,
+									"HTTP/1.1 413 Request Entity Too Large\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: 10\r\n"
+									"\r\n"
+									"TOOLARGE\r\n");
+			} else if(b.err!=NULL || b.status!=NULL) {
+				mg_printf(conn,
+									"HTTP/1.1 500 ERROR\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: %zu\r\n"
+									"\r\n"
+									"ERROR: %s\r\n",
+									9+strlen(b.err!=NULL ? b.err : b.status), b.err!=NULL ? b.err : b.status);
+			} else if(status!=JSONSTREAM_OK) {
+				mg_printf(conn,
+									"HTTP/1.1 200 OK\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: 12\r\n"
+									"\r\n"
+									"PARSEERROR\r\n");
+			} else if(b.count==0 && !b.binary) {
+				mg_printf(conn,
+									"HTTP/1.1 200 OK\r\n"
+									"Content-Type: text/plain\r\n"
+									"Content-Length: 7\r\n"
+									"\r\n"
+									"EMPTY\r\n");
+			} else {
+				// no records is an empty binstream body
+				mg_printf(conn,
+									"HTTP/1.1 200 OK\r\n"
+									"Content-Type: %s\r\n"
+									"Content-Length: %zu\r\n"
+									"\r\n",
+									b.binary ? BINSTREAM_TYPE : "application/json", b.out.len);
+				mg_write(conn, b.out.buf, b.out.len);
+			}
+			jsonstream_free(b.js);
+			binstream_free(b.bs);
+			jsonwriter_free(&b.out);
+			jsonwriter_free(&b.keybuf);
+			jsonwriter_free(&b.valbuf);
+			free(b.keys);
+			free(b.err);
+			if(b.snap!=NULL) {
+				leveldb_release_snapshot(dbh, b.snap);
+			}
+    } else if(strncmp(req, "/kv/", 4) == 0 && (!strcmp(request_info->request_method, "PUT") || !strcmp(request_info->request_method, "POST"))) {
+			// raw value in the body, binary safe and sized up front from Content-Length
+			const char *clhdr=mg_get_header(conn, "Content-Length");
+			const char *expect=mg_get_header(conn, "Expect");
+			char *key=req+4;
+			char *val=NULL;
+			char *e=NULL;
+			long long vlen=clhdr!=NULL ? strtoll(clhdr, &e, 10) : -1;
+			unsigned long kcrc=0;
+			int kcrcm=-1;
+
+			kcrc=bhash(LAYOUT_HASH(layout), key, strlen(key));
+			kcrcm=kcrc % BUCKETS;
+
+			if(clhdr==NULL || *clhdr=='\0' || *e!='\0' || vlen<0) {
+				mg_printf(conn,
+									"HTTP/1.1 411 Length Required\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: 16\r\n"
+									"\r\n"
+									"LENGTHREQUIRED\r\n");
+			} else if(vlen>maxvalue) {
+				LOG_DEBUG(vlevel, _("Value for %s too large: %lli bytes\n"), key, vlen);
+				mg_printf(conn,
+									"HTTP/1.1 413 Request Entity Too Large\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: 10\r\n"
+									"\r\n"
+									"TOOLARGE\r\n");
+			} else if(*key=='\0') {
+				mg_printf(conn,
+									"HTTP/1.1 500 ERROR\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: 11\r\n"
+									"\r\n"
+									"MALFORMED\r\n");
+			} else if(!inshard(kcrcm)) {
+				LOG_TRACE(vlevel,_("Deny element: key %s crc %08lX bucket %i\n"), key, kcrc, kcrcm);
+				mg_printf(conn,
+									"HTTP/1.1 500 ERROR\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: 12\r\n"
+									"\r\n"
+									"OUTOFRANGE\r\n");
+			} else if((val=malloc(vlen ? vlen : 1))==NULL) {
+				LOG_ERROR(vlevel,_("Unable to allocate %lli bytes for %s\n"), vlen, key);
+				mg_printf(conn,
+									"HTTP/1.1 500 ERROR\r\n"
+									"Content-Type: text/plain\r\n"
+									"Connection: close\r\n"
+									"Content-Length: 7\r\n"
+									"\r\n"
+									"NOMEM\r\n");
+			} else {
+				if(expect!=NULL && !strcasecmp(expect, "100-continue")) {
+					mg_printf(conn, "HTTP/1.1 100 Continue\r\n\r\n");
+				}
+				if(mg_read(conn, val, vlen)!=vlen) {
+					LOG_ERROR(vlevel,_("Short body for %s, expected %lli bytes\n"), key, vlen);
 					mg_printf(conn,
-										"HTTP/1.1 200 OK\r\n"
+										"HTTP/1.1 400 Bad Request\r\n"
 										"Content-Type: text/plain\r\n"
-										"Content-Length: 7\r\n"
+										"Connection: close\r\n"
+										"Content-Length: 11\r\n"
 										"\r\n"
-										"EMPTY\r\n");
+										"SHORTBODY\r\n");
+				} else {
+					LOG_TRACE(vlevel,_("Allow element: key %s length %lli crc %08lX bucket %i\n"), key, vlen, kcrc, kcrcm);
+					hotsample(key, strlen(key), kcrcm, 1);
+					written=putvalue(key, strlen(key), val, vlen, ttl, &pre, &version, &errptr);
+					if(errptr!=NULL) {
+						LOG_ERROR(vlevel,_("leveldb_put(): %s\n"),errptr);
+						mg_printf(conn,
+											"HTTP/1.1 500 ERROR\r\n"
+											"Content-Type: text/plain\r\n"
+											"Content-Length: %zu\r\n"
+											"\r\n"
+											"ERROR: %s\r\n",
+											9+strlen(errptr), errptr);
+					} else {
+						sendput(conn, written, version);
+					}
 				}
 			}
-			free(pd);
+			free(val);
     } else { // other
       LOG_ERROR(vlevel,_("Unknown/unhandled request\n"));
 			mg_printf(conn,
@@ -375,56 +3188,172 @@ static void *mghandle(enum mg_event event, struct mg_connection *conn) {
 								"\r\n"
 								"MALFORMED\r\n");
     }
+    if(deadline>0 && dlstate!=1) {
+      double finished=walltime();
+      // an aborted batch or a late answer is work nobody will use
+      if(dlstate==2 || finished>deadline) {
+        if(dlstate==0) {
+          __sync_fetch_and_add(&dllate, 1);
+        }
+        __sync_fetch_and_add(&dlwastedus, (unsigned long)((finished-started)*1000000));
+      }
+    }
     free(req);
+    return "";
+  } else if (event == MG_RAW_CONNECTION) {
+    mcserve(conn);
+    return "";
   } else {
     return NULL;
   }
 }
 
 int main(int argc, char **argv) {
+  const char *optstring="d:p:c:n:a:t:b:B:M:V:L:S:G:w:W:U:H:D:C:T:K:f:vh";
   int goopt;
-  int listenport=8080;
-  int numthreads=10;
+  int draintime=30;
   int tf;
+  int ondisk;
+  pthread_t sweepthread;
+  pthread_t flushthread;
+  int sweeping=0;
+  int hsock=-1;
+  int hconn=-1;
+  int hlisten=0;
+  int nfds;
+  int fds[HANDOFF_MAX_FDS];
+  int fdssl[HANDOFF_MAX_FDS];
+  int fdraw[HANDOFF_MAX_FDS];
+  char tags[HANDOFF_MAX_FDS];
+  struct pollfd pfd;
   
-  char *dbd=NULL;
-  char *lpstr=NULL;
   char *ntstr=NULL;
-  char *alfile=NULL;
 
   leveldb_options_t *dbopt;
+  leveldb_cache_t *cache=NULL;
+  leveldb_filterpolicy_t *bloom=NULL;
 
-  struct mg_context *ctx= NULL; 
   char **mgoptions;
   
   signal(SIGINT,handlesig);
   signal(SIGTERM,handlesig);
+  signal(SIGHUP,handlesig);
   
+  // the config file sets the baseline, flags on the command line override it
+  opterr=0;
+  while ((goopt=getopt (argc, argv, optstring)) != -1) {
+    if(goopt=='f') {
+      cfgfile=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(cfgfile,(char*)optarg,strlen((char*)optarg));
+    }
+  }
+  optind=1;
+  opterr=1;
+  if(cfgfile!=NULL && loadconfig(0)!=0) {
+    LOG_FATAL(vlevel, _("Unable to load config file: %s\n"),cfgfile);
+    exit(EXIT_FAILURE);
+  }
+
   // command line parsing
-  while ((goopt=getopt (argc, argv, "d:p:n:a:t:b:B:vh")) != -1) {
+  while ((goopt=getopt (argc, argv, optstring)) != -1) {
     switch (goopt) {
+    case 'f': // config file, already loaded above
+      break;
     case 'd': // database 
+      free(dbd);
       dbd=calloc(strlen((char*)optarg)+1,sizeof(char));
       strncpy(dbd,(char*)optarg,strlen((char*)optarg));
+      cfgflag(cfgkeys, "database");
       break;
     case 'a': // access log, passed to mongoose
+      free(alfile);
       alfile=calloc(strlen((char*)optarg)+1,sizeof(char));
       strncpy(alfile,(char*)optarg,strlen((char*)optarg));
+      cfgflag(cfgkeys, "access_log");
+      break;
+    case 'p': // port spec, passed to mongoose
+      free(portspec);
+      portspec=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(portspec,(char*)optarg,strlen((char*)optarg));
+      cfgflag(cfgkeys, "port");
+      break;
+    case 'c': // memcached port spec, passed to mongoose as raw ports
+      free(mcportspec);
+      mcportspec=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(mcportspec,(char*)optarg,strlen((char*)optarg));
+      cfgflag(cfgkeys, "memcached_port");
       break;
-    case 'p': // port
-      listenport=atoi(optarg);
+    case 'U': // unix socket peer acl, passed to mongoose
+      unixacl=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(unixacl,(char*)optarg,strlen((char*)optarg));
       break;
     case 'n': // number of threads
       numthreads=atoi(optarg);
+      cfgflag(cfgkeys, "threads");
 			break;
+    case 'H': // handoff socket
+      handoff=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(handoff,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'D': // drain time after handoff
+      draintime=atoi(optarg);
+      break;
+    case 'C': // tls certificate, passed to mongoose
+      sslcert=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(sslcert,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'T': // tls ticket key, passed to mongoose
+      ticketkey=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(ticketkey,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'L': // on-disk layout
+      if((layout=layoutparse(optarg))<0) {
+        usage("-L takes raw or bucket, then optionally ,ttl ,version and ,crc32c\n",EXIT_FAILURE);
+      }
+      cfgflag(cfgkeys, "layout");
+      break;
+    case 'S': // durable writes
+      if(strcmp(optarg,"yes") && strcmp(optarg,"no")) {
+        usage("-S takes yes or no\n",EXIT_FAILURE);
+      }
+      durable=!strcmp(optarg,"yes");
+      cfgflag(cfgkeys, "durable_writes");
+      break;
+    case 'G': // group commit window
+      gcommitwindow=strtol(optarg,NULL,10);
+      cfgflag(cfgkeys, "group_commit_window");
+      break;
+    case 'K': // kernel tls, passed to mongoose
+      ktls=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(ktls,(char*)optarg,strlen((char*)optarg));
+      break;
     case 'b': // low crc mapping
 			bucketlow=(int)strtoll((char*)optarg,NULL,10);
+      cfgflag(cfgkeys, "bucketlow");
       break;
     case 'B': // high crc mapping
 			buckethigh=(int)strtoll((char*)optarg,NULL,10);
+      cfgflag(cfgkeys, "buckethigh");
+      break;
+    case 'M': // largest PUT value
+      maxvalue=strtol(optarg,NULL,10);
+      cfgflag(cfgkeys, "max_value_size");
+      break;
+    case 'V': // value cache bytes
+      vcachesize=strtol(optarg,NULL,10);
+      cfgflag(cfgkeys, "value_cache_size");
+      break;
+    case 'w': // worker cpus, passed to mongoose
+      workercpus=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(workercpus,(char*)optarg,strlen((char*)optarg));
+      break;
+    case 'W': // acceptor cpus, passed to mongoose
+      acceptorcpus=calloc(strlen((char*)optarg)+1,sizeof(char));
+      strncpy(acceptorcpus,(char*)optarg,strlen((char*)optarg));
       break;
     case 'v': // verbose
       vlevel++;
+      cfgflag(cfgkeys, "loglevel");
       break;
     case 'h': // help
       usage(NULL,EXIT_SUCCESS);
@@ -453,8 +3382,11 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
   
-  if(listenport<0 || listenport>65536) {
-    LOG_FATAL(vlevel, _("Given port out of bounds: %i\n"),listenport);
+  if(portspec==NULL) {
+    portspec=strdup("8080");
+  } else if(strspn(portspec,"0123456789")==strlen(portspec) && atoi(portspec)>65535) {
+    // anything fancier (ip:port, unix:path, lists) is validated by mongoose
+    LOG_FATAL(vlevel, _("Given port out of bounds: %s\n"),portspec);
     exit(EXIT_FAILURE);
   }
   
@@ -463,58 +3395,244 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  if(bucketlow<0 || buckethigh>BUCKETS || bucketlow>=buckethigh) {
+    LOG_FATAL(vlevel, _("Given bucket range out of bounds: %i-%i\n"),bucketlow,buckethigh);
+    exit(EXIT_FAILURE);
+  }
+  shardset();
+
+  if(maxvalue<0 || maxvalue>INT_MAX) {
+    LOG_FATAL(vlevel, _("Given max value size out of bounds: %li\n"),maxvalue);
+    exit(EXIT_FAILURE);
+  }
+
+  if(vcachesize<0) {
+    LOG_FATAL(vlevel, _("Given value cache size out of bounds: %li\n"),vcachesize);
+    exit(EXIT_FAILURE);
+  }
+
+  if(gcommitwindow<0 || gcommitwindow>1000000) {
+    LOG_FATAL(vlevel, _("Given group commit window out of bounds: %li\n"),gcommitwindow);
+    exit(EXIT_FAILURE);
+  }
+
+  if(ktls!=NULL && strcmp(ktls,"yes") && strcmp(ktls,"no")) {
+    usage("-K takes yes or no\n",EXIT_FAILURE);
+  }
+
+  if(draintime<0) {
+    LOG_FATAL(vlevel, _("Given drain time out of bounds: %i\n"),draintime);
+    exit(EXIT_FAILURE);
+  }
+
+  // if an instance is already running on the handoff socket, take over its
+  // listening sockets so no connection is ever refused. The database can
+  // only be opened once it lets go of it, which is signalled by EOF.
+  if(handoff!=NULL) {
+    if((hsock=handoffsock(handoff,&hlisten))==-1) {
+      LOG_FATAL(vlevel, _("Unable to set up handoff socket %s: %s\n"),handoff,strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if(!hlisten) {
+      LOG_INFO(vlevel, _("Taking over listening sockets from running instance via %s\n"),handoff);
+      if((nfds=recvfds(hsock,fds,tags,HANDOFF_MAX_FDS))<=0) {
+        LOG_FATAL(vlevel, _("No listening sockets received from running instance\n"));
+        exit(EXIT_FAILURE);
+      }
+      free(portspec);
+      free(mcportspec);
+      portspec=calloc(nfds*16,sizeof(char));
+      mcportspec=calloc(nfds*16,sizeof(char));
+      for(tf=0;tf<nfds;tf++) {
+        if(tags[tf]=='m') {
+          snprintf(mcportspec+strlen(mcportspec),16,"%sfd:%i",*mcportspec ? "," : "",fds[tf]);
+        } else {
+          snprintf(portspec+strlen(portspec),16,"%sfd:%i%s",*portspec ? "," : "",fds[tf],tags[tf]=='s' ? "s" : "");
+        }
+      }
+      LOG_DEBUG(vlevel, _("Inherited listening sockets: %s, memcached: %s, waiting for running instance to drain\n"),portspec,mcportspec);
+      while(read(hsock,&tf,sizeof(tf))>0);
+      close(hsock);
+      if((hsock=handoffsock(handoff,&hlisten))==-1 || !hlisten) {
+        LOG_FATAL(vlevel, _("Unable to listen on handoff socket %s: %s\n"),handoff,strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  topology=numatopology();
+  LOG_INFO(vlevel, _("NUMA topology: %s, acceptor cpus: %s, worker cpus: %s\n"), topology,
+           acceptorcpus ? acceptorcpus : "any", workercpus ? workercpus : "any");
+
   // XXX - set up leveldb handle
   LOG_TRACE(vlevel, _("Setting up leveldb store in %s\n"),dbd);
   dbopt=leveldb_options_create();
   leveldb_options_set_create_if_missing(dbopt, 1);
-  leveldb_options_set_write_buffer_size(dbopt, 8388608);
-  leveldb_options_set_compression(dbopt,leveldb_no_compression);
+  leveldb_options_set_write_buffer_size(dbopt, writebuffer);
+  leveldb_options_set_compression(dbopt,compression);
+  leveldb_options_set_block_size(dbopt, blocksize);
+  leveldb_options_set_max_open_files(dbopt, maxopenfiles);
+  if(cachesize>0) {
+    cache=leveldb_cache_create_lru(cachesize);
+    leveldb_options_set_cache(dbopt, cache);
+  }
+  if(bloombits>0) {
+    bloom=leveldb_filterpolicy_create_bloom(bloombits);
+    leveldb_options_set_filter_policy(dbopt, bloom);
+  }
+  LOG_INFO(vlevel, _("Storage profile: block cache %li, bloom bits %i, %s, block size %li, write buffer %li, max open files %i, read checksums %s\n"),
+           cachesize, bloombits, compression==leveldb_no_compression ? "uncompressed" : "snappy", blocksize, writebuffer, maxopenfiles,
+           verifychecksums ? "on" : "off");
+  if((ondisk=layoutread(dbd))>=0 && ondisk!=layout) {
+    LOG_FATAL(vlevel, _("Database %s uses the %s layout, not %s, convert it with cskvconv\n"), dbd, layoutname(ondisk), layoutname(layout));
+    exit(EXIT_FAILURE);
+  }
   dbh=leveldb_open(dbopt,dbd,&errptr);
+  if(ondisk<0 && dbh!=NULL && layoutwrite(dbd, layout)!=0) {
+    LOG_ERROR(vlevel, _("Unable to record the layout of %s: %s\n"), dbd, strerror(errno));
+  }
+  // versions carry on after the last block reserved, see newversion()
+  if(layout & LAYOUT_VERSION) {
+    versionceil=nextversion=versionsread(dbd);
+    if(nextversion==0) {
+      nextversion=1;
+    }
+  }
 
   LOG_TRACE(vlevel, _("Setting leveldb read options\n"));
   ropt = leveldb_readoptions_create();
-  leveldb_readoptions_set_verify_checksums(ropt, 1);
-  leveldb_readoptions_set_fill_cache(ropt, 0);
+  leveldb_readoptions_set_verify_checksums(ropt, verifychecksums);
+  leveldb_readoptions_set_fill_cache(ropt, cache!=NULL);
+
+  if((hotkeys=hotkeys_new(BUCKETS))==NULL) {
+    LOG_FATAL(vlevel, _("Unable to set up hot key tracking\n"));
+    exit(EXIT_FAILURE);
+  }
+
+  if((keylocks=keylock_new())==NULL) {
+    LOG_FATAL(vlevel, _("Unable to set up the key locks\n"));
+    exit(EXIT_FAILURE);
+  }
+
+  // always there so reloads can turn it on, a zero budget never caches
+  if((vcache=vcache_new(vcachesize))==NULL) {
+    LOG_FATAL(vlevel, _("Unable to set up the value cache\n"));
+    exit(EXIT_FAILURE);
+  }
 
   LOG_TRACE(vlevel, _("Setting leveldb write options\n"));
   wopt = leveldb_writeoptions_create();
   leveldb_writeoptions_set_sync(wopt, 0);
+  if(durable) {
+    if((gcommit=gcommit_new(dbh, gcommitbytes, gcommitwindow))==NULL) {
+      LOG_FATAL(vlevel, _("Unable to start the group commit thread\n"));
+      exit(EXIT_FAILURE);
+    }
+    LOG_INFO(vlevel, _("Durable writes, group commit of up to %li bytes with a %li usec window\n"), gcommitbytes, gcommitwindow);
+  }
 
   // set mgoptions - XXX this needs to be handled better
-  lpstr=calloc(7,sizeof(char));
-  snprintf(lpstr,6,"%i",listenport);
-  
-  ntstr=calloc(4,sizeof(char));
-  snprintf(ntstr,3,"%i",numthreads);
+  ntstr=calloc(8,sizeof(char));
+  snprintf(ntstr,8,"%i",numthreads);
   
+  mgoptions = calloc(23,sizeof(char*));
+  tf=0;
+  mgoptions[tf++]="listening_ports";
+  mgoptions[tf++]=portspec;
+  if(mcportspec!=NULL && *mcportspec) {
+    mgoptions[tf++]="raw_listening_ports";
+    mgoptions[tf++]=mcportspec;
+  }
+  mgoptions[tf++]="document_root";
+  mgoptions[tf++]="/dev/null";
+  mgoptions[tf++]="num_threads";
+  mgoptions[tf++]=ntstr;
   if(alfile!=NULL) {
-    mgoptions = calloc(9,sizeof(char*));
-  } else {
-    mgoptions = calloc(7,sizeof(char*));
-  }
-  mgoptions[0]="listening_ports";
-  mgoptions[1]=lpstr;
-  mgoptions[2]="document_root";
-  mgoptions[3]="/dev/null";
-  mgoptions[4]="num_threads";
-  mgoptions[5]=ntstr;
-  if(alfile!=NULL) {
-    mgoptions[6]="access_log_file";
-    mgoptions[7]=alfile;
-    mgoptions[8]=NULL;
-  } else {
-    mgoptions[6]=NULL;
+    mgoptions[tf++]="access_log_file";
+    mgoptions[tf++]=alfile;
+  }
+  if(acceptorcpus!=NULL) {
+    mgoptions[tf++]="acceptor_cpus";
+    mgoptions[tf++]=acceptorcpus;
+  }
+  if(workercpus!=NULL) {
+    mgoptions[tf++]="worker_cpus";
+    mgoptions[tf++]=workercpus;
+  }
+  if(unixacl!=NULL) {
+    mgoptions[tf++]="unix_access_control_list";
+    mgoptions[tf++]=unixacl;
+  }
+  if(sslcert!=NULL) {
+    mgoptions[tf++]="ssl_certificate";
+    mgoptions[tf++]=sslcert;
   }
+  if(ticketkey!=NULL) {
+    mgoptions[tf++]="ssl_ticket_key_file";
+    mgoptions[tf++]=ticketkey;
+  }
+  if(ktls!=NULL) {
+    mgoptions[tf++]="ssl_ktls";
+    mgoptions[tf++]=ktls;
+  }
+  mgoptions[tf]=NULL;
   // main loop
   LOG_INFO(vlevel, _("Starting Mongoose HTTP server loop\n"));
   ctx = mg_start(&mghandle, NULL, (const char**)mgoptions);
   if(ctx!=NULL) {
+    // expired entries are deleted in the background
+    if((layout & LAYOUT_TTL) && pthread_create(&sweepthread, NULL, &sweeper, NULL)==0) {
+      sweeping=1;
+    }
+    // and counters accumulated in memory written, if reloads ever turn that on
+    if(pthread_create(&flushthread, NULL, &counterflusher, NULL)!=0) {
+      LOG_FATAL(vlevel, _("Unable to start the counter flush thread\n"));
+      exit(EXIT_FAILURE);
+    }
+    pfd.fd=hsock;
+    pfd.events=POLLIN;
     while(!done) {
-      // cleaner thread here?
-      sleep(1);
+      if(reload) {
+        reload=0;
+        if(cfgfile==NULL) {
+          LOG_WARN(vlevel, _("SIGHUP received but no config file given, nothing to reload\n"));
+        } else {
+          loadconfig(1);
+        }
+      }
+      if(hsock==-1) {
+        sleep(1);
+      } else if(poll(&pfd,1,1000)==1 && (hconn=accept(hsock,NULL,NULL))!=-1) {
+        // a new instance wants our listening sockets, hand them over and
+        // get out of its way
+        nfds=mg_get_listening_sockets(ctx,fds,fdssl,fdraw,HANDOFF_MAX_FDS);
+        for(tf=0;tf<nfds;tf++) {
+          tags[tf]=fdraw[tf] ? 'm' : fdssl[tf] ? 's' : 'p';
+        }
+        if(sendfds(hconn,fds,tags,nfds)==0) {
+          LOG_INFO(vlevel, _("Handed %i listening sockets to new instance\n"),nfds);
+          close(hsock);
+          hsock=-1;
+          break;
+        }
+        LOG_ERROR(vlevel, _("Unable to hand off listening sockets: %s\n"),strerror(errno));
+        close(hconn);
+        hconn=-1;
+      }
     }
     LOG_INFO(vlevel, _("Ending Mongoose HTTP server loop\n"));
-    mg_stop(ctx);
+    if(hconn!=-1) {
+      LOG_INFO(vlevel, _("Draining in-flight requests, up to %i seconds\n"),draintime);
+      mg_drain(ctx,draintime*1000);
+    } else {
+      mg_stop(ctx);
+    }
+    if(sweeping) {
+      sweepstop=1;
+      pthread_join(sweepthread, NULL);
+    }
+    flushstop=1;
+    pthread_join(flushthread, NULL);
   } else {
     LOG_FATAL(vlevel,_("Error in creating Mongoose HTTP server\n"));
   }
@@ -522,18 +3640,54 @@ int main(int argc, char **argv) {
 
   // close leveldb handle
   LOG_TRACE(vlevel, _("Cleaning up leveldb\n"));
-  leveldb_compact_range(dbh, NULL, 0, NULL, 0);
+  if(hconn==-1) {
+    // skipped on handoff, the new instance is waiting for the database
+    leveldb_compact_range(dbh, NULL, 0, NULL, 0);
+  }
 
   leveldb_options_destroy(dbopt);
   leveldb_readoptions_destroy(ropt);
   leveldb_writeoptions_destroy(wopt);
+  if(gcommit!=NULL) {
+    gcommit_free(gcommit);
+  }
   leveldb_close(dbh);
+  if(cache!=NULL) {
+    leveldb_cache_destroy(cache);
+  }
+  if(bloom!=NULL) {
+    leveldb_filterpolicy_destroy(bloom);
+  }
+  vcache_free(vcache);
+  keylock_free(keylocks);
+  hotkeys_free(hotkeys);
+
+  if(hconn!=-1) {
+    // EOF tells the new instance the database is free
+    close(hconn);
+  }
+  if(hsock!=-1) {
+    close(hsock);
+    unlink(handoff);
+  }
 
   LOG_TRACE(vlevel, _("Cleaning up\n"));
   free(dbd);
-  free(lpstr);
+  free(alfile);
+  free(cfgfile);
+  free(portspec);
+  free(mcportspec);
+  free(unixacl);
+  free(adminacl);
+  free(handoff);
+  free(sslcert);
+  free(ticketkey);
+  free(ktls);
   free(ntstr);
   free(mgoptions);
+  free(acceptorcpus);
+  free(workercpus);
+  free(topology);
   
   return EXIT_SUCCESS;
 }
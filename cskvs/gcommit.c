@@ -0,0 +1,228 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gcommit.h"
+
+struct group {
+	leveldb_writebatch_t *wb;
+	size_t bytes;
+	int writers;
+	int refs;               // writers still waiting on the group
+	int done;
+	char *err;
+};
+
+struct gcommit {
+	leveldb_t *db;
+	leveldb_writeoptions_t *wopt;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;    // a group has writers, or filled up
+	pthread_cond_t synced;  // a group is on disk
+	struct group *cur;      // the group being gathered
+	size_t maxbytes;
+	long window;
+	int stop;
+	struct gcommit_stats st;
+};
+
+static struct group *groupnew(void) {
+	struct group *g=calloc(1, sizeof(struct group));
+
+	if(g!=NULL && (g->wb=leveldb_writebatch_create())==NULL) {
+		free(g);
+		return NULL;
+	}
+	return g;
+}
+
+static void groupfree(struct group *g) {
+	leveldb_writebatch_destroy(g->wb);
+	free(g->err);
+	free(g);
+}
+
+static void groupput(void *arg, const char *k, size_t klen, const char *v, size_t vlen) {
+	struct group *g=arg;
+
+	leveldb_writebatch_put(g->wb, k, klen, v, vlen);
+	g->bytes+=klen+vlen;
+}
+
+static void groupdel(void *arg, const char *k, size_t klen) {
+	struct group *g=arg;
+
+	leveldb_writebatch_delete(g->wb, k, klen);
+	g->bytes+=klen;
+}
+
+static int histbucket(unsigned long n) {
+	int i=0;
+
+	while(n>1 && i<GCOMMIT_HIST-1) {
+		n>>=1;
+		i++;
+	}
+	return i;
+}
+
+static double monotime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void *committer(void *arg) {
+	struct gcommit *gc=arg;
+	struct group *g, *next;
+	struct timespec until;
+	double started;
+
+	pthread_mutex_lock(&gc->lock);
+	for(;;) {
+		while(gc->cur->writers==0 && !gc->stop) {
+			pthread_cond_wait(&gc->work, &gc->lock);
+		}
+		if(gc->cur->writers==0) {
+			break;
+		}
+		// let more writers join until the window closes or the group is full
+		if(gc->window>0 && gc->cur->bytes<gc->maxbytes && !gc->stop) {
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec+=(gc->window%1000000)*1000;
+			until.tv_sec+=gc->window/1000000+until.tv_nsec/1000000000;
+			until.tv_nsec%=1000000000;
+			while(gc->cur->bytes<gc->maxbytes && !gc->stop &&
+						pthread_cond_timedwait(&gc->work, &gc->lock, &until)!=ETIMEDOUT);
+		}
+		if((next=groupnew())==NULL) {
+			// keep gathering into the current group, better late than lost
+			pthread_mutex_unlock(&gc->lock);
+			sleep(1);
+			pthread_mutex_lock(&gc->lock);
+			continue;
+		}
+		g=gc->cur;
+		gc->cur=next;
+		pthread_mutex_unlock(&gc->lock);
+
+		started=monotime();
+		leveldb_write(gc->db, gc->wopt, g->wb, &g->err);
+
+		pthread_mutex_lock(&gc->lock);
+		gc->st.groups++;
+		gc->st.writes+=g->writers;
+		gc->st.bytes+=g->bytes;
+		gc->st.syncus+=(monotime()-started)*1e6;
+		gc->st.writers[histbucket(g->writers)]++;
+		gc->st.kbytes[histbucket(g->bytes/1024)]++;
+		g->done=1;
+		pthread_cond_broadcast(&gc->synced);
+	}
+	pthread_mutex_unlock(&gc->lock);
+	return NULL;
+}
+
+struct gcommit *gcommit_new(leveldb_t *db, size_t maxbytes, long window) {
+	struct gcommit *gc=calloc(1, sizeof(struct gcommit));
+
+	if(gc==NULL) {
+		return NULL;
+	}
+	gc->db=db;
+	gc->maxbytes=maxbytes;
+	gc->window=window;
+	gc->wopt=leveldb_writeoptions_create();
+	leveldb_writeoptions_set_sync(gc->wopt, 1);
+	pthread_mutex_init(&gc->lock, NULL);
+	pthread_cond_init(&gc->work, NULL);
+	pthread_cond_init(&gc->synced, NULL);
+	if((gc->cur=groupnew())==NULL || pthread_create(&gc->thread, NULL, &committer, gc)!=0) {
+		if(gc->cur!=NULL) {
+			groupfree(gc->cur);
+		}
+		leveldb_writeoptions_destroy(gc->wopt);
+		free(gc);
+		return NULL;
+	}
+	return gc;
+}
+
+void gcommit_tune(struct gcommit *gc, size_t maxbytes, long window) {
+	pthread_mutex_lock(&gc->lock);
+	gc->maxbytes=maxbytes;
+	gc->window=window;
+	pthread_cond_signal(&gc->work);
+	pthread_mutex_unlock(&gc->lock);
+}
+
+void gcommit_free(struct gcommit *gc) {
+	pthread_mutex_lock(&gc->lock);
+	gc->stop=1;
+	pthread_cond_signal(&gc->work);
+	pthread_mutex_unlock(&gc->lock);
+	pthread_join(gc->thread, NULL);
+
+	groupfree(gc->cur);
+	leveldb_writeoptions_destroy(gc->wopt);
+	pthread_cond_destroy(&gc->synced);
+	pthread_cond_destroy(&gc->work);
+	pthread_mutex_destroy(&gc->lock);
+	free(gc);
+}
+
+void gcommit_write(struct gcommit *gc, leveldb_writebatch_t *wb, char **err) {
+	struct group *g;
+
+	pthread_mutex_lock(&gc->lock);
+	g=gc->cur;
+	leveldb_writebatch_iterate(wb, g, &groupput, &groupdel);
+	g->refs++;
+	if(g->writers++==0 || g->bytes>=gc->maxbytes) {
+		pthread_cond_signal(&gc->work);
+	}
+	while(!g->done) {
+		pthread_cond_wait(&gc->synced, &gc->lock);
+	}
+	if(g->err!=NULL) {
+		*err=strdup(g->err);
+	}
+	if(--g->refs==0) {
+		groupfree(g);
+	}
+	pthread_mutex_unlock(&gc->lock);
+}
+
+void gcommit_stats(struct gcommit *gc, struct gcommit_stats *st) {
+	pthread_mutex_lock(&gc->lock);
+	memcpy(st, &gc->st, sizeof(struct gcommit_stats));
+	st->maxbytes=gc->maxbytes;
+	st->window=gc->window;
+	pthread_mutex_unlock(&gc->lock);
+}
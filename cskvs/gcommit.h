@@ -0,0 +1,63 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef __GCOMMIT_H__
+#define __GCOMMIT_H__
+
+#include <stddef.h>
+#include <leveldb/c.h>
+
+// Group commit for durable writes. Writers hand their batch to
+// gcommit_write(), which appends it to the group being gathered and blocks.
+// One commit thread writes each group with a single synced leveldb_write(),
+// so many concurrent writers share one fsync, and wakes the group's writers
+// once it is on disk. A group closes when it holds maxbytes, once window
+// microseconds passed since its first writer, or right away with a window of
+// 0; writers that arrive while a group is being synced form the next one.
+
+// histogram buckets, bucket i counts groups of [2^i, 2^(i+1)) writers and
+// of [2^i, 2^(i+1)) KB, the last bucket takes everything larger
+#define GCOMMIT_HIST 16
+
+struct gcommit;
+
+struct gcommit_stats {
+	unsigned long groups;
+	unsigned long writes;
+	unsigned long bytes;
+	unsigned long syncus;                 // time spent in synced writes
+	unsigned long writers[GCOMMIT_HIST];  // writers per group
+	unsigned long kbytes[GCOMMIT_HIST];   // KB per group
+	size_t maxbytes;
+	long window;
+};
+
+struct gcommit *gcommit_new(leveldb_t *db, size_t maxbytes, long window);
+void gcommit_tune(struct gcommit *gc, size_t maxbytes, long window);
+// commits what is pending, then stops the commit thread
+void gcommit_free(struct gcommit *gc);
+
+// returns once wb is synced to disk, *err as leveldb_write() sets it
+void gcommit_write(struct gcommit *gc, leveldb_writebatch_t *wb, char **err);
+
+void gcommit_stats(struct gcommit *gc, struct gcommit_stats *st);
+
+#endif // __GCOMMIT_H__
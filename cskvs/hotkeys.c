@@ -0,0 +1,229 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hotkeys.h"
+
+struct hkslot {
+	struct hotkey hk;
+	uint64_t hash;
+};
+
+struct hotkeys {
+	uint32_t sketch[HOTKEYS_DEPTH][HOTKEYS_WIDTH];
+	pthread_mutex_t lock;          // slots
+	struct hkslot slots[HOTKEYS_SLOTS];
+	int nbuckets;
+	unsigned long *reads;          // per bucket
+	unsigned long *writes;
+	unsigned long samples;
+	long nextdecay;
+};
+
+struct hotkeys *hotkeys_new(int buckets) {
+	struct hotkeys *hk=calloc(1, sizeof(struct hotkeys));
+
+	if(hk==NULL) {
+		return NULL;
+	}
+	hk->nbuckets=buckets;
+	hk->reads=calloc(buckets, sizeof(unsigned long));
+	hk->writes=calloc(buckets, sizeof(unsigned long));
+	if(hk->reads==NULL || hk->writes==NULL) {
+		hotkeys_free(hk);
+		return NULL;
+	}
+	pthread_mutex_init(&hk->lock, NULL);
+	hk->nextdecay=time(NULL)+HOTKEYS_HALFLIFE;
+	return hk;
+}
+
+void hotkeys_free(struct hotkeys *hk) {
+	if(hk!=NULL) {
+		pthread_mutex_destroy(&hk->lock);
+		free(hk->reads);
+		free(hk->writes);
+		free(hk);
+	}
+}
+
+// each thread starts at its own point in the cycle, otherwise with many
+// quiet threads none of them would ever reach rate and nothing is sampled
+int hotkeys_sampled(long rate) {
+	static __thread unsigned long tick;
+
+	if(tick==0) {
+		tick=((uintptr_t)&tick>>4)*2654435761UL+1;
+	}
+	return rate>0 && ++tick%rate==0;
+}
+
+// FNV-1a, the sketch rows index with h1+i*h2 from its two halves
+static uint64_t hkhash(const char *key, size_t klen) {
+	uint64_t h=14695981039346656037ULL;
+	size_t i;
+
+	for(i=0; i<klen; i++) {
+		h^=(unsigned char)key[i];
+		h*=1099511628211ULL;
+	}
+	return h;
+}
+
+// Halves every count. Adds racing with it may be lost, which only blurs a
+// picture that is an estimate anyway.
+static void decay(struct hotkeys *hk) {
+	int i, j;
+
+	for(i=0; i<HOTKEYS_DEPTH; i++) {
+		for(j=0; j<HOTKEYS_WIDTH; j++) {
+			hk->sketch[i][j]>>=1;
+		}
+	}
+	for(i=0; i<hk->nbuckets; i++) {
+		hk->reads[i]>>=1;
+		hk->writes[i]>>=1;
+	}
+	pthread_mutex_lock(&hk->lock);
+	for(i=0; i<HOTKEYS_SLOTS; i++) {
+		hk->slots[i].hk.count>>=1;
+		hk->slots[i].hk.reads>>=1;
+		hk->slots[i].hk.writes>>=1;
+	}
+	pthread_mutex_unlock(&hk->lock);
+}
+
+void hotkeys_add(struct hotkeys *hk, const char *key, size_t klen, int bucket, int write) {
+	uint64_t h=hkhash(key, klen);
+	uint32_t h1=h, h2=(h>>32) | 1, est=UINT32_MAX, c;
+	size_t kept=klen<HOTKEYS_KEY_MAX ? klen : HOTKEYS_KEY_MAX;
+	long now=time(NULL), next=hk->nextdecay;
+	struct hkslot *s, *coolest=NULL;
+	int i;
+
+	if(now>=next && __sync_bool_compare_and_swap(&hk->nextdecay, next, now+HOTKEYS_HALFLIFE)) {
+		decay(hk);
+	}
+	__sync_fetch_and_add(&hk->samples, 1);
+	if(bucket>=0 && bucket<hk->nbuckets) {
+		__sync_fetch_and_add(write ? &hk->writes[bucket] : &hk->reads[bucket], 1);
+	}
+	for(i=0; i<HOTKEYS_DEPTH; i++) {
+		c=__sync_add_and_fetch(&hk->sketch[i][(h1+i*h2) % HOTKEYS_WIDTH], 1);
+		if(c<est) {
+			est=c;
+		}
+	}
+
+	if(pthread_mutex_trylock(&hk->lock)!=0) {
+		return;
+	}
+	for(i=0; i<HOTKEYS_SLOTS; i++) {
+		s=&hk->slots[i];
+		if(s->hk.count>0 && s->hash==h && s->hk.klen==kept && !memcmp(s->hk.key, key, kept)) {
+			break;
+		}
+		if(coolest==NULL || s->hk.count<coolest->hk.count) {
+			coolest=s;
+		}
+	}
+	if(i==HOTKEYS_SLOTS) {
+		if(est<=coolest->hk.count) {
+			pthread_mutex_unlock(&hk->lock);
+			return;
+		}
+		s=coolest;
+		memset(s, 0, sizeof(struct hkslot));
+		memcpy(s->hk.key, key, kept);
+		s->hk.klen=kept;
+		s->hk.truncated=kept<klen;
+		s->hk.bucket=bucket;
+		s->hash=h;
+	}
+	s->hk.count=est;
+	if(write) {
+		s->hk.writes++;
+	} else {
+		s->hk.reads++;
+	}
+	pthread_mutex_unlock(&hk->lock);
+}
+
+unsigned long hotkeys_samples(struct hotkeys *hk) {
+	return hk->samples;
+}
+
+static int hotkeycmp(const void *a, const void *b) {
+	const struct hotkey *x=a, *y=b;
+	return (x->count<y->count)-(x->count>y->count);
+}
+
+int hotkeys_top(struct hotkeys *hk, struct hotkey *out, int n) {
+	struct hotkey all[HOTKEYS_SLOTS];
+	int i, found=0;
+
+	pthread_mutex_lock(&hk->lock);
+	for(i=0; i<HOTKEYS_SLOTS; i++) {
+		if(hk->slots[i].hk.count>0) {
+			all[found++]=hk->slots[i].hk;
+		}
+	}
+	pthread_mutex_unlock(&hk->lock);
+	qsort(all, found, sizeof(struct hotkey), &hotkeycmp);
+	n=found<n ? found : n;
+	memcpy(out, all, n*sizeof(struct hotkey));
+	return n;
+}
+
+static int hotbucketcmp(const void *a, const void *b) {
+	const struct hotbucket *x=a, *y=b;
+	unsigned long xt=x->reads+x->writes, yt=y->reads+y->writes;
+
+	return (xt<yt)-(xt>yt);
+}
+
+int hotkeys_topbuckets(struct hotkeys *hk, struct hotbucket *out, int n) {
+	struct hotbucket *all=malloc(hk->nbuckets*sizeof(struct hotbucket));
+	int i, found=0;
+
+	if(all==NULL) {
+		return 0;
+	}
+	for(i=0; i<hk->nbuckets; i++) {
+		if(hk->reads[i]>0 || hk->writes[i]>0) {
+			all[found].bucket=i;
+			all[found].reads=hk->reads[i];
+			all[found].writes=hk->writes[i];
+			found++;
+		}
+	}
+	qsort(all, found, sizeof(struct hotbucket), &hotbucketcmp);
+	n=found<n ? found : n;
+	memcpy(out, all, n*sizeof(struct hotbucket));
+	free(all);
+	return n;
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+
+#ifndef __HOTKEYS_H__
+#define __HOTKEYS_H__
+
+#include <stddef.h>
+
+// Hot key detection. A sampled share of key accesses is counted in a
+// count-min sketch of HOTKEYS_DEPTH rows of HOTKEYS_WIDTH counters, bumped
+// with atomic adds so request threads never wait on each other. A key whose
+// estimate beats the coolest of the HOTKEYS_SLOTS candidates takes its slot
+// (space saving). The candidates are only updated by a thread that gets their
+// lock without waiting, a sample that finds it busy just counts in the
+// sketch. Reads and writes per bucket are counted alongside. Every count
+// halves each HOTKEYS_HALFLIFE seconds, so the picture follows the load.
+
+#define HOTKEYS_DEPTH 4
+#define HOTKEYS_WIDTH 4096
+#define HOTKEYS_SLOTS 64
+#define HOTKEYS_KEY_MAX 128
+#define HOTKEYS_HALFLIFE 60
+
+struct hotkey {
+	char key[HOTKEYS_KEY_MAX];
+	size_t klen;            // bytes of key kept, longer keys are truncated
+	int truncated;
+	int bucket;
+	unsigned long count;    // sketch estimate of the key's samples
+	unsigned long reads;    // samples since the key became a candidate
+	unsigned long writes;
+};
+
+struct hotbucket {
+	int bucket;
+	unsigned long reads;
+	unsigned long writes;
+};
+
+struct hotkeys;
+
+struct hotkeys *hotkeys_new(int buckets);
+void hotkeys_free(struct hotkeys *hk);
+
+// whether the calling thread samples this access, one in rate, never if
+// rate is 0
+int hotkeys_sampled(long rate);
+void hotkeys_add(struct hotkeys *hk, const char *key, size_t klen, int bucket, int write);
+unsigned long hotkeys_samples(struct hotkeys *hk);
+
+// the hottest n candidates and buckets, hottest first, returns how many
+int hotkeys_top(struct hotkeys *hk, struct hotkey *out, int n);
+int hotkeys_topbuckets(struct hotkeys *hk, struct hotbucket *out, int n);
+
+#endif // __HOTKEYS_H__
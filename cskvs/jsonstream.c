@@ -0,0 +1,549 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jsonstream.h"
+
+enum {
+	S_START,        // before the opening [
+	S_ELEM_FIRST,   // after [, an element or ]
+	S_ELEM,         // after a comma, an element
+	S_MEMBER_FIRST, // after {, a member name or }
+	S_MEMBER,       // after a comma, a member name
+	S_STRING,       // inside a string, see target
+	S_COLON,        // after a member name
+	S_VALUE,        // after the colon
+	S_SKIP,         // inside a value of a member we don't care about
+	S_AFTER_MEMBER, // a comma or }
+	S_AFTER_ELEM,   // a comma or ]
+	S_DONE          // after the closing ], only whitespace
+};
+
+enum { T_NAME, T_KEY, T_VALUE, T_VERSION, T_OTHER };
+
+#define NAME_MAX_LEN 8
+#define VERSION_MAX_LEN 24
+
+struct sbuf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+struct jsonstream {
+	int state;
+	int target;        // what the current string is decoded into
+	int member;        // T_KEY, T_VALUE, T_VERSION or T_OTHER for the current member
+	int esc;           // 0, 1 after a backslash, 2-5 reading \u hex digits
+	unsigned int cp;   // code point of a \u escape being read
+	unsigned int hi;   // pending high surrogate
+	int skipdepth;     // nesting of a skipped value
+	int skipstr;       // 1 inside a string of a skipped value, 2 after a backslash
+	int haskey;
+	int hasval;
+	int hasversion;
+	char name[NAME_MAX_LEN];
+	char version[VERSION_MAX_LEN];
+	size_t versionlen;
+	size_t namelen;
+	struct sbuf key;
+	struct sbuf val;
+	size_t maxstr;
+	size_t offset;
+	jsonstream_cb cb;
+	void *arg;
+};
+
+struct jsonstream *jsonstream_new(size_t maxstr, jsonstream_cb cb, void *arg) {
+	struct jsonstream *js=calloc(1, sizeof(struct jsonstream));
+
+	if(js!=NULL) {
+		js->maxstr=maxstr;
+		js->cb=cb;
+		js->arg=arg;
+	}
+	return js;
+}
+
+void jsonstream_free(struct jsonstream *js) {
+	if(js!=NULL) {
+		free(js->key.buf);
+		free(js->val.buf);
+		free(js);
+	}
+}
+
+// the version member of the element the callback is looking at, 0 if it
+// has none. Points into the parser like key and value.
+int jsonstream_version(const struct jsonstream *js, const char **ver, size_t *len) {
+	*ver=js->version;
+	*len=js->versionlen;
+	return js->hasversion;
+}
+
+// bytes consumed so far, points near the problem after an error
+size_t jsonstream_offset(const struct jsonstream *js) {
+	return js->offset;
+}
+
+static int isws(char c) {
+	return c==' ' || c=='\t' || c=='\n' || c=='\r';
+}
+
+static int sbufput(struct jsonstream *js, struct sbuf *sb, const char *s, size_t n) {
+	if(sb->len+n>js->maxstr) {
+		return JSONSTREAM_TOOLONG;
+	}
+	if(sb->len+n>sb->size) {
+		size_t size=sb->size ? sb->size : 64;
+		char *nb;
+
+		while(size<sb->len+n) {
+			size*=2;
+		}
+		if((nb=realloc(sb->buf, size))==NULL) {
+			return JSONSTREAM_TOOLONG;
+		}
+		sb->buf=nb;
+		sb->size=size;
+	}
+	memcpy(sb->buf+sb->len, s, n);
+	sb->len+=n;
+	return JSONSTREAM_OK;
+}
+
+static int put(struct jsonstream *js, const char *s, size_t n) {
+	if(js->target==T_NAME) {
+		// only key, value and version matter, anything longer is some other member
+		if(js->namelen+n<=NAME_MAX_LEN) {
+			memcpy(js->name+js->namelen, s, n);
+		}
+		js->namelen+=n;
+		return JSONSTREAM_OK;
+	}
+	if(js->target==T_VERSION) {
+		if(js->versionlen+n>VERSION_MAX_LEN) {
+			return JSONSTREAM_TOOLONG;
+		}
+		memcpy(js->version+js->versionlen, s, n);
+		js->versionlen+=n;
+		return JSONSTREAM_OK;
+	}
+	return sbufput(js, js->target==T_KEY ? &js->key : &js->val, s, n);
+}
+
+static int putcp(struct jsonstream *js, unsigned int cp) {
+	char u[4];
+
+	if(cp<0x80) {
+		u[0]=cp;
+		return put(js, u, 1);
+	} else if(cp<0x800) {
+		u[0]=0xC0|(cp>>6);
+		u[1]=0x80|(cp&0x3F);
+		return put(js, u, 2);
+	} else if(cp<0x10000) {
+		u[0]=0xE0|(cp>>12);
+		u[1]=0x80|((cp>>6)&0x3F);
+		u[2]=0x80|(cp&0x3F);
+		return put(js, u, 3);
+	}
+	u[0]=0xF0|(cp>>18);
+	u[1]=0x80|((cp>>12)&0x3F);
+	u[2]=0x80|((cp>>6)&0x3F);
+	u[3]=0x80|(cp&0x3F);
+	return put(js, u, 4);
+}
+
+// a high surrogate not followed by a low one becomes U+FFFD
+static int flushhi(struct jsonstream *js) {
+	if(js->hi) {
+		js->hi=0;
+		return putcp(js, 0xFFFD);
+	}
+	return JSONSTREAM_OK;
+}
+
+static int hexval(char c) {
+	if(c>='0' && c<='9') {
+		return c-'0';
+	} else if(c>='a' && c<='f') {
+		return c-'a'+10;
+	} else if(c>='A' && c<='F') {
+		return c-'A'+10;
+	}
+	return -1;
+}
+
+// one character of a string body, the opening quote is already consumed
+static int stringchar(struct jsonstream *js, char c) {
+	int ret, h;
+
+	if(js->esc==1) {
+		const char *from="\"\\/bfnrt", *to="\"\\/\b\f\n\r\t";
+		const char *p;
+
+		if(c=='u') {
+			js->esc=2;
+			js->cp=0;
+			return JSONSTREAM_OK;
+		}
+		if(c=='\0' || (p=strchr(from, c))==NULL) {
+			return JSONSTREAM_ERROR;
+		}
+		js->esc=0;
+		if((ret=flushhi(js))!=JSONSTREAM_OK) {
+			return ret;
+		}
+		return put(js, to+(p-from), 1);
+	} else if(js->esc>1) {
+		if((h=hexval(c))<0) {
+			return JSONSTREAM_ERROR;
+		}
+		js->cp=js->cp<<4|h;
+		if(++js->esc<6) {
+			return JSONSTREAM_OK;
+		}
+		js->esc=0;
+		if(js->cp>=0xDC00 && js->cp<=0xDFFF && js->hi) {
+			ret=putcp(js, 0x10000+((js->hi-0xD800)<<10)+(js->cp-0xDC00));
+			js->hi=0;
+			return ret;
+		}
+		if((ret=flushhi(js))!=JSONSTREAM_OK) {
+			return ret;
+		}
+		if(js->cp>=0xD800 && js->cp<=0xDBFF) {
+			js->hi=js->cp;
+			return JSONSTREAM_OK;
+		}
+		return putcp(js, js->cp>=0xDC00 && js->cp<=0xDFFF ? 0xFFFD : js->cp);
+	}
+
+	if((unsigned char)c<0x20) {
+		return JSONSTREAM_ERROR;
+	}
+	if(c=='\\') {
+		js->esc=1;
+		return JSONSTREAM_OK;
+	}
+	if((ret=flushhi(js))!=JSONSTREAM_OK) {
+		return ret;
+	}
+	if(c=='"') {
+		if(js->target==T_NAME) {
+			if(js->namelen==3 && !memcmp(js->name, "key", 3)) {
+				js->member=T_KEY;
+			} else if(js->namelen==5 && !memcmp(js->name, "value", 5)) {
+				js->member=T_VALUE;
+			} else if(js->namelen==7 && !memcmp(js->name, "version", 7)) {
+				js->member=T_VERSION;
+			} else {
+				js->member=T_OTHER;
+			}
+			js->state=S_COLON;
+		} else {
+			if(js->target==T_KEY) {
+				js->haskey=1;
+			} else if(js->target==T_VALUE) {
+				js->hasval=1;
+			} else {
+				js->hasversion=1;
+			}
+			js->state=S_AFTER_MEMBER;
+		}
+		return JSONSTREAM_OK;
+	}
+	return put(js, &c, 1);
+}
+
+static void startstring(struct jsonstream *js, int target) {
+	js->state=S_STRING;
+	js->target=target;
+	js->esc=0;
+	js->hi=0;
+	if(target==T_NAME) {
+		js->namelen=0;
+	} else if(target==T_VERSION) {
+		js->versionlen=0;
+	} else {
+		// a repeated member overwrites the earlier one
+		(target==T_KEY ? &js->key : &js->val)->len=0;
+	}
+}
+
+// feeds the next piece of the body. Returns JSONSTREAM_OK when all of it was
+// consumed, anything else stops the parse for good.
+int jsonstream_feed(struct jsonstream *js, const char *buf, size_t len) {
+	size_t i=0;
+	int ret;
+
+	while(i<len) {
+		char c=buf[i];
+
+		if(js->state==S_STRING) {
+			if((ret=stringchar(js, c))!=JSONSTREAM_OK) {
+				return ret;
+			}
+			i++;
+			js->offset++;
+			continue;
+		}
+		if(js->state==S_SKIP) {
+			if(js->skipstr) {
+				if(js->skipstr==2) {
+					js->skipstr=1;
+				} else if(c=='\\') {
+					js->skipstr=2;
+				} else if(c=='"') {
+					js->skipstr=0;
+					if(js->skipdepth==0) {
+						js->state=S_AFTER_MEMBER;
+					}
+				}
+			} else if(c=='"') {
+				js->skipstr=1;
+			} else if(c=='{' || c=='[') {
+				js->skipdepth++;
+			} else if(c=='}' || c==']' || c==',' || isws(c)) {
+				if(js->skipdepth==0) {
+					// end of a bare scalar, the delimiter belongs to the object
+					js->state=S_AFTER_MEMBER;
+					continue;
+				}
+				if((c=='}' || c==']') && --js->skipdepth==0) {
+					js->state=S_AFTER_MEMBER;
+				}
+			}
+			i++;
+			js->offset++;
+			continue;
+		}
+
+		i++;
+		js->offset++;
+		if(isws(c)) {
+			continue;
+		}
+		switch(js->state) {
+		case S_START:
+			if(c!='[') {
+				return JSONSTREAM_ERROR;
+			}
+			js->state=S_ELEM_FIRST;
+			break;
+		case S_ELEM_FIRST:
+		case S_ELEM:
+			if(c==']' && js->state==S_ELEM_FIRST) {
+				js->state=S_DONE;
+			} else if(c=='{') {
+				js->haskey=js->hasval=js->hasversion=0;
+				js->key.len=js->val.len=0;
+				js->state=S_MEMBER_FIRST;
+			} else {
+				return JSONSTREAM_ERROR;
+			}
+			break;
+		case S_MEMBER_FIRST:
+		case S_MEMBER:
+			if(c=='"') {
+				startstring(js, T_NAME);
+			} else if(c=='}' && js->state==S_MEMBER_FIRST) {
+				js->state=S_AFTER_MEMBER;
+				i--;
+				js->offset--;
+			} else {
+				return JSONSTREAM_ERROR;
+			}
+			break;
+		case S_COLON:
+			if(c!=':') {
+				return JSONSTREAM_ERROR;
+			}
+			js->state=S_VALUE;
+			break;
+		case S_VALUE:
+			if(js->member!=T_OTHER) {
+				if(c!='"') {
+					return JSONSTREAM_ERROR;
+				}
+				startstring(js, js->member);
+			} else if(c==',' || c=='}' || c==']') {
+				return JSONSTREAM_ERROR;
+			} else {
+				// let S_SKIP see the first character of the value
+				js->state=S_SKIP;
+				js->skipdepth=0;
+				js->skipstr=0;
+				i--;
+				js->offset--;
+			}
+			break;
+		case S_AFTER_MEMBER:
+			if(c==',') {
+				js->state=S_MEMBER;
+			} else if(c=='}') {
+				if(!js->haskey) {
+					return JSONSTREAM_ERROR;
+				}
+				js->state=S_AFTER_ELEM;
+				if(js->cb(js->arg, js->key.len ? js->key.buf : "", js->key.len,
+									js->val.len ? js->val.buf : "", js->val.len, js->hasval)) {
+					return JSONSTREAM_STOPPED;
+				}
+			} else {
+				return JSONSTREAM_ERROR;
+			}
+			break;
+		case S_AFTER_ELEM:
+			if(c==',') {
+				js->state=S_ELEM;
+			} else if(c==']') {
+				js->state=S_DONE;
+			} else {
+				return JSONSTREAM_ERROR;
+			}
+			break;
+		default: // S_DONE, trailing garbage
+			return JSONSTREAM_ERROR;
+		}
+	}
+	return JSONSTREAM_OK;
+}
+
+// call at the end of the body, JSONSTREAM_ERROR if the array is incomplete
+int jsonstream_finish(struct jsonstream *js) {
+	return js->state==S_DONE ? JSONSTREAM_OK : JSONSTREAM_ERROR;
+}
+
+int jsonwriter_init(struct jsonwriter *w, size_t size, jsonwriter_flush_cb flush, void *arg) {
+	memset(w, 0, sizeof(struct jsonwriter));
+	if((w->buf=malloc(size))==NULL) {
+		return -1;
+	}
+	w->size=size;
+	w->flush=flush;
+	w->arg=arg;
+	return 0;
+}
+
+void jsonwriter_free(struct jsonwriter *w) {
+	free(w->buf);
+	w->buf=NULL;
+}
+
+// hands the buffer to flush, returns -1 only if it could neither be flushed
+// nor grown
+static int makeroom(struct jsonwriter *w) {
+	char *nb;
+
+	if(w->flush!=NULL && w->len>0 && w->flush(w->arg, w->buf, w->len)==0) {
+		w->flushed+=w->len;
+		w->len=0;
+		return 0;
+	}
+	if((nb=realloc(w->buf, w->size*2))==NULL) {
+		return -1;
+	}
+	w->buf=nb;
+	w->size*=2;
+	return 0;
+}
+
+int jsonwriter_flush(struct jsonwriter *w) {
+	if(w->len==0 || w->flush==NULL || w->flush(w->arg, w->buf, w->len)!=0) {
+		return -1;
+	}
+	w->flushed+=w->len;
+	w->len=0;
+	return 0;
+}
+
+int jsonwriter_raw(struct jsonwriter *w, const char *s, size_t n) {
+	while(n>0) {
+		size_t room=w->size-w->len;
+
+		if(room==0) {
+			if(makeroom(w)!=0) {
+				return -1;
+			}
+			continue;
+		}
+		if(room>n) {
+			room=n;
+		}
+		memcpy(w->buf+w->len, s, room);
+		w->len+=room;
+		s+=room;
+		n-=room;
+	}
+	return 0;
+}
+
+// writes s as a quoted JSON string, runs of plain bytes are copied in one go
+int jsonwriter_string(struct jsonwriter *w, const char *s, size_t n) {
+	static const char hex[]="0123456789abcdef";
+	size_t i, run=0;
+	char esc[6];
+	int elen;
+
+	if(jsonwriter_raw(w, "\"", 1)!=0) {
+		return -1;
+	}
+	for(i=0; i<n; i++) {
+		unsigned char c=s[i];
+
+		if(c>=0x20 && c!='"' && c!='\\') {
+			continue;
+		}
+		if(jsonwriter_raw(w, s+run, i-run)!=0) {
+			return -1;
+		}
+		run=i+1;
+		esc[0]='\\';
+		elen=2;
+		switch(c) {
+		case '"': esc[1]='"'; break;
+		case '\\': esc[1]='\\'; break;
+		case '\b': esc[1]='b'; break;
+		case '\f': esc[1]='f'; break;
+		case '\n': esc[1]='n'; break;
+		case '\r': esc[1]='r'; break;
+		case '\t': esc[1]='t'; break;
+		default:
+			esc[1]='u';
+			esc[2]='0';
+			esc[3]='0';
+			esc[4]=hex[c>>4];
+			esc[5]=hex[c&0xF];
+			elen=6;
+		}
+		if(jsonwriter_raw(w, esc, elen)!=0) {
+			return -1;
+		}
+	}
+	if(jsonwriter_raw(w, s+run, n-run)!=0) {
+		return -1;
+	}
+	return jsonwriter_raw(w, "\"", 1);
+}
@@ -0,0 +1,77 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef __JSONSTREAM_H__
+#define __JSONSTREAM_H__
+
+#include <stddef.h>
+
+// Push parser for the batch bodies of /mset/ and /mget/:
+//
+//   [{"key": "k1", "value": "v1"}, {"key": "k2"}, ...]
+//
+// The body is fed in whatever pieces mg_read() hands out. For each element
+// the callback gets the decoded key and, if present, value. Both point into
+// scratch buffers owned by the parser that are reused for the next element,
+// so memory stays bounded by the longest string, not the batch. An /mset/
+// element may also carry a short "version" string for a conditional write,
+// see jsonstream_version(). Other members are skipped, key, value and
+// version must be strings.
+
+#define JSONSTREAM_OK 0       // all input consumed, more may follow
+#define JSONSTREAM_ERROR -1   // malformed JSON
+#define JSONSTREAM_TOOLONG -2 // a string is longer than the parser allows
+#define JSONSTREAM_STOPPED -3 // the callback asked to stop
+
+// return non-zero to stop parsing, the feed then returns JSONSTREAM_STOPPED
+typedef int (*jsonstream_cb)(void *arg, const char *key, size_t klen, const char *val, size_t vlen, int hasval);
+
+struct jsonstream;
+
+struct jsonstream *jsonstream_new(size_t maxstr, jsonstream_cb cb, void *arg);
+int jsonstream_feed(struct jsonstream *js, const char *buf, size_t len);
+int jsonstream_finish(struct jsonstream *js);
+int jsonstream_version(const struct jsonstream *js, const char **ver, size_t *len);
+size_t jsonstream_offset(const struct jsonstream *js);
+void jsonstream_free(struct jsonstream *js);
+
+// The other direction: JSON text is escaped straight into one output buffer
+// that is handed to flush whenever it fills up, so a response of any size
+// needs only that buffer. Without a flush function, or while it returns
+// non-zero, the buffer grows instead.
+typedef int (*jsonwriter_flush_cb)(void *arg, const char *buf, size_t len);
+
+struct jsonwriter {
+	char *buf;
+	size_t len;
+	size_t size;
+	jsonwriter_flush_cb flush;
+	void *arg;
+	size_t flushed;   // bytes handed to flush so far
+};
+
+int jsonwriter_init(struct jsonwriter *w, size_t size, jsonwriter_flush_cb flush, void *arg);
+int jsonwriter_raw(struct jsonwriter *w, const char *s, size_t n);
+int jsonwriter_string(struct jsonwriter *w, const char *s, size_t n);
+int jsonwriter_flush(struct jsonwriter *w);
+void jsonwriter_free(struct jsonwriter *w);
+
+#endif // __JSONSTREAM_H__
@@ -0,0 +1,158 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keylock.h"
+
+struct klpending {
+	struct klpending *next;
+	long long val;
+	long ttl;
+	size_t klen;
+	char key[];
+};
+
+struct klstripe {
+	pthread_mutex_t lock;
+	struct klpending *pending;
+} __attribute__((aligned(64)));
+
+struct keylock {
+	struct klstripe stripes[KEYLOCK_STRIPES];
+	size_t npending;
+};
+
+struct keylock *keylock_new(void) {
+	struct keylock *kl=calloc(1, sizeof(struct keylock));
+	int i;
+
+	if(kl==NULL) {
+		return NULL;
+	}
+	for(i=0; i<KEYLOCK_STRIPES; i++) {
+		pthread_mutex_init(&kl->stripes[i].lock, NULL);
+	}
+	return kl;
+}
+
+void keylock_free(struct keylock *kl) {
+	struct klpending *p;
+	int i;
+
+	for(i=0; i<KEYLOCK_STRIPES; i++) {
+		while((p=kl->stripes[i].pending)!=NULL) {
+			kl->stripes[i].pending=p->next;
+			free(p);
+		}
+		pthread_mutex_destroy(&kl->stripes[i].lock);
+	}
+	free(kl);
+}
+
+// FNV-1a
+int keylock_stripe(struct keylock *kl, const char *key, size_t klen) {
+	uint64_t h=14695981039346656037ULL;
+	size_t i;
+
+	for(i=0; i<klen; i++) {
+		h^=(unsigned char)key[i];
+		h*=1099511628211ULL;
+	}
+	return (h>>16) % KEYLOCK_STRIPES;
+}
+
+void keylock_lock(struct keylock *kl, int stripe) {
+	pthread_mutex_lock(&kl->stripes[stripe].lock);
+}
+
+void keylock_unlock(struct keylock *kl, int stripe) {
+	pthread_mutex_unlock(&kl->stripes[stripe].lock);
+}
+
+static struct klpending **klfind(struct keylock *kl, int stripe, const char *key, size_t klen) {
+	struct klpending **pp;
+
+	for(pp=&kl->stripes[stripe].pending; *pp!=NULL; pp=&(*pp)->next) {
+		if((*pp)->klen==klen && !memcmp((*pp)->key, key, klen)) {
+			break;
+		}
+	}
+	return pp;
+}
+
+int keylock_pending(struct keylock *kl, int stripe, const char *key, size_t klen, long long *val) {
+	struct klpending *p=*klfind(kl, stripe, key, klen);
+
+	if(p==NULL) {
+		return 0;
+	}
+	*val=p->val;
+	return 1;
+}
+
+int keylock_setpending(struct keylock *kl, int stripe, const char *key, size_t klen, long long val, long ttl) {
+	struct klpending **pp=klfind(kl, stripe, key, klen);
+
+	if(*pp==NULL) {
+		if((*pp=malloc(sizeof(struct klpending)+klen))==NULL) {
+			return -1;
+		}
+		(*pp)->next=NULL;
+		(*pp)->klen=klen;
+		memcpy((*pp)->key, key, klen);
+		__sync_fetch_and_add(&kl->npending, 1);
+	}
+	(*pp)->val=val;
+	(*pp)->ttl=ttl;
+	return 0;
+}
+
+void keylock_droppending(struct keylock *kl, int stripe, const char *key, size_t klen) {
+	struct klpending **pp=klfind(kl, stripe, key, klen), *p=*pp;
+
+	if(p!=NULL) {
+		*pp=p->next;
+		free(p);
+		__sync_fetch_and_sub(&kl->npending, 1);
+	}
+}
+
+size_t keylock_flush(struct keylock *kl, int stripe, keylock_flush_cb cb, void *arg) {
+	struct klpending *p;
+	size_t n=0;
+
+	while((p=kl->stripes[stripe].pending)!=NULL) {
+		kl->stripes[stripe].pending=p->next;
+		cb(arg, p->key, p->klen, p->val, p->ttl);
+		free(p);
+		n++;
+	}
+	__sync_fetch_and_sub(&kl->npending, n);
+	return n;
+}
+
+size_t keylock_npending(struct keylock *kl) {
+	return kl->npending;
+}
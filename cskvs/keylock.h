@@ -0,0 +1,60 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef __KEYLOCK_H__
+#define __KEYLOCK_H__
+
+#include <stddef.h>
+
+// Striped locks for read-modify-write of single keys. A key hashes to one of
+// KEYLOCK_STRIPES mutexes, writers that need to see their own read take it
+// around the read and the write. Holders of several stripes take them in
+// ascending order.
+//
+// Each stripe also holds the counters accumulated in memory for its keys,
+// only touched with the stripe locked: the current value of a counter whose
+// write to leveldb is still outstanding, plus the ttl to write it with.
+
+#define KEYLOCK_STRIPES 1024
+
+struct keylock;
+
+typedef void (*keylock_flush_cb)(void *arg, const char *key, size_t klen, long long val, long ttl);
+
+struct keylock *keylock_new(void);
+void keylock_free(struct keylock *kl);
+
+int keylock_stripe(struct keylock *kl, const char *key, size_t klen);
+void keylock_lock(struct keylock *kl, int stripe);
+void keylock_unlock(struct keylock *kl, int stripe);
+
+// 1 and the value if the key has a counter pending
+int keylock_pending(struct keylock *kl, int stripe, const char *key, size_t klen, long long *val);
+int keylock_setpending(struct keylock *kl, int stripe, const char *key, size_t klen, long long val, long ttl);
+void keylock_droppending(struct keylock *kl, int stripe, const char *key, size_t klen);
+// hands every pending counter of the stripe to cb and forgets them, returns
+// how many there were
+size_t keylock_flush(struct keylock *kl, int stripe, keylock_flush_cb cb, void *arg);
+// pending counters over all stripes, without locking, for stats and to skip
+// idle flushes
+size_t keylock_npending(struct keylock *kl);
+
+#endif // __KEYLOCK_H__
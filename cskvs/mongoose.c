@@ -23,6 +23,7 @@
 #else
 #ifdef __linux__
 #define _XOPEN_SOURCE 600     // For flockfile() on Linux
+#define _GNU_SOURCE           // For CPU_SET() and pthread_setaffinity_np()
 #endif
 #define _LARGEFILE_SOURCE     // Enable 64-bit file offsets
 #define __STDC_FORMAT_MACROS  // <inttypes.h> wants this for C++
@@ -176,6 +177,8 @@ typedef struct DIR {
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
@@ -190,6 +193,9 @@ typedef struct DIR {
 #include <dlfcn.h>
 #endif
 #include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -279,6 +285,12 @@ typedef int socklen_t;
 
 static const char *http_500_error = "Internal Server Error";
 
+#if defined(NO_SSL_DL)
+// Linked against the system OpenSSL: use its headers, which also give us
+// session cache, ticket key and kernel TLS controls.
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#else
 // Snatched from OpenSSL includes. I put the prototypes here to be independent
 // from the OpenSSL source installation. Having this, mongoose + SSL can be
 // built on any system with binary SSL libraries installed.
@@ -291,31 +303,6 @@ typedef struct ssl_ctx_st SSL_CTX;
 #define SSL_FILETYPE_PEM 1
 #define CRYPTO_LOCK  1
 
-#if defined(NO_SSL_DL)
-extern void SSL_free(SSL *);
-extern int SSL_accept(SSL *);
-extern int SSL_connect(SSL *);
-extern int SSL_read(SSL *, void *, int);
-extern int SSL_write(SSL *, const void *, int);
-extern int SSL_get_error(const SSL *, int);
-extern int SSL_set_fd(SSL *, int);
-extern SSL *SSL_new(SSL_CTX *);
-extern SSL_CTX *SSL_CTX_new(SSL_METHOD *);
-extern SSL_METHOD *SSLv23_server_method(void);
-extern SSL_METHOD *SSLv23_client_method(void);
-extern int SSL_library_init(void);
-extern void SSL_load_error_strings(void);
-extern int SSL_CTX_use_PrivateKey_file(SSL_CTX *, const char *, int);
-extern int SSL_CTX_use_certificate_file(SSL_CTX *, const char *, int);
-extern int SSL_CTX_use_certificate_chain_file(SSL_CTX *, const char *);
-extern void SSL_CTX_set_default_passwd_cb(SSL_CTX *, mg_callback_t);
-extern void SSL_CTX_free(SSL_CTX *);
-extern unsigned long ERR_get_error(void);
-extern char *ERR_error_string(unsigned long, char *);
-extern int CRYPTO_num_locks(void);
-extern void CRYPTO_set_locking_callback(void (*)(int, int, const char *, int));
-extern void CRYPTO_set_id_callback(unsigned long (*)(void));
-#else
 // Dynamically loaded SSL functionality
 struct ssl_func {
   const char *name;   // SSL function name
@@ -344,6 +331,7 @@ struct ssl_func {
 #define SSL_CTX_use_certificate_chain_file \
   (* (int (*)(SSL_CTX *, const char *)) ssl_sw[16].ptr)
 #define SSLv23_client_method (* (SSL_METHOD * (*)(void)) ssl_sw[17].ptr)
+#define SSL_shutdown (* (int (*)(SSL *)) ssl_sw[18].ptr)
 
 #define CRYPTO_num_locks (* (int (*)(void)) crypto_sw[0].ptr)
 #define CRYPTO_set_locking_callback \
@@ -376,6 +364,7 @@ static struct ssl_func ssl_sw[] = {
   {"SSL_load_error_strings", NULL},
   {"SSL_CTX_use_certificate_chain_file", NULL},
   {"SSLv23_client_method", NULL},
+  {"SSL_shutdown", NULL},
   {NULL,    NULL}
 };
 
@@ -392,6 +381,12 @@ static struct ssl_func crypto_sw[] = {
 #endif // NO_SSL
 #endif // NO_SSL_DL
 
+// OpenSSL 1.1 and newer do their own locking
+#if !defined(NO_SSL) && \
+  (!defined(NO_SSL_DL) || OPENSSL_VERSION_NUMBER < 0x10100000L)
+#define SSL_NEEDS_LOCKS
+#endif
+
 static const char *month_names[] = {
   "Jan", "Feb", "Mar", "Apr", "May", "Jun",
   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
@@ -405,6 +400,9 @@ union usa {
 #if defined(USE_IPV6)
   struct sockaddr_in6 sin6;
 #endif
+#if !defined(_WIN32)
+  struct sockaddr_un un;
+#endif
 };
 
 // Describes a string (chunk of memory).
@@ -430,28 +428,43 @@ struct socket {
   union usa lsa;        // Local socket address
   union usa rsa;        // Remote socket address
   int is_ssl;           // Is socket SSL-ed
+  int is_raw;           // From raw_listening_ports, see MG_RAW_CONNECTION
+  double accept_time;   // When accept() returned, 0 once a request used it
+  void *parked_state;   // What mg_park() was given, NULL for a new connection
+  int parked_index;     // Slot in the master's poll set, -1 if not in it yet
 };
 
 // NOTE(lsm): this enum shoulds be in sync with the config_options below.
 enum {
+  ACCEPTOR_CPUS,
   CGI_EXTENSIONS, CGI_ENVIRONMENT, PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER,
-  PROTECT_URI, AUTHENTICATION_DOMAIN, SSI_EXTENSIONS, THROTTLE,
+  ENABLE_H2C, SSL_KTLS, PROTECT_URI, AUTHENTICATION_DOMAIN, SSI_EXTENSIONS, THROTTLE,
+  UNIX_ACCESS_CONTROL_LIST, WORKER_CPUS, SSL_TICKET_KEY_FILE,
+  SSL_SESSION_CACHE_SIZE,
   ACCESS_LOG_FILE, ENABLE_DIRECTORY_LISTING, ERROR_LOG_FILE,
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
-  EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
+  EXTRA_MIME_TYPES, LISTENING_PORTS, RAW_LISTENING_PORTS, DOCUMENT_ROOT,
+  SSL_CERTIFICATE,
   NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES,
   NUM_OPTIONS
 };
 
 static const char *config_options[] = {
+  "A", "acceptor_cpus", NULL,
   "C", "cgi_pattern", "**.cgi$|**.pl$|**.php$",
   "E", "cgi_environment", NULL,
   "G", "put_delete_passwords_file", NULL,
   "I", "cgi_interpreter", NULL,
+  "H", "enable_h2c", "yes",
+  "K", "ssl_ktls", "yes",
   "P", "protect_uri", NULL,
   "R", "authentication_domain", "mydomain.com",
   "S", "ssi_pattern", "**.shtml$|**.shtm$",
   "T", "throttle", NULL,
+  "U", "unix_access_control_list", NULL,
+  "W", "worker_cpus", NULL,
+  "Y", "ssl_ticket_key_file", NULL,
+  "Z", "ssl_session_cache_size", "20480",
   "a", "access_log_file", NULL,
   "d", "enable_directory_listing", "yes",
   "e", "error_log_file", NULL,
@@ -461,6 +474,7 @@ static const char *config_options[] = {
   "l", "access_control_list", NULL,
   "m", "extra_mime_types", NULL,
   "p", "listening_ports", "8080",
+  "q", "raw_listening_ports", NULL,
   "r", "document_root",  ".",
   "s", "ssl_certificate", NULL,
   "t", "num_threads", "20",
@@ -473,6 +487,7 @@ static const char *config_options[] = {
 
 struct mg_context {
   volatile int stop_flag;       // Should we stop event loop
+  volatile int drain_flag;      // Stop accepting, finish what we have
   SSL_CTX *ssl_ctx;             // SSL context
   SSL_CTX *client_ssl_ctx;      // Client SSL context
   char *config[NUM_OPTIONS];    // Mongoose configuration parameters
@@ -482,6 +497,7 @@ struct mg_context {
   struct socket *listening_sockets;
 
   volatile int num_threads;  // Number of threads
+  volatile int target_threads;  // Number of threads wanted, see mg_set_num_threads()
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
@@ -490,6 +506,20 @@ struct mg_context {
   volatile int sq_tail;      // Tail of the socket queue
   pthread_cond_t sq_full;    // Signaled when socket is produced
   pthread_cond_t sq_empty;   // Signaled when socket is consumed
+
+  struct socket *parked;     // Raw connections idle in mg_park(), see mutex
+  int park_pipe[2];          // Wakes the master up to poll a parked one too
+
+  struct h2_stream *tasks;   // HTTP/2 streams for idle workers, see h2_start()
+  struct h2_stream *tasks_tail;
+  int num_tasks;
+  int num_idle;              // Workers waiting in consume_socket()
+};
+
+// Growable buffer, always NUL-terminated
+struct h2_buf {
+  char *buf;
+  int64_t len, size;
 };
 
 struct mg_connection {
@@ -504,6 +534,7 @@ struct mg_connection {
   char *buf;                  // Buffer for received data
   char *path_info;            // PATH_INFO part of the URL
   int must_close;             // 1 if connection must be closed
+  int ktls_send;              // 1 if kernel encrypts writes, bypass SSL
   int buf_size;               // Buffer size
   int request_len;            // Size of the request + headers in a buffer
   int data_len;               // Total size of data in a buffer
@@ -511,6 +542,10 @@ struct mg_connection {
   int throttle;               // Throttling, bytes/sec. <= 0 means no throttle
   time_t last_throttle_time;  // Last time throttled data was sent
   int64_t last_throttle_bytes;// Bytes sent this second
+  struct h2_stream *h2;       // HTTP/2 stream this pseudo connection runs
+  int idle;                   // Waiting for the peer: HTTP/2 with no open
+                              // streams, or a raw connection in mg_recv()
+  int closing;                // Draining the peer's data before close
 };
 
 const char **mg_get_valid_option_names(void) {
@@ -897,6 +932,7 @@ static int should_keep_alive(const struct mg_connection *conn) {
   const char *http_version = conn->request_info.http_version;
   const char *header = mg_get_header(conn, "Connection");
   if (conn->must_close ||
+      conn->ctx->drain_flag ||
       conn->status_code == 401 ||
       mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") != 0 ||
       (header != NULL && mg_strcasecmp(header, "keep-alive") != 0) ||
@@ -1443,7 +1479,7 @@ static int64_t push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf,
 // If it is set, we return 0, and this means that we must not continue
 // reading, must give up and close the connection and exit serving thread.
 static int wait_until_socket_is_readable(struct mg_connection *conn) {
-  int result;
+  int result, waits = 0;
   struct timeval tv;
   fd_set set;
 
@@ -1454,9 +1490,12 @@ static int wait_until_socket_is_readable(struct mg_connection *conn) {
     FD_SET(conn->client.sock, &set);
     result = select(conn->client.sock + 1, &set, NULL, NULL, &tv);
   } while ((result == 0 || (result < 0 && ERRNO == EINTR)) &&
-           conn->ctx->stop_flag == 0);
+           conn->ctx->stop_flag == 0 &&
+           !(conn->idle && conn->ctx->drain_flag) &&
+           // A peer that never closes its end must not keep the thread
+           !(conn->closing && ++waits >= 4));
 
-  return conn->ctx->stop_flag || result < 0 ? 0 : 1;
+  return conn->ctx->stop_flag || result <= 0 ? 0 : 1;
 }
 
 // Read from IO channel - opened file descriptor, socket, or SSL descriptor.
@@ -1525,9 +1564,86 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len) {
   return nread;
 }
 
+int mg_recv(struct mg_connection *conn, void *buf, size_t len) {
+  int n;
+
+  conn->idle = 1;
+  n = pull(NULL, conn, (char *) buf, (int) len);
+  conn->idle = 0;
+
+  return n;
+}
+
+int mg_park(struct mg_connection *conn, void *state) {
+#if defined(_WIN32)
+  (void) conn;
+  (void) state;
+  return 0;
+#else
+  struct mg_context *ctx = conn->ctx;
+  struct socket *sp;
+
+  if (!conn->client.is_raw || conn->ssl != NULL ||
+      (sp = (struct socket *) malloc(sizeof(*sp))) == NULL) {
+    return 0;
+  }
+  *sp = conn->client;
+  sp->parked_state = state;
+  sp->parked_index = -1;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  // Nobody polls parked connections once the master is on its way out
+  if (ctx->stop_flag || ctx->drain_flag) {
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    free(sp);
+    return 0;
+  }
+  sp->next = ctx->parked;
+  ctx->parked = sp;
+  // The worker must not close it, it belongs to the parked list now
+  conn->client.sock = INVALID_SOCKET;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  (void) write(ctx->park_pipe[1], "", 1);
+
+  return 1;
+#endif // _WIN32
+}
+
+void *mg_get_parked(struct mg_connection *conn) {
+  return conn->client.parked_state;
+}
+
+static int h2_append(struct h2_buf *b, const void *data, int64_t len) {
+  int64_t size = b->size > 0 ? b->size : 1024;
+  char *p;
+
+  while (size < b->len + len + 1) {
+    size *= 2;
+  }
+  if (size != b->size) {
+    if ((p = (char *) realloc(b->buf, (size_t) size)) == NULL) {
+      return 0;
+    }
+    b->buf = p;
+    b->size = size;
+  }
+  memcpy(b->buf + b->len, data, (size_t) len);
+  b->len += len;
+  b->buf[b->len] = '\0';
+
+  return 1;
+}
+
+static int h2_write(struct mg_connection *conn, const void *buf, size_t len);
+
 int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
   time_t now;
   int64_t n, total, allowed;
+  SSL *ssl = conn->ktls_send ? NULL : conn->ssl;
+
+  if (conn->h2 != NULL) {
+    return h2_write(conn, buf, len);
+  }
 
   if (conn->throttle > 0) {
     if ((now = time(NULL)) != conn->last_throttle_time) {
@@ -1538,14 +1654,14 @@ int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
     if (allowed > (int64_t) len) {
       allowed = len;
     }
-    if ((total = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
+    if ((total = push(NULL, conn->client.sock, ssl, (const char *) buf,
                       (int64_t) allowed)) == allowed) {
       buf = (char *) buf + total;
       conn->last_throttle_bytes += total;
       while (total < (int64_t) len && conn->ctx->stop_flag == 0) {
         allowed = conn->throttle > (int64_t) len - total ?
           (int64_t) len - total : conn->throttle;
-        if ((n = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
+        if ((n = push(NULL, conn->client.sock, ssl, (const char *) buf,
                       (int64_t) allowed)) != allowed) {
           break;
         }
@@ -1557,12 +1673,16 @@ int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
       }
     }
   } else {
-    total = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
+    total = push(NULL, conn->client.sock, ssl, (const char *) buf,
                  (int64_t) len);
   }
   return (int) total;
 }
 
+void mg_must_close(struct mg_connection *conn) {
+  conn->must_close = 1;
+}
+
 int mg_printf(struct mg_connection *conn, const char *fmt, ...) {
   char mem[MG_BUF_LEN], *buf = mem;
   int len;
@@ -1762,9 +1882,17 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
 }
 
 static int sslize(struct mg_connection *conn, SSL_CTX *s, int (*func)(SSL *)) {
-  return (conn->ssl = SSL_new(s)) != NULL &&
-    SSL_set_fd(conn->ssl, conn->client.sock) == 1 &&
-    func(conn->ssl) == 1;
+  if ((conn->ssl = SSL_new(s)) == NULL ||
+      SSL_set_fd(conn->ssl, conn->client.sock) != 1 ||
+      func(conn->ssl) != 1) {
+    return 0;
+  }
+#if defined(BIO_get_ktls_send)
+  // Once the kernel has the keys, the socket encrypts by itself and
+  // push() can send() straight to it.
+  conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) > 0;
+#endif
+  return 1;
 }
 
 // Check whether full request is buffered. Return:
@@ -4121,20 +4249,95 @@ static void close_all_listening_sockets(struct mg_context *ctx) {
   for (sp = ctx->listening_sockets; sp != NULL; sp = tmp) {
     tmp = sp->next;
     (void) closesocket(sp->sock);
+#if !defined(_WIN32)
+    // When draining, the socket lives on in the process we handed it to
+    if (sp->lsa.sa.sa_family == AF_UNIX && !ctx->drain_flag) {
+      (void) unlink(sp->lsa.un.sun_path);
+    }
+#endif
     free(sp);
   }
 }
 
-// Valid listening port specification is: [ip_address:]port[s]
-// Examples: 80, 443s, 127.0.0.1:3128, 1.2.3.4:8080s
+// Length of the address actually stored in the union. Linux refuses to
+// bind() a Unix socket with a length larger than struct sockaddr_un.
+static socklen_t usa_len(const union usa *usa) {
+#if !defined(_WIN32)
+  if (usa->sa.sa_family == AF_UNIX) {
+    return sizeof(usa->un);
+  }
+#endif
+  return sizeof(*usa);
+}
+
+#if !defined(_WIN32)
+// Remove Unix socket file left behind by a previous run. If something is
+// still accepting connections on that path, or the path is not a socket at
+// all, leave it alone and fail.
+static int remove_stale_socket(const union usa *usa) {
+  struct stat st;
+  SOCKET sock;
+  int in_use;
+
+  if (usa->sa.sa_family != AF_UNIX ||
+      lstat(usa->un.sun_path, &st) != 0) {
+    return 0;
+  } else if (!S_ISSOCK(st.st_mode)) {
+    errno = EEXIST;
+    return -1;
+  } else if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+    return -1;
+  }
+  in_use = connect(sock, &usa->sa, usa_len(usa)) == 0;
+  (void) closesocket(sock);
+  if (in_use) {
+    errno = EADDRINUSE;
+    return -1;
+  }
+  (void) unlink(usa->un.sun_path);
+
+  return 0;
+}
+#else
+static int remove_stale_socket(const union usa *usa) {
+  (void) usa;
+  return 0;
+}
+#endif // !_WIN32
+
+// Valid listening port specification is: [ip_address:]port[s], unix:path
+// or fd:N[s] for an already listening socket inherited from another process.
+// Examples: 80, 443s, 127.0.0.1:3128, 1.2.3.4:8080s, unix:/run/cskvs.sock, fd:3
 // TODO(lsm): add parsing of the IPv6 address
 static int parse_port_string(const struct vec *vec, struct socket *so) {
   int a, b, c, d, port, len;
+  socklen_t slen;
 
   // MacOS needs that. If we do not zero it, subsequent bind() will fail.
   // Also, all-zeroes in the socket address means binding to all addresses
   // for both IPv4 and IPv6 (INADDR_ANY and IN6ADDR_ANY_INIT).
   memset(so, 0, sizeof(*so));
+  so->sock = INVALID_SOCKET;
+
+#if !defined(_WIN32)
+  if (sscanf(vec->ptr, "fd:%d%n", &a, &len) == 1 && a >= 0 &&
+      len <= (int) vec->len &&
+      (len == (int) vec->len || vec->ptr[len] == 's')) {
+    slen = sizeof(so->lsa);
+    so->sock = a;
+    so->is_ssl = len < (int) vec->len;
+    return getsockname(so->sock, &so->lsa.sa, &slen) == 0;
+  }
+  if (vec->len > 5 && !strncmp(vec->ptr, "unix:", 5)) {
+    len = (int) vec->len - 5;
+    if (len >= (int) sizeof(so->lsa.un.sun_path)) {
+      return 0;
+    }
+    so->lsa.un.sun_family = AF_UNIX;
+    memcpy(so->lsa.un.sun_path, vec->ptr + 5, (size_t) len);
+    return 1;
+  }
+#endif // !_WIN32
 
   if (sscanf(vec->ptr, "%d.%d.%d.%d:%d%n", &a, &b, &c, &d, &port, &len) == 5) {
     // Bind to a specific IPv4 address
@@ -4158,56 +4361,72 @@ static int parse_port_string(const struct vec *vec, struct socket *so) {
   return 1;
 }
 
+// Both lists take the same specs, raw_listening_ports ones skip HTTP and
+// hand their connections to the MG_RAW_CONNECTION callback instead.
 static int set_ports_option(struct mg_context *ctx) {
-  const char *list = ctx->config[LISTENING_PORTS];
-  int on = 1, success = 1;
-  SOCKET sock;
+  const char *list;
+  int on = 1, success = 1, raw;
   struct vec vec;
   struct socket so, *listener;
 
-  while (success && (list = next_option(list, &vec, NULL)) != NULL) {
-    if (!parse_port_string(&vec, &so)) {
-      cry(fc(ctx), "%s: %.*s: invalid port spec. Expecting list of: %s",
-          __func__, (int) vec.len, vec.ptr, "[IP_ADDRESS:]PORT[s|p]");
-      success = 0;
-    } else if (so.is_ssl &&
-               (ctx->ssl_ctx == NULL || ctx->config[SSL_CERTIFICATE] == NULL)) {
-      cry(fc(ctx), "Cannot add SSL socket, is -ssl_certificate option set?");
-      success = 0;
-    } else if ((sock = socket(so.lsa.sa.sa_family, SOCK_STREAM, 6)) ==
-               INVALID_SOCKET ||
-               // On Windows, SO_REUSEADDR is recommended only for
-               // broadcast UDP sockets
-               setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on,
-                          sizeof(on)) != 0 ||
-               // Set TCP keep-alive. This is needed because if HTTP-level
-               // keep-alive is enabled, and client resets the connection,
-               // server won't get TCP FIN or RST and will keep the connection
-               // open forever. With TCP keep-alive, next keep-alive
-               // handshake will figure out that the client is down and
-               // will close the server end.
-               // Thanks to Igor Klopov who suggested the patch.
-               setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (char *) &on,
-                          sizeof(on)) != 0 ||
-               bind(sock, &so.lsa.sa, sizeof(so.lsa)) != 0 ||
-               listen(sock, SOMAXCONN) != 0) {
-      closesocket(sock);
-      cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
-          (int) vec.len, vec.ptr, strerror(ERRNO));
-      success = 0;
-    } else if ((listener = (struct socket *)
-                calloc(1, sizeof(*listener))) == NULL) {
-      // NOTE(lsm): order is important: call cry before closesocket(),
-      // cause closesocket() alters the errno.
-      cry(fc(ctx), "%s: %s", __func__, strerror(ERRNO));
-      closesocket(sock);
-      success = 0;
-    } else {
-      *listener = so;
-      listener->sock = sock;
-      set_close_on_exec(listener->sock);
-      listener->next = ctx->listening_sockets;
-      ctx->listening_sockets = listener;
+  for (raw = 0; raw < 2 && success; raw++) {
+    list = ctx->config[raw ? RAW_LISTENING_PORTS : LISTENING_PORTS];
+    while (success && (list = next_option(list, &vec, NULL)) != NULL) {
+      if (!parse_port_string(&vec, &so)) {
+        cry(fc(ctx), "%s: %.*s: invalid port spec. Expecting list of: %s",
+            __func__, (int) vec.len, vec.ptr,
+            "[IP_ADDRESS:]PORT[s|p], unix:PATH or fd:N[s]");
+        success = 0;
+      } else if (raw && so.is_ssl) {
+        cry(fc(ctx), "%s: %.*s: raw sockets cannot be SSL", __func__,
+            (int) vec.len, vec.ptr);
+        success = 0;
+      } else if (so.is_ssl &&
+                 (ctx->ssl_ctx == NULL || ctx->config[SSL_CERTIFICATE] == NULL)) {
+        cry(fc(ctx), "Cannot add SSL socket, is -ssl_certificate option set?");
+        success = 0;
+      } else if (so.sock == INVALID_SOCKET &&
+                 remove_stale_socket(&so.lsa) != 0) {
+        cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
+            (int) vec.len, vec.ptr, strerror(ERRNO));
+        success = 0;
+      } else if (so.sock == INVALID_SOCKET &&
+                 ((so.sock = socket(so.lsa.sa.sa_family, SOCK_STREAM,
+                                   so.lsa.sa.sa_family == AF_UNIX ? 0 : 6)) ==
+                 INVALID_SOCKET ||
+                 // On Windows, SO_REUSEADDR is recommended only for
+                 // broadcast UDP sockets
+                 setsockopt(so.sock, SOL_SOCKET, SO_REUSEADDR,
+                            (const char *) &on, sizeof(on)) != 0 ||
+                 // Set TCP keep-alive. This is needed because if HTTP-level
+                 // keep-alive is enabled, and client resets the connection,
+                 // server won't get TCP FIN or RST and will keep the connection
+                 // open forever. With TCP keep-alive, next keep-alive
+                 // handshake will figure out that the client is down and
+                 // will close the server end.
+                 // Thanks to Igor Klopov who suggested the patch.
+                 setsockopt(so.sock, SOL_SOCKET, SO_KEEPALIVE, (char *) &on,
+                            sizeof(on)) != 0 ||
+                 bind(so.sock, &so.lsa.sa, usa_len(&so.lsa)) != 0 ||
+                 listen(so.sock, SOMAXCONN) != 0)) {
+        closesocket(so.sock);
+        cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
+            (int) vec.len, vec.ptr, strerror(ERRNO));
+        success = 0;
+      } else if ((listener = (struct socket *)
+                  calloc(1, sizeof(*listener))) == NULL) {
+        // NOTE(lsm): order is important: call cry before closesocket(),
+        // cause closesocket() alters the errno.
+        cry(fc(ctx), "%s: %s", __func__, strerror(ERRNO));
+        closesocket(so.sock);
+        success = 0;
+      } else {
+        *listener = so;
+        listener->is_raw = raw;
+        set_close_on_exec(listener->sock);
+        listener->next = ctx->listening_sockets;
+        ctx->listening_sockets = listener;
+      }
     }
   }
 
@@ -4263,11 +4482,11 @@ static void log_access(const struct mg_connection *conn) {
 
 // Verify given socket address against the ACL.
 // Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
-static int check_acl(struct mg_context *ctx, uint32_t remote_ip) {
+static int check_acl_list(struct mg_context *ctx, const char *list,
+                          uint32_t remote_ip) {
   int allowed, flag;
   uint32_t net, mask;
   struct vec vec;
-  const char *list = ctx->config[ACCESS_CONTROL_LIST];
 
   // If any ACL is set, deny by default
   allowed = list == NULL ? '+' : '-';
@@ -4288,12 +4507,103 @@ static int check_acl(struct mg_context *ctx, uint32_t remote_ip) {
   return allowed == '+';
 }
 
+static int check_acl(struct mg_context *ctx, uint32_t remote_ip) {
+  return check_acl_list(ctx, ctx->config[ACCESS_CONTROL_LIST], remote_ip);
+}
+
+int mg_check_acl(struct mg_connection *conn, const char *list) {
+  uint32_t remote_ip;
+
+  // Unix socket peers were checked against their credentials on accept
+  if (conn->client.rsa.sa.sa_family == AF_UNIX) {
+    return 1;
+  }
+  remote_ip = ntohl(* (uint32_t *) &conn->client.rsa.sin.sin_addr);
+  if (list == NULL) {
+    return (remote_ip >> 24) == 127;
+  }
+  return check_acl_list(conn->ctx, list, remote_ip);
+}
+
+// Verify credentials of the process on the other end of a Unix socket
+// against the unix_access_control_list, e.g. "+uid:1000,+gid:33,-uid:0".
+// Return -1 if ACL is malformed, 0 if peer is disallowed, 1 if allowed.
+static int check_peer_acl(struct mg_context *ctx, unsigned long uid,
+                          unsigned long gid) {
+  int allowed, flag, n;
+  unsigned long id;
+  struct vec vec;
+  const char *list = ctx->config[UNIX_ACCESS_CONTROL_LIST];
+
+  // If any ACL is set, deny by default
+  allowed = list == NULL ? '+' : '-';
+
+  while ((list = next_option(list, &vec, NULL)) != NULL) {
+    flag = vec.ptr[0];
+    n = 0;
+    if (flag != '+' && flag != '-') {
+      // Malformed, reported below
+    } else if (vec.len == 2 && vec.ptr[1] == '*') {
+      allowed = flag;
+      n = 1;
+    } else if (sscanf(&vec.ptr[1], "uid:%lu%n", &id, &n) == 1 &&
+               isdigit(* (const unsigned char *) &vec.ptr[5])) {
+      allowed = id == uid ? flag : allowed;
+    } else if (sscanf(&vec.ptr[1], "gid:%lu%n", &id, &n) == 1 &&
+               isdigit(* (const unsigned char *) &vec.ptr[5])) {
+      allowed = id == gid ? flag : allowed;
+    } else {
+      n = 0;
+    }
+    // The id must run up to the end of the entry, e.g. no "+uid:1x"
+    if (n == 0 || n + 1 != (int) vec.len) {
+      cry(fc(ctx), "%s: entry must be [+|-]uid:N, [+|-]gid:N or [+|-]*",
+          __func__);
+      return -1;
+    }
+  }
+
+  return allowed == '+';
+}
+
+// Fetch credentials of the peer process connected to a Unix socket.
+// Return 0 if they are not available.
+static int get_peer_credentials(SOCKET sock, unsigned long *uid,
+                                unsigned long *gid) {
+#if defined(SO_PEERCRED)
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+    return 0;
+  }
+  *uid = cred.uid;
+  *gid = cred.gid;
+  return 1;
+#elif !defined(_WIN32)
+  uid_t u;
+  gid_t g;
+
+  if (getpeereid(sock, &u, &g) != 0) {
+    return 0;
+  }
+  *uid = u;
+  *gid = g;
+  return 1;
+#else
+  (void) sock; (void) uid; (void) gid;
+  return 0;
+#endif
+}
+
+#if defined(_WIN32)
 static void add_to_set(SOCKET fd, fd_set *set, int *max_fd) {
   FD_SET(fd, set);
   if (fd > (SOCKET) *max_fd) {
     *max_fd = (int) fd;
   }
 }
+#endif // _WIN32
 
 #if !defined(_WIN32)
 static int set_uid_option(struct mg_context *ctx) {
@@ -4320,8 +4630,6 @@ static int set_uid_option(struct mg_context *ctx) {
 #endif // !_WIN32
 
 #if !defined(NO_SSL)
-static pthread_mutex_t *ssl_mutexes;
-
 // Return OpenSSL error message
 static const char *ssl_error(void) {
   unsigned long err;
@@ -4329,6 +4637,9 @@ static const char *ssl_error(void) {
   return err == 0 ? "" : ERR_error_string(err, NULL);
 }
 
+#if defined(SSL_NEEDS_LOCKS)
+static pthread_mutex_t *ssl_mutexes;
+
 static void ssl_locking_callback(int mode, int mutex_num, const char *file,
                                  int line) {
   line = 0;    // Unused
@@ -4344,6 +4655,7 @@ static void ssl_locking_callback(int mode, int mutex_num, const char *file,
 static unsigned long ssl_id_callback(void) {
   return (unsigned long) pthread_self();
 }
+#endif // SSL_NEEDS_LOCKS
 
 #if !defined(NO_SSL_DL)
 static int load_dll(struct mg_context *ctx, const char *dll_name,
@@ -4378,10 +4690,63 @@ static int load_dll(struct mg_context *ctx, const char *dll_name,
 }
 #endif // NO_SSL_DL
 
+// Set up session resumption and kernel TLS on the server context. All
+// workers share one SSL_CTX, so its session cache is shared by all of
+// them. Ticket keys are random per process, unless loaded from
+// ssl_ticket_key_file, so several processes (or a restarted one) can
+// resume each other's sessions.
+static int set_ssl_session_options(struct mg_context *ctx) {
+#if defined(NO_SSL_DL)
+  unsigned char keys[80];
+  const char *path = ctx->config[SSL_TICKET_KEY_FILE];
+  FILE *fp;
+  int ok;
+
+  SSL_CTX_set_session_cache_mode(ctx->ssl_ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx->ssl_ctx,
+                              atol(ctx->config[SSL_SESSION_CACHE_SIZE]));
+  SSL_CTX_set_session_id_context(ctx->ssl_ctx,
+                                 (const unsigned char *) "mongoose", 8);
+
+  if (path != NULL) {
+    // 16 bytes key name, 32 bytes HMAC secret, 32 bytes AES key
+    if ((fp = fopen(path, "rb")) == NULL) {
+      cry(fc(ctx), "%s: cannot open %s: %s", __func__, path, strerror(ERRNO));
+      return 0;
+    }
+    ok = fread(keys, 1, sizeof(keys), fp) == sizeof(keys);
+    (void) fclose(fp);
+    if (!ok || SSL_CTX_set_tlsext_ticket_keys(ctx->ssl_ctx, keys,
+                                              sizeof(keys)) != 1) {
+      cry(fc(ctx), "%s: %s: need %d bytes of ticket key", __func__, path,
+          (int) sizeof(keys));
+      return 0;
+    }
+    memset(keys, 0, sizeof(keys));
+  }
+
+#if defined(SSL_OP_ENABLE_KTLS)
+  if (!strcmp(ctx->config[SSL_KTLS], "yes")) {
+    SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_ENABLE_KTLS);
+  }
+#endif
+#else
+  if (ctx->config[SSL_TICKET_KEY_FILE] != NULL) {
+    cry(fc(ctx), "%s: ssl_ticket_key_file needs mongoose built with NO_SSL_DL",
+        __func__);
+    return 0;
+  }
+#endif // NO_SSL_DL
+
+  return 1;
+}
+
 // Dynamically load SSL library. Set up ctx->ssl_ctx pointer.
 static int set_ssl_option(struct mg_context *ctx) {
   struct mg_connection *conn;
+#if defined(SSL_NEEDS_LOCKS)
   int i, size;
+#endif
   const char *pem;
 
   // If PEM file is not specified, skip SSL initialization.
@@ -4424,6 +4789,11 @@ static int set_ssl_option(struct mg_context *ctx) {
     (void) SSL_CTX_use_certificate_chain_file(ctx->ssl_ctx, pem);
   }
 
+  if (!set_ssl_session_options(ctx)) {
+    return 0;
+  }
+
+#if defined(SSL_NEEDS_LOCKS)
   // Initialize locking callbacks, needed for thread safety.
   // http://www.openssl.org/support/faq.html#PROG1
   size = sizeof(pthread_mutex_t) * CRYPTO_num_locks();
@@ -4438,11 +4808,13 @@ static int set_ssl_option(struct mg_context *ctx) {
 
   CRYPTO_set_locking_callback(&ssl_locking_callback);
   CRYPTO_set_id_callback(&ssl_id_callback);
+#endif // SSL_NEEDS_LOCKS
 
   return 1;
 }
 
 static void uninitialize_ssl(struct mg_context *ctx) {
+#if defined(SSL_NEEDS_LOCKS)
   int i;
   if (ctx->ssl_ctx != NULL) {
     CRYPTO_set_locking_callback(NULL);
@@ -4452,6 +4824,9 @@ static void uninitialize_ssl(struct mg_context *ctx) {
     CRYPTO_set_locking_callback(NULL);
     CRYPTO_set_id_callback(NULL);
   }
+#else
+  (void) ctx;
+#endif // SSL_NEEDS_LOCKS
 }
 #endif // !NO_SSL
 
@@ -4462,7 +4837,100 @@ static int set_gpass_option(struct mg_context *ctx) {
 }
 
 static int set_acl_option(struct mg_context *ctx) {
-  return check_acl(ctx, (uint32_t) 0x7f000001UL) != -1;
+  return check_acl(ctx, (uint32_t) 0x7f000001UL) != -1 &&
+    check_peer_acl(ctx, 0, 0) != -1;
+}
+
+#if defined(__linux__)
+// Parse CPU list, e.g. "0-3,8,10-11", into the given CPU set.
+// Return 0 if the list is malformed or selects no CPUs.
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+  int a, b, n;
+
+  CPU_ZERO(set);
+  while (*list != '\0') {
+    if (sscanf(list, "%d%n", &a, &n) != 1 || a < 0) {
+      return 0;
+    }
+    list += n;
+    b = a;
+    if (*list == '-') {
+      if (sscanf(++list, "%d%n", &b, &n) != 1 || b < a) {
+        return 0;
+      }
+      list += n;
+    }
+    for (; a <= b && a < CPU_SETSIZE; a++) {
+      CPU_SET(a, set);
+    }
+    if (*list == ',') {
+      list++;
+    } else if (*list != '\0') {
+      return 0;
+    }
+  }
+
+  return CPU_COUNT(set) > 0;
+}
+
+int mg_pin_thread(const char *cpu_list) {
+  cpu_set_t set;
+
+  return parse_cpu_list(cpu_list, &set) &&
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Pin the calling thread to the CPUs given by the configuration option.
+// Worker threads call this before allocating their connection buffer, so
+// with the kernel's first-touch policy that memory lands on the local node.
+static void set_thread_affinity(struct mg_context *ctx, int option) {
+  if (ctx->config[option] != NULL && !mg_pin_thread(ctx->config[option])) {
+    cry(fc(ctx), "%s: cannot pin to CPUs [%s]: %s", __func__,
+        ctx->config[option], strerror(ERRNO));
+  }
+}
+
+static int set_affinity_options(struct mg_context *ctx) {
+  static const int options[] = {ACCEPTOR_CPUS, WORKER_CPUS};
+  cpu_set_t set;
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(options); i++) {
+    if (ctx->config[options[i]] != NULL &&
+        !parse_cpu_list(ctx->config[options[i]], &set)) {
+      cry(fc(ctx), "%s: %s: invalid CPU list [%s]", __func__,
+          config_options[options[i] * ENTRIES_PER_CONFIG_OPTION + 1],
+          ctx->config[options[i]]);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+#else
+int mg_pin_thread(const char *cpu_list) {
+  (void) cpu_list;
+  return 0;
+}
+
+static void set_thread_affinity(struct mg_context *ctx, int option) {
+  (void) ctx;
+  (void) option;
+}
+
+static int set_affinity_options(struct mg_context *ctx) {
+  if (ctx->config[ACCEPTOR_CPUS] != NULL || ctx->config[WORKER_CPUS] != NULL) {
+    cry(fc(ctx), "%s: CPU affinity is not supported", __func__);
+  }
+  return 1;
+}
+#endif // __linux__
+
+static double now_seconds(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
 static void reset_per_request_attributes(struct mg_connection *conn) {
@@ -4486,6 +4954,7 @@ static void close_socket_gracefully(struct mg_connection *conn) {
   // Send FIN to the client
   (void) shutdown(sock, SHUT_WR);
   set_non_blocking_mode(sock);
+  conn->closing = 1;
 
   // Read and discard pending incoming data. If we do not do that and close the
   // socket, the data in the send buffer may be discarded. This
@@ -4498,13 +4967,18 @@ static void close_socket_gracefully(struct mg_connection *conn) {
 
   // Now we know that our FIN is ACK-ed, safe to close
   (void) closesocket(sock);
+  conn->closing = 0;
 }
 
 static void close_connection(struct mg_connection *conn) {
   if (conn->ssl) {
+    // Send close_notify, clients throw away sessions of connections that
+    // end without it and could not resume them
+    (void) SSL_shutdown(conn->ssl);
     SSL_free(conn->ssl);
     conn->ssl = NULL;
   }
+  conn->ktls_send = 0;
 
   if (conn->client.sock != INVALID_SOCKET) {
     close_socket_gracefully(conn);
@@ -4615,51 +5089,1348 @@ static int is_valid_uri(const char *uri) {
   return uri[0] == '/' || (uri[0] == '*' && uri[1] == '\0');
 }
 
-static void process_new_connection(struct mg_connection *conn) {
-  struct mg_request_info *ri = &conn->request_info;
-  int keep_alive_enabled, discard_len;
-  const char *cl;
+// HTTP/2 over cleartext TCP (h2c), RFC 7540 and HPACK, RFC 7541.
+// Streams are reassembled into HTTP/1.1 requests and run through the
+// regular handle_request() path on a pseudo connection, each on a worker of
+// its own when one is idle. Their output goes back as HEADERS and DATA
+// frames while the handler writes it.
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_MAX 16384
+#define H2_MAX_STREAMS 100
+#define H2_MAX_HEADER_BLOCK 65536
+#define H2_MAX_REQUEST_BODY (16 * 1024 * 1024)
+#define H2_TABLE_SIZE 4096
+#define H2_DEFAULT_WINDOW 65535
+#define H2_OUT_MAX (4 * H2_FRAME_MAX)  // Buffered per stream, see h2_write()
+#define H2_MAX_WINDOW 0x7fffffff
 
-  keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
+enum {
+  H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+  H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+};
 
-  do {
-    reset_per_request_attributes(conn);
-    conn->request_len = read_request(NULL, conn, conn->buf, conn->buf_size,
-                                     &conn->data_len);
-    assert(conn->request_len < 0 || conn->data_len >= conn->request_len);
-    if (conn->request_len == 0 && conn->data_len == conn->buf_size) {
-      send_http_error(conn, 413, "Request Too Large", "%s", "");
-      return;
-    } if (conn->request_len <= 0) {
-      return;  // Remote end closed the connection
-    }
-    if (parse_http_request(conn->buf, conn->buf_size, ri) <= 0 ||
-        !is_valid_uri(ri->uri)) {
-      // Do not put garbage in the access log, just send it back to the client
-      send_http_error(conn, 400, "Bad Request",
-          "Cannot parse HTTP request: [%.*s]", conn->data_len, conn->buf);
-      conn->must_close = 1;
-    } else if (strcmp(ri->http_version, "1.0") &&
-               strcmp(ri->http_version, "1.1")) {
-      // Request seems valid, but HTTP version is strange
-      send_http_error(conn, 505, "HTTP version not supported", "%s", "");
-      log_access(conn);
-    } else {
-      // Request is valid, handle it
-      if ((cl = get_header(ri, "Content-Length")) != NULL) {
-        conn->content_len = strtoll(cl, NULL, 10);
-      } else if (!mg_strcasecmp(ri->request_method, "POST") ||
-                 !mg_strcasecmp(ri->request_method, "PUT")) {
-        conn->content_len = -1;
-      } else {
-        conn->content_len = 0;
-      }
-      conn->birth_time = time(NULL);
-      handle_request(conn);
-      call_user(conn, MG_REQUEST_COMPLETE);
-      log_access(conn);
-    }
-    if (ri->remote_user != NULL) {
+enum {
+  H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR, H2_CONNECT_ERROR,
+  H2_ENHANCE_YOUR_CALM
+};
+
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+struct h2_field {
+  char *name;
+  char *value;
+};
+
+struct h2_stream {
+  struct h2_stream *next;
+  struct h2_session *session;
+  struct h2_stream *next_task;  // In the workers' queue, see h2_start()
+  uint32_t id;
+  int remote_closed;          // END_STREAM received, request is complete
+  int running;                // Handler not done yet, it frees a closed stream
+  int detached;               // Handler runs on a worker of its own
+  int closed;                 // Reset while running, off the stream list
+  int responding;             // Response HEADERS sent, out holds body
+  int done;                   // Handler finished, out holds the rest
+  int end_sent;               // END_STREAM went out
+  int malformed;              // Bad header seen, reset instead of running
+  int too_large;              // Body exceeded H2_MAX_REQUEST_BODY
+  int has_host;               // Request carried its own Host header
+  int status;                 // Response status, 0 until the head is parsed
+  int chunked;                // Response body is chunked, see h2_body()
+  int body_end;               // Declared end of the response body reached
+  int64_t body_left;          // Content-Length still to come, -1 if none
+  int64_t chunk_left;         // Bytes left in the current chunk
+  int64_t send_window;        // Stream level flow control window
+  struct h2_buf hdrs;         // Regular headers as "Name: value\r\n" lines
+  struct h2_buf body;         // Request body
+  struct h2_buf head;         // Response head, then a partial chunk size line
+  struct h2_buf out;          // Response body not sent yet
+  int64_t out_sent;           // How much of out went out in DATA frames
+  int64_t out_total;          // Response body bytes so far, for the log
+  char *method, *path, *authority;
+};
+
+struct h2_session {
+  struct mg_connection *conn;
+  pthread_mutex_t lock;       // Held by the reader except in pull(), and by
+                              // handlers around their writes
+  pthread_cond_t cond;        // Windows opened or a handler finished
+  int running;                // Handlers not done yet
+  int dead;                   // Reader is done, handlers can't send anymore
+  struct h2_stream *streams;
+  int num_streams;
+  uint32_t last_stream_id;    // Highest stream opened by the client
+  uint32_t continuation_id;   // Stream expecting CONTINUATION, 0 if none
+  struct h2_buf block;        // Header block being assembled
+  uint32_t block_id;
+  int block_end_stream;
+  int64_t send_window;        // Connection level flow control window
+  int64_t initial_window;     // SETTINGS_INITIAL_WINDOW_SIZE of the client
+  int max_frame;              // Largest DATA frame we may send
+  int going_away;             // Either side sent GOAWAY, no new streams
+  int goaway_sent;
+  struct h2_field dyn[H2_TABLE_SIZE / 32];  // HPACK table, newest first
+  int num_dyn, dyn_size, dyn_max;
+  unsigned char rbuf[H2_FRAME_MAX + 9];
+  int rlen;
+  unsigned char sbuf[H2_FRAME_MAX + 9];
+};
+
+static const struct {
+  const char *name;
+  const char *value;
+} h2_static_table[] = {
+  {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+  {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+  {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+  {":status", "206"}, {":status", "304"}, {":status", "400"},
+  {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+  {"accept-ranges", ""}, {"accept", ""},
+  {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+  {"authorization", ""}, {"cache-control", ""},
+  {"content-disposition", ""}, {"content-encoding", ""},
+  {"content-language", ""}, {"content-length", ""},
+  {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+  {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+  {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+  {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+  {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+  {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+  {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+  {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+  {"set-cookie", ""}, {"strict-transport-security", ""},
+  {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+  {"via", ""}, {"www-authenticate", ""}
+};
+
+// The HPACK Huffman code is canonical, so the number of codes of each
+// length and the symbols in code order are enough to decode it.
+static const unsigned short h2_huffman_count[31] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const unsigned short h2_huffman_symbols[257] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46,
+  47, 51, 52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102,
+  103, 104, 108, 109, 110, 112, 114, 117, 58, 66, 67, 68, 69, 70,
+  71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84,
+  85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42,
+  44, 59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+  0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92, 195, 208,
+  128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+  179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154,
+  156, 160, 163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190,
+  196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140, 141, 143, 147,
+  149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+  183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171, 206,
+  215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+  210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214,
+  221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+  2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18,
+  19, 20, 21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+  249, 10, 13, 22, 256,
+};
+
+static int h2c_enabled(const struct mg_connection *conn) {
+  return conn->ssl == NULL &&
+    !mg_strcasecmp(conn->ctx->config[ENABLE_H2C], "yes");
+}
+
+static void h2_put32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char) (v >> 24);
+  p[1] = (unsigned char) (v >> 16);
+  p[2] = (unsigned char) (v >> 8);
+  p[3] = (unsigned char) v;
+}
+
+static uint32_t h2_get32(const unsigned char *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+    ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Decode a canonical Huffman string, one bit at a time. Return 0 if the
+// input holds EOS or is not padded with at most 7 one bits.
+static int h2_huffman_decode(const unsigned char *src, int len, char *dst,
+                             int *dst_len) {
+  int i, n, bit, bits = 0, code = 0, first = 0, index = 0, count, ones = 1;
+  int sym;
+
+  *dst_len = 0;
+  for (i = 0; i < len; i++) {
+    for (n = 7; n >= 0; n--) {
+      bit = (src[i] >> n) & 1;
+      code |= bit;
+      ones &= bit;
+      count = h2_huffman_count[++bits];
+      if (code - count < first) {
+        if ((sym = h2_huffman_symbols[index + (code - first)]) == 256) {
+          return 0;
+        }
+        dst[(*dst_len)++] = (char) sym;
+        bits = code = first = index = 0;
+        ones = 1;
+      } else if (bits == 30) {
+        return 0;
+      } else {
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+      }
+    }
+  }
+  dst[*dst_len] = '\0';
+
+  return bits <= 7 && ones;
+}
+
+static int h2_decode_int(const unsigned char **p, const unsigned char *end,
+                         int prefix, uint32_t *value) {
+  uint32_t max = (1U << prefix) - 1, v;
+  int shift = 0;
+
+  if (*p >= end) {
+    return 0;
+  }
+  v = *(*p)++ & max;
+  if (v == max) {
+    do {
+      if (*p >= end || shift > 21) {
+        return 0;
+      }
+      v += (uint32_t) (**p & 0x7f) << shift;
+      shift += 7;
+    } while (*(*p)++ & 0x80);
+  }
+  *value = v;
+
+  return 1;
+}
+
+// Decode a string literal into a malloc()-ed, NUL-terminated copy
+static char *h2_decode_string(const unsigned char **p,
+                              const unsigned char *end) {
+  uint32_t len;
+  int huffman, n;
+  char *s;
+
+  if (*p >= end) {
+    return NULL;
+  }
+  huffman = **p & 0x80;
+  if (!h2_decode_int(p, end, 7, &len) || len > (uint32_t) (end - *p)) {
+    return NULL;
+  }
+  // Shortest Huffman code is 5 bits
+  if ((s = (char *) malloc(huffman ? len * 8 / 5 + 1 : len + 1)) == NULL) {
+    return NULL;
+  }
+  if (huffman) {
+    if (!h2_huffman_decode(*p, (int) len, s, &n)) {
+      free(s);
+      return NULL;
+    }
+  } else {
+    memcpy(s, *p, len);
+    s[len] = '\0';
+  }
+  *p += len;
+
+  return s;
+}
+
+static void h2_table_evict(struct h2_session *s, int limit) {
+  struct h2_field *f;
+
+  while (s->num_dyn > 0 && s->dyn_size > limit) {
+    f = &s->dyn[--s->num_dyn];
+    s->dyn_size -= (int) (strlen(f->name) + strlen(f->value) + 32);
+    free(f->name);
+    free(f->value);
+  }
+}
+
+static void h2_table_add(struct h2_session *s, const char *name,
+                         const char *value) {
+  int size = (int) (strlen(name) + strlen(value) + 32);
+
+  // An entry larger than the table just empties it
+  h2_table_evict(s, size > s->dyn_max ? 0 : s->dyn_max - size);
+  if (size <= s->dyn_max) {
+    memmove(&s->dyn[1], &s->dyn[0], s->num_dyn * sizeof(s->dyn[0]));
+    s->dyn[0].name = mg_strdup(name);
+    s->dyn[0].value = mg_strdup(value);
+    s->dyn_size += size;
+    s->num_dyn++;
+  }
+}
+
+static int h2_table_get(const struct h2_session *s, uint32_t index,
+                        const char **name, const char **value) {
+  if (index == 0) {
+    return 0;
+  } else if (index <= ARRAY_SIZE(h2_static_table)) {
+    *name = h2_static_table[index - 1].name;
+    *value = h2_static_table[index - 1].value;
+  } else if (index - ARRAY_SIZE(h2_static_table) <= (uint32_t) s->num_dyn) {
+    *name = s->dyn[index - ARRAY_SIZE(h2_static_table) - 1].name;
+    *value = s->dyn[index - ARRAY_SIZE(h2_static_table) - 1].value;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static int is_hop_by_hop_header(const char *name) {
+  return !mg_strcasecmp(name, "connection") ||
+    !mg_strcasecmp(name, "keep-alive") ||
+    !mg_strcasecmp(name, "proxy-connection") ||
+    !mg_strcasecmp(name, "transfer-encoding") ||
+    !mg_strcasecmp(name, "upgrade");
+}
+
+// Store one decoded header on the stream. st is NULL for refused streams,
+// whose header blocks are still decoded to keep the HPACK table in sync.
+static void h2_add_header(struct h2_stream *st, const char *name,
+                          const char *value) {
+  if (st == NULL) {
+    return;
+  } else if (strpbrk(name, "\r\n") != NULL || strpbrk(value, "\r\n") != NULL) {
+    st->malformed = 1;
+  } else if (!strcmp(name, ":method")) {
+    free(st->method);
+    st->method = mg_strdup(value);
+  } else if (!strcmp(name, ":path")) {
+    free(st->path);
+    st->path = mg_strdup(value);
+  } else if (!strcmp(name, ":authority")) {
+    free(st->authority);
+    st->authority = mg_strdup(value);
+  } else if (name[0] == ':' || !mg_strcasecmp(name, "content-length") ||
+             !mg_strcasecmp(name, "http2-settings") ||
+             is_hop_by_hop_header(name)) {
+    // :scheme is implied, Content-Length is recomputed from DATA frames
+  } else {
+    if (!mg_strcasecmp(name, "host")) {
+      st->has_host = 1;
+    }
+    if (!h2_append(&st->hdrs, name, strlen(name)) ||
+        !h2_append(&st->hdrs, ": ", 2) ||
+        !h2_append(&st->hdrs, value, strlen(value)) ||
+        !h2_append(&st->hdrs, "\r\n", 2)) {
+      st->malformed = 1;
+    }
+  }
+}
+
+// Decode an HPACK header block. Return 0 on a compression error.
+static int h2_decode_block(struct h2_session *s, struct h2_stream *st,
+                           const unsigned char *p, int len) {
+  const unsigned char *end = p + len;
+  const char *name, *value;
+  char *nbuf, *vbuf;
+  uint32_t index;
+  int incremental;
+
+  while (p < end) {
+    if (*p & 0x80) {
+      // Indexed header field
+      if (!h2_decode_int(&p, end, 7, &index) ||
+          !h2_table_get(s, index, &name, &value)) {
+        return 0;
+      }
+      h2_add_header(st, name, value);
+    } else if ((*p & 0xe0) == 0x20) {
+      // Dynamic table size update
+      if (!h2_decode_int(&p, end, 5, &index) || index > H2_TABLE_SIZE) {
+        return 0;
+      }
+      s->dyn_max = (int) index;
+      h2_table_evict(s, s->dyn_max);
+    } else {
+      // Literal, with incremental indexing, without or never indexed
+      incremental = (*p & 0xc0) == 0x40;
+      if (!h2_decode_int(&p, end, incremental ? 6 : 4, &index)) {
+        return 0;
+      }
+      if (index == 0) {
+        nbuf = h2_decode_string(&p, end);
+      } else if (h2_table_get(s, index, &name, &value)) {
+        // Copy, adding to the table may evict the entry we refer to
+        nbuf = mg_strdup(name);
+      } else {
+        return 0;
+      }
+      if (nbuf == NULL || (vbuf = h2_decode_string(&p, end)) == NULL) {
+        free(nbuf);
+        return 0;
+      }
+      h2_add_header(st, nbuf, vbuf);
+      if (incremental) {
+        h2_table_add(s, nbuf, vbuf);
+      }
+      free(nbuf);
+      free(vbuf);
+    }
+  }
+
+  return 1;
+}
+
+static int h2_encode_int(struct h2_buf *b, int flags, int prefix,
+                         uint32_t value) {
+  unsigned char buf[8];
+  uint32_t max = (1U << prefix) - 1;
+  int n = 0;
+
+  if (value < max) {
+    buf[n++] = (unsigned char) (flags | value);
+  } else {
+    buf[n++] = (unsigned char) (flags | max);
+    for (value -= max; value >= 128; value >>= 7) {
+      buf[n++] = (unsigned char) ((value & 0x7f) | 0x80);
+    }
+    buf[n++] = (unsigned char) value;
+  }
+  return h2_append(b, buf, n);
+}
+
+static int h2_encode_string(struct h2_buf *b, const char *s, size_t len) {
+  return h2_encode_int(b, 0, 7, (uint32_t) len) && h2_append(b, s, len);
+}
+
+// Encode a response header as a literal without indexing. We never add to
+// the client's table, so its SETTINGS_HEADER_TABLE_SIZE does not matter.
+static int h2_encode_header(struct h2_buf *b, const char *name,
+                            const char *value, size_t value_len) {
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(h2_static_table); i++) {
+    if (!strcmp(h2_static_table[i].name, name)) {
+      return h2_encode_int(b, 0, 4, (uint32_t) i + 1) &&
+        h2_encode_string(b, value, value_len);
+    }
+  }
+  return h2_encode_int(b, 0, 4, 0) && h2_encode_string(b, name, strlen(name)) &&
+    h2_encode_string(b, value, value_len);
+}
+
+static int h2_send_frame(struct h2_session *s, int type, int flags,
+                         uint32_t id, const void *payload, int len) {
+  struct mg_connection *conn = s->conn;
+  unsigned char *b = s->sbuf;
+
+  b[0] = (unsigned char) (len >> 16);
+  b[1] = (unsigned char) (len >> 8);
+  b[2] = (unsigned char) len;
+  b[3] = (unsigned char) type;
+  b[4] = (unsigned char) flags;
+  h2_put32(b + 5, id & H2_MAX_WINDOW);
+  if (len > 0) {
+    memcpy(b + 9, payload, len);
+  }
+  return push(NULL, conn->client.sock, conn->ktls_send ? NULL : conn->ssl,
+              (const char *) b, len + 9) == len + 9;
+}
+
+static int h2_rst(struct h2_session *s, uint32_t id, uint32_t error) {
+  unsigned char buf[4];
+
+  h2_put32(buf, error);
+  return h2_send_frame(s, H2_RST_STREAM, 0, id, buf, sizeof(buf));
+}
+
+static int h2_goaway(struct h2_session *s, uint32_t error) {
+  unsigned char buf[8];
+
+  h2_put32(buf, s->last_stream_id);
+  h2_put32(buf + 4, error);
+  s->going_away = s->goaway_sent = 1;
+  return h2_send_frame(s, H2_GOAWAY, 0, 0, buf, sizeof(buf));
+}
+
+static int h2_window_update(struct h2_session *s, uint32_t id, uint32_t n) {
+  unsigned char buf[4];
+
+  h2_put32(buf, n);
+  return h2_send_frame(s, H2_WINDOW_UPDATE, 0, id, buf, sizeof(buf));
+}
+
+static struct h2_stream *h2_find_stream(struct h2_session *s, uint32_t id) {
+  struct h2_stream *st;
+
+  for (st = s->streams; st != NULL && st->id != id; st = st->next);
+  return st;
+}
+
+static struct h2_stream *h2_new_stream(struct h2_session *s, uint32_t id) {
+  struct h2_stream *st;
+
+  if ((st = (struct h2_stream *) calloc(1, sizeof(*st))) != NULL) {
+    st->session = s;
+    st->id = id;
+    st->send_window = s->initial_window;
+    st->next = s->streams;
+    s->streams = st;
+    s->num_streams++;
+  }
+  return st;
+}
+
+static void h2_free_stream(struct h2_stream *st) {
+  free(st->hdrs.buf);
+  free(st->body.buf);
+  free(st->head.buf);
+  free(st->out.buf);
+  free(st->method);
+  free(st->path);
+  free(st->authority);
+  free(st);
+}
+
+static void h2_close_stream(struct h2_session *s, struct h2_stream *st) {
+  struct h2_stream **pp;
+
+  for (pp = &s->streams; *pp != NULL && *pp != st; pp = &(*pp)->next);
+  if (*pp != NULL) {
+    *pp = st->next;
+    s->num_streams--;
+  }
+  if (st->running) {
+    st->closed = 1;  // Its handler still uses it and frees it when done
+  } else {
+    h2_free_stream(st);
+  }
+}
+
+// Send as much of the response body as the flow control windows allow,
+// END_STREAM once the handler is done and all of it went out. While the
+// handler still writes, only full frames go out. Return 0 if the
+// connection failed.
+static int h2_flush(struct h2_session *s, struct h2_stream *st) {
+  int64_t n;
+  int last;
+
+  if (!st->responding) {
+    return 1;
+  }
+  while (!st->end_sent &&
+         (st->done || st->out.len - st->out_sent >= s->max_frame)) {
+    n = st->out.len - st->out_sent;
+    n = n > s->max_frame ? s->max_frame : n;
+    n = n > s->send_window ? s->send_window : n;
+    n = n > st->send_window ? st->send_window : n;
+    n = n > 0 ? n : 0;
+    last = st->done && st->out_sent + n == st->out.len;
+    if (n == 0 && !last) {
+      break;  // Wait for WINDOW_UPDATE or more output
+    }
+    if (!h2_send_frame(s, H2_DATA, last ? H2_FLAG_END_STREAM : 0, st->id,
+                       st->out.buf + st->out_sent, (int) n)) {
+      return 0;
+    }
+    st->out_sent += n;
+    st->send_window -= n;
+    s->send_window -= n;
+    st->end_sent = last;
+  }
+  if (st->end_sent) {
+    if (st->done) {
+      h2_close_stream(s, st);
+    }
+    return 1;
+  }
+
+  // Keep only what is still to be sent
+  if (st->out_sent > 0) {
+    st->out.len -= st->out_sent;
+    memmove(st->out.buf, st->out.buf + st->out_sent, (size_t) st->out.len);
+    st->out_sent = 0;
+  }
+  return 1;
+}
+
+static int h2_flush_all(struct h2_session *s) {
+  struct h2_stream *st, *next;
+
+  for (st = s->streams; st != NULL; st = next) {
+    next = st->next;
+    if (!h2_flush(s, st)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Convert the HTTP/1.1 response head captured in resp into HEADERS
+// frames. Return the response status, or -1 if the stream was reset.
+static int h2_respond(struct h2_session *s, struct h2_stream *st,
+                      struct h2_buf *resp) {
+  struct h2_buf hb = {NULL, 0, 0};
+  char *p, *eol, *end, *colon, *name, *value;
+  int64_t content_len = -1;
+  int status, sent, n, flags;
+  size_t i;
+
+  if (resp->len < 12 || strncmp(resp->buf, "HTTP/", 5) ||
+      (end = strstr(resp->buf, "\r\n\r\n")) == NULL ||
+      (p = strchr(resp->buf, ' ')) == NULL ||
+      (status = atoi(p + 1)) < 100 || status > 999) {
+    h2_rst(s, st->id, H2_INTERNAL_ERROR);
+    h2_close_stream(s, st);
+    return -1;
+  }
+
+  for (i = 7; i < 14; i++) {
+    if (atoi(h2_static_table[i].value) == status) {
+      break;
+    }
+  }
+  if (i < 14) {
+    h2_encode_int(&hb, 0x80, 7, (uint32_t) i + 1);
+  } else {
+    char code[4];
+    snprintf(code, sizeof(code), "%d", status);
+    h2_encode_header(&hb, ":status", code, strlen(code));
+  }
+
+  // Header lines; HTTP/2 wants lowercase names and no hop-by-hop headers
+  for (p = strstr(resp->buf, "\r\n") + 2; p < end; p = eol + 2) {
+    eol = strstr(p, "\r\n");
+    *eol = '\0';
+    if ((colon = strchr(p, ':')) == NULL) {
+      continue;
+    }
+    *colon = '\0';
+    for (name = p; *name != '\0'; name++) {
+      *name = (char) lowercase(name);
+    }
+    name = p;
+    for (value = colon + 1; *value == ' ' || *value == '\t'; value++);
+    if (!strcmp(name, "transfer-encoding")) {
+      st->chunked = strstr(value, "chunked") != NULL;
+    } else if (!strcmp(name, "content-length")) {
+      content_len = strtoll(value, NULL, 10);
+    }
+    if (!is_hop_by_hop_header(name)) {
+      h2_encode_header(&hb, name, value, strlen(value));
+    }
+  }
+  if (hb.buf == NULL) {
+    h2_rst(s, st->id, H2_INTERNAL_ERROR);
+    h2_close_stream(s, st);
+    return -1;
+  }
+
+  // Like an HTTP/1.1 client, ignore whatever follows the declared body
+  st->body_left = st->chunked ? -1 : content_len;
+  st->body_end = st->body_left == 0;
+  st->responding = 1;
+  st->status = status;
+
+  for (sent = 0; sent == 0 || sent < hb.len; sent += n) {
+    n = hb.len - sent > s->max_frame ? s->max_frame : (int) (hb.len - sent);
+    flags = sent + n == hb.len ? H2_FLAG_END_HEADERS : 0;
+    if (sent == 0 && st->body_end) {
+      flags |= H2_FLAG_END_STREAM;
+    }
+    if (!h2_send_frame(s, sent == 0 ? H2_HEADERS : H2_CONTINUATION, flags,
+                       st->id, hb.buf + sent, n)) {
+      break;
+    }
+  }
+  st->end_sent = st->body_end;
+  free(hb.buf);
+
+  return status;
+}
+
+// Append a piece of the response body to the stream output, undoing
+// Transfer-Encoding: chunked on the way. Return 0 if out of memory.
+static int h2_body(struct h2_stream *st, const char *p, int64_t len) {
+  const char *nl;
+  char *e;
+  int64_t n;
+
+  while (len > 0 && !st->body_end) {
+    if (!st->chunked || st->chunk_left > 0) {
+      n = st->chunked ? st->chunk_left : st->body_left;
+      n = n >= 0 && n < len ? n : len;
+      if (!h2_append(&st->out, p, n)) {
+        return 0;
+      }
+      p += n;
+      len -= n;
+      st->out_total += n;
+      if (st->chunked) {
+        st->chunk_left -= n;
+      } else if (st->body_left >= 0 && (st->body_left -= n) == 0) {
+        st->body_end = 1;
+      }
+    } else {
+      // Chunk size line, it may come in pieces. The CRLF that ends the
+      // previous chunk shows up as an empty line.
+      nl = (const char *) memchr(p, '\n', (size_t) len);
+      n = nl == NULL ? len : nl - p + 1;
+      if (!h2_append(&st->head, p, n)) {
+        return 0;
+      }
+      p += n;
+      len -= n;
+      if (nl != NULL) {
+        n = strtoll(st->head.buf, &e, 16);
+        if (e != st->head.buf) {
+          st->chunk_left = n;
+          st->body_end = n <= 0;
+        }
+        st->head.len = 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// mg_write() on a stream's pseudo connection. The response head is
+// collected until it is complete, the body goes out in DATA frames as the
+// handler writes it. A handler on a worker of its own waits for the client
+// once H2_OUT_MAX is buffered; one on the connection's worker can't, the
+// client's WINDOW_UPDATEs are only read there, so it buffers.
+static int h2_write(struct mg_connection *conn, const void *buf, size_t len) {
+  struct h2_stream *st = conn->h2;
+  struct h2_session *s = st->session;
+  struct h2_buf resp;
+  const char *end;
+  int64_t skip;
+  int ok;
+
+  (void) pthread_mutex_lock(&s->lock);
+  if (st->closed || s->dead) {
+    ok = 0;
+  } else if (st->responding) {
+    ok = h2_body(st, (const char *) buf, (int64_t) len);
+  } else {
+    // The blank line may have started in the previous write
+    skip = st->head.len > 3 ? st->head.len - 3 : 0;
+    ok = h2_append(&st->head, buf, (int64_t) len);
+    if (ok && (end = strstr(st->head.buf + skip, "\r\n\r\n")) != NULL) {
+      // From here on head holds partial chunk size lines, see h2_body()
+      resp = st->head;
+      memset(&st->head, 0, sizeof(st->head));
+      skip = end + 4 - resp.buf;
+      ok = h2_respond(s, st, &resp) > 0 &&
+        h2_body(st, resp.buf + skip, resp.len - skip);
+      free(resp.buf);
+    }
+  }
+
+  while (ok && !st->closed && !s->dead) {
+    if (!h2_flush(s, st)) {
+      s->going_away = 1;
+      ok = 0;
+    } else if (st->detached && st->out.len - st->out_sent > H2_OUT_MAX) {
+      (void) pthread_cond_wait(&s->cond, &s->lock);
+    } else {
+      break;
+    }
+  }
+  ok = ok && !st->closed && !s->dead;
+  (void) pthread_mutex_unlock(&s->lock);
+
+  return ok ? (int) len : -1;
+}
+
+// Run a complete request stream through the regular HTTP/1.1 machinery,
+// on a worker of its own or on the connection's one, see h2_start()
+static void h2_run(struct h2_session *s, struct h2_stream *st) {
+  struct mg_connection *conn = s->conn, *c = NULL;
+  struct h2_buf req = {NULL, 0, 0};
+  char cl[64];
+  int64_t sent;
+  int status, bad = st->malformed || st->method == NULL || st->path == NULL;
+
+  snprintf(cl, sizeof(cl), "Content-Length: %" INT64_FMT "\r\n\r\n",
+           st->body.len);
+  if (!bad &&
+      h2_append(&req, st->method, strlen(st->method)) &&
+      h2_append(&req, " ", 1) &&
+      h2_append(&req, st->path, strlen(st->path)) &&
+      h2_append(&req, " HTTP/1.1\r\n", 11) &&
+      (st->has_host || st->authority == NULL ||
+       (h2_append(&req, "Host: ", 6) &&
+        h2_append(&req, st->authority, strlen(st->authority)) &&
+        h2_append(&req, "\r\n", 2))) &&
+      (st->hdrs.len == 0 || h2_append(&req, st->hdrs.buf, st->hdrs.len)) &&
+      h2_append(&req, cl, strlen(cl)) &&
+      (st->body.len == 0 || h2_append(&req, st->body.buf, st->body.len)) &&
+      (c = (struct mg_connection *) calloc(1, sizeof(*c))) != NULL) {
+    c->ctx = conn->ctx;
+    c->client = conn->client;
+    c->client.sock = INVALID_SOCKET;
+    c->request_info.remote_ip = conn->request_info.remote_ip;
+    c->request_info.remote_port = conn->request_info.remote_port;
+    c->request_info.is_ssl = conn->request_info.is_ssl;
+    c->request_info.user_data = conn->request_info.user_data;
+    c->buf = req.buf;
+    c->buf_size = c->data_len = (int) req.len;
+    c->h2 = st;
+    c->birth_time = time(NULL);
+    reset_per_request_attributes(c);
+    c->request_info.arrival_time = now_seconds();
+
+    if ((c->request_len = parse_http_request(c->buf, c->buf_size,
+                                             &c->request_info)) <= 0 ||
+        !is_valid_uri(c->request_info.uri)) {
+      send_http_error(c, 400, "Bad Request", "%s", "Cannot parse request");
+    } else if (st->too_large) {
+      send_http_error(c, 413, "Request Entity Too Large", "%s", "");
+    } else {
+      c->content_len = st->body.len;
+      handle_request(c);
+      call_user(c, MG_REQUEST_COMPLETE);
+    }
+  }
+
+  (void) pthread_mutex_lock(&s->lock);
+  status = st->status;
+  sent = st->out_total;
+  st->running = 0;
+  if (st->closed) {
+    h2_free_stream(st);
+  } else if (!st->responding) {
+    // Bad request, out of memory, or no complete response head
+    h2_rst(s, st->id, bad ? H2_PROTOCOL_ERROR : H2_INTERNAL_ERROR);
+    h2_close_stream(s, st);
+  } else {
+    st->done = 1;
+    if (!h2_flush(s, st)) {
+      s->going_away = 1;
+    }
+  }
+  // A draining reader stops waiting for the client once nothing is left
+  if (s->num_streams == 0) {
+    conn->idle = 1;
+  }
+  s->running--;
+  (void) pthread_cond_broadcast(&s->cond);
+  (void) pthread_mutex_unlock(&s->lock);
+
+  if (c != NULL) {
+    if (status > 0) {
+      c->status_code = status;
+      c->num_bytes_sent = sent;
+      c->request_info.http_version = "2.0";
+      log_access(c);
+    }
+    if (c->request_info.remote_user != NULL) {
+      free((void *) c->request_info.remote_user);
+    }
+    free(c);
+  }
+  free(req.buf);
+}
+
+// Start the handler of a stream whose request is complete. An idle worker
+// takes it if there is one, so a slow handler holds up no other stream of
+// the connection; with the pool busy the connection's own worker runs it
+// rather than queueing it behind the connections waiting for a worker.
+// Called by the reader, with s->lock held.
+static void h2_start(struct h2_session *s, struct h2_stream *st) {
+  struct mg_context *ctx = s->conn->ctx;
+  int queued;
+
+  st->running = 1;
+  s->running++;
+  (void) pthread_mutex_lock(&ctx->mutex);
+  // Only queue what an idle worker is sure to pick up, see consume_socket()
+  if ((queued = ctx->num_idle > ctx->num_tasks) != 0) {
+    st->detached = 1;
+    st->next_task = NULL;
+    if (ctx->tasks_tail == NULL) {
+      ctx->tasks = st;
+    } else {
+      ctx->tasks_tail->next_task = st;
+    }
+    ctx->tasks_tail = st;
+    ctx->num_tasks++;
+    (void) pthread_cond_signal(&ctx->sq_full);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  if (!queued) {
+    (void) pthread_mutex_unlock(&s->lock);
+    h2_run(s, st);
+    (void) pthread_mutex_lock(&s->lock);
+  }
+}
+
+static int h2_apply_settings(struct h2_session *s, const unsigned char *p,
+                             int len) {
+  struct h2_stream *st;
+  uint32_t value;
+
+  if (len % 6 != 0) {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  for (; len > 0; p += 6, len -= 6) {
+    value = h2_get32(p + 2);
+    switch ((p[0] << 8) | p[1]) {
+      case 2:  // SETTINGS_ENABLE_PUSH, we never push anyway
+        if (value > 1) {
+          return H2_PROTOCOL_ERROR;
+        }
+        break;
+      case 4:  // SETTINGS_INITIAL_WINDOW_SIZE
+        if (value > H2_MAX_WINDOW) {
+          return H2_FLOW_CONTROL_ERROR;
+        }
+        for (st = s->streams; st != NULL; st = st->next) {
+          st->send_window += (int64_t) value - s->initial_window;
+        }
+        s->initial_window = value;
+        break;
+      case 5:  // SETTINGS_MAX_FRAME_SIZE
+        if (value < H2_FRAME_MAX || value > 0xffffff) {
+          return H2_PROTOCOL_ERROR;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return H2_NO_ERROR;
+}
+
+static int h2_end_block(struct h2_session *s) {
+  struct h2_stream *st = h2_find_stream(s, s->block_id);
+
+  if (!h2_decode_block(s, st, (unsigned char *) s->block.buf,
+                       (int) s->block.len)) {
+    return H2_COMPRESSION_ERROR;
+  }
+  s->block.len = 0;
+  if (st == NULL) {
+    h2_rst(s, s->block_id, H2_REFUSED_STREAM);
+  } else if (s->block_end_stream) {
+    st->remote_closed = 1;
+    h2_start(s, st);
+  }
+  return H2_NO_ERROR;
+}
+
+// Handle one frame. Return an error code, anything but H2_NO_ERROR tears
+// down the connection.
+static int h2_frame(struct h2_session *s, int type, int flags, uint32_t id,
+                    unsigned char *p, int len) {
+  struct h2_stream *st;
+  uint32_t value;
+  int pad, frame_len = len;
+
+  if (s->continuation_id != 0 &&
+      (type != H2_CONTINUATION || id != s->continuation_id)) {
+    return H2_PROTOCOL_ERROR;
+  }
+
+  if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_FLAG_PADDED)) {
+    if (len < 1 || p[0] >= len) {
+      return H2_PROTOCOL_ERROR;
+    }
+    pad = p[0];
+    p++;
+    len -= pad + 1;
+  }
+
+  switch (type) {
+    case H2_DATA:
+      if (id == 0 || id > s->last_stream_id) {
+        return H2_PROTOCOL_ERROR;
+      }
+      // Hand the window straight back, the body cap protects memory
+      if (frame_len > 0 && !h2_window_update(s, 0, frame_len)) {
+        return H2_INTERNAL_ERROR;
+      }
+      if ((st = h2_find_stream(s, id)) == NULL || st->remote_closed) {
+        break;  // Refused or reset stream, drop the data
+      }
+      if (st->too_large || st->body.len + len > H2_MAX_REQUEST_BODY) {
+        st->too_large = 1;
+      } else if (len > 0 && !h2_append(&st->body, p, len)) {
+        return H2_INTERNAL_ERROR;
+      }
+      if (flags & H2_FLAG_END_STREAM) {
+        st->remote_closed = 1;
+        h2_start(s, st);
+      } else if (frame_len > 0) {
+        h2_window_update(s, id, frame_len);
+      }
+      break;
+
+    case H2_HEADERS:
+      if (id == 0 || !(id & 1)) {
+        return H2_PROTOCOL_ERROR;
+      }
+      if (flags & H2_FLAG_PRIORITY) {
+        if (len < 5) {
+          return H2_PROTOCOL_ERROR;
+        }
+        p += 5;
+        len -= 5;
+      }
+      if ((st = h2_find_stream(s, id)) == NULL) {
+        if (id <= s->last_stream_id) {
+          return H2_STREAM_CLOSED;
+        }
+        s->last_stream_id = id;
+        if (!s->going_away && s->num_streams < H2_MAX_STREAMS) {
+          h2_new_stream(s, id);
+        }
+      } else if (st->remote_closed) {
+        return H2_STREAM_CLOSED;
+      }
+      s->block.len = 0;
+      if (!h2_append(&s->block, p, len)) {
+        return H2_INTERNAL_ERROR;
+      }
+      s->block_id = id;
+      s->block_end_stream = flags & H2_FLAG_END_STREAM;
+      if (!(flags & H2_FLAG_END_HEADERS)) {
+        s->continuation_id = id;
+        break;
+      }
+      return h2_end_block(s);
+
+    case H2_CONTINUATION:
+      if (s->continuation_id == 0) {
+        return H2_PROTOCOL_ERROR;
+      }
+      if (s->block.len + len > H2_MAX_HEADER_BLOCK) {
+        return H2_ENHANCE_YOUR_CALM;
+      }
+      if (!h2_append(&s->block, p, len)) {
+        return H2_INTERNAL_ERROR;
+      }
+      if (flags & H2_FLAG_END_HEADERS) {
+        s->continuation_id = 0;
+        return h2_end_block(s);
+      }
+      break;
+
+    case H2_PRIORITY:
+      if (id == 0) {
+        return H2_PROTOCOL_ERROR;
+      } else if (len != 5) {
+        return H2_FRAME_SIZE_ERROR;
+      }
+      break;
+
+    case H2_RST_STREAM:
+      if (id == 0 || id > s->last_stream_id) {
+        return H2_PROTOCOL_ERROR;
+      } else if (len != 4) {
+        return H2_FRAME_SIZE_ERROR;
+      }
+      if ((st = h2_find_stream(s, id)) != NULL) {
+        h2_close_stream(s, st);
+      }
+      break;
+
+    case H2_SETTINGS:
+      if (id != 0) {
+        return H2_PROTOCOL_ERROR;
+      }
+      if (flags & H2_FLAG_ACK) {
+        return len == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+      }
+      if ((pad = h2_apply_settings(s, p, len)) != H2_NO_ERROR) {
+        return pad;
+      }
+      h2_send_frame(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+      break;
+
+    case H2_PUSH_PROMISE:
+      return H2_PROTOCOL_ERROR;  // Clients must not push
+
+    case H2_PING:
+      if (id != 0) {
+        return H2_PROTOCOL_ERROR;
+      } else if (len != 8) {
+        return H2_FRAME_SIZE_ERROR;
+      }
+      if (!(flags & H2_FLAG_ACK)) {
+        h2_send_frame(s, H2_PING, H2_FLAG_ACK, 0, p, len);
+      }
+      break;
+
+    case H2_GOAWAY:
+      if (id != 0) {
+        return H2_PROTOCOL_ERROR;
+      }
+      s->going_away = 1;
+      break;
+
+    case H2_WINDOW_UPDATE:
+      if (len != 4) {
+        return H2_FRAME_SIZE_ERROR;
+      }
+      value = h2_get32(p) & H2_MAX_WINDOW;
+      if (id == 0) {
+        if (value == 0) {
+          return H2_PROTOCOL_ERROR;
+        } else if ((s->send_window += value) > H2_MAX_WINDOW) {
+          return H2_FLOW_CONTROL_ERROR;
+        }
+      } else if ((st = h2_find_stream(s, id)) != NULL) {
+        if (value == 0 || (st->send_window += value) > H2_MAX_WINDOW) {
+          h2_rst(s, id, value == 0 ? H2_PROTOCOL_ERROR :
+                 H2_FLOW_CONTROL_ERROR);
+          h2_close_stream(s, st);
+        }
+      }
+      break;
+
+    default:
+      break;  // Unknown frame types must be ignored
+  }
+
+  return H2_NO_ERROR;
+}
+
+// Make sure at least need bytes are buffered. While draining, say GOAWAY
+// and give up once no stream is left.
+static int h2_fill(struct h2_session *s, int need) {
+  struct mg_connection *conn = s->conn;
+  int n;
+
+  while (s->rlen < need) {
+    if (conn->ctx->drain_flag && !s->goaway_sent) {
+      h2_goaway(s, H2_NO_ERROR);
+    }
+    if (s->going_away && s->num_streams == 0) {
+      return 0;
+    }
+    conn->idle = s->num_streams == 0;
+    (void) pthread_mutex_unlock(&s->lock);
+    n = pull(NULL, conn, (char *) s->rbuf + s->rlen,
+             (int) sizeof(s->rbuf) - s->rlen);
+    (void) pthread_mutex_lock(&s->lock);
+    conn->idle = 0;
+    if (n <= 0) {
+      return 0;
+    }
+    s->rlen += n;
+  }
+  return 1;
+}
+
+static int h2_base64url_decode(const char *src, unsigned char *dst,
+                               int dst_len) {
+  static const char *b64 =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  const char *p;
+  uint32_t acc = 0;
+  int bits = 0, n = 0;
+
+  for (; *src != '\0' && *src != '='; src++) {
+    if ((p = strchr(b64, *src)) == NULL) {
+      return -1;
+    }
+    acc = (acc << 6) | (uint32_t) (p - b64);
+    if ((bits += 6) >= 8) {
+      bits -= 8;
+      if (n >= dst_len) {
+        return -1;
+      }
+      dst[n++] = (unsigned char) (acc >> bits);
+    }
+  }
+  return n;
+}
+
+static void h2_free_session(struct h2_session *s) {
+  while (s->streams != NULL) {
+    h2_close_stream(s, s->streams);
+  }
+  h2_table_evict(s, 0);
+  free(s->block.buf);
+  (void) pthread_cond_destroy(&s->cond);
+  (void) pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+// Take over the connection and speak HTTP/2 until either side is done.
+// With upgraded set, conn holds an HTTP/1.1 request carrying
+// "Upgrade: h2c" that becomes stream 1. Return 0 if the upgrade was
+// declined and the request should be served as HTTP/1.1.
+static int h2_serve(struct mg_connection *conn, int upgraded) {
+  static const unsigned char settings[] = {0, 3, 0, 0, 0, H2_MAX_STREAMS};
+  struct mg_request_info *ri = &conn->request_info;
+  struct h2_session *s;
+  struct h2_stream *st = NULL;
+  unsigned char hs[256];
+  uint32_t id;
+  int i, n, start, len, type, flags, err = H2_NO_ERROR;
+
+  if ((s = (struct h2_session *) calloc(1, sizeof(*s))) == NULL) {
+    return !upgraded;
+  }
+  s->conn = conn;
+  (void) pthread_mutex_init(&s->lock, NULL);
+  (void) pthread_cond_init(&s->cond, NULL);
+  s->send_window = s->initial_window = H2_DEFAULT_WINDOW;
+  s->max_frame = H2_FRAME_MAX;
+  s->dyn_max = H2_TABLE_SIZE;
+
+  if (upgraded) {
+    if ((n = h2_base64url_decode(get_header(ri, "HTTP2-Settings"), hs,
+                                 sizeof(hs))) < 0 ||
+        h2_apply_settings(s, hs, n) != H2_NO_ERROR ||
+        (st = h2_new_stream(s, 1)) == NULL) {
+      h2_free_session(s);
+      return 0;
+    }
+    s->last_stream_id = 1;
+    st->remote_closed = 1;
+    st->method = mg_strdup(ri->request_method);
+    st->path = mg_strdup(ri->uri);
+    for (i = 0; i < ri->num_headers; i++) {
+      h2_add_header(st, ri->http_headers[i].name, ri->http_headers[i].value);
+    }
+    mg_printf(conn, "%s", "HTTP/1.1 101 Switching Protocols\r\n"
+              "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+  }
+
+  // Whatever followed the request line(s) is already HTTP/2
+  start = upgraded ? conn->request_len : 0;
+  s->rlen = conn->data_len - start;
+  memcpy(s->rbuf, conn->buf + start, s->rlen);
+  conn->data_len = conn->request_len = 0;
+
+  (void) pthread_mutex_lock(&s->lock);
+  h2_send_frame(s, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  if (st != NULL) {
+    h2_start(s, st);
+  }
+
+  if (h2_fill(s, H2_PREFACE_LEN) &&
+      !memcmp(s->rbuf, H2_PREFACE, H2_PREFACE_LEN)) {
+    s->rlen -= H2_PREFACE_LEN;
+    memmove(s->rbuf, s->rbuf + H2_PREFACE_LEN, s->rlen);
+
+    while (h2_fill(s, 9)) {
+      len = (s->rbuf[0] << 16) | (s->rbuf[1] << 8) | s->rbuf[2];
+      type = s->rbuf[3];
+      flags = s->rbuf[4];
+      id = h2_get32(s->rbuf + 5) & H2_MAX_WINDOW;
+      if (len > H2_FRAME_MAX) {
+        err = H2_FRAME_SIZE_ERROR;
+        break;
+      } else if (!h2_fill(s, 9 + len)) {
+        break;
+      }
+      err = h2_frame(s, type, flags, id, s->rbuf + 9, len);
+      s->rlen -= 9 + len;
+      memmove(s->rbuf, s->rbuf + 9 + len, s->rlen);
+      if (err != H2_NO_ERROR || !h2_flush_all(s)) {
+        break;
+      }
+      // Handlers waiting for a window may have one now
+      (void) pthread_cond_broadcast(&s->cond);
+    }
+  } else {
+    err = H2_PROTOCOL_ERROR;
+  }
+
+  if (err != H2_NO_ERROR || !s->goaway_sent) {
+    h2_goaway(s, err);
+  }
+  // Handlers still running can't send anymore, wait until they see that
+  s->dead = 1;
+  (void) pthread_cond_broadcast(&s->cond);
+  while (s->running > 0) {
+    (void) pthread_cond_wait(&s->cond, &s->lock);
+  }
+  (void) pthread_mutex_unlock(&s->lock);
+  h2_free_session(s);
+
+  return 1;
+}
+
+static void process_new_connection(struct mg_connection *conn) {
+  struct mg_request_info *ri = &conn->request_info;
+  int keep_alive_enabled, discard_len;
+  const char *cl, *upgrade;
+
+  keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
+
+  do {
+    reset_per_request_attributes(conn);
+    conn->request_len = read_request(NULL, conn, conn->buf, conn->buf_size,
+                                     &conn->data_len);
+    assert(conn->request_len < 0 || conn->data_len >= conn->request_len);
+    if (conn->request_len == 0 && conn->data_len == conn->buf_size) {
+      send_http_error(conn, 413, "Request Too Large", "%s", "");
+      return;
+    } if (conn->request_len <= 0) {
+      return;  // Remote end closed the connection
+    }
+    if (conn->request_len == 18 && !memcmp(conn->buf, H2_PREFACE, 18) &&
+        h2c_enabled(conn)) {
+      h2_serve(conn, 0);  // HTTP/2 with prior knowledge
+      return;
+    }
+    // The first request on a connection has been waiting since accept()
+    ri->arrival_time = conn->client.accept_time > 0 ?
+      conn->client.accept_time : now_seconds();
+    conn->client.accept_time = 0;
+    if (parse_http_request(conn->buf, conn->buf_size, ri) <= 0 ||
+        !is_valid_uri(ri->uri)) {
+      // Do not put garbage in the access log, just send it back to the client
+      send_http_error(conn, 400, "Bad Request",
+          "Cannot parse HTTP request: [%.*s]", conn->data_len, conn->buf);
+      conn->must_close = 1;
+    } else if (strcmp(ri->http_version, "1.0") &&
+               strcmp(ri->http_version, "1.1")) {
+      // Request seems valid, but HTTP version is strange
+      send_http_error(conn, 505, "HTTP version not supported", "%s", "");
+      log_access(conn);
+    } else {
+      // Request is valid, handle it
+      if ((cl = get_header(ri, "Content-Length")) != NULL) {
+        conn->content_len = strtoll(cl, NULL, 10);
+      } else if (!mg_strcasecmp(ri->request_method, "POST") ||
+                 !mg_strcasecmp(ri->request_method, "PUT")) {
+        conn->content_len = -1;
+      } else {
+        conn->content_len = 0;
+      }
+      if (conn->content_len == 0 && !strcmp(ri->http_version, "1.1") &&
+          (upgrade = get_header(ri, "Upgrade")) != NULL &&
+          strstr(upgrade, "h2c") != NULL &&
+          get_header(ri, "HTTP2-Settings") != NULL && h2c_enabled(conn) &&
+          h2_serve(conn, 1)) {
+        return;
+      }
+      conn->birth_time = time(NULL);
+      handle_request(conn);
+      call_user(conn, MG_REQUEST_COMPLETE);
+      log_access(conn);
+      // A handler that refused a body leaves the rest of it on the wire,
+      // it must not be parsed as the next request
+      if (conn->content_len > 0 &&
+          conn->consumed_content < conn->content_len &&
+          conn->request_len + conn->content_len > (int64_t) conn->data_len) {
+        conn->must_close = 1;
+      }
+    }
+    if (ri->remote_user != NULL) {
       free((void *) ri->remote_user);
     }
 
@@ -4673,23 +6444,54 @@ static void process_new_connection(struct mg_connection *conn) {
     assert(conn->data_len <= conn->buf_size);
 
   } while (conn->ctx->stop_flag == 0 &&
+           conn->ctx->drain_flag == 0 &&
            keep_alive_enabled &&
            conn->content_len >= 0 &&
            should_keep_alive(conn));
 }
 
-// Worker threads take accepted socket from the queue
-static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+// Worker threads take accepted socket from the queue, or an HTTP/2 stream
+// to run, returned in task
+static int consume_socket(struct mg_context *ctx, struct socket *sp,
+                          struct h2_stream **task) {
+  int got;
+
   (void) pthread_mutex_lock(&ctx->mutex);
   DEBUG_TRACE(("going idle"));
 
   // If the queue is empty, wait. We're idle at this point.
-  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
+  ctx->num_idle++;
+  while (ctx->sq_head == ctx->sq_tail && ctx->tasks == NULL &&
+         ctx->stop_flag == 0 && ctx->drain_flag == 0 &&
+         ctx->num_threads <= ctx->target_threads) {
     pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
   }
+  ctx->num_idle--;
+
+  // Streams come first, even when stopping: h2_start() queued each one for
+  // a worker that was idle, and its connection waits for it to finish
+  if ((*task = ctx->tasks) != NULL) {
+    if ((ctx->tasks = (*task)->next_task) == NULL) {
+      ctx->tasks_tail = NULL;
+    }
+    ctx->num_tasks--;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return 1;
+  }
+
+  // Thread count was lowered, retire this worker
+  if (ctx->num_threads > ctx->target_threads && ctx->stop_flag == 0 &&
+      ctx->drain_flag == 0) {
+    ctx->num_threads--;
+    DEBUG_TRACE(("retiring, %d threads left", ctx->num_threads));
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return -1;
+  }
 
   // If we're stopping, sq_head may be equal to sq_tail.
-  if (ctx->sq_head > ctx->sq_tail) {
+  // If we're draining, keep serving whatever is still queued.
+  got = ctx->sq_head > ctx->sq_tail;
+  if (got) {
     // Copy socket from the queue and increment tail
     *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
     ctx->sq_tail++;
@@ -4705,12 +6507,15 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   (void) pthread_cond_signal(&ctx->sq_empty);
   (void) pthread_mutex_unlock(&ctx->mutex);
 
-  return !ctx->stop_flag;
+  return !ctx->stop_flag && (got || !ctx->drain_flag);
 }
 
 static void worker_thread(struct mg_context *ctx) {
   struct mg_connection *conn;
+  struct h2_stream *task;
+  int got = 0;
 
+  set_thread_affinity(ctx, WORKER_CPUS);
   conn = (struct mg_connection *) calloc(1, sizeof(*conn) + MAX_REQUEST_SIZE);
   if (conn == NULL) {
     cry(fc(ctx), "%s", "Cannot create new connection struct, OOM");
@@ -4720,7 +6525,11 @@ static void worker_thread(struct mg_context *ctx) {
 
     // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
     // sq_empty condvar to wake up the master waiting in produce_socket()
-    while (consume_socket(ctx, &conn->client)) {
+    while ((got = consume_socket(ctx, &conn->client, &task)) > 0) {
+      if (task != NULL) {
+        h2_run(task->session, task);
+        continue;
+      }
       conn->birth_time = time(NULL);
       conn->ctx = ctx;
 
@@ -4734,7 +6543,10 @@ static void worker_thread(struct mg_context *ctx) {
       conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
       conn->request_info.is_ssl = conn->client.is_ssl;
 
-      if (!conn->client.is_ssl ||
+      if (conn->client.is_raw) {
+        conn->request_info.arrival_time = conn->client.accept_time;
+        call_user(conn, MG_RAW_CONNECTION);
+      } else if (!conn->client.is_ssl ||
           (conn->client.is_ssl &&
            sslize(conn, conn->ctx->ssl_ctx, SSL_accept))) {
         process_new_connection(conn);
@@ -4745,12 +6557,15 @@ static void worker_thread(struct mg_context *ctx) {
     free(conn);
   }
 
-  // Signal master that we're done with connection and exiting
-  (void) pthread_mutex_lock(&ctx->mutex);
-  ctx->num_threads--;
-  (void) pthread_cond_signal(&ctx->cond);
-  assert(ctx->num_threads >= 0);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+  // Signal master that we're done with connection and exiting. Retired
+  // workers were already taken off the count by consume_socket().
+  if (got == 0) {
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    (void) pthread_cond_signal(&ctx->cond);
+    assert(ctx->num_threads >= 0);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+  }
 
   DEBUG_TRACE(("exiting"));
 }
@@ -4781,31 +6596,123 @@ static void accept_new_connection(const struct socket *listener,
   struct socket accepted;
   char src_addr[20];
   socklen_t len;
+  unsigned long uid = (unsigned long) -1, gid = (unsigned long) -1;
   int allowed;
 
   len = sizeof(accepted.rsa);
   accepted.lsa = listener->lsa;
   accepted.sock = accept(listener->sock, &accepted.rsa.sa, &len);
   if (accepted.sock != INVALID_SOCKET) {
-    allowed = check_acl(ctx, ntohl(* (uint32_t *) &accepted.rsa.sin.sin_addr));
+    accepted.accept_time = now_seconds();
+    if (listener->lsa.sa.sa_family == AF_UNIX) {
+      // No address to check, use the peer process credentials instead
+      memset(&accepted.rsa, 0, sizeof(accepted.rsa));
+      accepted.rsa.sa.sa_family = AF_UNIX;
+      allowed = get_peer_credentials(accepted.sock, &uid, &gid) &&
+        check_peer_acl(ctx, uid, gid) == 1;
+    } else {
+      allowed = check_acl(ctx,
+                          ntohl(* (uint32_t *) &accepted.rsa.sin.sin_addr));
+    }
     if (allowed) {
       // Put accepted socket structure into the queue
       DEBUG_TRACE(("accepted socket %d", accepted.sock));
       accepted.is_ssl = listener->is_ssl;
+      accepted.is_raw = listener->is_raw;
+      accepted.parked_state = NULL;
       produce_socket(ctx, &accepted);
     } else {
-      sockaddr_to_string(src_addr, sizeof(src_addr), &accepted.rsa);
+      if (listener->lsa.sa.sa_family == AF_UNIX) {
+        snprintf(src_addr, sizeof(src_addr), "uid %lu", uid);
+      } else {
+        sockaddr_to_string(src_addr, sizeof(src_addr), &accepted.rsa);
+      }
       cry(fc(ctx), "%s: %s is not allowed to connect", __func__, src_addr);
       (void) closesocket(accepted.sock);
     }
   }
 }
 
+#if !defined(_WIN32)
+// Put the listening sockets, the park pipe and the parked connections in
+// the poll set, growing it as needed. Return the number of entries.
+static int fill_poll_set(struct mg_context *ctx, struct pollfd **pfd,
+                         int *size) {
+  struct pollfd *p;
+  struct socket *sp;
+  int n = 0;
+
+  for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
+    n++;
+  }
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (sp = ctx->parked; sp != NULL; sp = sp->next) {
+    n++;
+  }
+  if (n + 1 > *size) {
+    if ((p = (struct pollfd *) realloc(*pfd, (n + 1) * sizeof(*p))) == NULL) {
+      // Poll nothing this round, the next one tries again
+      (void) pthread_mutex_unlock(&ctx->mutex);
+      return 0;
+    }
+    *pfd = p;
+    *size = n + 1;
+  }
+  p = *pfd;
+  n = 0;
+  for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next, n++) {
+    p[n].fd = sp->sock;
+    p[n].events = POLLIN;
+  }
+  p[n].fd = ctx->park_pipe[0];
+  p[n++].events = POLLIN;
+  for (sp = ctx->parked; sp != NULL; sp = sp->next, n++) {
+    sp->parked_index = n;
+    p[n].fd = sp->sock;
+    p[n].events = POLLIN;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  return n;
+}
+
+// Hand parked connections the peer sent more on, or hung up, to the workers
+static void wake_parked(struct mg_context *ctx, const struct pollfd *pfd) {
+  struct socket **pp, *sp, *ready = NULL;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (pp = &ctx->parked; (sp = *pp) != NULL; ) {
+    if (sp->parked_index >= 0 && pfd[sp->parked_index].revents != 0) {
+      *pp = sp->next;
+      sp->next = ready;
+      ready = sp;
+    } else {
+      pp = &sp->next;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  while ((sp = ready) != NULL) {
+    ready = sp->next;
+    produce_socket(ctx, sp);
+    free(sp);
+  }
+}
+#endif // !_WIN32
+
 static void master_thread(struct mg_context *ctx) {
+#if defined(_WIN32)
   fd_set read_set;
   struct timeval tv;
-  struct socket *sp;
   int max_fd;
+#else
+  struct pollfd *pfd = NULL;
+  char drain[64];
+  int i, n, size = 0;
+#endif // _WIN32
+  struct socket *sp;
+
+  set_thread_affinity(ctx, ACCEPTOR_CPUS);
 
   // Increase priority of the master thread
 #if defined(_WIN32)
@@ -4818,7 +6725,23 @@ static void master_thread(struct mg_context *ctx) {
   pthread_setschedparam(pthread_self(), SCHED_RR, &sched_param);
 #endif
 
-  while (ctx->stop_flag == 0) {
+  while (ctx->stop_flag == 0 && ctx->drain_flag == 0) {
+#if !defined(_WIN32)
+    n = fill_poll_set(ctx, &pfd, &size);
+    if (poll(pfd, n, 200) > 0) {
+      for (sp = ctx->listening_sockets, i = 0; sp != NULL; sp = sp->next, i++) {
+        if (ctx->stop_flag == 0 && ctx->drain_flag == 0 &&
+            (pfd[i].revents & POLLIN)) {
+          accept_new_connection(sp, ctx);
+        }
+      }
+      if (pfd[i].revents & POLLIN) {
+        while (read(ctx->park_pipe[0], drain, sizeof(drain)) > 0) {
+        }
+      }
+      wake_parked(ctx, pfd);
+    }
+#else
     FD_ZERO(&read_set);
     max_fd = -1;
 
@@ -4839,15 +6762,30 @@ static void master_thread(struct mg_context *ctx) {
 #endif // _WIN32
     } else {
       for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
-        if (ctx->stop_flag == 0 && FD_ISSET(sp->sock, &read_set)) {
+        if (ctx->stop_flag == 0 && ctx->drain_flag == 0 &&
+            FD_ISSET(sp->sock, &read_set)) {
           accept_new_connection(sp, ctx);
         }
       }
     }
+#endif // !_WIN32
   }
   DEBUG_TRACE(("stopping workers"));
 
-  // Stop signal received: somebody called mg_stop. Quit.
+#if !defined(_WIN32)
+  // Parked connections are idle, they are dropped like the idle keep-alive
+  // ones. Their state is the callback's and goes with the process.
+  (void) pthread_mutex_lock(&ctx->mutex);
+  while ((sp = ctx->parked) != NULL) {
+    ctx->parked = sp->next;
+    (void) closesocket(sp->sock);
+    free(sp);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  free(pfd);
+#endif // !_WIN32
+
+  // Stop signal received: somebody called mg_stop or mg_drain. Quit.
   close_all_listening_sockets(ctx);
 
   // Wakeup workers that are waiting for connections to handle.
@@ -4893,12 +6831,19 @@ static void free_context(struct mg_context *ctx) {
   if (ctx->client_ssl_ctx != NULL) {
     SSL_CTX_free(ctx->client_ssl_ctx);
   }
-#ifndef NO_SSL
+#if defined(SSL_NEEDS_LOCKS)
   if (ssl_mutexes != NULL) {
     free(ssl_mutexes);
     ssl_mutexes = NULL;
   }
-#endif // !NO_SSL
+#endif // SSL_NEEDS_LOCKS
+
+#if !defined(_WIN32)
+  if (ctx->park_pipe[0] != -1) {
+    (void) close(ctx->park_pipe[0]);
+    (void) close(ctx->park_pipe[1]);
+  }
+#endif // !_WIN32
 
   // Deallocate context itself
   free(ctx);
@@ -4918,6 +6863,71 @@ void mg_stop(struct mg_context *ctx) {
 #endif // _WIN32
 }
 
+void mg_drain(struct mg_context *ctx, int timeout_ms) {
+  ctx->drain_flag = 1;
+
+  // Master closes listeners and quits once workers have served everything
+  // that was accepted. Connections still around after the timeout are
+  // dropped, just like mg_stop() does.
+  while (ctx->stop_flag != 2 && timeout_ms > 0) {
+    (void) mg_sleep(10);
+    timeout_ms -= 10;
+  }
+#if defined(__GNUC__)
+  (void) __sync_bool_compare_and_swap(&ctx->stop_flag, 0, 1);
+#else
+  if (ctx->stop_flag == 0) {
+    ctx->stop_flag = 1;
+  }
+#endif
+  while (ctx->stop_flag != 2) {
+    (void) mg_sleep(10);
+  }
+  free_context(ctx);
+
+#if defined(_WIN32) && !defined(__SYMBIAN32__)
+  (void) WSACleanup();
+#endif // _WIN32
+}
+
+int mg_set_num_threads(struct mg_context *ctx, int n) {
+  int ok;
+
+  if (n < 1) {
+    return 0;
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  ctx->target_threads = n;
+  while (ctx->num_threads < n && ctx->stop_flag == 0 && ctx->drain_flag == 0) {
+    if (mg_start_thread((mg_thread_func_t) worker_thread, ctx) != 0) {
+      cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
+      break;
+    }
+    ctx->num_threads++;
+  }
+  // Surplus workers notice on their next trip through consume_socket()
+  (void) pthread_cond_broadcast(&ctx->sq_full);
+  ok = ctx->num_threads >= n;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  return ok;
+}
+
+int mg_get_listening_sockets(struct mg_context *ctx, int *socks, int *is_ssl,
+                             int *is_raw, int n) {
+  struct socket *sp;
+  int i = 0;
+
+  for (sp = ctx->listening_sockets; sp != NULL && i < n; sp = sp->next, i++) {
+    socks[i] = (int) sp->sock;
+    is_ssl[i] = sp->is_ssl;
+    is_raw[i] = sp->is_raw;
+  }
+
+  return i;
+}
+
 struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
                             const char **options) {
   struct mg_context *ctx;
@@ -4937,6 +6947,7 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
   }
   ctx->user_callback = user_callback;
   ctx->user_data = user_data;
+  ctx->park_pipe[0] = ctx->park_pipe[1] = -1;
 
   while (options && (name = *options++) != NULL) {
     if ((i = get_option_index(name)) == -1) {
@@ -4976,10 +6987,23 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
 #if !defined(_WIN32)
       !set_uid_option(ctx) ||
 #endif
-      !set_acl_option(ctx)) {
+      !set_acl_option(ctx) ||
+      !set_affinity_options(ctx)) {
+    free_context(ctx);
+    return NULL;
+  }
+
+#if !defined(_WIN32)
+  if (pipe(ctx->park_pipe) != 0) {
+    cry(fc(ctx), "Cannot create park pipe: %s", strerror(ERRNO));
     free_context(ctx);
     return NULL;
   }
+  for (i = 0; i < 2; i++) {
+    set_close_on_exec(ctx->park_pipe[i]);
+    (void) set_non_blocking_mode(ctx->park_pipe[i]);
+  }
+#endif // !_WIN32
 
 #if !defined(_WIN32) && !defined(__SYMBIAN32__)
   // Ignore SIGPIPE signal, so if browser cancels the request, it
@@ -4998,7 +7022,8 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
   mg_start_thread((mg_thread_func_t) master_thread, ctx);
 
   // Start worker threads
-  for (i = 0; i < atoi(ctx->config[NUM_THREADS]); i++) {
+  ctx->target_threads = atoi(ctx->config[NUM_THREADS]);
+  for (i = 0; i < ctx->target_threads; i++) {
     if (mg_start_thread((mg_thread_func_t) worker_thread, ctx) != 0) {
       cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
     } else {
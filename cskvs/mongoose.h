@@ -47,6 +47,8 @@ struct mg_request_info {
     const char *name;         // HTTP header name
     const char *value;        // HTTP header value
   } http_headers[64];         // Maximum 64 headers
+  double arrival_time;        // Seconds since the epoch the request arrived,
+                              // includes time spent in the accept queue
   void *user_data;            // User data pointer passed to the mg_start()
   void *ev_data;              // Event-specific data pointer
 };
@@ -117,6 +119,14 @@ enum mg_event {
   // Callback's return value is ignored.
   // ev_data contains NULL.
   MG_WEBSOCKET_CLOSE,
+
+  // Connection accepted on one of the raw_listening_ports. Mongoose does not
+  // speak HTTP on it: the callback runs its own protocol with mg_recv() and
+  // mg_write() on the worker thread, the connection is closed once it
+  // returns unless the callback parked it with mg_park(). Return value is
+  // ignored.
+  // ev_data contains NULL.
+  MG_RAW_CONNECTION
 };
 
 
@@ -175,6 +185,40 @@ struct mg_context *mg_start(mg_callback_t callback, void *user_data,
 void mg_stop(struct mg_context *);
 
 
+// Gracefully stop the web server.
+//
+// Like mg_stop(), but listening sockets are closed first and requests that
+// were already accepted are allowed to complete. Keep-alive connections are
+// closed after their current request. Anything still in flight after
+// timeout_ms milliseconds is dropped. Unix socket paths are left in place,
+// so listeners handed to another process keep working. Context pointer
+// becomes invalid.
+void mg_drain(struct mg_context *, int timeout_ms);
+
+
+// Change the number of worker threads of a running server.
+//
+// New workers are started right away. When lowering the count, idle
+// workers exit at once and busy ones after their current connection.
+//
+// Return:
+//   1 on success, 0 if n is not positive or a worker could not be started.
+int mg_set_num_threads(struct mg_context *, int n);
+
+
+// Get the listening sockets of a running server.
+//
+// Store up to n socket descriptors in socks, whether each one is an SSL
+// listener in is_ssl and whether it is a raw one in is_raw. The descriptors
+// can be passed to another process, which picks them up with "fd:N" (or
+// "fd:Ns") entries in listening_ports or raw_listening_ports.
+//
+// Return:
+//   number of sockets stored.
+int mg_get_listening_sockets(struct mg_context *, int *socks, int *is_ssl,
+                             int *is_raw, int n);
+
+
 // Get the value of particular configuration parameter.
 // The value returned is read-only. Mongoose does not allow changing
 // configuration at run time.
@@ -220,6 +264,12 @@ struct mg_request_info *mg_get_request_info(struct mg_connection *);
 int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+// Close the connection once the handler returns instead of keeping it alive.
+// For a handler that cannot finish a reply it has started to send, so the
+// client sees it cut short rather than complete.
+void mg_must_close(struct mg_connection *conn);
+
+
 // Send data to the browser using printf() semantics.
 //
 // Works exactly like mg_write(), but allows to do message formatting.
@@ -256,6 +306,33 @@ void mg_send_file(struct mg_connection *conn, const char *path);
 int mg_read(struct mg_connection *, void *buf, size_t len);
 
 
+// Read what has arrived on a raw connection, at most len bytes, waiting
+// only while nothing has. An idle connection gives up when the server
+// stops or drains.
+//
+// Return:
+//   number of bytes read, 0 if the peer closed it, negative on error or
+//   when the server is going away.
+int mg_recv(struct mg_connection *, void *buf, size_t len);
+
+
+// Give the worker back while a raw connection waits for its peer. Instead
+// of being closed the connection joins the ones the master thread polls,
+// once the peer sends more or hangs up MG_RAW_CONNECTION runs again with
+// state, see mg_get_parked(). The callback must return right away and not
+// touch state after a successful park.
+//
+// Return:
+//   1 if parked, 0 if not (no support on this platform or the server is
+//   going away), the callback then goes on serving the connection itself.
+int mg_park(struct mg_connection *, void *state);
+
+
+// The state a raw connection was parked with, NULL on its first
+// MG_RAW_CONNECTION.
+void *mg_get_parked(struct mg_connection *);
+
+
 // Get the value of particular HTTP header.
 //
 // This is a helper function. It traverses request_info->http_headers array,
@@ -264,6 +341,15 @@ int mg_read(struct mg_connection *, void *buf, size_t len);
 const char *mg_get_header(const struct mg_connection *, const char *name);
 
 
+// Check the client of the connection against an access control list in the
+// access_control_list format, e.g. "-0.0.0.0/0,+10.0.0.0/8". Without a list
+// only loopback clients are allowed. Unix socket clients always are, their
+// credentials were checked on accept.
+// Return -1 if the list is malformed, 0 if the client is disallowed, 1 if
+// allowed.
+int mg_check_acl(struct mg_connection *, const char *list);
+
+
 // Get a value of particular form variable.
 //
 // Parameters:
@@ -332,6 +418,12 @@ typedef void * (*mg_thread_func_t)(void *);
 int mg_start_thread(mg_thread_func_t f, void *p);
 
 
+// Pin the calling thread to a CPU list like "0-3,8,10-11", the syntax of the
+// acceptor_cpus and worker_cpus options.
+// Return: 1 on success, 0 if the list is malformed or pinning failed.
+int mg_pin_thread(const char *cpu_list);
+
+
 // Return builtin mime type for the given file name.
 // For unrecognized extensions, "text/plain" is returned.
 const char *mg_get_builtin_mime_type(const char *file_name);
@@ -18,16 +18,24 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "config.h"
 #include "util.h"
 
 char *fmmap(char *base, char *file) {
@@ -155,3 +163,507 @@ void jsondeslash(char **jstr) {
 		}
 	}
 }
+
+// describes the NUMA layout as "node0:0-7,16-23 node1:8-15,24-31", caller frees
+char *numatopology(void) {
+	char *ret=calloc(SHORT_STRING_MAX, sizeof(char));
+	char path[SHORT_STRING_MAX];
+	char cpus[SHORT_STRING_MAX];
+	int node=0, len=0;
+	FILE *fp;
+
+	while(len<SHORT_STRING_MAX-1) {
+		snprintf(path, SHORT_STRING_MAX, "/sys/devices/system/node/node%i/cpulist", node);
+		if((fp=fopen(path, "r"))==NULL) {
+			break;
+		}
+		if(fgets(cpus, SHORT_STRING_MAX, fp)!=NULL) {
+			cpus[strcspn(cpus, "\n")]='\0';
+			len+=snprintf(ret+len, SHORT_STRING_MAX-len, "%snode%i:%s", len ? " " : "", node, cpus);
+		}
+		fclose(fp);
+		node++;
+	}
+	if(node==0) { // no NUMA information, report the online cpus as one node
+		snprintf(ret, SHORT_STRING_MAX, "node0:0-%li", sysconf(_SC_NPROCESSORS_ONLN)-1);
+	}
+	return ret;
+}
+
+// sends n descriptors over a connected unix socket with SCM_RIGHTS, tags
+// carries one byte of caller defined meaning per descriptor
+int sendfds(int sock, const int *fds, const char *tags, int n) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char *cbuf;
+	int ret;
+
+	if(n<=0 || n>HANDOFF_MAX_FDS) {
+		return -1;
+	}
+	cbuf=calloc(CMSG_SPACE(n*sizeof(int)), sizeof(char));
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base=(void*)tags;
+	iov.iov_len=n;
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=cbuf;
+	msg.msg_controllen=CMSG_SPACE(n*sizeof(int));
+	cmsg=CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level=SOL_SOCKET;
+	cmsg->cmsg_type=SCM_RIGHTS;
+	cmsg->cmsg_len=CMSG_LEN(n*sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, n*sizeof(int));
+	ret=sendmsg(sock, &msg, 0)==n ? 0 : -1;
+	free(cbuf);
+	return ret;
+}
+
+// receives descriptors sent by sendfds(), returns how many arrived or -1
+int recvfds(int sock, int *fds, char *tags, int max) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char *cbuf;
+	int n=-1;
+
+	cbuf=calloc(CMSG_SPACE(max*sizeof(int)), sizeof(char));
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base=tags;
+	iov.iov_len=max;
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=cbuf;
+	msg.msg_controllen=CMSG_SPACE(max*sizeof(int));
+	if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)>0 && !(msg.msg_flags&MSG_CTRUNC)) {
+		for(cmsg=CMSG_FIRSTHDR(&msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(&msg, cmsg)) {
+			if(cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_RIGHTS) {
+				n=(cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+				memcpy(fds, CMSG_DATA(cmsg), n*sizeof(int));
+			}
+		}
+	}
+	free(cbuf);
+	return n;
+}
+
+// opens the handoff socket at path, either connected to a running
+// predecessor (*listening=0) or, if nobody is there, a fresh listener for
+// our own successor to connect to later (*listening=1)
+int handoffsock(const char *path, int *listening) {
+	struct sockaddr_un sun;
+	int sock;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family=AF_UNIX;
+	if(strlen(path)>=sizeof(sun.sun_path)) {
+		errno=ENAMETOOLONG;
+		return -1;
+	}
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path)-1);
+	if((sock=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0))==-1) {
+		return -1;
+	}
+	if(connect(sock, (struct sockaddr*)&sun, sizeof(sun))==0) {
+		*listening=0;
+		return sock;
+	}
+	unlink(path);
+	if(bind(sock, (struct sockaddr*)&sun, sizeof(sun))!=0 || listen(sock, 1)!=0) {
+		close(sock);
+		return -1;
+	}
+	*listening=1;
+	return sock;
+}
+
+// reads a config file of "key = value" lines, blank lines and lines starting
+// with # are skipped. set() is called with arg for every entry and returns
+// non-zero to reject it. Returns the number of rejected or malformed lines, -1 if the
+// file can not be read.
+int readconfig(const char *file, int (*set)(void *arg, char *key, char *val), void *arg) {
+	char line[URL_STRING_MAX];
+	char *key, *val, *e;
+	int bad=0, lineno=0;
+	FILE *fp;
+
+	if((fp=fopen(file, "r"))==NULL) {
+		return -1;
+	}
+	while(fgets(line, URL_STRING_MAX, fp)!=NULL) {
+		lineno++;
+		key=line+strspn(line, " \t");
+		if(*key=='#' || *key=='\0' || *key=='\r' || *key=='\n') {
+			continue;
+		}
+		if((val=strchr(key, '='))==NULL) {
+			LOG_ERROR(vlevel, _("%s:%i: expected key = value\n"), file, lineno);
+			bad++;
+			continue;
+		}
+		for(e=val; e>key && isspace((unsigned char)e[-1]); e--);
+		*e='\0';
+		val++;
+		val+=strspn(val, " \t");
+		for(e=val+strlen(val); e>val && isspace((unsigned char)e[-1]); e--);
+		*e='\0';
+		if(set(arg, key, val)!=0) {
+			LOG_ERROR(vlevel, _("%s:%i: invalid setting %s = %s\n"), file, lineno, key, val);
+			bad++;
+		}
+	}
+	fclose(fp);
+	return bad;
+}
+
+static int cfgset(void *arg, char *key, char *val) {
+	struct cfgkey *k=cfgfind(arg, key);
+	char *e;
+	long n;
+
+	if(k==NULL) {
+		return 1;
+	}
+	switch(k->type) {
+	case CFG_INT:
+	case CFG_LONG:
+		errno=0;
+		n=strtol(val, &e, 10);
+		if(*val=='\0' || *e!='\0' || errno!=0) {
+			return 1;
+		}
+		break;
+	case CFG_YESNO:
+		if(strcmp(val, "yes") && strcmp(val, "no")) {
+			return 1;
+		}
+		n=!strcmp(val, "yes");
+		break;
+	case CFG_NAMED:
+		if((n=k->parse(val))<0) {
+			return 1;
+		}
+		break;
+	default:
+		if(!k->flag) {
+			snprintf(k->sstaged, SHORT_STRING_MAX, "%s", val);
+		}
+		return 0;
+	}
+	if(!k->flag) {
+		k->staged=n;
+	}
+	return 0;
+}
+
+struct cfgkey *cfgfind(struct cfgkey *keys, const char *key) {
+	for(; keys->key!=NULL; keys++) {
+		if(!strcmp(keys->key, key)) {
+			return keys;
+		}
+	}
+	return NULL;
+}
+
+// marks key as set on the command line, reloads keep the flag's value
+void cfgflag(struct cfgkey *keys, const char *key) {
+	cfgfind(keys, key)->flag=1;
+}
+
+// stages the values of file, keys missing from it or set by a flag keep
+// their current value. Returns the number of bad lines and out of bounds
+// values, -1 if the file can not be read. Nothing is stored, see
+// cfgapply().
+int cfgread(const char *file, struct cfgkey *keys) {
+	struct cfgkey *k;
+	int bad;
+
+	for(k=keys; k->key!=NULL; k++) {
+		if(k->type==CFG_STRING) {
+			snprintf(k->sstaged, SHORT_STRING_MAX, "%s", *(char **)k->var ? *(char **)k->var : "");
+		} else {
+			k->staged=k->type==CFG_LONG ? *(long *)k->var : *(int *)k->var;
+		}
+	}
+	if((bad=readconfig(file, &cfgset, keys))<0) {
+		return -1;
+	}
+	for(k=keys; k->key!=NULL; k++) {
+		if((k->type==CFG_INT || k->type==CFG_LONG) && (k->staged<k->min || k->staged>k->max)) {
+			LOG_ERROR(vlevel, _("%s: %s = %li out of bounds, %li to %li\n"), file, k->key, k->staged, k->min, k->max);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+static int cfgchanged(const struct cfgkey *k) {
+	if(k->type==CFG_STRING) {
+		return strcmp(k->sstaged, *(char **)k->var ? *(char **)k->var : "")!=0;
+	}
+	return k->staged!=(k->type==CFG_LONG ? *(long *)k->var : *(int *)k->var);
+}
+
+// stores the staged values, at startup all of them. Once running keys with
+// restart set keep their value and a changed one is listed in pending.
+// Numbers are stored atomically, handlers read them without a lock.
+void cfgapply(struct cfgkey *keys, int running, char *pending, size_t len) {
+	struct cfgkey *k;
+	size_t n;
+
+	pending[0]='\0';
+	for(k=keys; k->key!=NULL; k++) {
+		if(running && k->restart) {
+			if(cfgchanged(k)) {
+				n=strlen(pending);
+				snprintf(pending+n, len-n, "%s\"%s\"", n ? ", " : "", k->key);
+			}
+		} else if(k->type==CFG_STRING) {
+			free(*(char **)k->var);
+			*(char **)k->var=*k->sstaged ? strdup(k->sstaged) : NULL;
+		} else if(k->type==CFG_LONG) {
+			__atomic_store_n((long *)k->var, k->staged, __ATOMIC_RELAXED);
+		} else {
+			__atomic_store_n((int *)k->var, (int)k->staged, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// sets the rate in tokens per second and the burst of the bucket, a rate of
+// 0 turns the limit off
+void tokenbucket_set(struct tokenbucket *tb, int rate, int burst) {
+	pthread_mutex_lock(&tb->lock);
+	__atomic_store_n(&tb->rate, rate, __ATOMIC_RELAXED);
+	tb->burst=burst;
+	pthread_mutex_unlock(&tb->lock);
+}
+
+// takes a token from the bucket, which refills at rate tokens per second and
+// holds up to burst of them (one second worth if burst is 0). Returns 1 if
+// a token was available or there is no limit.
+int tokenbucket_take(struct tokenbucket *tb) {
+	double now, cap;
+	int ret=1;
+
+	if(__atomic_load_n(&tb->rate, __ATOMIC_RELAXED)==0) {
+		return 1;
+	}
+	now=walltime();
+	pthread_mutex_lock(&tb->lock);
+	if(tb->rate>0) {
+		cap=tb->burst>0 ? tb->burst : tb->rate;
+		tb->tokens=tb->last==0 ? cap : tb->tokens+(now-tb->last)*tb->rate;
+		if(tb->tokens>cap) {
+			tb->tokens=cap;
+		}
+		tb->last=now;
+		if((ret=tb->tokens>=1)) {
+			tb->tokens-=1;
+		}
+	}
+	pthread_mutex_unlock(&tb->lock);
+	return ret;
+}
+
+// seconds since the epoch, with microseconds
+double walltime(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+// returns the absolute deadline given by an X-Request-Deadline value, 0 if
+// there is none or it does not parse. Relative values count from arrival,
+// or from now if the arrival time is unknown.
+double deadlineparse(const char *hdr, double arrival) {
+	char *e;
+	double v;
+
+	if(hdr==NULL) {
+		return 0;
+	}
+	v=strtod(hdr+(*hdr=='+'), &e);
+	if(e==hdr+(*hdr=='+') || *e!='\0' || v<0) {
+		return 0;
+	}
+	if(*hdr=='+') {
+		return (arrival>0 ? arrival : walltime())+v/1000.0;
+	}
+	return v;
+}
+
+int keybucket(int layout, const char *key, size_t klen) {
+	return bhash(LAYOUT_HASH(layout), key, klen) % BUCKETS;
+}
+
+// the key as it is stored under layout, malloc()ed, slen gets its length
+char *storedkey(int layout, const char *key, size_t klen, size_t *slen) {
+	return storedkeyin(layout, layout & LAYOUT_BUCKET ? keybucket(layout, key, klen) : 0, key, klen, slen);
+}
+
+// the same for a key whose bucket the caller already knows
+char *storedkeyin(int layout, int bucket, const char *key, size_t klen, size_t *slen) {
+	size_t pfx=layout & LAYOUT_BUCKET ? BUCKET_PREFIX_LEN : 0;
+	char *sk=malloc(klen+pfx+1);
+
+	if(sk==NULL) {
+		return NULL;
+	}
+	if(pfx) {
+		sk[0]=(bucket>>8) & 0xff;
+		sk[1]=bucket & 0xff;
+	}
+	memcpy(sk+pfx, key, klen);
+	*slen=klen+pfx;
+	return sk;
+}
+
+static const char *layoutnames[]={ "raw", "bucket", "raw,ttl", "bucket,ttl",
+	"raw,version", "bucket,version", "raw,ttl,version", "bucket,ttl,version",
+	"raw,crc32c", "bucket,crc32c", "raw,ttl,crc32c", "bucket,ttl,crc32c",
+	"raw,version,crc32c", "bucket,version,crc32c", "raw,ttl,version,crc32c", "bucket,ttl,version,crc32c" };
+
+int layoutparse(const char *name) {
+	int i;
+
+	for(i=0; i<16; i++) {
+		if(!strcmp(name, layoutnames[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char *layoutname(int layout) {
+	return layoutnames[layout & (LAYOUT_BUCKET|LAYOUT_HEADER|LAYOUT_CRC32C)];
+}
+
+// returns the layout recorded in dir, LAYOUT_RAW if there is a database
+// without a record, -1 if dir holds no database yet or the record is bad
+int layoutread(const char *dir) {
+	char path[SHORT_STRING_MAX], name[32];
+	FILE *fp;
+	int layout=-1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, LAYOUT_FILE);
+	if((fp=fopen(path, "r"))!=NULL) {
+		if(fgets(name, sizeof(name), fp)!=NULL) {
+			name[strcspn(name, "\r\n")]='\0';
+			layout=layoutparse(name);
+		}
+		fclose(fp);
+		return layout;
+	}
+	snprintf(path, sizeof(path), "%s/CURRENT", dir);
+	return access(path, F_OK)==0 ? LAYOUT_RAW : -1;
+}
+
+int layoutwrite(const char *dir, int layout) {
+	char path[SHORT_STRING_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, LAYOUT_FILE);
+	if((fp=fopen(path, "w"))==NULL) {
+		return -1;
+	}
+	fprintf(fp, "%s\n", layoutname(layout));
+	return fclose(fp);
+}
+
+// writes the header for a value expiring at expires, 0 never, with version,
+// 0 for none. Returns its length, hdr needs VALUE_HEADER_MAX bytes.
+size_t valueencode(char *hdr, uint32_t expires, unsigned long long version) {
+	size_t n=1;
+
+	hdr[0]=(expires ? VALUE_EXPIRES : 0) | (version ? VALUE_VERSION : 0);
+	if(expires) {
+		hdr[n++]=(expires>>24) & 0xff;
+		hdr[n++]=(expires>>16) & 0xff;
+		hdr[n++]=(expires>>8) & 0xff;
+		hdr[n++]=expires & 0xff;
+	}
+	while(version) {
+		hdr[n++]=(version & 0x7f) | (version>0x7f ? 0x80 : 0);
+		version>>=7;
+	}
+	return n;
+}
+
+// splits a stored value into its header fields and body, 0 if the header is
+// bad. Missing fields are 0.
+int valuedecode(const char *val, size_t vlen, uint32_t *expires, unsigned long long *version, const char **body, size_t *blen) {
+	const unsigned char *v=(const unsigned char *)val;
+	size_t n=1;
+	int shift=0;
+
+	*expires=0;
+	*version=0;
+	if(vlen<1 || (v[0] & ~(VALUE_EXPIRES|VALUE_VERSION))) {
+		return 0;
+	}
+	if(v[0] & VALUE_EXPIRES) {
+		if(vlen<n+4) {
+			return 0;
+		}
+		*expires=(uint32_t)v[1]<<24 | v[2]<<16 | v[3]<<8 | v[4];
+		n+=4;
+	}
+	if(v[0] & VALUE_VERSION) {
+		do {
+			if(n>=vlen || shift>63) {
+				return 0;
+			}
+			*version|=(unsigned long long)(v[n] & 0x7f)<<shift;
+			shift+=7;
+		} while(v[n++] & 0x80);
+	}
+	*body=val+n;
+	*blen=vlen-n;
+	return 1;
+}
+
+// points body past the header, 0 if the value expired or the header is bad
+int valuebody(const char *val, size_t vlen, time_t now, const char **body, size_t *blen) {
+	unsigned long long version;
+	uint32_t expires;
+
+	return valuedecode(val, vlen, &expires, &version, body, blen) && (expires==0 || (time_t)expires>now);
+}
+
+unsigned long long versionsread(const char *dir) {
+	char path[SHORT_STRING_MAX], num[32];
+	unsigned long long ceil=0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, VERSIONS_FILE);
+	if((fp=fopen(path, "r"))!=NULL) {
+		if(fgets(num, sizeof(num), fp)!=NULL) {
+			ceil=strtoull(num, NULL, 10);
+		}
+		fclose(fp);
+	}
+	return ceil;
+}
+
+// replaces the file atomically and syncs it, a crash leaves the old or the
+// new ceiling, never none
+int versionswrite(const char *dir, unsigned long long ceil) {
+	char path[SHORT_STRING_MAX], tmp[SHORT_STRING_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, VERSIONS_FILE);
+	snprintf(tmp, sizeof(tmp), "%s/%s.tmp", dir, VERSIONS_FILE);
+	if((fp=fopen(tmp, "w"))==NULL) {
+		return -1;
+	}
+	if(fprintf(fp, "%llu\n", ceil)<0 || fflush(fp)!=0 || fsync(fileno(fp))!=0) {
+		fclose(fp);
+		return -1;
+	}
+	if(fclose(fp)!=0) {
+		return -1;
+	}
+	return rename(tmp, path);
+}
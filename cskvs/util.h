@@ -21,10 +21,14 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__ 
 
+#include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 #include <libintl.h>
 #include <locale.h>
 
+#include "bhash.h"
+
 #ifndef _
 #define _(STRING)    gettext(STRING)
 #endif
@@ -35,11 +39,102 @@ char *fmmap(char *base, char *file);
 char *strreplace(const char* instr, char *sstr, char *dstr);
 int url_decode(const char *src, size_t src_len, char *dst, size_t dst_len, int is_form_url_encoded);
 void jsondeslash(char **jstr);
+char *numatopology(void);
+int sendfds(int sock, const int *fds, const char *tags, int n);
+int recvfds(int sock, int *fds, char *tags, int max);
+int handoffsock(const char *path, int *listening);
+
+// rate limiter, see tokenbucket_take()
+struct tokenbucket {
+	pthread_mutex_t lock;
+	int rate;
+	int burst;
+	double tokens;
+	double last;
+};
+#define TOKENBUCKET_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 }
+void tokenbucket_set(struct tokenbucket *tb, int rate, int burst);
+int tokenbucket_take(struct tokenbucket *tb);
+
+// request deadlines, X-Request-Deadline is either absolute seconds since the
+// epoch (fractions allowed) or +N milliseconds relative to the arrival time
+#define DEADLINE_HEADER "X-Request-Deadline"
+double walltime(void);
+double deadlineparse(const char *hdr, double arrival);
+
+// on-disk key layouts. raw stores keys as given, bucket puts the key's
+// bucket id in front (BUCKET_PREFIX_LEN bytes, big endian) so each bucket is
+// one contiguous key range. LAYOUT_TTL and LAYOUT_VERSION can be added to
+// either, values then carry a header, see valueencode(). LAYOUT_CRC32C
+// assigns buckets by BHASH_CRC32C instead of zlib's crc32(). The layout of a
+// database is recorded in LAYOUT_FILE in its directory, databases without one
+// are raw.
+#define LAYOUT_RAW 0
+#define LAYOUT_BUCKET 1
+#define LAYOUT_TTL 2
+#define LAYOUT_VERSION 4
+#define LAYOUT_CRC32C 8
+#define LAYOUT_HEADER (LAYOUT_TTL|LAYOUT_VERSION)
+#define LAYOUT_HASH(layout) ((layout) & LAYOUT_CRC32C ? BHASH_CRC32C : BHASH_CRC32)
+#define LAYOUT_FILE "LAYOUT"
+#define BUCKET_PREFIX_LEN 2
+int keybucket(int layout, const char *key, size_t klen);
+char *storedkey(int layout, const char *key, size_t klen, size_t *slen);
+char *storedkeyin(int layout, int bucket, const char *key, size_t klen, size_t *slen);
+int layoutparse(const char *name);
+const char *layoutname(int layout);
+int layoutread(const char *dir);
+int layoutwrite(const char *dir, int layout);
+
+// value header of LAYOUT_HEADER databases, a tag byte of VALUE_* flags, with
+// VALUE_EXPIRES the expiry in unix seconds as big endian u32, then with
+// VALUE_VERSION the version as an LEB128 varint. VALUE_PLAIN is neither.
+#define VALUE_PLAIN 0
+#define VALUE_EXPIRES 1
+#define VALUE_VERSION 2
+#define VALUE_HEADER_MAX 15
+size_t valueencode(char *hdr, uint32_t expires, unsigned long long version);
+int valuedecode(const char *val, size_t vlen, uint32_t *expires, unsigned long long *version, const char **body, size_t *blen);
+int valuebody(const char *val, size_t vlen, time_t now, const char **body, size_t *blen);
+
+// versions are handed out in blocks, VERSIONS_FILE in the database directory
+// holds the end of the last block so they keep growing across restarts
+#define VERSIONS_FILE "VERSIONS"
+unsigned long long versionsread(const char *dir);
+int versionswrite(const char *dir, unsigned long long ceil);
 
 #define SHORT_STRING_MAX 512 
 #define URL_STRING_MAX 8192
 #define POST_DATA_STRING_MAX 16384
-
+#define HANDOFF_MAX_FDS 16
+
+// a config file key and the variable it sets, tables of them end with a
+// NULL key. cfgread() stages the file's values, cfgapply() stores them.
+#define CFG_INT 0      // int between min and max
+#define CFG_LONG 1     // long between min and max
+#define CFG_YESNO 2    // int, 1 for yes and 0 for no
+#define CFG_STRING 3   // malloc()ed char *, NULL for an empty value
+#define CFG_NAMED 4    // int, parse turns the name into it, name back
+struct cfgkey {
+	const char *key;
+	int type;
+	void *var;
+	long min;
+	long max;
+	int restart;                     // only stored at startup
+	int (*parse)(const char *name);  // negative for an unknown name
+	const char *(*name)(int value);
+	long staged;
+	char sstaged[SHORT_STRING_MAX];
+	int flag;                        // set by a flag, the file can't change it
+};
+int readconfig(const char *file, int (*set)(void *arg, char *key, char *val), void *arg);
+struct cfgkey *cfgfind(struct cfgkey *keys, const char *key);
+void cfgflag(struct cfgkey *keys, const char *key);
+int cfgread(const char *file, struct cfgkey *keys);
+void cfgapply(struct cfgkey *keys, int running, char *pending, size_t len);
+
+// vlevel changes on a config reload, the macros read it atomically
 #define LOG_LVL_TRACE 4
 #define LOG_LVL_DEBUG 3
 #define LOG_LVL_INFO 2
@@ -47,7 +142,7 @@ void jsondeslash(char **jstr);
 #define LOG_LVL_ERROR 0
 #define LOG_LVL_FATAL -1
 
-#define LOG_TRACE(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_TRACE) { \
+#define LOG_TRACE(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_TRACE) { \
       time_t t=time(NULL);                                    \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -56,7 +151,7 @@ void jsondeslash(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_DEBUG(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_DEBUG) { \
+#define LOG_DEBUG(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_DEBUG) { \
       time_t t=time(NULL);                                    \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -65,7 +160,7 @@ void jsondeslash(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_INFO(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_INFO) { \
+#define LOG_INFO(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_INFO) { \
       time_t t=time(NULL);                                  \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -74,7 +169,7 @@ void jsondeslash(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_WARN(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_WARN) { \
+#define LOG_WARN(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_WARN) { \
       time_t t=time(NULL);                                  \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -83,7 +178,7 @@ void jsondeslash(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_ERROR(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_ERROR) { \
+#define LOG_ERROR(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_ERROR) { \
       time_t t=time(NULL);                                    \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -92,7 +187,7 @@ void jsondeslash(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_FATAL(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_FATAL) { \
+#define LOG_FATAL(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_FATAL) { \
       time_t t=time(NULL);                                    \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
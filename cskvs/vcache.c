@@ -0,0 +1,311 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vcache.h"
+
+struct vcentry {
+	struct vcentry *next;   // hash chain
+	uint64_t hash;
+	size_t klen;
+	size_t vlen;
+	size_t slot;            // index in the clock ring
+	int ref;
+	char data[];            // key, then value
+};
+
+struct vcshard {
+	pthread_mutex_t lock;
+	struct vcentry **table;
+	size_t nbuckets;
+	struct vcentry **ring;  // the clock, entries in insertion order
+	size_t nring;
+	size_t ringsize;
+	size_t hand;
+	size_t bytes;
+	size_t budget;
+	unsigned long gen;      // bumped by every write to the shard
+	int writing;            // writes between vcache_begin() and vcache_end()
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	unsigned long evictions;
+	unsigned long invalidations;
+} __attribute__((aligned(64)));
+
+struct vcache {
+	struct vcshard shards[VCACHE_SHARDS];
+};
+
+#define ENTRY_SIZE(e) (sizeof(struct vcentry)+(e)->klen+(e)->vlen)
+
+// FNV-1a, the low bits pick the shard and the high bits the bucket
+static uint64_t vchash(const char *key, size_t klen) {
+	uint64_t h=14695981039346656037ULL;
+	size_t i;
+
+	for(i=0; i<klen; i++) {
+		h^=(unsigned char)key[i];
+		h*=1099511628211ULL;
+	}
+	return h;
+}
+
+static struct vcshard *vcshard(struct vcache *vc, uint64_t h) {
+	return &vc->shards[h % VCACHE_SHARDS];
+}
+
+static struct vcentry **vcfind(struct vcshard *s, uint64_t h, const char *key, size_t klen) {
+	struct vcentry **p=&s->table[(h>>32) & (s->nbuckets-1)];
+
+	while(*p!=NULL && ((*p)->hash!=h || (*p)->klen!=klen || memcmp((*p)->data, key, klen))) {
+		p=&(*p)->next;
+	}
+	return p;
+}
+
+// unlinks the entry p points at from the table and the ring and frees it
+static void vcremove(struct vcshard *s, struct vcentry **p) {
+	struct vcentry *e=*p;
+
+	*p=e->next;
+	s->ring[e->slot]=s->ring[--s->nring];
+	s->ring[e->slot]->slot=e->slot;
+	if(s->hand>=s->nring) {
+		s->hand=0;
+	}
+	s->bytes-=ENTRY_SIZE(e);
+	free(e);
+}
+
+// makes room for need bytes, second chance for referenced entries
+static void vcevict(struct vcshard *s, size_t need) {
+	struct vcentry *e;
+
+	while(s->nring>0 && s->bytes+need>s->budget) {
+		e=s->ring[s->hand];
+		if(e->ref) {
+			e->ref=0;
+			s->hand=(s->hand+1) % s->nring;
+		} else {
+			vcremove(s, vcfind(s, e->hash, e->data, e->klen));
+			s->evictions++;
+		}
+	}
+}
+
+static int vcgrow(struct vcshard *s) {
+	struct vcentry **nt, *e, *next;
+	size_t i, nb=s->nbuckets*2;
+
+	if((nt=calloc(nb, sizeof(struct vcentry *)))==NULL) {
+		return -1;
+	}
+	for(i=0; i<s->nbuckets; i++) {
+		for(e=s->table[i]; e!=NULL; e=next) {
+			next=e->next;
+			e->next=nt[(e->hash>>32) & (nb-1)];
+			nt[(e->hash>>32) & (nb-1)]=e;
+		}
+	}
+	free(s->table);
+	s->table=nt;
+	s->nbuckets=nb;
+	return 0;
+}
+
+struct vcache *vcache_new(size_t budget) {
+	struct vcache *vc=calloc(1, sizeof(struct vcache));
+	int i;
+
+	if(vc==NULL) {
+		return NULL;
+	}
+	for(i=0; i<VCACHE_SHARDS; i++) {
+		pthread_mutex_init(&vc->shards[i].lock, NULL);
+		vc->shards[i].nbuckets=64;
+		vc->shards[i].table=calloc(vc->shards[i].nbuckets, sizeof(struct vcentry *));
+		vc->shards[i].budget=budget/VCACHE_SHARDS;
+		if(vc->shards[i].table==NULL) {
+			vcache_free(vc);
+			return NULL;
+		}
+	}
+	return vc;
+}
+
+void vcache_resize(struct vcache *vc, size_t budget) {
+	int i;
+
+	for(i=0; i<VCACHE_SHARDS; i++) {
+		pthread_mutex_lock(&vc->shards[i].lock);
+		vc->shards[i].budget=budget/VCACHE_SHARDS;
+		vcevict(&vc->shards[i], 0);
+		pthread_mutex_unlock(&vc->shards[i].lock);
+	}
+}
+
+void vcache_free(struct vcache *vc) {
+	size_t j;
+	int i;
+
+	if(vc==NULL) {
+		return;
+	}
+	for(i=0; i<VCACHE_SHARDS; i++) {
+		for(j=0; j<vc->shards[i].nring; j++) {
+			free(vc->shards[i].ring[j]);
+		}
+		free(vc->shards[i].ring);
+		free(vc->shards[i].table);
+		pthread_mutex_destroy(&vc->shards[i].lock);
+	}
+	free(vc);
+}
+
+void vcache_view(struct vcache *vc, unsigned long *gens) {
+	int i;
+
+	for(i=0; i<VCACHE_SHARDS; i++) {
+		gens[i]=__sync_fetch_and_add(&vc->shards[i].gen, 0);
+	}
+}
+
+int vcache_get(struct vcache *vc, const unsigned long *gens, const char *key, size_t klen, char **val, size_t *vlen) {
+	uint64_t h=vchash(key, klen);
+	struct vcshard *s=vcshard(vc, h);
+	struct vcentry *e;
+	int hit=0;
+
+	if(s->budget==0) {
+		return 0;
+	}
+	pthread_mutex_lock(&s->lock);
+	e=*vcfind(s, h, key, klen);
+	if(e!=NULL && (gens==NULL || (gens[h % VCACHE_SHARDS]==s->gen && !s->writing)) &&
+		 (*val=malloc(e->vlen ? e->vlen : 1))!=NULL) {
+		memcpy(*val, e->data+e->klen, e->vlen);
+		*vlen=e->vlen;
+		e->ref=1;
+		hit=1;
+		s->hits++;
+	} else {
+		s->misses++;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return hit;
+}
+
+void vcache_fill(struct vcache *vc, const unsigned long *gens, const char *key, size_t klen, const char *val, size_t vlen) {
+	uint64_t h=vchash(key, klen);
+	struct vcshard *s=vcshard(vc, h);
+	struct vcentry *e, **p;
+	size_t need=sizeof(struct vcentry)+klen+vlen;
+
+	// a single entry may take at most an eighth of its shard
+	if(need>s->budget/8) {
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	if(gens[h % VCACHE_SHARDS]!=s->gen || s->writing || *(p=vcfind(s, h, key, klen))!=NULL) {
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	vcevict(s, need);
+	if(s->nring==s->ringsize) {
+		size_t n=s->ringsize ? s->ringsize*2 : 64;
+		struct vcentry **nr=realloc(s->ring, n*sizeof(struct vcentry *));
+
+		if(nr==NULL) {
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+		s->ring=nr;
+		s->ringsize=n;
+	}
+	if((e=malloc(need))!=NULL) {
+		e->hash=h;
+		e->klen=klen;
+		e->vlen=vlen;
+		e->ref=0;
+		memcpy(e->data, key, klen);
+		memcpy(e->data+klen, val, vlen);
+		// eviction may have emptied the bucket p pointed into
+		p=vcfind(s, h, key, klen);
+		e->next=*p;
+		*p=e;
+		e->slot=s->nring;
+		s->ring[s->nring++]=e;
+		s->bytes+=need;
+		s->inserts++;
+		if(s->nring>s->nbuckets) {
+			vcgrow(s);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void vcinvalidate(struct vcache *vc, const char *key, size_t klen, int delta) {
+	uint64_t h=vchash(key, klen);
+	struct vcshard *s=vcshard(vc, h);
+	struct vcentry **p;
+
+	pthread_mutex_lock(&s->lock);
+	if(*(p=vcfind(s, h, key, klen))!=NULL) {
+		vcremove(s, p);
+		s->invalidations++;
+	}
+	s->gen++;
+	s->writing+=delta;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void vcache_begin(struct vcache *vc, const char *key, size_t klen) {
+	vcinvalidate(vc, key, klen, 1);
+}
+
+void vcache_end(struct vcache *vc, const char *key, size_t klen) {
+	vcinvalidate(vc, key, klen, -1);
+}
+
+void vcache_stats(struct vcache *vc, struct vcache_stats *st) {
+	int i;
+
+	memset(st, 0, sizeof(struct vcache_stats));
+	for(i=0; i<VCACHE_SHARDS; i++) {
+		struct vcshard *s=&vc->shards[i];
+
+		pthread_mutex_lock(&s->lock);
+		st->hits+=s->hits;
+		st->misses+=s->misses;
+		st->inserts+=s->inserts;
+		st->evictions+=s->evictions;
+		st->invalidations+=s->invalidations;
+		st->entries+=s->nring;
+		st->bytes+=s->bytes;
+		st->budget+=s->budget;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
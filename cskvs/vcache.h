@@ -0,0 +1,70 @@
+// Copyright (c) 2012 Dave DeMaagd
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef __VCACHE_H__
+#define __VCACHE_H__
+
+#include <stddef.h>
+
+// In-process cache of leveldb values for hot keys, split into VCACHE_SHARDS
+// independently locked shards that share a byte budget. Eviction is CLOCK:
+// a hit sets the entry's reference bit, the hand clears it on its first pass
+// and evicts on the second.
+//
+// Writers bracket their leveldb write with vcache_begin() and vcache_end().
+// Both drop the key and bump its shard's generation, and while a write is in
+// flight the shard takes no fills. Readers take a view of the generations
+// before reading leveldb and pass it to vcache_fill(), which refuses the
+// value if any write touched the shard meanwhile, so a stale read never
+// lands in the cache.
+
+#define VCACHE_SHARDS 64
+
+struct vcache;
+
+struct vcache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	unsigned long evictions;
+	unsigned long invalidations;
+	size_t entries;
+	size_t bytes;
+	size_t budget;
+};
+
+struct vcache *vcache_new(size_t budget);
+void vcache_resize(struct vcache *vc, size_t budget);
+void vcache_free(struct vcache *vc);
+
+// gens gets VCACHE_SHARDS entries
+void vcache_view(struct vcache *vc, unsigned long *gens);
+// 1 and a malloc()ed copy of the value on a hit. With gens, only entries
+// that are still current for that view count.
+int vcache_get(struct vcache *vc, const unsigned long *gens, const char *key, size_t klen, char **val, size_t *vlen);
+void vcache_fill(struct vcache *vc, const unsigned long *gens, const char *key, size_t klen, const char *val, size_t vlen);
+
+void vcache_begin(struct vcache *vc, const char *key, size_t klen);
+void vcache_end(struct vcache *vc, const char *key, size_t klen);
+
+void vcache_stats(struct vcache *vc, struct vcache_stats *st);
+
+#endif // __VCACHE_H__
@@ -77,7 +77,7 @@ int db_select(dbhandle **dbh, char *key, char **ret) {
 	LOG_DEBUG(vlevel, _("Selecting '%s'\n"),key);
 	char *tmp=leveldb_get((*dbh)->dbh, (*dbh)->ropt, key, strlen(key), &klen, &((*dbh)->errptr));
 	if((*dbh)->errptr!=NULL) {
-		LOG_ERROR("leveldb_get(): '%s': %s\n",key,(*dbh)->errptr);
+		LOG_ERROR(vlevel, "leveldb_get(): '%s': %s\n",key,(*dbh)->errptr);
 		return 1; 
 	}
 	if(klen==0) {
@@ -23,6 +23,7 @@
 #else
 #ifdef __linux__
 #define _XOPEN_SOURCE 600     // For flockfile() on Linux
+#define _GNU_SOURCE           // For struct ucred on Linux
 #endif
 #define _LARGEFILE_SOURCE     // Enable 64-bit file offsets
 #define __STDC_FORMAT_MACROS  // <inttypes.h> wants this for C++
@@ -183,6 +184,7 @@ typedef struct DIR {
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
@@ -412,6 +414,9 @@ union usa {
 #if defined(USE_IPV6)
   struct sockaddr_in6 sin6;
 #endif
+#if !defined(_WIN32)
+  struct sockaddr_un un;
+#endif
 };
 
 // Describes a string (chunk of memory).
@@ -443,6 +448,7 @@ struct socket {
 enum {
   CGI_EXTENSIONS, CGI_ENVIRONMENT, PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER,
   PROTECT_URI, AUTHENTICATION_DOMAIN, SSI_EXTENSIONS, THROTTLE,
+  UNIX_ACCESS_CONTROL_LIST,
   ACCESS_LOG_FILE, ENABLE_DIRECTORY_LISTING, ERROR_LOG_FILE,
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
   EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
@@ -459,6 +465,7 @@ static const char *config_options[] = {
   "R", "authentication_domain", "mydomain.com",
   "S", "ssi_pattern", "**.shtml$|**.shtm$",
   "T", "throttle", NULL,
+  "U", "unix_access_control_list", NULL,
   "a", "access_log_file", NULL,
   "d", "enable_directory_listing", "yes",
   "e", "error_log_file", NULL,
@@ -489,6 +496,7 @@ struct mg_context {
   struct socket *listening_sockets;
 
   volatile int num_threads;  // Number of threads
+  volatile int target_threads;  // Number of threads wanted, see mg_set_num_threads()
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
@@ -4244,12 +4252,63 @@ static void close_all_listening_sockets(struct mg_context *ctx) {
   for (sp = ctx->listening_sockets; sp != NULL; sp = tmp) {
     tmp = sp->next;
     (void) closesocket(sp->sock);
+#if !defined(_WIN32)
+    if (sp->lsa.sa.sa_family == AF_UNIX) {
+      (void) unlink(sp->lsa.un.sun_path);
+    }
+#endif
     free(sp);
   }
 }
 
-// Valid listening port specification is: [ip_address:]port[s]
-// Examples: 80, 443s, 127.0.0.1:3128, 1.2.3.4:8080s
+// Length of the address actually stored in the union. Linux refuses to
+// bind() a Unix socket with a length larger than struct sockaddr_un.
+static socklen_t usa_len(const union usa *usa) {
+#if !defined(_WIN32)
+  if (usa->sa.sa_family == AF_UNIX) {
+    return sizeof(usa->un);
+  }
+#endif
+  return sizeof(*usa);
+}
+
+#if !defined(_WIN32)
+// Remove Unix socket file left behind by a previous run. If something is
+// still accepting connections on that path, or the path is not a socket at
+// all, leave it alone and fail.
+static int remove_stale_socket(const union usa *usa) {
+  struct stat st;
+  SOCKET sock;
+  int in_use;
+
+  if (usa->sa.sa_family != AF_UNIX ||
+      lstat(usa->un.sun_path, &st) != 0) {
+    return 0;
+  } else if (!S_ISSOCK(st.st_mode)) {
+    errno = EEXIST;
+    return -1;
+  } else if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+    return -1;
+  }
+  in_use = connect(sock, &usa->sa, usa_len(usa)) == 0;
+  (void) closesocket(sock);
+  if (in_use) {
+    errno = EADDRINUSE;
+    return -1;
+  }
+  (void) unlink(usa->un.sun_path);
+
+  return 0;
+}
+#else
+static int remove_stale_socket(const union usa *usa) {
+  (void) usa;
+  return 0;
+}
+#endif // !_WIN32
+
+// Valid listening port specification is: [ip_address:]port[s] or unix:path
+// Examples: 80, 443s, 127.0.0.1:3128, 1.2.3.4:8080s, unix:/run/cskvs.sock
 // TODO(lsm): add parsing of the IPv6 address
 static int parse_port_string(const struct vec *vec, struct socket *so) {
   int a, b, c, d, port, len;
@@ -4259,6 +4318,18 @@ static int parse_port_string(const struct vec *vec, struct socket *so) {
   // for both IPv4 and IPv6 (INADDR_ANY and IN6ADDR_ANY_INIT).
   memset(so, 0, sizeof(*so));
 
+#if !defined(_WIN32)
+  if (vec->len > 5 && !strncmp(vec->ptr, "unix:", 5)) {
+    len = (int) vec->len - 5;
+    if (len >= (int) sizeof(so->lsa.un.sun_path)) {
+      return 0;
+    }
+    so->lsa.un.sun_family = AF_UNIX;
+    memcpy(so->lsa.un.sun_path, vec->ptr + 5, (size_t) len);
+    return 1;
+  }
+#endif // !_WIN32
+
   if (sscanf(vec->ptr, "%d.%d.%d.%d:%d%n", &a, &b, &c, &d, &port, &len) == 5) {
     // Bind to a specific IPv4 address
     so->lsa.sin.sin_addr.s_addr = htonl((a << 24) | (b << 16) | (c << 8) | d);
@@ -4291,13 +4362,19 @@ static int set_ports_option(struct mg_context *ctx) {
   while (success && (list = next_option(list, &vec, NULL)) != NULL) {
     if (!parse_port_string(&vec, &so)) {
       cry(fc(ctx), "%s: %.*s: invalid port spec. Expecting list of: %s",
-          __func__, (int) vec.len, vec.ptr, "[IP_ADDRESS:]PORT[s|p]");
+          __func__, (int) vec.len, vec.ptr,
+          "[IP_ADDRESS:]PORT[s|p] or unix:PATH");
       success = 0;
     } else if (so.is_ssl &&
                (ctx->ssl_ctx == NULL || ctx->config[SSL_CERTIFICATE] == NULL)) {
       cry(fc(ctx), "Cannot add SSL socket, is -ssl_certificate option set?");
       success = 0;
-    } else if ((sock = socket(so.lsa.sa.sa_family, SOCK_STREAM, 6)) ==
+    } else if (remove_stale_socket(&so.lsa) != 0) {
+      cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
+          (int) vec.len, vec.ptr, strerror(ERRNO));
+      success = 0;
+    } else if ((sock = socket(so.lsa.sa.sa_family, SOCK_STREAM,
+                              so.lsa.sa.sa_family == AF_UNIX ? 0 : 6)) ==
                INVALID_SOCKET ||
                // On Windows, SO_REUSEADDR is recommended only for
                // broadcast UDP sockets
@@ -4312,7 +4389,7 @@ static int set_ports_option(struct mg_context *ctx) {
                // Thanks to Igor Klopov who suggested the patch.
                setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (char *) &on,
                           sizeof(on)) != 0 ||
-               bind(sock, &so.lsa.sa, sizeof(so.lsa)) != 0 ||
+               bind(sock, &so.lsa.sa, usa_len(&so.lsa)) != 0 ||
                listen(sock, SOMAXCONN) != 0) {
       closesocket(sock);
       cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
@@ -4386,11 +4463,11 @@ static void log_access(const struct mg_connection *conn) {
 
 // Verify given socket address against the ACL.
 // Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
-static int check_acl(struct mg_context *ctx, uint32_t remote_ip) {
+static int check_acl_list(struct mg_context *ctx, const char *list,
+                          uint32_t remote_ip) {
   int allowed, flag;
   uint32_t net, mask;
   struct vec vec;
-  const char *list = ctx->config[ACCESS_CONTROL_LIST];
 
   // If any ACL is set, deny by default
   allowed = list == NULL ? '+' : '-';
@@ -4411,6 +4488,95 @@ static int check_acl(struct mg_context *ctx, uint32_t remote_ip) {
   return allowed == '+';
 }
 
+static int check_acl(struct mg_context *ctx, uint32_t remote_ip) {
+  return check_acl_list(ctx, ctx->config[ACCESS_CONTROL_LIST], remote_ip);
+}
+
+int mg_check_acl(struct mg_connection *conn, const char *list) {
+  uint32_t remote_ip;
+
+  // Unix socket peers were checked against their credentials on accept
+  if (conn->client.rsa.sa.sa_family == AF_UNIX) {
+    return 1;
+  }
+  remote_ip = ntohl(* (uint32_t *) &conn->client.rsa.sin.sin_addr);
+  if (list == NULL) {
+    return (remote_ip >> 24) == 127;
+  }
+  return check_acl_list(conn->ctx, list, remote_ip);
+}
+
+// Verify credentials of the process on the other end of a Unix socket
+// against the unix_access_control_list, e.g. "+uid:1000,+gid:33,-uid:0".
+// Return -1 if ACL is malformed, 0 if peer is disallowed, 1 if allowed.
+static int check_peer_acl(struct mg_context *ctx, unsigned long uid,
+                          unsigned long gid) {
+  int allowed, flag, n;
+  unsigned long id;
+  struct vec vec;
+  const char *list = ctx->config[UNIX_ACCESS_CONTROL_LIST];
+
+  // If any ACL is set, deny by default
+  allowed = list == NULL ? '+' : '-';
+
+  while ((list = next_option(list, &vec, NULL)) != NULL) {
+    flag = vec.ptr[0];
+    n = 0;
+    if (flag != '+' && flag != '-') {
+      // Malformed, reported below
+    } else if (vec.len == 2 && vec.ptr[1] == '*') {
+      allowed = flag;
+      n = 1;
+    } else if (sscanf(&vec.ptr[1], "uid:%lu%n", &id, &n) == 1 &&
+               isdigit(* (const unsigned char *) &vec.ptr[5])) {
+      allowed = id == uid ? flag : allowed;
+    } else if (sscanf(&vec.ptr[1], "gid:%lu%n", &id, &n) == 1 &&
+               isdigit(* (const unsigned char *) &vec.ptr[5])) {
+      allowed = id == gid ? flag : allowed;
+    } else {
+      n = 0;
+    }
+    // The id must run up to the end of the entry, e.g. no "+uid:1x"
+    if (n == 0 || n + 1 != (int) vec.len) {
+      cry(fc(ctx), "%s: entry must be [+|-]uid:N, [+|-]gid:N or [+|-]*",
+          __func__);
+      return -1;
+    }
+  }
+
+  return allowed == '+';
+}
+
+// Fetch credentials of the peer process connected to a Unix socket.
+// Return 0 if they are not available.
+static int get_peer_credentials(SOCKET sock, unsigned long *uid,
+                                unsigned long *gid) {
+#if defined(SO_PEERCRED)
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+    return 0;
+  }
+  *uid = cred.uid;
+  *gid = cred.gid;
+  return 1;
+#elif !defined(_WIN32)
+  uid_t u;
+  gid_t g;
+
+  if (getpeereid(sock, &u, &g) != 0) {
+    return 0;
+  }
+  *uid = u;
+  *gid = g;
+  return 1;
+#else
+  (void) sock; (void) uid; (void) gid;
+  return 0;
+#endif
+}
+
 static void add_to_set(SOCKET fd, fd_set *set, int *max_fd) {
   FD_SET(fd, set);
   if (fd > (SOCKET) *max_fd) {
@@ -4589,7 +4755,8 @@ static int set_gpass_option(struct mg_context *ctx) {
 }
 
 static int set_acl_option(struct mg_context *ctx) {
-  return check_acl(ctx, (uint32_t) 0x7f000001UL) != -1;
+  return check_acl(ctx, (uint32_t) 0x7f000001UL) != -1 &&
+    check_peer_acl(ctx, 0, 0) != -1;
 }
 
 static void reset_per_request_attributes(struct mg_connection *conn) {
@@ -4816,10 +4983,19 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   DEBUG_TRACE(("going idle"));
 
   // If the queue is empty, wait. We're idle at this point.
-  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
+  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0 &&
+         ctx->num_threads <= ctx->target_threads) {
     pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
   }
 
+  // Thread count was lowered, retire this worker
+  if (ctx->num_threads > ctx->target_threads && ctx->stop_flag == 0) {
+    ctx->num_threads--;
+    DEBUG_TRACE(("retiring, %d threads left", ctx->num_threads));
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return -1;
+  }
+
   // If we're stopping, sq_head may be equal to sq_tail.
   if (ctx->sq_head > ctx->sq_tail) {
     // Copy socket from the queue and increment tail
@@ -4842,6 +5018,7 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
 
 static void worker_thread(struct mg_context *ctx) {
   struct mg_connection *conn;
+  int got = 0;
 
   conn = (struct mg_connection *) calloc(1, sizeof(*conn) + MAX_REQUEST_SIZE);
   if (conn == NULL) {
@@ -4852,7 +5029,7 @@ static void worker_thread(struct mg_context *ctx) {
 
     // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
     // sq_empty condvar to wake up the master waiting in produce_socket()
-    while (consume_socket(ctx, &conn->client)) {
+    while ((got = consume_socket(ctx, &conn->client)) > 0) {
       conn->birth_time = time(NULL);
       conn->ctx = ctx;
 
@@ -4877,12 +5054,15 @@ static void worker_thread(struct mg_context *ctx) {
     free(conn);
   }
 
-  // Signal master that we're done with connection and exiting
-  (void) pthread_mutex_lock(&ctx->mutex);
-  ctx->num_threads--;
-  (void) pthread_cond_signal(&ctx->cond);
-  assert(ctx->num_threads >= 0);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+  // Signal master that we're done with connection and exiting. A retired
+  // worker was already taken off the count by consume_socket().
+  if (got == 0) {
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    (void) pthread_cond_signal(&ctx->cond);
+    assert(ctx->num_threads >= 0);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+  }
 
   DEBUG_TRACE(("exiting"));
 }
@@ -4913,20 +5093,34 @@ static void accept_new_connection(const struct socket *listener,
   struct socket accepted;
   char src_addr[20];
   socklen_t len;
+  unsigned long uid = (unsigned long) -1, gid = (unsigned long) -1;
   int allowed;
 
   len = sizeof(accepted.rsa);
   accepted.lsa = listener->lsa;
   accepted.sock = accept(listener->sock, &accepted.rsa.sa, &len);
   if (accepted.sock != INVALID_SOCKET) {
-    allowed = check_acl(ctx, ntohl(* (uint32_t *) &accepted.rsa.sin.sin_addr));
+    if (listener->lsa.sa.sa_family == AF_UNIX) {
+      // No address to check, use the peer process credentials instead
+      memset(&accepted.rsa, 0, sizeof(accepted.rsa));
+      accepted.rsa.sa.sa_family = AF_UNIX;
+      allowed = get_peer_credentials(accepted.sock, &uid, &gid) &&
+        check_peer_acl(ctx, uid, gid) == 1;
+    } else {
+      allowed = check_acl(ctx,
+                          ntohl(* (uint32_t *) &accepted.rsa.sin.sin_addr));
+    }
     if (allowed) {
       // Put accepted socket structure into the queue
       DEBUG_TRACE(("accepted socket %d", accepted.sock));
       accepted.is_ssl = listener->is_ssl;
       produce_socket(ctx, &accepted);
     } else {
-      sockaddr_to_string(src_addr, sizeof(src_addr), &accepted.rsa);
+      if (listener->lsa.sa.sa_family == AF_UNIX) {
+        snprintf(src_addr, sizeof(src_addr), "uid %lu", uid);
+      } else {
+        sockaddr_to_string(src_addr, sizeof(src_addr), &accepted.rsa);
+      }
       cry(fc(ctx), "%s: %s is not allowed to connect", __func__, src_addr);
       (void) closesocket(accepted.sock);
     }
@@ -5050,6 +5244,30 @@ void mg_stop(struct mg_context *ctx) {
 #endif // _WIN32
 }
 
+int mg_set_num_threads(struct mg_context *ctx, int n) {
+  int ok;
+
+  if (n < 1) {
+    return 0;
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  ctx->target_threads = n;
+  while (ctx->num_threads < n && ctx->stop_flag == 0) {
+    if (mg_start_thread((mg_thread_func_t) worker_thread, ctx) != 0) {
+      cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
+      break;
+    }
+    ctx->num_threads++;
+  }
+  // Surplus workers notice on their next trip through consume_socket()
+  (void) pthread_cond_broadcast(&ctx->sq_full);
+  ok = ctx->num_threads >= n;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  return ok;
+}
+
 struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
                             const char **options) {
   struct mg_context *ctx;
@@ -5131,7 +5349,8 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
   mg_start_thread((mg_thread_func_t) master_thread, ctx);
 
   // Start worker threads
-  for (i = 0; i < atoi(ctx->config[NUM_THREADS]); i++) {
+  ctx->target_threads = atoi(ctx->config[NUM_THREADS]);
+  for (i = 0; i < ctx->target_threads; i++) {
     if (mg_start_thread((mg_thread_func_t) worker_thread, ctx) != 0) {
       cry(fc(ctx), "Cannot start worker thread: %d", ERRNO);
     } else {
@@ -190,6 +190,16 @@ struct mg_context *mg_start(mg_callback_t callback, void *user_data,
 void mg_stop(struct mg_context *);
 
 
+// Change the number of worker threads of a running server.
+//
+// New workers are started right away. When lowering the count, idle
+// workers exit at once and busy ones after their current connection.
+//
+// Return:
+//   1 on success, 0 if n is not positive or a worker could not be started.
+int mg_set_num_threads(struct mg_context *, int n);
+
+
 // Get the value of particular configuration parameter.
 // The value returned is read-only. Mongoose does not allow changing
 // configuration at run time.
@@ -279,6 +289,15 @@ int mg_read(struct mg_connection *, void *buf, size_t len);
 const char *mg_get_header(const struct mg_connection *, const char *name);
 
 
+// Check the client of the connection against an access control list in the
+// access_control_list format, e.g. "-0.0.0.0/0,+10.0.0.0/8". Without a list
+// only loopback clients are allowed. Unix socket clients always are, their
+// credentials were checked on accept.
+// Return -1 if the list is malformed, 0 if the client is disallowed, 1 if
+// allowed.
+int mg_check_acl(struct mg_connection *, const char *list);
+
+
 // Get a value of particular form variable.
 //
 // Parameters:
@@ -22,7 +22,9 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sqlite3.h>
 #include <stdarg.h>
@@ -58,6 +60,35 @@ char **tmpldata;
 #define TMPL_LIST 4
 #define TMPL_ERROR 5 // ERROR needs to be last, it's used for memory allocation 
 
+char *cfgfile=NULL;
+char *dbs=NULL;
+char *portspec=NULL;
+char *alfile=NULL;
+char *tdir=NULL;
+char *adminacl=NULL;  // clients allowed to POST /meta/reload
+int numthreads=10;
+int ratelimit=0;
+int ratelimitburst=0;
+int reload=0;
+char pending[SHORT_STRING_MAX];
+pthread_mutex_t cfglock=PTHREAD_MUTEX_INITIALIZER;
+struct tokenbucket ratebucket=TOKENBUCKET_INITIALIZER;
+struct mg_context *ctx=NULL;
+
+// keys of the config file, those with restart set are only read at startup
+struct cfgkey cfgkeys[]={
+	{"threads", CFG_INT, &numthreads, 1, 99},
+	{"loglevel", CFG_INT, &vlevel, INT_MIN, INT_MAX},
+	{"ratelimit", CFG_INT, &ratelimit, 0, INT_MAX},
+	{"ratelimit_burst", CFG_INT, &ratelimitburst, 0, INT_MAX},
+	{"port", CFG_STRING, &portspec, 0, 0, 1},
+	{"database", CFG_STRING, &dbs, 0, 0, 1},
+	{"access_log", CFG_STRING, &alfile, 0, 0, 1},
+	{"templates", CFG_STRING, &tdir, 0, 0, 1},
+	{"admin_acl", CFG_STRING, &adminacl},
+	{NULL}
+};
+
 void usage(char *err, int ec) {
 	if(err!=NULL) {
 		fprintf(stderr,_("Error: %s\n"),err);
@@ -65,8 +96,10 @@ void usage(char *err, int ec) {
 	}
 
 	fprintf(stderr,_("Usage (v%i.%i.%i):\n"),urlshortd_VERSION_MAJOR,urlshortd_VERSION_MINOR,urlshortd_VERSION_REV);
+	fprintf(stderr,_(" -f /path/to/config     -- Config file of key = value lines, reread on SIGHUP or a POST to /meta/reload, flags override it\n"));
 	fprintf(stderr,_(" -d database definition -- Specifies database connection to use, module:/path/to/file\n"));
-	fprintf(stderr,_(" -p port spec           -- Port nuber to listen on, passed directly to mongoose HTTP library\n"));
+	fprintf(stderr,_(" -p port spec           -- Port nuber to listen on, passed directly to mongoose HTTP library, e.g. 8080,unix:/run/urlshortd.sock\n"));
+	fprintf(stderr,_(" -U acl                 -- Peer credential ACL for unix: listeners, e.g. +uid:1000,+gid:33 (default: allow all)\n"));
 	fprintf(stderr,_(" -n N                   -- Number of HTTP serving threads (default: 10)\n"));
 	fprintf(stderr,_(" -a /path/to/accessfile -- Access log file, must be writable (if it exists) or in a writable dir (if it does not exist, it will be created)\n"));
 	fprintf(stderr,_(" -t /path/to/templates  -- Template directory\n"));
@@ -84,9 +117,45 @@ void handlesig(int sig) {
 			LOG_DEBUG(vlevel, _("Finishing...\n"));
 			done=1; 
 		}
+	} else if(sig==SIGHUP) {
+		reload=1;
 	}
 }
 
+// (re)reads the config file. Threads, log level and rate limit change right
+// away, the rest is only read at startup and a changed value is listed in
+// pending until the next restart.
+static int loadconfig(int running) {
+	int threads, bad;
+
+	pthread_mutex_lock(&cfglock);
+	threads=numthreads;
+	if((bad=cfgread(cfgfile, cfgkeys))!=0) {
+		if(bad<0) {
+			LOG_ERROR(vlevel, _("Unable to read config file %s: %s\n"), cfgfile, strerror(errno));
+		} else {
+			LOG_ERROR(vlevel, _("%i bad entries in config file %s, keeping current settings\n"), bad, cfgfile);
+		}
+		pthread_mutex_unlock(&cfglock);
+		return -1;
+	}
+
+	cfgapply(cfgkeys, running, pending, SHORT_STRING_MAX);
+	tokenbucket_set(&ratebucket, ratelimit, ratelimitburst);
+	if(running) {
+		if(numthreads!=threads && !mg_set_num_threads(ctx, numthreads)) {
+			LOG_ERROR(vlevel, _("Unable to change HTTP serving threads to %i\n"), numthreads);
+		}
+		if(*pending) {
+			LOG_WARN(vlevel, _("Config file changes need a restart to take effect: %s\n"), pending);
+		}
+	}
+	LOG_INFO(vlevel, _("Loaded config file %s: threads %i, loglevel %i, ratelimit %i/%i\n"),
+					 cfgfile, numthreads, vlevel, ratelimit, ratelimitburst);
+	pthread_mutex_unlock(&cfglock);
+	return 0;
+}
+
 int ishash(char* str) {
 	int n=0;
 	int slen = strlen(str);
@@ -124,6 +193,54 @@ static void *mghandle(enum mg_event event, struct mg_connection *conn) {
 								"%s",
 								(int)strlen(status), status);
 			free(status);
+		} else if(strncmp(req, "/meta/config\0", 13) == 0) { // effective config
+			char *cinfo=calloc(URL_STRING_MAX, sizeof(char));
+			pthread_mutex_lock(&cfglock);
+			cfgjson(cfgkeys, cfgfile, pending, cinfo, URL_STRING_MAX);
+			pthread_mutex_unlock(&cfglock);
+			mg_printf(conn,
+								"HTTP/1.1 200 OK\r\n"
+								"Content-Type: application/json\r\n"
+								"Content-Length: %d\r\n"
+								"\r\n"
+								"%s\r\n",
+								(int)strlen(cinfo)+2, cinfo);
+			free(cinfo);
+		} else if(strncmp(req, "/meta/reload\0", 13) == 0) { // reread config file
+			const char *rstatus, *code;
+			int allowed;
+
+			// it changes the server: POST only, from clients admin_acl allows, without
+			// one loopback and unix socket clients
+			pthread_mutex_lock(&cfglock);
+			allowed=mg_check_acl(conn, adminacl);
+			pthread_mutex_unlock(&cfglock);
+			if(strcmp(request_info->request_method, "POST")) {
+				rstatus="BADMETHOD";
+				code="405 Method Not Allowed\r\nAllow: POST";
+			} else if(allowed!=1) {
+				rstatus="FORBIDDEN";
+				code="403 Forbidden";
+			} else {
+				rstatus=cfgfile==NULL ? "NOCONFIG" : loadconfig(1)==0 ? "OK" : "ERROR";
+				code=strcmp(rstatus, "OK") ? "500 ERROR" : "200 OK";
+			}
+			mg_printf(conn,
+								"HTTP/1.1 %s\r\n"
+								"Content-Type: text/plain\r\n"
+								"Content-Length: %d\r\n"
+								"\r\n"
+								"%s\r\n",
+								code, (int)strlen(rstatus)+2, rstatus);
+		} else if(!tokenbucket_take(&ratebucket)) { // over the rate limit
+			mg_printf(conn,
+								"HTTP/1.1 429 Too Many Requests\r\n"
+								"Content-Type: text/plain\r\n"
+								"Retry-After: 1\r\n"
+								"Content-Length: %d\r\n"
+								"\r\n"
+								"RATELIMITED\r\n",
+								13);
 		} else if(strncmp(req, "/\0", 2) == 0) { // home page
 			mg_printf(conn,
 								"HTTP/1.1 200 OK\r\n"
@@ -229,52 +346,80 @@ static void *mghandle(enum mg_event event, struct mg_connection *conn) {
 }
 
 int main(int argc, char **argv) {
+	const char *optstring="d:p:n:a:t:U:f:vh";
   int goopt;
-	int listenport=8080;
-	int numthreads=10;
 	int tf;
 
 	void *dlh;
 
 	char *dle;
-	char *dbs=NULL;
-	char *lpstr=NULL;
+	char *unixacl=NULL;
 	char *ntstr=NULL;
-	char *alfile=NULL;
-	char *tdir=NULL;
 
-	struct mg_context *ctx= NULL; 
   char **mgoptions;
 
 	signal(SIGINT,handlesig);
   signal(SIGTERM,handlesig);
+	signal(SIGHUP,handlesig);
 
   setlocale(LC_ALL, "");
   textdomain("urlshortd");
 
+	// the config file sets the baseline, flags on the command line override it
+	opterr=0;
+	while ((goopt=getopt (argc, argv, optstring)) != -1) {
+		if(goopt=='f') {
+			cfgfile=calloc(strlen((char*)optarg)+1,sizeof(char));
+			strncpy(cfgfile,(char*)optarg,strlen((char*)optarg));
+		}
+	}
+	optind=1;
+	opterr=1;
+	if(cfgfile!=NULL && loadconfig(0)!=0) {
+		LOG_FATAL(vlevel, _("Unable to load config file: %s\n"),cfgfile);
+		exit(EXIT_FAILURE);
+	}
+
 	// command line parsing
-	while ((goopt=getopt (argc, argv, "d:p:n:a:t:vh")) != -1) {
+	while ((goopt=getopt (argc, argv, optstring)) != -1) {
 		switch (goopt) {
+		case 'f': // config file, already loaded above
+			break;
 		case 'd': // database 
+			free(dbs);
 			dbs=calloc(strlen((char*)optarg)+1,sizeof(char));
 			strncpy(dbs,(char*)optarg,strlen((char*)optarg));
+			cfgflag(cfgkeys, "database");
 			break;
 		case 't':
+			free(tdir);
 			tdir=calloc(strlen((char*)optarg)+1,sizeof(char));
 			strncpy(tdir,(char*)optarg,strlen((char*)optarg));
+			cfgflag(cfgkeys, "templates");
 			break;
 		case 'a':
+			free(alfile);
 			alfile=calloc(strlen((char*)optarg)+1,sizeof(char));
 			strncpy(alfile,(char*)optarg,strlen((char*)optarg));
+			cfgflag(cfgkeys, "access_log");
+			break;
+		case 'p': // port spec
+			free(portspec);
+			portspec=calloc(strlen((char*)optarg)+1,sizeof(char));
+			strncpy(portspec,(char*)optarg,strlen((char*)optarg));
+			cfgflag(cfgkeys, "port");
 			break;
-		case 'p': // port
-			listenport=atoi(optarg);
+		case 'U': // unix socket peer acl
+			unixacl=calloc(strlen((char*)optarg)+1,sizeof(char));
+			strncpy(unixacl,(char*)optarg,strlen((char*)optarg));
 			break;
 		case 'n': // number of threads
 			numthreads=atoi(optarg);
+			cfgflag(cfgkeys, "threads");
 			break;
 		case 'v': // verbose
 			vlevel++;
+			cfgflag(cfgkeys, "loglevel");
 			break;
 		case 'h': // help
 			usage(NULL,EXIT_SUCCESS);
@@ -303,8 +448,11 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	if(listenport<0 || listenport>65536) {
-		LOG_FATAL(vlevel, _("Given port out of bounds: %i\n"),listenport);
+	if(portspec==NULL) {
+		portspec=strdup("8080");
+	} else if(strspn(portspec,"0123456789")==strlen(portspec) && atoi(portspec)>65535) {
+		// anything fancier (ip:port, unix:path, lists) is validated by mongoose
+		LOG_FATAL(vlevel, _("Given port out of bounds: %s\n"),portspec);
 		exit(EXIT_FAILURE);
 	}
 
@@ -371,6 +519,7 @@ int main(int argc, char **argv) {
 		cf=dbs+n+1;
 
 		sprintf(lf,"./libmod_%s.so",mn);
+		dbs[n]=':'; // keep the whole spec around for /meta/config
 
 		dlh=dlopen(lf, RTLD_LAZY);
 		if((dle=dlerror())!=NULL) {
@@ -407,35 +556,39 @@ int main(int argc, char **argv) {
 	}
 
 	// set mgoptions - XXX this needs to be handled better
-	lpstr=calloc(7,sizeof(char));
-	snprintf(lpstr,6,"%i",listenport);
-
 	ntstr=calloc(4,sizeof(char));
-	snprintf(ntstr,3,"%i",numthreads);
-
+	snprintf(ntstr,4,"%i",numthreads);
+
+	mgoptions = calloc(11,sizeof(char*));
+	tf=0;
+	mgoptions[tf++]="listening_ports";
+	mgoptions[tf++]=portspec;
+	mgoptions[tf++]="document_root";
+	mgoptions[tf++]="/dev/null";
+	mgoptions[tf++]="num_threads";
+	mgoptions[tf++]=ntstr;
 	if(alfile!=NULL) {
-		mgoptions = calloc(9,sizeof(char*));
-	} else {
-		mgoptions = calloc(7,sizeof(char*));
+		mgoptions[tf++]="access_log_file";
+		mgoptions[tf++]=alfile;
 	}
-	mgoptions[0]="listening_ports";
-	mgoptions[1]=lpstr;
-	mgoptions[2]="document_root";
-	mgoptions[3]="/dev/null";
-	mgoptions[4]="num_threads";
-	mgoptions[5]=ntstr;
-	if(alfile!=NULL) {
-		mgoptions[6]="access_log_file";
-		mgoptions[7]=alfile;
-		mgoptions[8]=NULL;
-	} else {
-		mgoptions[6]=NULL;
+	if(unixacl!=NULL) {
+		mgoptions[tf++]="unix_access_control_list";
+		mgoptions[tf++]=unixacl;
 	}
+	mgoptions[tf]=NULL;
 	// main loop
 	LOG_DEBUG(vlevel, _("Starting Mongoose HTTP server loop\n"));
   ctx = mg_start(&mghandle, NULL, (const char**)mgoptions);
 	if(ctx!=NULL) {
 		while(!done) {
+			if(reload) {
+				reload=0;
+				if(cfgfile==NULL) {
+					LOG_WARN(vlevel, _("SIGHUP received but no config file given, nothing to reload\n"));
+				} else {
+					loadconfig(1);
+				}
+			}
 			// cleaner thread here?
 			sleep(1);
 		}
@@ -450,7 +603,11 @@ int main(int argc, char **argv) {
 	LOG_DEBUG(vlevel, _("Cleaning up\n"));
 	dlclose(dlh);
 	free(dbs);
-	free(lpstr);
+	free(portspec);
+	free(unixacl);
+	free(alfile);
+	free(cfgfile);
+	free(adminacl);
 	free(ntstr);
 	free(mgoptions);
 	free(tdir);
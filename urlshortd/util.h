@@ -21,6 +21,7 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__ 
 
+#include <pthread.h>
 #include <time.h>
 #include <libintl.h>
 #include <locale.h>
@@ -36,9 +37,49 @@ char *strreplace(const char* instr, char *sstr, char *dstr);
 int url_decode(const char *src, size_t src_len, char *dst, size_t dst_len, int is_form_url_encoded);
 void jsondequote(char **jstr);
 
+// rate limiter, see tokenbucket_take()
+struct tokenbucket {
+	pthread_mutex_t lock;
+	int rate;
+	int burst;
+	double tokens;
+	double last;
+};
+#define TOKENBUCKET_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 }
+void tokenbucket_set(struct tokenbucket *tb, int rate, int burst);
+int tokenbucket_take(struct tokenbucket *tb);
+
 #define SHORT_STRING_MAX 512 
 #define URL_STRING_MAX 8192
 
+// a config file key and the variable it sets, tables of them end with a
+// NULL key. cfgread() stages the file's values, cfgapply() stores them.
+#define CFG_INT 0      // int between min and max
+#define CFG_LONG 1     // long between min and max
+#define CFG_YESNO 2    // int, 1 for yes and 0 for no
+#define CFG_STRING 3   // malloc()ed char *, NULL for an empty value
+#define CFG_NAMED 4    // int, parse turns the name into it, name back
+struct cfgkey {
+	const char *key;
+	int type;
+	void *var;
+	long min;
+	long max;
+	int restart;                     // only stored at startup
+	int (*parse)(const char *name);  // negative for an unknown name
+	const char *(*name)(int value);
+	long staged;
+	char sstaged[SHORT_STRING_MAX];
+	int flag;                        // set by a flag, the file can't change it
+};
+int readconfig(const char *file, int (*set)(void *arg, char *key, char *val), void *arg);
+struct cfgkey *cfgfind(struct cfgkey *keys, const char *key);
+void cfgflag(struct cfgkey *keys, const char *key);
+int cfgread(const char *file, struct cfgkey *keys);
+void cfgapply(struct cfgkey *keys, int running, char *pending, size_t len);
+size_t cfgjson(const struct cfgkey *keys, const char *file, const char *pending, char *buf, size_t len);
+
+// vlevel changes on a config reload, the macros read it atomically
 #define LOG_LVL_TRACE 4
 #define LOG_LVL_DEBUG 3
 #define LOG_LVL_INFO 2
@@ -46,7 +87,7 @@ void jsondequote(char **jstr);
 #define LOG_LVL_ERROR 0
 #define LOG_LVL_FATAL -1
 
-#define LOG_TRACE(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_TRACE) { \
+#define LOG_TRACE(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_TRACE) { \
       time_t t=time(NULL);                                    \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -55,7 +96,7 @@ void jsondequote(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_DEBUG(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_DEBUG) { \
+#define LOG_DEBUG(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_DEBUG) { \
       time_t t=time(NULL);                                    \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -64,7 +105,7 @@ void jsondequote(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_INFO(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_INFO) { \
+#define LOG_INFO(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_INFO) { \
       time_t t=time(NULL);                                  \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -73,7 +114,7 @@ void jsondequote(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_WARN(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_WARN) { \
+#define LOG_WARN(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_WARN) { \
       time_t t=time(NULL);                                  \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -82,7 +123,7 @@ void jsondequote(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_ERROR(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_ERROR) { \
+#define LOG_ERROR(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_ERROR) { \
       time_t t=time(NULL);                                    \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \
@@ -91,7 +132,7 @@ void jsondequote(char **jstr);
       printf(fmt,##__VA_ARGS__);                                        \
     } } while(0)
 
-#define LOG_FATAL(vlevel, fmt,...) do { if(vlevel >= LOG_LVL_FATAL) { \
+#define LOG_FATAL(vlevel, fmt,...) do { if(__atomic_load_n(&(vlevel), __ATOMIC_RELAXED) >= LOG_LVL_FATAL) { \
       time_t t=time(NULL);                                    \
       char *tstr=calloc(SHORT_STRING_MAX,sizeof(char));                 \
       strftime(tstr,SHORT_STRING_MAX, "%Y-%m-%d %H:%M:%S", localtime(&t)); \